@@ -23,8 +23,8 @@
 #include "sp_vm_types.h"
 
 /** SourcePawn Engine API Versions */
-#define SOURCEPAWN_ENGINE2_API_VERSION 0xC
-#define SOURCEPAWN_API_VERSION   0x020D
+#define SOURCEPAWN_ENGINE2_API_VERSION 0x17
+#define SOURCEPAWN_API_VERSION   0x0217
 
 namespace SourceMod {
   struct IdentityToken_t;
@@ -490,6 +490,22 @@ namespace SourcePawn
      * @brief Return the file or location this plugin was loaded from.
      */
     virtual const char *GetFilename() = 0;
+
+    /**
+     * @brief Update the native binding at the given index, as with
+     * UpdateNativeBinding(), to a native that compiled code can call
+     * without building a parameter array or updating the context. Calls
+     * whose argument count differs from the signature, and calls from the
+     * interpreter, use the regular function.
+     *
+     * @param index     Native index.
+     * @param info      Native information; it must remain valid as long as
+     *                  the plugin is loaded.
+     * @param flags     Native flags.
+     * @param data      User data pointer.
+     */
+    virtual int UpdateFastNativeBinding(uint32_t index, const sp_fastnativeinfo_t *info,
+                                        uint32_t flags, void *data) = 0;
   };
 
   
@@ -1235,6 +1251,30 @@ namespace SourcePawn
     virtual void LeaveScope() = 0;
   };
 
+  /**
+   * @brief Receives interrupts requested with
+   * ISourcePawnEngine2::RequestInterrupt().
+   */
+  class IInterruptHandler
+  {
+   public:
+    /**
+     * @brief Called on the thread running scripts, at the first safepoint
+     * after an interrupt was requested. Safepoints are loop backedges,
+     * function calls (just before the call, including calls the JIT has
+     * inlined), and calls into a plugin. Every execution tier stops at the
+     * same ones. The stack can be walked from here, and plugins can be
+     * called.
+     *
+     * @param ctx       Context being run or entered.
+     * @param reasons   Every reason requested since the last call, OR'd
+     *                  together.
+     * @return          SP_ERROR_NONE to resume the script, or an error code
+     *                  to throw in it.
+     */
+    virtual int OnInterrupt(IPluginContext *ctx, uint32_t reasons) = 0;
+  };
+
   struct sp_plugin_s;
   typedef struct sp_plugin_s sp_plugin_t;
 
@@ -1514,6 +1554,160 @@ namespace SourcePawn
      * @brief Returns the environment.
      */
     virtual ISourcePawnEnvironment *Environment() = 0;
+
+    /**
+     * @brief Sets whether functions are interpreted until they become hot,
+     * rather than compiled by the JIT on first use. Has no effect if the JIT
+     * is disabled.
+     *
+     * @param enabled  True or false to enable or disable.
+     */
+    virtual void SetTieringEnabled(bool enabled) = 0;
+
+    /**
+     * @brief Returns whether tiered compilation is enabled.
+     *
+     * @return      True if tiered compilation is enabled, false otherwise.
+     */
+    virtual bool IsTieringEnabled() = 0;
+
+    /**
+     * @brief Sets how many background threads compile functions. Functions
+     * that would be compiled on the calling thread are queued instead, and
+     * run in the interpreter until their code is ready. Zero, the default,
+     * compiles on the calling thread. Has no effect if the JIT is disabled.
+     *
+     * @param threads  Number of compile threads.
+     * @return         True on success, false if threads could not be started
+     *                 or the JIT is not available.
+     */
+    virtual bool SetCompileThreads(size_t threads) = 0;
+
+    /**
+     * @brief Sets whether a plugin is compiled in full, with its calls
+     * linked directly, the first time any of its functions is invoked,
+     * rather than each function on its first call. This avoids compile
+     * stalls later on. Has no effect if the JIT is disabled.
+     *
+     * @param enabled  True or false to enable or disable.
+     */
+    virtual void SetEagerCompileEnabled(bool enabled) = 0;
+
+    /**
+     * @brief Returns whether eager compilation is enabled.
+     *
+     * @return      True if eager compilation is enabled, false otherwise.
+     */
+    virtual bool IsEagerCompileEnabled() = 0;
+
+    /**
+     * @brief Sets a directory in which compiled functions are kept, so that
+     * a plugin loaded again, even by a later process, does not have to be
+     * compiled again. Entries are only reused by the same build of the VM,
+     * on the same kind of CPU, for an identical plugin. This must be called
+     * before any plugin runs.
+     *
+     * @param path     Directory to use; it is created if it does not exist.
+     * @return         True on success, false if the directory cannot be used
+     *                 or the JIT cannot cache code on this platform.
+     */
+    virtual bool SetCodeCachePath(const char *path) = 0;
+
+    /**
+     * @brief Replaces calls to a native with an intrinsic. Plugins loaded
+     * afterward call the intrinsic's fallback directly, or, if it has an
+     * emitter, run its code inline, instead of calling the native. Natives
+     * bound by the host under this name are ignored. This must be called
+     * before any plugin is loaded.
+     *
+     * @param intrinsic  Intrinsic; it must remain valid until shutdown.
+     * @return           True on success, false if the name is already taken
+     *                   or the intrinsic is malformed.
+     */
+    virtual bool RegisterIntrinsic(const sp_intrinsic_t *intrinsic) = 0;
+
+    /**
+     * @brief Makes generated code visible to the Linux perf profiler, by
+     * writing each function, named "plugin.smx::function", to
+     * /tmp/perf-<pid>.map as it is compiled. Optionally, code and source
+     * lines are also written to a jitdump file, for "perf inject --jit".
+     * Has no effect on code compiled before this is called.
+     *
+     * @param jitdump_dir  Directory for jit-<pid>.dump, or NULL to only
+     *                     write the perf map.
+     * @return             True on success, false if the files cannot be
+     *                     written or the platform is not supported.
+     */
+    virtual bool EnablePerfMap(const char *jitdump_dir) = 0;
+
+    /**
+     * @brief Registers each function compiled from now on with debuggers,
+     * through GDB's JIT interface, so that backtraces and disassembly show
+     * "plugin.smx::function" and its source lines. This works in core dumps
+     * too, and costs a small amount of memory per function.
+     *
+     * @return             True on success, false if the platform is not
+     *                     supported.
+     */
+    virtual bool EnableGdbJitInterface() = 0;
+
+    /**
+     * @brief Sets whether each function's bytecode is optimized when it is
+     * first verified, before it is interpreted or compiled. This removes
+     * redundant pushes and pops, folds constants and branches, and drops
+     * dead stores, which helps most with plugins built without compiler
+     * optimizations. Enabled by default. Only affects plugins loaded
+     * afterward.
+     *
+     * @param enabled  True or false to enable or disable.
+     */
+    virtual void SetPcodeOptimizationEnabled(bool enabled) = 0;
+
+    /**
+     * @brief Returns whether bytecode optimization is enabled.
+     *
+     * @return      True if bytecode optimization is enabled, false otherwise.
+     */
+    virtual bool IsPcodeOptimizationEnabled() = 0;
+
+    /**
+     * @brief Sets whether functions that stay hot in compiled code are
+     * compiled again by an optimizing compiler, which keeps values in
+     * registers, removes redundant computations and bounds checks, and
+     * hoists invariant code out of loops. Functions switch to optimized code
+     * on their next call. Only available on x64; has no effect if the JIT is
+     * disabled.
+     *
+     * @param enabled  True or false to enable or disable.
+     */
+    virtual void SetOptimizingJitEnabled(bool enabled) = 0;
+
+    /**
+     * @brief Returns whether the optimizing compiler is enabled.
+     *
+     * @return      True if the optimizing compiler is enabled, false otherwise.
+     */
+    virtual bool IsOptimizingJitEnabled() = 0;
+
+    /**
+     * @brief Sets the handler for interrupts requested with
+     * RequestInterrupt().
+     *
+     * @param handler  Interrupt handler, or NULL to ignore interrupts.
+     */
+    virtual void SetInterruptHandler(IInterruptHandler *handler) = 0;
+
+    /**
+     * @brief Asks the running script to call the interrupt handler at its
+     * next safepoint, for example to sample its stack or to cancel it. If
+     * no script is running, the handler is called when one next starts.
+     * This can be called from any thread, and takes the same time however
+     * much code is loaded.
+     *
+     * @param reason   Nonzero mask of host-defined reason bits. The top bit
+     *                 is reserved.
+     */
+    virtual void RequestInterrupt(uint32_t reason) = 0;
   };
 
   // @brief This class is the v3 API for SourcePawn. It provides access to
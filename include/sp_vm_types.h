@@ -111,6 +111,11 @@ namespace SourcePawn
 	class IProfiler;
 };
 
+namespace sp
+{
+	class MacroAssembler;
+};
+
 struct sp_context_s;
 
 /**
@@ -195,6 +200,61 @@ typedef struct sp_nativeinfo_s
 	SPVM_NATIVE_FUNC func;	/**< Address of native implementation */
 } sp_nativeinfo_t;
 
+/**
+ * @brief Intrinsic callback prototype, passed a parameter stack (0=count, 1+=args).
+ * It must be pure: it cannot use the plugin's context, throw errors, or call back
+ * into the VM. A cell must be returned.
+ */
+typedef cell_t (*SPVM_INTRINSIC_FUNC)(const cell_t *);
+
+/**
+ * @brief Intrinsic code generator, passed the JIT's macro assembler. The first
+ * argument is in PRI and the second in ALT (eax and edx, or rax and rdx on
+ * x64); the result must be left in PRI as a 32-bit value. ALT and the flags
+ * may be clobbered, all other registers must be preserved, and the code must
+ * not call out. This may be called from compile threads. Return false, without
+ * emitting anything, to use the fallback instead.
+ */
+typedef bool (*SPVM_INTRINSIC_EMITTER)(sp::MacroAssembler &);
+
+/**
+ * @brief Used for replacing natives with intrinsics, see
+ * ISourcePawnEngine2::RegisterIntrinsic().
+ */
+typedef struct sp_intrinsic_s
+{
+	const char		*name;		/**< Name of the native */
+	SPVM_INTRINSIC_FUNC fallback;	/**< Implementation used by the interpreter */
+	SPVM_INTRINSIC_EMITTER emitter;	/**< Optional JIT code generator, or NULL */
+	unsigned int	nparams;	/**< Number of parameters; the emitter takes at most 2 */
+} sp_intrinsic_t;
+
+#define SP_FASTARG_CELL			(0)		/**< Passed or returned as a cell_t */
+#define SP_FASTARG_FLOAT		(1)		/**< Passed or returned as a float */
+
+#define SP_MAX_FASTNATIVE_PARAMS	3	/**< Maximum number of parameters of a fast native */
+
+/**
+ * @brief Used for binding natives that compiled code can call directly, see
+ * IPluginRuntime::UpdateFastNativeBinding().
+ *
+ * The fast function is called as "ret fast(int *fallback, arg1, ...)", where
+ * each argument and the return value are a cell_t or a float, as given by the
+ * signature. It has no access to the plugin's context, so it must not throw
+ * errors or call back into the VM. Instead, it can set *fallback to 1 and
+ * return, without side effects; the regular function is then called with the
+ * same arguments, and can report the error.
+ */
+typedef struct sp_fastnativeinfo_s
+{
+	const char		*name;		/**< Name of the native */
+	SPVM_NATIVE_FUNC func;		/**< Regular implementation */
+	void			*fast;		/**< Fast implementation */
+	unsigned int	nparams;	/**< Number of parameters */
+	uint8_t			param_kinds[SP_MAX_FASTNATIVE_PARAMS];	/**< SP_FASTARG_* of each parameter */
+	uint8_t			return_kind;	/**< SP_FASTARG_* of the return value */
+} sp_fastnativeinfo_t;
+
 /** 
  * @brief Run-time debug file table
  */
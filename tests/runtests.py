@@ -14,6 +14,8 @@ def main():
                       help="Disable the peephole optimizer when compiling")
   parser.add_argument('--spcomp', type=str, help="Path to spcomp", required=True)
   parser.add_argument('--shell', type=str, help="Path to shell", required=True)
+  parser.add_argument('--env', type=str, action='append', default=[], metavar='KEY=VALUE',
+                      help="Set an environment variable for the shell, such as TIERED_JIT=1")
   args = parser.parse_args()
 
   with TempFolder() as tempFolder:
@@ -46,6 +48,7 @@ class ChangeFolder(object):
 class Test(object):
   ManifestKeys = set([
     'returnCode',
+    'env',
   ])
 
   def __init__(self, name, path):
@@ -81,6 +84,15 @@ class Test(object):
       return int(self.manifest['returnCode'])
     return 0
 
+  @property
+  def environment(self):
+    env = {}
+    if 'env' in self.manifest:
+      for pair in self.manifest['env'].split():
+        key, value = pair.split('=', 1)
+        env[key] = value
+    return env
+
 class TestRunner(object):
   def __init__(self, args, tempFolder):
     super(TestRunner, self).__init__()
@@ -205,7 +217,12 @@ class TestRunner(object):
     ]
     if os.path.splitext(self.shell)[1] == '.js':
       argv = ['node'] + argv
-    p = subprocess.Popen(argv, stdout = subprocess.PIPE, stderr = subprocess.PIPE)
+    env = os.environ.copy()
+    for pair in self.args.env:
+      key, value = pair.split('=', 1)
+      env[key] = value
+    env.update(test.environment)
+    p = subprocess.Popen(argv, stdout = subprocess.PIPE, stderr = subprocess.PIPE, env = env)
     stdout, stderr = p.communicate()
     stdout = stdout.decode('utf-8')
     stderr = stderr.decode('utf-8')
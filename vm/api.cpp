@@ -310,7 +310,15 @@ SourcePawnEngine2::GetEngineName()
     info = ", interp-x86";
   } else {
 # if defined(KE_ARCH_X86)
-    info = ", jit-x86";
+    if (Environment::get()->IsTieringEnabled())
+      info = ", tiered-x86";
+    else
+      info = ", jit-x86";
+# elif defined(KE_ARCH_X64)
+    if (Environment::get()->IsTieringEnabled())
+      info = ", tiered-x64";
+    else
+      info = ", jit-x64";
 # else
     info = ", unknown";
 # endif
@@ -405,6 +413,112 @@ SourcePawnEngine2::IsJitEnabled()
   return Environment::get()->IsJitEnabled();
 }
 
+void
+SourcePawnEngine2::SetTieringEnabled(bool enabled)
+{
+  Environment::get()->SetTieringEnabled(enabled);
+}
+
+bool
+SourcePawnEngine2::IsTieringEnabled()
+{
+  return Environment::get()->IsTieringEnabled();
+}
+
+bool
+SourcePawnEngine2::SetCompileThreads(size_t threads)
+{
+#if defined(SP_HAS_JIT)
+  return Environment::get()->SetCompileThreads(threads);
+#else
+  return threads == 0;
+#endif
+}
+
+void
+SourcePawnEngine2::SetEagerCompileEnabled(bool enabled)
+{
+  Environment::get()->SetEagerCompileEnabled(enabled);
+}
+
+bool
+SourcePawnEngine2::IsEagerCompileEnabled()
+{
+  return Environment::get()->IsEagerCompileEnabled();
+}
+
+void
+SourcePawnEngine2::SetPcodeOptimizationEnabled(bool enabled)
+{
+  Environment::get()->SetPcodeOptimizationEnabled(enabled);
+}
+
+bool
+SourcePawnEngine2::IsPcodeOptimizationEnabled()
+{
+  return Environment::get()->IsPcodeOptimizationEnabled();
+}
+
+void
+SourcePawnEngine2::SetOptimizingJitEnabled(bool enabled)
+{
+  Environment::get()->SetOptimizingJitEnabled(enabled);
+}
+
+bool
+SourcePawnEngine2::IsOptimizingJitEnabled()
+{
+  return Environment::get()->IsOptimizingJitEnabled();
+}
+
+void
+SourcePawnEngine2::SetInterruptHandler(IInterruptHandler *handler)
+{
+  Environment::get()->SetInterruptHandler(handler);
+}
+
+void
+SourcePawnEngine2::RequestInterrupt(uint32_t reason)
+{
+  Environment::get()->RequestInterrupt(reason & ~Environment::kTimeoutInterrupt);
+}
+
+bool
+SourcePawnEngine2::SetCodeCachePath(const char *path)
+{
+#if defined(SP_HAS_JIT)
+  return Environment::get()->SetCodeCachePath(path);
+#else
+  return false;
+#endif
+}
+
+bool
+SourcePawnEngine2::RegisterIntrinsic(const sp_intrinsic_t *intrinsic)
+{
+  return Environment::get()->RegisterIntrinsic(intrinsic);
+}
+
+bool
+SourcePawnEngine2::EnablePerfMap(const char *jitdump_dir)
+{
+#if defined(SP_HAS_JIT)
+  return Environment::get()->EnablePerfMap(jitdump_dir);
+#else
+  return false;
+#endif
+}
+
+bool
+SourcePawnEngine2::EnableGdbJitInterface()
+{
+#if defined(SP_HAS_JIT)
+  return Environment::get()->EnableGdbJitInterface();
+#else
+  return false;
+#endif
+}
+
 void
 SourcePawnEngine2::SetProfiler(IProfiler *profiler)
 {
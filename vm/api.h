@@ -69,6 +69,21 @@ class SourcePawnEngine2 : public ISourcePawnEngine2
   void SetProfilingTool(IProfilingTool *tool) override;
   IPluginRuntime *LoadBinaryFromFile(const char *file, char *error, size_t maxlength) override;
   ISourcePawnEnvironment *Environment() override;
+  void SetTieringEnabled(bool enabled) override;
+  bool IsTieringEnabled() override;
+  bool SetCompileThreads(size_t threads) override;
+  void SetEagerCompileEnabled(bool enabled) override;
+  bool IsEagerCompileEnabled() override;
+  void SetPcodeOptimizationEnabled(bool enabled) override;
+  bool IsPcodeOptimizationEnabled() override;
+  void SetOptimizingJitEnabled(bool enabled) override;
+  bool IsOptimizingJitEnabled() override;
+  void SetInterruptHandler(IInterruptHandler *handler) override;
+  void RequestInterrupt(uint32_t reason) override;
+  bool SetCodeCachePath(const char *path) override;
+  bool RegisterIntrinsic(const sp_intrinsic_t *intrinsic) override;
+  bool EnablePerfMap(const char *jitdump_dir) override;
+  bool EnableGdbJitInterface() override;
 
  private:
   char engine_name_[256];
@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <limits.h>
 
 class AssemblerBase
@@ -45,7 +46,9 @@ class AssemblerBase
   static const size_t kMaxBufferSize = INT_MAX / 2;
 
  public:
-  AssemblerBase() {
+  AssemblerBase()
+   : cold_start_(UINT32_MAX)
+  {
     buffer_ = (uint8_t *)malloc(kMinBufferSize);
     pos_ = buffer_;
     end_ = buffer_ + kMinBufferSize;
@@ -69,6 +72,28 @@ class AssemblerBase
     return uint32_t(pos_ - buffer_);
   }
 
+  // Everything emitted after this is cold code, which is linked apart from
+  // the hot code before it, so that rarely taken paths don't share cache
+  // lines and pages with the code around them. Offsets still count through
+  // both parts in emission order. The hot code must end with an instruction
+  // that doesn't fall through, and no jump or call may end it.
+  void startColdCode() {
+    assert(!hasColdCode());
+    cold_start_ = pc();
+  }
+  bool hasColdCode() const {
+    return cold_start_ != UINT32_MAX;
+  }
+  bool isCold(uint32_t offset) const {
+    return offset >= cold_start_;
+  }
+  uint32_t hotLength() const {
+    return hasColdCode() ? cold_start_ : pc();
+  }
+  uint32_t coldLength() const {
+    return pc() - hotLength();
+  }
+
  protected:
   void writeByte(uint8_t byte) {
     write<uint8_t>(byte);
@@ -144,9 +169,23 @@ class AssemblerBase
     return buffer_;
   }
 
+  // Copy the hot code to |code| and the cold code to |cold_code|.
+  void copyToExecutableMemory(uint8_t *code, uint8_t *cold_code) {
+    memcpy(code, buffer(), hotLength());
+    if (coldLength())
+      memcpy(cold_code, buffer() + hotLength(), coldLength());
+  }
+  // Where the code at |offset| was copied to.
+  uint8_t *linkedAddress(uint8_t *code, uint8_t *cold_code, uint32_t offset) const {
+    if (isCold(offset))
+      return cold_code + (offset - cold_start_);
+    return code + offset;
+  }
+
  private:
   uint8_t *buffer_;
   uint8_t *end_;
+  uint32_t cold_start_;
 
  protected:
   uint8_t *pos_;
@@ -0,0 +1,841 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include "bounds-analysis.h"
+#include "opcodes.h"
+#include "plugin-runtime.h"
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+
+namespace sp {
+
+using namespace ke;
+
+// Give up on methods that take too long to settle.
+static const size_t kMaxVisitsPerBlock = 64;
+
+// After this many changes to a range in a block's entry state, bounds that
+// are still moving are widened to the next array limit, or zero, and past
+// those to the limits of a cell. Each widening step is a finite climb, so
+// the analysis always settles. The loop test narrows whatever it overshoots.
+static const uint32_t kWidenAfter = 2;
+
+static int
+CompareThresholds(const void* a, const void* b)
+{
+  int64_t left = *reinterpret_cast<const int64_t*>(a);
+  int64_t right = *reinterpret_cast<const int64_t*>(b);
+  if (left < right)
+    return -1;
+  return left > right ? 1 : 0;
+}
+
+BoundsAnalysis::BoundsAnalysis(PluginRuntime* rt, uint32_t startOffset, uint32_t endOffset,
+                               const Vector<cell_t>& jumpTargets,
+                               const Vector<int32_t>& stackDepths)
+ : code_(reinterpret_cast<const cell_t*>(rt->code().bytes)),
+   method_(code_ + startOffset / sizeof(cell_t)),
+   end_(code_ + endOffset / sizeof(cell_t)),
+   jump_targets_(jumpTargets),
+   stack_depths_(stackDepths),
+   width_(kFirstSlot),
+   pri_slot_(kNoSlot),
+   alt_slot_(kNoSlot)
+{
+}
+
+BoundsAnalysis::Range
+BoundsAnalysis::Top()
+{
+  Range range = { INT_MIN, INT_MAX };
+  return range;
+}
+
+BoundsAnalysis::Range
+BoundsAnalysis::Constant(cell_t value)
+{
+  Range range = { value, value };
+  return range;
+}
+
+// Arithmetic wraps, so a result that might leave the range of a cell could be
+// anything.
+BoundsAnalysis::Range
+BoundsAnalysis::Add(const Range& a, const Range& b)
+{
+  Range range = { a.lo + b.lo, a.hi + b.hi };
+  if (range.lo < INT_MIN || range.hi > INT_MAX)
+    return Top();
+  return range;
+}
+
+BoundsAnalysis::Range
+BoundsAnalysis::Sub(const Range& a, const Range& b)
+{
+  Range range = { a.lo - b.hi, a.hi - b.lo };
+  if (range.lo < INT_MIN || range.hi > INT_MAX)
+    return Top();
+  return range;
+}
+
+bool
+BoundsAnalysis::analyze()
+{
+  if (!findSlots())
+    return false;
+  if (checks_.empty())
+    return true;
+
+  width_ = kFirstSlot + slots_.length();
+
+  // The first block starts after PROC.
+  blocks_.append(method_ + 1);
+  for (size_t i = 0; i < jump_targets_.length(); i++) {
+    const cell_t* target = code_ + jump_targets_[i] / sizeof(cell_t);
+    if (target <= method_ || target > end_)
+      return false;
+    if (target != blocks_.back())
+      blocks_.append(target);
+  }
+
+  for (size_t i = 0; i < blocks_.length(); i++) {
+    for (size_t j = 0; j < width_; j++)
+      entry_states_.append(Top());
+    for (size_t j = 0; j < width_; j++)
+      changes_.append(0);
+    reached_.append(0);
+    queued_.append(0);
+  }
+  for (size_t i = 0; i < width_; i++)
+    cur_.append(Top());
+
+  reached_[0] = 1;
+  queued_[0] = 1;
+  worklist_.append(0);
+
+  size_t visits = 0;
+  while (!worklist_.empty()) {
+    if (++visits > blocks_.length() * kMaxVisitsPerBlock)
+      return false;
+
+    int block = worklist_.popCopy();
+    queued_[block] = 0;
+    if (!walk(block))
+      return false;
+  }
+
+  for (size_t i = 0; i < checks_.length(); i++) {
+    if (check_redundant_[i])
+      redundant_.append(checks_[i]);
+  }
+  return true;
+}
+
+// Find the frame slots worth tracking: those accessed directly, whose address
+// is never taken. Taking the address of a slot could be the start of an
+// array, so it excludes every slot above it, up to the edge of the frame.
+bool
+BoundsAnalysis::findSlots()
+{
+  Vector<cell_t> escaped;
+
+  // Indexes count down to zero.
+  addThreshold(0);
+
+  const cell_t* cip = method_ + 1;
+  while (cip < end_) {
+    size_t length = InstructionLength(cip, end_);
+    if (!length)
+      return false;
+
+    OPCODE op = (OPCODE)*cip;
+    const cell_t* params = cip + 1;
+    switch (op) {
+    case OP_LOAD_S_PRI:
+    case OP_LOAD_S_ALT:
+    case OP_STOR_S_PRI:
+    case OP_STOR_S_ALT:
+    case OP_ZERO_S:
+    case OP_CONST_S:
+    case OP_INC_S:
+    case OP_DEC_S:
+    case OP_LOAD_S_BOTH:
+    case OP_PUSH_S:
+    case OP_PUSH2_S:
+    case OP_PUSH3_S:
+    case OP_PUSH4_S:
+    case OP_PUSH5_S:
+    {
+      size_t n = 1;
+      if (op == OP_LOAD_S_BOTH)
+        n = 2;
+      else if (op >= OP_PUSH_S)
+        n = length - 1;
+      for (size_t i = 0; i < n; i++) {
+        cell_t offset = params[i];
+        if (!IsAligned(offset, sizeof(cell_t)))
+          return false;
+        if (offset >= 0 && offset < 12)
+          continue;
+        if (slotIndex(offset) == kNoSlot && slots_.length() < kMaxSlots)
+          slots_.append(offset);
+      }
+      break;
+    }
+
+    case OP_ADDR_PRI:
+    case OP_ADDR_ALT:
+    case OP_PUSH_ADR:
+    case OP_PUSH2_ADR:
+    case OP_PUSH3_ADR:
+    case OP_PUSH4_ADR:
+    case OP_PUSH5_ADR:
+      for (size_t i = 1; i < length; i++)
+        escaped.append(params[i - 1]);
+      break;
+
+    case OP_BOUNDS:
+      checks_.append(cell_t((cip - code_) * sizeof(cell_t)));
+      check_redundant_.append(0);
+      if (uint32_t(params[0]) <= INT_MAX)
+        addThreshold(params[0]);
+      break;
+
+    default:
+      break;
+    }
+    cip += length;
+  }
+
+  qsort(thresholds_.buffer(), thresholds_.length(), sizeof(int64_t), CompareThresholds);
+
+  for (size_t i = 0; i < escaped.length(); i++) {
+    cell_t base = escaped[i];
+    for (size_t j = 0; j < slots_.length(); j++) {
+      cell_t offset = slots_[j];
+      if (offset >= base && (offset < 0) == (base < 0)) {
+        slots_.remove(j);
+        j--;
+      }
+    }
+  }
+  return true;
+}
+
+// An index checked against |value| settles just below, at, or above it.
+void
+BoundsAnalysis::addThreshold(cell_t value)
+{
+  for (int64_t delta = -1; delta <= 1; delta++)
+    thresholds_.append(int64_t(value) + delta);
+}
+
+int64_t
+BoundsAnalysis::widenUp(int64_t value) const
+{
+  for (size_t i = 0; i < thresholds_.length(); i++) {
+    if (thresholds_[i] >= value)
+      return thresholds_[i];
+  }
+  return INT_MAX;
+}
+
+int64_t
+BoundsAnalysis::widenDown(int64_t value) const
+{
+  for (size_t i = thresholds_.length(); i > 0; i--) {
+    if (thresholds_[i - 1] <= value)
+      return thresholds_[i - 1];
+  }
+  return INT_MIN;
+}
+
+int
+BoundsAnalysis::slotIndex(cell_t offset) const
+{
+  for (size_t i = 0; i < slots_.length(); i++) {
+    if (slots_[i] == offset)
+      return int(i);
+  }
+  return kNoSlot;
+}
+
+int32_t
+BoundsAnalysis::depthAt(const cell_t* cip) const
+{
+  size_t index = cip - method_;
+  if (index >= stack_depths_.length())
+    return -1;
+  return stack_depths_[index];
+}
+
+size_t
+BoundsAnalysis::checkAt(const cell_t* cip) const
+{
+  cell_t offset = cell_t((cip - code_) * sizeof(cell_t));
+  size_t lo = 0;
+  size_t hi = checks_.length();
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (checks_[mid] < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  assert(lo < checks_.length() && checks_[lo] == offset);
+  return lo;
+}
+
+int
+BoundsAnalysis::blockAt(const cell_t* cip) const
+{
+  size_t lo = 0;
+  size_t hi = blocks_.length();
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (blocks_[mid] == cip)
+      return int(mid);
+    if (blocks_[mid] < cip)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -1;
+}
+
+bool
+BoundsAnalysis::walk(int block)
+{
+  for (size_t i = 0; i < width_; i++)
+    cur_[i] = entry_states_[block * width_ + i];
+  pri_slot_ = kNoSlot;
+  alt_slot_ = kNoSlot;
+
+  const cell_t* next_block = (size_t(block) + 1 < blocks_.length())
+                             ? blocks_[block + 1]
+                             : nullptr;
+
+  const cell_t* cip = blocks_[block];
+  while (cip < end_) {
+    if (cip == next_block) {
+      join(cip);
+      return true;
+    }
+
+    size_t length = InstructionLength(cip, end_);
+    if (!length)
+      return false;
+
+    dropDeadSlots(cip);
+
+    bool fallthrough = true;
+    if (!step(cip, (OPCODE)*cip, &fallthrough))
+      return false;
+    if (!fallthrough)
+      return true;
+    cip += length;
+  }
+  return true;
+}
+
+// Slots below the top of the stack are dead. Without a known depth, no
+// local slot can be trusted.
+void
+BoundsAnalysis::dropDeadSlots(const cell_t* cip)
+{
+  int32_t depth = depthAt(cip);
+  for (size_t i = 0; i < slots_.length(); i++) {
+    cell_t offset = slots_[i];
+    if (offset >= 0)
+      continue;
+    if (depth < 0 || -offset > depth) {
+      cur_[kFirstSlot + i] = Top();
+      if (pri_slot_ == int(i))
+        pri_slot_ = kNoSlot;
+      if (alt_slot_ == int(i))
+        alt_slot_ = kNoSlot;
+    }
+  }
+}
+
+void
+BoundsAnalysis::join(const cell_t* target)
+{
+  int block = blockAt(target);
+  if (block < 0)
+    return;
+
+  Range* entry = &entry_states_[block * width_];
+  uint32_t* changes = &changes_[block * width_];
+  if (!reached_[block]) {
+    for (size_t i = 0; i < width_; i++)
+      entry[i] = cur_[i];
+    reached_[block] = 1;
+  } else {
+    bool changed = false;
+    for (size_t i = 0; i < width_; i++) {
+      if (cur_[i].lo >= entry[i].lo && cur_[i].hi <= entry[i].hi)
+        continue;
+
+      bool widen = changes[i] >= kWidenAfter;
+      changes[i]++;
+      if (cur_[i].lo < entry[i].lo) {
+        entry[i].lo = widen ? widenDown(cur_[i].lo) : cur_[i].lo;
+        changed = true;
+      }
+      if (cur_[i].hi > entry[i].hi) {
+        entry[i].hi = widen ? widenUp(cur_[i].hi) : cur_[i].hi;
+        changed = true;
+      }
+    }
+    if (!changed)
+      return;
+  }
+
+  if (!queued_[block]) {
+    queued_[block] = 1;
+    worklist_.append(block);
+  }
+}
+
+BoundsAnalysis::Range
+BoundsAnalysis::slotRange(cell_t offset)
+{
+  int index = slotIndex(offset);
+  if (index == kNoSlot)
+    return Top();
+  return cur_[kFirstSlot + index];
+}
+
+void
+BoundsAnalysis::setReg(size_t which, const Range& range, int slot)
+{
+  cur_[which] = range;
+  if (which == kPri)
+    pri_slot_ = slot;
+  else
+    alt_slot_ = slot;
+}
+
+void
+BoundsAnalysis::setSlot(cell_t offset, const Range& range)
+{
+  int index = slotIndex(offset);
+  if (index == kNoSlot)
+    return;
+  cur_[kFirstSlot + index] = range;
+  if (pri_slot_ == index)
+    pri_slot_ = kNoSlot;
+  if (alt_slot_ == index)
+    alt_slot_ = kNoSlot;
+}
+
+// Copy narrowed register ranges back to the slots they were loaded from.
+void
+BoundsAnalysis::syncTags()
+{
+  if (pri_slot_ != kNoSlot && pri_slot_ == alt_slot_) {
+    // Both hold the same value, so both constraints apply.
+    if (cur_[kAlt].lo > cur_[kPri].lo)
+      cur_[kPri].lo = cur_[kAlt].lo;
+    if (cur_[kAlt].hi < cur_[kPri].hi)
+      cur_[kPri].hi = cur_[kAlt].hi;
+    cur_[kAlt] = cur_[kPri];
+  }
+  if (pri_slot_ != kNoSlot)
+    cur_[kFirstSlot + pri_slot_] = cur_[kPri];
+  if (alt_slot_ != kNoSlot)
+    cur_[kFirstSlot + alt_slot_] = cur_[kAlt];
+}
+
+// Narrow |a| and |b| given that a < b, or a <= b. Returns false if that
+// can't hold.
+static bool
+NarrowLess(int64_t* alo, int64_t* ahi, int64_t* blo, int64_t* bhi, bool orEqual)
+{
+  int64_t gap = orEqual ? 0 : 1;
+  if (*ahi > *bhi - gap)
+    *ahi = *bhi - gap;
+  if (*blo < *alo + gap)
+    *blo = *alo + gap;
+  return *alo <= *ahi && *blo <= *bhi;
+}
+
+// Follow both edges of a conditional jump, narrowing pri and alt on each.
+// Returns false if the fallthrough edge can't be taken.
+bool
+BoundsAnalysis::branch(OPCODE op, const cell_t* target)
+{
+  Range pri = cur_[kPri];
+  Range alt = cur_[kAlt];
+  bool taken = true;
+  bool fallthrough = true;
+
+  // The state on the taken edge is built in place, then pri and alt are
+  // reset and narrowed for the fallthrough edge.
+  switch (op) {
+  case OP_JZER:
+    taken = pri.lo <= 0 && pri.hi >= 0;
+    cur_[kPri] = Constant(0);
+    break;
+  case OP_JNZ:
+    taken = pri.lo != 0 || pri.hi != 0;
+    if (cur_[kPri].lo == 0)
+      cur_[kPri].lo = 1;
+    if (cur_[kPri].hi == 0)
+      cur_[kPri].hi = -1;
+    break;
+  case OP_JEQ:
+  case OP_JNEQ:
+    break;
+  case OP_JSLESS:
+    taken = NarrowLess(&cur_[kPri].lo, &cur_[kPri].hi, &cur_[kAlt].lo, &cur_[kAlt].hi, false);
+    break;
+  case OP_JSLEQ:
+    taken = NarrowLess(&cur_[kPri].lo, &cur_[kPri].hi, &cur_[kAlt].lo, &cur_[kAlt].hi, true);
+    break;
+  case OP_JSGRTR:
+    taken = NarrowLess(&cur_[kAlt].lo, &cur_[kAlt].hi, &cur_[kPri].lo, &cur_[kPri].hi, false);
+    break;
+  case OP_JSGEQ:
+    taken = NarrowLess(&cur_[kAlt].lo, &cur_[kAlt].hi, &cur_[kPri].lo, &cur_[kPri].hi, true);
+    break;
+  default:
+    break;
+  }
+
+  if (taken) {
+    Range pri_slot_range = Top();
+    Range alt_slot_range = Top();
+    if (pri_slot_ != kNoSlot)
+      pri_slot_range = cur_[kFirstSlot + pri_slot_];
+    if (alt_slot_ != kNoSlot)
+      alt_slot_range = cur_[kFirstSlot + alt_slot_];
+
+    syncTags();
+    join(target);
+
+    if (pri_slot_ != kNoSlot)
+      cur_[kFirstSlot + pri_slot_] = pri_slot_range;
+    if (alt_slot_ != kNoSlot)
+      cur_[kFirstSlot + alt_slot_] = alt_slot_range;
+  }
+
+  cur_[kPri] = pri;
+  cur_[kAlt] = alt;
+
+  switch (op) {
+  case OP_JZER:
+    fallthrough = pri.lo != 0 || pri.hi != 0;
+    if (cur_[kPri].lo == 0)
+      cur_[kPri].lo = 1;
+    if (cur_[kPri].hi == 0)
+      cur_[kPri].hi = -1;
+    break;
+  case OP_JNZ:
+    fallthrough = pri.lo <= 0 && pri.hi >= 0;
+    cur_[kPri] = Constant(0);
+    break;
+  case OP_JSLESS:
+    fallthrough = NarrowLess(&cur_[kAlt].lo, &cur_[kAlt].hi, &cur_[kPri].lo, &cur_[kPri].hi, true);
+    break;
+  case OP_JSLEQ:
+    fallthrough = NarrowLess(&cur_[kAlt].lo, &cur_[kAlt].hi, &cur_[kPri].lo, &cur_[kPri].hi, false);
+    break;
+  case OP_JSGRTR:
+    fallthrough = NarrowLess(&cur_[kPri].lo, &cur_[kPri].hi, &cur_[kAlt].lo, &cur_[kAlt].hi, true);
+    break;
+  case OP_JSGEQ:
+    fallthrough = NarrowLess(&cur_[kPri].lo, &cur_[kPri].hi, &cur_[kAlt].lo, &cur_[kAlt].hi, false);
+    break;
+  default:
+    break;
+  }
+
+  if (fallthrough)
+    syncTags();
+  return fallthrough;
+}
+
+bool
+BoundsAnalysis::step(const cell_t* cip, OPCODE op, bool* fallthrough)
+{
+  const cell_t* params = cip + 1;
+  int32_t depth = depthAt(cip);
+
+  switch (op) {
+  case OP_NOP:
+  case OP_BREAK:
+  case OP_STOR_PRI:
+  case OP_STOR_ALT:
+  case OP_SREF_S_PRI:
+  case OP_SREF_S_ALT:
+  case OP_STOR_I:
+  case OP_STRB_I:
+  case OP_STACK:
+  case OP_ZERO:
+  case OP_INC:
+  case OP_DEC:
+  case OP_INC_I:
+  case OP_DEC_I:
+  case OP_MOVS:
+  case OP_FILL:
+  case OP_TRACKER_PUSH_C:
+    // Nothing tracked can change: tracked slots are never reached through a
+    // pointer.
+    return true;
+
+  case OP_LOAD_S_PRI:
+    setReg(kPri, slotRange(params[0]), slotIndex(params[0]));
+    return true;
+  case OP_LOAD_S_ALT:
+    setReg(kAlt, slotRange(params[0]), slotIndex(params[0]));
+    return true;
+  case OP_LOAD_S_BOTH:
+    setReg(kPri, slotRange(params[0]), slotIndex(params[0]));
+    setReg(kAlt, slotRange(params[1]), slotIndex(params[1]));
+    return true;
+
+  case OP_CONST_PRI:
+    setReg(kPri, Constant(params[0]), kNoSlot);
+    return true;
+  case OP_CONST_ALT:
+    setReg(kAlt, Constant(params[0]), kNoSlot);
+    return true;
+  case OP_ZERO_PRI:
+    setReg(kPri, Constant(0), kNoSlot);
+    return true;
+  case OP_ZERO_ALT:
+    setReg(kAlt, Constant(0), kNoSlot);
+    return true;
+
+  case OP_STOR_S_PRI:
+    setSlot(params[0], cur_[kPri]);
+    pri_slot_ = slotIndex(params[0]);
+    return true;
+  case OP_STOR_S_ALT:
+    setSlot(params[0], cur_[kAlt]);
+    alt_slot_ = slotIndex(params[0]);
+    return true;
+  case OP_ZERO_S:
+    setSlot(params[0], Constant(0));
+    return true;
+  case OP_CONST_S:
+    setSlot(params[0], Constant(params[1]));
+    return true;
+  case OP_INC_S:
+    setSlot(params[0], Add(slotRange(params[0]), Constant(1)));
+    return true;
+  case OP_DEC_S:
+    setSlot(params[0], Sub(slotRange(params[0]), Constant(1)));
+    return true;
+
+  case OP_MOVE_PRI:
+    setReg(kPri, cur_[kAlt], alt_slot_);
+    return true;
+  case OP_MOVE_ALT:
+    setReg(kAlt, cur_[kPri], pri_slot_);
+    return true;
+  case OP_XCHG:
+  {
+    Range pri = cur_[kPri];
+    int pri_slot = pri_slot_;
+    setReg(kPri, cur_[kAlt], alt_slot_);
+    setReg(kAlt, pri, pri_slot);
+    return true;
+  }
+
+  case OP_INC_PRI:
+    setReg(kPri, Add(cur_[kPri], Constant(1)), kNoSlot);
+    return true;
+  case OP_INC_ALT:
+    setReg(kAlt, Add(cur_[kAlt], Constant(1)), kNoSlot);
+    return true;
+  case OP_DEC_PRI:
+    setReg(kPri, Sub(cur_[kPri], Constant(1)), kNoSlot);
+    return true;
+  case OP_DEC_ALT:
+    setReg(kAlt, Sub(cur_[kAlt], Constant(1)), kNoSlot);
+    return true;
+  case OP_ADD_C:
+    setReg(kPri, Add(cur_[kPri], Constant(params[0])), kNoSlot);
+    return true;
+  case OP_ADD:
+    setReg(kPri, Add(cur_[kPri], cur_[kAlt]), kNoSlot);
+    return true;
+  case OP_SUB:
+    setReg(kPri, Sub(cur_[kPri], cur_[kAlt]), kNoSlot);
+    return true;
+  case OP_SUB_ALT:
+    setReg(kPri, Sub(cur_[kAlt], cur_[kPri]), kNoSlot);
+    return true;
+
+  case OP_PUSH_PRI:
+  case OP_PUSH_ALT:
+    if (depth >= 0)
+      setSlot(-(depth + cell_t(sizeof(cell_t))), cur_[op == OP_PUSH_PRI ? kPri : kAlt]);
+    return true;
+
+  case OP_PUSH_C:
+  case OP_PUSH2_C:
+  case OP_PUSH3_C:
+  case OP_PUSH4_C:
+  case OP_PUSH5_C:
+  case OP_PUSH_S:
+  case OP_PUSH2_S:
+  case OP_PUSH3_S:
+  case OP_PUSH4_S:
+  case OP_PUSH5_S:
+  {
+    if (depth < 0)
+      return true;
+    bool is_const = (op == OP_PUSH_C) || (op != OP_PUSH_S && (op - OP_PUSH2_C) % 4 == 0);
+    size_t n = InstructionLength(cip, end_) - 1;
+
+    // Read every source before writing, in case a push overwrites one.
+    Range values[5];
+    for (size_t i = 0; i < n; i++)
+      values[i] = is_const ? Constant(params[i]) : slotRange(params[i]);
+    for (size_t i = 0; i < n; i++)
+      setSlot(-(depth + cell_t((i + 1) * sizeof(cell_t))), values[i]);
+    return true;
+  }
+
+  case OP_PUSH:
+  case OP_PUSH2:
+  case OP_PUSH3:
+  case OP_PUSH4:
+  case OP_PUSH5:
+  case OP_PUSH_ADR:
+  case OP_PUSH2_ADR:
+  case OP_PUSH3_ADR:
+  case OP_PUSH4_ADR:
+  case OP_PUSH5_ADR:
+  {
+    if (depth < 0)
+      return true;
+    size_t n = InstructionLength(cip, end_) - 1;
+    for (size_t i = 0; i < n; i++)
+      setSlot(-(depth + cell_t((i + 1) * sizeof(cell_t))), Top());
+    return true;
+  }
+
+  case OP_POP_PRI:
+  case OP_POP_ALT:
+  {
+    Range value = (depth >= 0) ? slotRange(-depth) : Top();
+    setReg(op == OP_POP_PRI ? kPri : kAlt, value, kNoSlot);
+    return true;
+  }
+
+  case OP_SWAP_PRI:
+  case OP_SWAP_ALT:
+  {
+    size_t reg = (op == OP_SWAP_PRI) ? kPri : kAlt;
+    Range value = (depth >= 0) ? slotRange(-depth) : Top();
+    if (depth >= 0)
+      setSlot(-depth, cur_[reg]);
+    setReg(reg, value, kNoSlot);
+    return true;
+  }
+
+  case OP_GENARRAY:
+  case OP_GENARRAY_Z:
+    // The dimension sizes are popped and the array address is pushed.
+    for (cell_t i = 0; i < params[0]; i++) {
+      int32_t slot_depth = depth - i * cell_t(sizeof(cell_t));
+      if (slot_depth <= 0)
+        break;
+      setSlot(-slot_depth, Top());
+    }
+    return true;
+
+  case OP_HEAP:
+    setReg(kAlt, Top(), kNoSlot);
+    return true;
+
+  case OP_BOUNDS:
+  {
+    // The check is unsigned.
+    int64_t limit = uint32_t(params[0]);
+    size_t index = checkAt(cip);
+    check_redundant_[index] = (cur_[kPri].lo >= 0 && cur_[kPri].hi <= limit);
+
+    // Past the check, pri is in bounds. A limit past INT_MAX lets negative
+    // values through, so it doesn't tell us anything.
+    if (limit > INT_MAX)
+      return true;
+    if (cur_[kPri].lo < 0 || cur_[kPri].hi > limit) {
+      if (cur_[kPri].lo < 0)
+        cur_[kPri].lo = 0;
+      if (cur_[kPri].hi > limit)
+        cur_[kPri].hi = limit;
+      if (cur_[kPri].lo > cur_[kPri].hi) {
+        *fallthrough = false;
+        return true;
+      }
+    }
+    if (pri_slot_ != kNoSlot)
+      cur_[kFirstSlot + pri_slot_] = cur_[kPri];
+    return true;
+  }
+
+  case OP_JUMP:
+    join(code_ + params[0] / sizeof(cell_t));
+    *fallthrough = false;
+    return true;
+
+  case OP_JZER:
+  case OP_JNZ:
+  case OP_JEQ:
+  case OP_JNEQ:
+  case OP_JSLESS:
+  case OP_JSLEQ:
+  case OP_JSGRTR:
+  case OP_JSGEQ:
+    *fallthrough = branch(op, code_ + params[0] / sizeof(cell_t));
+    return true;
+
+  case OP_SWITCH:
+  {
+    const cell_t* table = code_ + params[0] / sizeof(cell_t);
+    if (table < method_ || table + 3 > end_ || table[0] != OP_CASETBL ||
+        !InstructionLength(table, end_))
+    {
+      return false;
+    }
+    join(code_ + table[2] / sizeof(cell_t));
+    for (cell_t i = 0; i < table[1]; i++)
+      join(code_ + table[3 + i * 2 + 1] / sizeof(cell_t));
+    *fallthrough = false;
+    return true;
+  }
+
+  case OP_RETN:
+  case OP_HALT:
+    *fallthrough = false;
+    return true;
+
+  case OP_CASETBL:
+    // Only reached as data, after a jump.
+    return false;
+
+  default:
+    // Everything else leaves something unknown in pri, alt, or both.
+    setReg(kPri, Top(), kNoSlot);
+    setReg(kAlt, Top(), kNoSlot);
+    return true;
+  }
+}
+
+} // namespace sp
@@ -0,0 +1,126 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_bounds_analysis_h_
+#define _include_sourcepawn_vm_bounds_analysis_h_
+
+#include <sp_vm_types.h>
+#include <smx/smx-v1-opcodes.h>
+#include <amtl/am-vector.h>
+
+namespace sp {
+
+class PluginRuntime;
+
+// Finds BOUNDS checks that can never fail, so the JIT can leave them out.
+//
+// This is an interval analysis over a verified method. It tracks the range
+// of pri, alt, and frame slots whose address is never taken, and narrows
+// them on conditional jumps. Loops are handled by iterating to a fixed point,
+// widening bounds that keep growing. An induction variable that starts at a
+// constant, only counts up, and is tested against a constant limit at the
+// loop header therefore ends up with a range the check can be compared to.
+class BoundsAnalysis final
+{
+ public:
+  // |jumpTargets| are the method's jump and switch targets, sorted, and
+  // |stackDepths| has the verifier's stack depth at each cell of the method,
+  // or -1 where it isn't known.
+  BoundsAnalysis(PluginRuntime* rt, uint32_t startOffset, uint32_t endOffset,
+                 const ke::Vector<cell_t>& jumpTargets,
+                 const ke::Vector<int32_t>& stackDepths);
+
+  // Returns false if the method has code the analysis can't decode. No
+  // checks are redundant in that case.
+  bool analyze();
+
+  // Pcode offsets of redundant BOUNDS instructions, in order.
+  const ke::Vector<cell_t>& redundantChecks() const {
+    return redundant_;
+  }
+
+ private:
+  struct Range {
+    int64_t lo;
+    int64_t hi;
+  };
+
+  // Indexes into a state; frame slots follow pri and alt.
+  static const size_t kPri = 0;
+  static const size_t kAlt = 1;
+  static const size_t kFirstSlot = 2;
+  static const size_t kMaxSlots = 32;
+  static const int kNoSlot = -1;
+
+  static Range Top();
+  static Range Constant(cell_t value);
+  static Range Add(const Range& a, const Range& b);
+  static Range Sub(const Range& a, const Range& b);
+
+  bool findSlots();
+  void addThreshold(cell_t value);
+  int64_t widenUp(int64_t value) const;
+  int64_t widenDown(int64_t value) const;
+  int slotIndex(cell_t offset) const;
+  int32_t depthAt(const cell_t* cip) const;
+  int blockAt(const cell_t* cip) const;
+  size_t checkAt(const cell_t* cip) const;
+
+  bool walk(int block);
+  bool step(const cell_t* cip, OPCODE op, bool* fallthrough);
+  void dropDeadSlots(const cell_t* cip);
+  void join(const cell_t* target);
+  bool branch(OPCODE op, const cell_t* target);
+
+  Range slotRange(cell_t offset);
+  void setReg(size_t which, const Range& range, int slot);
+  void setSlot(cell_t offset, const Range& range);
+  void syncTags();
+
+ private:
+  const cell_t* code_;
+  const cell_t* method_;
+  const cell_t* end_;
+  const ke::Vector<cell_t>& jump_targets_;
+  const ke::Vector<int32_t>& stack_depths_;
+
+  // Array limits from the method's checks, and zero, sorted, as widening
+  // points.
+  ke::Vector<int64_t> thresholds_;
+
+  // Tracked frame slots, by offset.
+  ke::Vector<cell_t> slots_;
+  size_t width_;
+
+  // Start of each block, and the state on entry, |width_| ranges per block,
+  // with how many times each range has grown.
+  ke::Vector<const cell_t*> blocks_;
+  ke::Vector<Range> entry_states_;
+  ke::Vector<uint8_t> reached_;
+  ke::Vector<uint32_t> changes_;
+  ke::Vector<int> worklist_;
+  ke::Vector<uint8_t> queued_;
+
+  // The state while walking a block, and which slots pri and alt hold.
+  ke::Vector<Range> cur_;
+  int pri_slot_;
+  int alt_slot_;
+
+  // Every BOUNDS in the method, and whether it was last seen to be redundant.
+  ke::Vector<cell_t> checks_;
+  ke::Vector<uint8_t> check_redundant_;
+  ke::Vector<cell_t> redundant_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_bounds_analysis_h_
@@ -32,22 +32,28 @@ CodeAllocator::~CodeAllocator()
 }
 
 CodeChunk
-CodeAllocator::Allocate(size_t rawBytes)
+CodeAllocator::Allocate(size_t rawBytes, size_t rawColdBytes)
 {
   size_t bytes = Align(rawBytes, kMallocAlignment);
   if (bytes < rawBytes)
     return CodeChunk();
+  size_t coldBytes = Align(rawColdBytes, kMallocAlignment);
+  if (coldBytes < rawColdBytes)
+    return CodeChunk();
+  size_t totalBytes = bytes + coldBytes;
+  if (totalBytes < bytes)
+    return CodeChunk();
 
   // First search the cache for any pools we can re-use.
-  RefPtr<CodePool> pool = findPool(bytes);
+  RefPtr<CodePool> pool = findPool(totalBytes);
   if (pool)
-    return allocateInPool(pool, bytes);
+    return allocateInPool(pool, rawBytes, rawColdBytes);
 
-  pool = CodePool::AllocateFor(bytes);
+  pool = CodePool::AllocateFor(totalBytes);
   if (!pool)
     return CodeChunk();
 
-  CodeChunk chunk = allocateInPool(pool, bytes);
+  CodeChunk chunk = allocateInPool(pool, rawBytes, rawColdBytes);
 
   // Enter this pool into the cache if we can.
   if (cached_pools_.length() < kMaxCachedPools) {
@@ -84,10 +90,15 @@ CodeAllocator::findPool(size_t bytes)
 }
 
 CodeChunk
-CodeAllocator::allocateInPool(RefPtr<CodePool> pool, size_t bytes)
+CodeAllocator::allocateInPool(RefPtr<CodePool> pool, size_t bytes, size_t cold_bytes)
 {
-  uint8_t* address = pool->allocate(bytes);
-  return CodeChunk(pool, address, bytes);
+  // Chunks remember the unaligned sizes, so offsets past the hot code map into
+  // the cold code.
+  uint8_t* address = pool->allocate(Align(bytes, kMallocAlignment));
+  uint8_t* cold_address = nullptr;
+  if (cold_bytes)
+    cold_address = pool->allocateCold(Align(cold_bytes, kMallocAlignment));
+  return CodeChunk(pool, address, bytes, cold_address, cold_bytes);
 }
 
 static size_t kPageGranularity = 0;
@@ -132,6 +143,7 @@ CodePool::AllocateFor(size_t askBytes)
 CodePool::CodePool(uint8_t* start, size_t size)
  : start_(start),
    ptr_(start),
+   cold_ptr_(start + size),
    end_(start + size),
    size_(size)
 {
@@ -149,8 +161,16 @@ CodePool::~CodePool()
 uint8_t*
 CodePool::allocate(size_t bytes)
 {
-  assert(ptr_ + bytes <= end_);
+  assert(ptr_ + bytes <= cold_ptr_);
   uint8_t* result = ptr_;
   ptr_ += bytes;
   return result;
 }
+
+uint8_t*
+CodePool::allocateCold(size_t bytes)
+{
+  assert(ptr_ + bytes <= cold_ptr_);
+  cold_ptr_ -= bytes;
+  return cold_ptr_;
+}
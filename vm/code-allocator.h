@@ -16,14 +16,20 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <am-refcounting.h>
+#include <am-refcounting-threadsafe.h>
 #include <am-vector.h>
 
 namespace sp {
 
 using namespace ke;
 
-// Manages CodeChunks, optimized for the underlying system allocator.
-class CodePool : public ke::Refcounted<CodePool>
+// Manages CodeChunks, optimized for the underlying system allocator. Chunks
+// can be created and released on compile threads, so the refcount is atomic.
+//
+// Hot code is allocated from the bottom of the pool, and cold code from the
+// top, so hot code stays packed together. Both parts of a chunk come from the
+// same pool, so they can always reach each other with rel32 displacements.
+class CodePool : public ke::RefcountedThreadsafe<CodePool>
 {
   friend class CodeAllocator;
 
@@ -36,8 +42,9 @@ class CodePool : public ke::Refcounted<CodePool>
   static RefPtr<CodePool> AllocateFor(size_t bytes);
 
   uint8_t* allocate(size_t bytes);
+  uint8_t* allocateCold(size_t bytes);
   size_t bytesFree() const {
-    return end_ - ptr_;
+    return cold_ptr_ - ptr_;
   }
 
  private:
@@ -47,21 +54,31 @@ class CodePool : public ke::Refcounted<CodePool>
  private:
   uint8_t* start_;
   uint8_t* ptr_;
+  uint8_t* cold_ptr_;
   uint8_t* end_;
   size_t size_;
 };
 
-// Raw reference to allocated code.
+// Raw reference to allocated code, with an optional cold part.
+//
+// Offsets into a chunk count through the hot code and then the cold code, as
+// if the cold code directly followed it, which is how the assembler emitted
+// them.
 struct CodeChunk
 {
   CodeChunk()
    : address_(nullptr),
-     bytes_(0)
+     bytes_(0),
+     cold_address_(nullptr),
+     cold_bytes_(0)
   {}
-  CodeChunk(RefPtr<CodePool> pool, uint8_t* address, size_t bytes)
+  CodeChunk(RefPtr<CodePool> pool, uint8_t* address, size_t bytes,
+            uint8_t* cold_address, size_t cold_bytes)
    : pool_(pool),
      address_(address),
-     bytes_(bytes)
+     bytes_(bytes),
+     cold_address_(cold_address),
+     cold_bytes_(cold_bytes)
   {}
 
   uint8_t* address() const {
@@ -70,11 +87,40 @@ struct CodeChunk
   size_t bytes() const {
     return bytes_;
   }
+  uint8_t* cold_address() const {
+    return cold_address_;
+  }
+  size_t cold_bytes() const {
+    return cold_bytes_;
+  }
+
+  uint8_t* addressOf(uint32_t offset) const {
+    if (offset < bytes_)
+      return address_ + offset;
+    return cold_address_ + (offset - bytes_);
+  }
+
+  // Returns false if |pc| is in neither part. The end of each part counts as
+  // part of it, for return addresses.
+  bool offsetOf(const void* pc, uint32_t* offset) const {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(pc);
+    if (p >= address_ && p <= address_ + bytes_) {
+      *offset = uint32_t(p - address_);
+      return true;
+    }
+    if (cold_address_ && p >= cold_address_ && p <= cold_address_ + cold_bytes_) {
+      *offset = uint32_t(bytes_ + (p - cold_address_));
+      return true;
+    }
+    return false;
+  }
 
  private:
   RefPtr<CodePool> pool_;
   uint8_t* address_;
   size_t bytes_;
+  uint8_t* cold_address_;
+  size_t cold_bytes_;
 };
 
 // Manages CodePools.
@@ -84,12 +130,13 @@ class CodeAllocator
   CodeAllocator();
   ~CodeAllocator();
 
-  CodeChunk Allocate(size_t bytes);
+  // If |cold_bytes| is not 0, the chunk also gets a cold part.
+  CodeChunk Allocate(size_t bytes, size_t cold_bytes = 0);
 
  private:
   RefPtr<CodePool> newPool(size_t bytes);
   RefPtr<CodePool> findPool(size_t bytes);
-  CodeChunk allocateInPool(RefPtr<CodePool> pool, size_t bytes);
+  CodeChunk allocateInPool(RefPtr<CodePool> pool, size_t bytes, size_t cold_bytes);
 
  private:
   CodeAllocator(const CodeAllocator&) = delete;
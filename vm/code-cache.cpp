@@ -0,0 +1,509 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include "code-cache.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <atomic>
+#if defined(KE_WINDOWS)
+# include <direct.h>
+# include <intrin.h>
+# include <windows.h>
+#else
+# include <cpuid.h>
+# include <dlfcn.h>
+#endif
+#include <smx/smx-v1-opcodes.h>
+#include "api.h"
+#include "code-stubs.h"
+#include "compiled-function.h"
+#include "environment.h"
+#include "file-utils.h"
+#include "plugin-context.h"
+#include "plugin-runtime.h"
+#include "md5/md5.h"
+
+using namespace sp;
+
+// Anything in the VM's own image, to find where it was loaded.
+static int sModuleMarker;
+
+// Makes temporary file names unique across compile threads.
+static std::atomic<uint32_t> sTempFileCounter(0);
+
+static uint64_t
+HashBytes(uint64_t hash, const void *bytes, size_t length)
+{
+  // FNV-1a.
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(bytes);
+  for (size_t i = 0; i < length; i++) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static const uint64_t kHashSeed = 0xcbf29ce484222325ULL;
+
+static bool
+MakeDirectory(const char *path)
+{
+#if defined(KE_WINDOWS)
+  if (_mkdir(path) == 0)
+    return true;
+#else
+  if (mkdir(path, 0755) == 0)
+    return true;
+#endif
+  return errno == EEXIST;
+}
+
+CodeCache::CodeCache(Environment *env)
+ : env_(env),
+   build_id_(0),
+   cpu_features_(0),
+   module_base_(0)
+{
+}
+
+bool
+CodeCache::Initialize(const char *path)
+{
+  if (!MakeDirectory(path))
+    return false;
+  path_ = path;
+
+  // Code refers to the VM's functions relative to where it was loaded, and
+  // bakes in the layout of its structures, so entries are only good for the
+  // exact binary that wrote them.
+  const char *module_path;
+#if defined(KE_WINDOWS)
+  HMODULE module;
+  if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                          GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                          reinterpret_cast<LPCSTR>(&sModuleMarker),
+                          &module))
+  {
+    return false;
+  }
+  char module_name[MAX_PATH];
+  if (!GetModuleFileNameA(module, module_name, sizeof(module_name)))
+    return false;
+  module_base_ = uintptr_t(module);
+  module_path = module_name;
+#else
+  Dl_info info;
+  if (!dladdr(&sModuleMarker, &info) || !info.dli_fbase || !info.dli_fname)
+    return false;
+  module_base_ = uintptr_t(info.dli_fbase);
+  module_path = info.dli_fname;
+#endif
+
+  struct stat st;
+  if (stat(module_path, &st) != 0)
+    return false;
+
+  uint64_t size = uint64_t(st.st_size);
+  uint64_t mtime = uint64_t(st.st_mtime);
+  uint32_t version = kVersion;
+  build_id_ = HashBytes(kHashSeed, &version, sizeof(version));
+  build_id_ = HashBytes(build_id_, &size, sizeof(size));
+  build_id_ = HashBytes(build_id_, &mtime, sizeof(mtime));
+
+  // The JIT only relies on baseline features today, but any CPU change is
+  // treated as a new cache so that can change without invalidating entries
+  // by hand.
+#if defined(KE_WINDOWS)
+  int regs[4];
+  __cpuid(regs, 1);
+  uint64_t features = (uint64_t(uint32_t(regs[2])) << 32) | uint32_t(regs[3]);
+#else
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  uint64_t features = (uint64_t(ecx) << 32) | edx;
+#endif
+  cpu_features_ = uint32_t(HashBytes(kHashSeed, &features, sizeof(features)));
+  return true;
+}
+
+bool
+CodeCache::FileFor(PluginRuntime *rt, uint32_t pcode_offset, ke::AString *dir,
+                   ke::AString *file)
+{
+  char hash[65];
+  const unsigned char *code_hash = rt->GetCodeHash();
+  const unsigned char *data_hash = rt->GetDataHash();
+  for (size_t i = 0; i < 16; i++)
+    UTIL_Format(hash + i * 2, 3, "%02x", code_hash[i]);
+  for (size_t i = 0; i < 16; i++)
+    UTIL_Format(hash + 32 + i * 2, 3, "%02x", data_hash[i]);
+
+  // The code is hashed as it was loaded, so whether it was optimized since
+  // is part of the key too.
+  *dir = ke::AString::Sprintf("%s/%s-%016llx-%08x%s",
+                              path_.chars(),
+                              hash,
+                              (unsigned long long)build_id_,
+                              cpu_features_,
+                              rt->writableCode() ? "-opt" : "");
+  *file = ke::AString::Sprintf("%s/%08x.jit", dir->chars(), pcode_offset);
+  return true;
+}
+
+// The compiler replaces some natives with opcodes or intrinsics, depending on
+// how they are bound, so entries are only good while those are bound the same
+// way. Methods that use intrinsics are never saved, since the host can change
+// them, but other methods must not be reused once a native becomes one.
+uint32_t
+CodeCache::NativesKey(PluginRuntime *rt)
+{
+  uint64_t hash = kHashSeed;
+  for (size_t i = 0; i < rt->image()->NumNatives(); i++) {
+    NativeEntry *native = rt->NativeAt(i);
+    uint32_t replacement = OP_NOP;
+    uint32_t intrinsic = 0;
+    if (native->status == SP_NATIVE_BOUND &&
+        !(native->flags & (SP_NTVFLAG_EPHEMERAL|SP_NTVFLAG_OPTIONAL)))
+    {
+      replacement = rt->GetNativeReplacement(i);
+      intrinsic = !!rt->GetIntrinsic(i);
+    }
+    hash = HashBytes(hash, &replacement, sizeof(replacement));
+    hash = HashBytes(hash, &intrinsic, sizeof(intrinsic));
+  }
+  return uint32_t(hash);
+}
+
+bool
+CodeCache::Classify(PluginRuntime *rt, CompiledFunction *fun, uintptr_t value,
+                    Relocation *reloc)
+{
+  PluginContext *cx = rt->GetBaseContext();
+  uintptr_t memory = uintptr_t(cx->memory());
+  uintptr_t natives = rt->image()->NumNatives() ? uintptr_t(rt->NativeAt(0)) : 0;
+
+  uint32_t pcoffs;
+  if (fun->GetCodeOffset(reinterpret_cast<void *>(value), &pcoffs)) {
+    reloc->kind = RelocKind::Code;
+    reloc->delta = pcoffs;
+  } else if (value >= uintptr_t(cx) && value < uintptr_t(cx) + sizeof(PluginContext)) {
+    reloc->kind = RelocKind::Context;
+    reloc->delta = value - uintptr_t(cx);
+  } else if (value >= memory && value <= memory + cx->HeapSize()) {
+    reloc->kind = RelocKind::Memory;
+    reloc->delta = value - memory;
+  } else if (natives &&
+             value >= natives &&
+             value < natives + rt->image()->NumNatives() * sizeof(NativeEntry))
+  {
+    reloc->kind = RelocKind::Natives;
+    reloc->delta = value - natives;
+  } else if (value >= uintptr_t(env_) && value < uintptr_t(env_) + sizeof(Environment)) {
+    reloc->kind = RelocKind::Environment;
+    reloc->delta = value - uintptr_t(env_);
+  } else if (value == uintptr_t(env_->stubs()->ReturnStub())) {
+    reloc->kind = RelocKind::ReturnStub;
+    reloc->delta = 0;
+  } else {
+#if defined(KE_WINDOWS)
+    HMODULE module;
+    if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                            GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                            reinterpret_cast<LPCSTR>(value),
+                            &module) ||
+        uintptr_t(module) != module_base_)
+    {
+      return false;
+    }
+#else
+    Dl_info info;
+    if (!dladdr(reinterpret_cast<void *>(value), &info) ||
+        uintptr_t(info.dli_fbase) != module_base_)
+    {
+      return false;
+    }
+#endif
+    reloc->kind = RelocKind::Module;
+    reloc->delta = value - module_base_;
+  }
+  return true;
+}
+
+bool
+CodeCache::Resolve(PluginRuntime *rt, const CodeChunk &code, const Relocation &reloc,
+                   uintptr_t *value)
+{
+  PluginContext *cx = rt->GetBaseContext();
+
+  switch (reloc.kind) {
+  case RelocKind::Code:
+    if (reloc.delta > code.bytes() + code.cold_bytes())
+      return false;
+    *value = uintptr_t(code.addressOf(uint32_t(reloc.delta)));
+    return true;
+  case RelocKind::Context:
+    if (reloc.delta >= sizeof(PluginContext))
+      return false;
+    *value = uintptr_t(cx) + uintptr_t(reloc.delta);
+    return true;
+  case RelocKind::Memory:
+    if (reloc.delta > cx->HeapSize())
+      return false;
+    *value = uintptr_t(cx->memory()) + uintptr_t(reloc.delta);
+    return true;
+  case RelocKind::Natives:
+    if (reloc.delta >= rt->image()->NumNatives() * sizeof(NativeEntry))
+      return false;
+    *value = uintptr_t(rt->NativeAt(0)) + uintptr_t(reloc.delta);
+    return true;
+  case RelocKind::Environment:
+    if (reloc.delta >= sizeof(Environment))
+      return false;
+    *value = uintptr_t(env_) + uintptr_t(reloc.delta);
+    return true;
+  case RelocKind::ReturnStub:
+    *value = uintptr_t(env_->stubs()->ReturnStub());
+    return true;
+  case RelocKind::Module:
+    *value = module_base_ + uintptr_t(reloc.delta);
+    return true;
+  default:
+    return false;
+  }
+}
+
+template <typename T> static inline void
+Append(ke::Vector<uint8_t> &out, const T *items, size_t count)
+{
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(items);
+  for (size_t i = 0; i < count * sizeof(T); i++)
+    out.append(bytes[i]);
+}
+
+void
+CodeCache::Save(PluginRuntime *rt, CompiledFunction *fun,
+                const ke::Vector<uint32_t> &refs,
+                const ke::Vector<uint32_t> &code_refs,
+                const ke::Vector<uint32_t> &split_refs)
+{
+  size_t code_size = fun->GetCodeSize();
+  size_t cold_size = fun->GetColdCodeSize();
+
+  ke::Vector<Relocation> relocs;
+  for (size_t i = 0; i < refs.length() + code_refs.length(); i++) {
+    bool is_code = i >= refs.length();
+    uint32_t end = is_code ? code_refs[i - refs.length()] : refs[i];
+
+    Relocation reloc;
+    reloc.offset = end - sizeof(uint64_t);
+    uintptr_t value = *reinterpret_cast<uintptr_t *>(fun->GetCodeAt(reloc.offset));
+    if (is_code) {
+      uint32_t pcoffs;
+      if (!fun->GetCodeOffset(reinterpret_cast<void *>(value), &pcoffs))
+        return;
+      reloc.kind = RelocKind::Code;
+      reloc.delta = pcoffs;
+    } else if (!Classify(rt, fun, value, &reloc)) {
+      return;
+    }
+    relocs.append(reloc);
+  }
+
+  // Displacements that depend on where the cold code was placed are stored
+  // as if it directly followed the hot code.
+  ke::Vector<uint8_t> linear;
+  Append(linear, reinterpret_cast<const uint8_t *>(fun->GetEntryAddress()), code_size);
+  Append(linear, reinterpret_cast<const uint8_t *>(fun->GetColdCodeAddress()), cold_size);
+  for (size_t i = 0; i < split_refs.length(); i++) {
+    uint8_t *site = fun->GetCodeAt(split_refs[i]);
+    uint32_t target;
+    if (!fun->GetCodeOffset(site + *reinterpret_cast<int32_t *>(site - 4), &target))
+      return;
+    int32_t disp = int32_t(target) - int32_t(split_refs[i]);
+    memcpy(linear.buffer() + split_refs[i] - sizeof(int32_t), &disp, sizeof(disp));
+  }
+
+  ke::Vector<CallSite> call_sites;
+  for (size_t i = 0; i < fun->NumCallSites(); i++)
+    call_sites.append(fun->GetCallSite(i));
+
+  ke::Vector<uint8_t> payload;
+  Append(payload, linear.buffer(), linear.length());
+  Append(payload, relocs.buffer(), relocs.length());
+  Append(payload, split_refs.buffer(), split_refs.length());
+  Append(payload, fun->cip_map().buffer(), fun->cip_map().length());
+  Append(payload, fun->osr_entries().buffer(), fun->osr_entries().length());
+  Append(payload, call_sites.buffer(), call_sites.length());
+
+  FileHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kMagic;
+  header.version = kVersion;
+  header.build_id = build_id_;
+  header.cpu_features = cpu_features_;
+  header.natives_key = NativesKey(rt);
+  header.heap_size = uint32_t(rt->GetBaseContext()->HeapSize());
+  header.pcode_offset = uint32_t(fun->GetCodeOffset());
+  header.code_size = uint32_t(code_size);
+  header.cold_size = uint32_t(cold_size);
+  header.num_relocs = uint32_t(relocs.length());
+  header.num_split_refs = uint32_t(split_refs.length());
+  header.num_cip_map = uint32_t(fun->cip_map().length());
+  header.num_osr_entries = uint32_t(fun->osr_entries().length());
+  header.num_call_sites = uint32_t(call_sites.length());
+
+  MD5 md5;
+  md5.update(payload.buffer(), (unsigned int)payload.length());
+  md5.finalize();
+  md5.raw_digest(header.checksum);
+
+  ke::AString dir, file;
+  if (!FileFor(rt, fun->GetCodeOffset(), &dir, &file))
+    return;
+  if (!MakeDirectory(dir.chars()))
+    return;
+
+  // Write to a temporary file first, so readers never see a partial entry.
+  ke::AString temp = ke::AString::Sprintf("%s.%u.tmp", file.chars(), sTempFileCounter++);
+  FILE *fp = fopen(temp.chars(), "wb");
+  if (!fp)
+    return;
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+            fwrite(payload.buffer(), payload.length(), 1, fp) == 1;
+  ok &= fclose(fp) == 0;
+#if defined(KE_WINDOWS)
+  if (ok)
+    ok = !!MoveFileExA(temp.chars(), file.chars(), MOVEFILE_REPLACE_EXISTING);
+#else
+  if (ok)
+    ok = rename(temp.chars(), file.chars()) == 0;
+#endif
+  if (!ok)
+    remove(temp.chars());
+}
+
+template <typename T> static inline FixedArray<T> *
+ReadArray(const uint8_t *&cursor, size_t count)
+{
+  FixedArray<T> *array = new FixedArray<T>(count);
+  memcpy(array->buffer(), cursor, count * sizeof(T));
+  cursor += count * sizeof(T);
+  return array;
+}
+
+CompiledFunction *
+CodeCache::Load(PluginRuntime *rt, uint32_t pcode_offset)
+{
+  ke::AString dir, file;
+  if (!FileFor(rt, pcode_offset, &dir, &file))
+    return nullptr;
+
+  FILE *fp = fopen(file.chars(), "rb");
+  if (!fp)
+    return nullptr;
+  FileReader reader(fp);
+  fclose(fp);
+
+  if (!reader.buffer() || reader.length() < sizeof(FileHeader))
+    return nullptr;
+
+  FileHeader header;
+  memcpy(&header, reader.buffer(), sizeof(header));
+  if (header.magic != kMagic ||
+      header.version != kVersion ||
+      header.build_id != build_id_ ||
+      header.cpu_features != cpu_features_ ||
+      header.natives_key != NativesKey(rt) ||
+      header.heap_size != rt->GetBaseContext()->HeapSize() ||
+      header.pcode_offset != pcode_offset)
+  {
+    return nullptr;
+  }
+
+  uint64_t total_size = uint64_t(header.code_size) + header.cold_size;
+  uint64_t expected = total_size +
+                      uint64_t(header.num_relocs) * sizeof(Relocation) +
+                      uint64_t(header.num_split_refs) * sizeof(uint32_t) +
+                      uint64_t(header.num_cip_map) * sizeof(CipMapEntry) +
+                      uint64_t(header.num_osr_entries) * sizeof(OsrEntry) +
+                      uint64_t(header.num_call_sites) * sizeof(CallSite);
+  const uint8_t *payload = reader.buffer() + sizeof(FileHeader);
+  size_t payload_length = reader.length() - sizeof(FileHeader);
+  if (expected != payload_length)
+    return nullptr;
+
+  uint8_t checksum[16];
+  MD5 md5;
+  md5.update(payload, (unsigned int)payload_length);
+  md5.finalize();
+  md5.raw_digest(checksum);
+  if (memcmp(checksum, header.checksum, sizeof(checksum)) != 0)
+    return nullptr;
+
+  CodeChunk code = env_->AllocateCode(header.code_size, header.cold_size);
+  if (!code.address())
+    return nullptr;
+
+  memcpy(code.address(), payload, header.code_size);
+  if (header.cold_size)
+    memcpy(code.cold_address(), payload + header.code_size, header.cold_size);
+
+  // An address or displacement never spans the hot and cold code.
+  const uint8_t *cursor = payload + total_size;
+  for (size_t i = 0; i < header.num_relocs; i++) {
+    Relocation reloc;
+    memcpy(&reloc, cursor, sizeof(reloc));
+    cursor += sizeof(reloc);
+
+    uintptr_t value;
+    if (uint64_t(reloc.offset) + sizeof(uint64_t) > total_size)
+      return nullptr;
+    if (!Resolve(rt, code, reloc, &value))
+      return nullptr;
+    memcpy(code.addressOf(reloc.offset), &value, sizeof(value));
+  }
+
+  for (size_t i = 0; i < header.num_split_refs; i++) {
+    uint32_t end;
+    memcpy(&end, cursor, sizeof(end));
+    cursor += sizeof(end);
+    if (end < sizeof(int32_t) || end > total_size)
+      return nullptr;
+
+    int32_t disp;
+    memcpy(&disp, payload + end - sizeof(int32_t), sizeof(disp));
+    int64_t target = int64_t(end) + disp;
+    if (target < 0 || target > int64_t(total_size))
+      return nullptr;
+    uint8_t *site = code.addressOf(end);
+    disp = int32_t(code.addressOf(uint32_t(target)) - site);
+    memcpy(site - sizeof(int32_t), &disp, sizeof(disp));
+  }
+
+  ke::AutoPtr<FixedArray<CipMapEntry>> cipmap(ReadArray<CipMapEntry>(cursor, header.num_cip_map));
+  ke::AutoPtr<FixedArray<OsrEntry>> osr(ReadArray<OsrEntry>(cursor, header.num_osr_entries));
+  ke::AutoPtr<FixedArray<CallSite>> call_sites(ReadArray<CallSite>(cursor, header.num_call_sites));
+
+  for (size_t i = 0; i < osr->length(); i++) {
+    if (osr->at(i).pcoffs >= total_size)
+      return nullptr;
+  }
+  for (size_t i = 0; i < call_sites->length(); i++) {
+    if (call_sites->at(i).pcoffs > total_size)
+      return nullptr;
+  }
+
+  return new CompiledFunction(code, pcode_offset, cipmap.take(), osr.take(), call_sites.take());
+}
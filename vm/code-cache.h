@@ -0,0 +1,127 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_code_cache_h_
+#define _include_sourcepawn_vm_code_cache_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sp_vm_types.h>
+#include <amtl/am-string.h>
+#include <amtl/am-vector.h>
+
+namespace sp {
+
+class CompiledFunction;
+class Environment;
+struct CodeChunk;
+class PluginRuntime;
+
+// Keeps compiled methods on disk, so unchanged plugins don't have to be
+// compiled again after a restart.
+//
+// Each plugin gets a directory named after the hashes of its code and data,
+// the VM build, and the CPU's features, with one file per method. A file
+// holds the method's code along with its cip map, OSR entries, and call
+// sites, and a relocation table for every absolute address in the code.
+// Addresses are stored relative to what they point into (the code itself,
+// the plugin's context, memory or natives, the Environment, the code stubs,
+// or the VM's own functions), and are rebased when the method is loaded. The
+// hot and cold code are stored back to back, with jumps between them as they
+// were assembled, and are split again on load.
+//
+// Only relocatable code can be saved: see Assembler::setRelocatable(). It
+// never embeds the addresses of other methods or of native functions, so
+// calls go through thunks and natives are looked up when called.
+//
+// Load and Save can be called from compile threads.
+class CodeCache
+{
+ public:
+  CodeCache(Environment *env);
+
+  bool Initialize(const char *path);
+
+  // Returns a method compiled by an earlier run, or null. The result is not
+  // published.
+  CompiledFunction *Load(PluginRuntime *rt, uint32_t pcode_offset);
+
+  // Save a method compiled as relocatable code. |refs| are the ends of its
+  // absolute addresses, |code_refs| the ends of those that point into the
+  // code itself, and |split_refs| the ends of its rel32 displacements between
+  // the hot and cold code. Methods that can't be saved are compiled again
+  // next time.
+  void Save(PluginRuntime *rt, CompiledFunction *fun,
+            const ke::Vector<uint32_t> &refs,
+            const ke::Vector<uint32_t> &code_refs,
+            const ke::Vector<uint32_t> &split_refs);
+
+ private:
+  enum class RelocKind : uint32_t {
+    Code,
+    Context,
+    Memory,
+    Natives,
+    Environment,
+    ReturnStub,
+    Module
+  };
+
+  struct Relocation {
+    // Offset of the address in the code.
+    uint32_t offset;
+    RelocKind kind;
+    // Offset of the address into whatever |kind| names.
+    uint64_t delta;
+  };
+
+  struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t build_id;
+    uint32_t cpu_features;
+    uint32_t natives_key;
+    uint32_t heap_size;
+    uint32_t pcode_offset;
+    uint32_t code_size;
+    uint32_t cold_size;
+    uint32_t num_relocs;
+    uint32_t num_split_refs;
+    uint32_t num_cip_map;
+    uint32_t num_osr_entries;
+    uint32_t num_call_sites;
+    // MD5 of everything after the header.
+    uint8_t checksum[16];
+  };
+
+  static const uint32_t kMagic = 0x434a5053; // "SPJC"
+  static const uint32_t kVersion = 4;
+
+  bool FileFor(PluginRuntime *rt, uint32_t pcode_offset, ke::AString *dir,
+               ke::AString *file);
+  uint32_t NativesKey(PluginRuntime *rt);
+  bool Classify(PluginRuntime *rt, CompiledFunction *fun, uintptr_t value,
+                Relocation *reloc);
+  bool Resolve(PluginRuntime *rt, const CodeChunk &code, const Relocation &reloc,
+               uintptr_t *value);
+
+ private:
+  Environment *env_;
+  ke::AString path_;
+  uint64_t build_id_;
+  uint32_t cpu_features_;
+  uintptr_t module_base_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_code_cache_h_
@@ -40,6 +40,9 @@ class CodeStubs
   void *ReturnStub() const {
     return return_stub_;
   }
+  const CodeChunk& invoke_stub() const {
+    return invoke_stub_;
+  }
   void *LegacyNativeStub();
 
  private:
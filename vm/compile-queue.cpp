@@ -0,0 +1,183 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include "compile-queue.h"
+#include "compiled-function.h"
+#include "environment.h"
+#include "jit.h"
+#include "method-info.h"
+#include "method-verifier.h"
+#include "plugin-runtime.h"
+#include "pool-allocator.h"
+
+using namespace sp;
+
+// Validating a method can rewrite its pcode, so a compile thread must not
+// read one that hasn't been validated. Compiled code may inline its callees,
+// so they are validated before the caller is queued.
+static void
+ValidateCallees(PluginRuntime *rt, MethodInfo *method)
+{
+  const cell_t *code = reinterpret_cast<const cell_t *>(rt->code().bytes);
+  ke::Vector<cell_t> callees;
+  MethodVerifier verifier(rt, method->pcode_offset());
+  verifier.collectOpcodes([&](cell_t offset, OPCODE op) -> void {
+    if (op == OP_CALL)
+      callees.append(code[offset / sizeof(cell_t) + 1]);
+  });
+  if (!verifier.verify())
+    return;
+
+  for (size_t i = 0; i < callees.length(); i++) {
+    if (RefPtr<MethodInfo> callee = rt->AcquireMethod(callees[i]))
+      callee->Validate();
+  }
+}
+
+CompileQueue::CompileQueue(Environment *env)
+ : env_(env),
+   terminate_(false)
+{
+}
+
+CompileQueue::~CompileQueue()
+{
+  assert(threads_.empty());
+  assert(queue_.empty());
+}
+
+bool
+CompileQueue::Initialize(size_t threads)
+{
+  for (size_t i = 0; i < threads; i++) {
+    ke::AutoPtr<ke::Thread> thread(new ke::Thread([this]() -> void {
+      Run();
+    }, "SP Compiler"));
+    if (!thread->Succeeded())
+      return false;
+    if (!threads_.append(ke::Move(thread)))
+      return false;
+  }
+  return true;
+}
+
+void
+CompileQueue::Shutdown()
+{
+  {
+    ke::AutoLock lock(&cv_);
+    terminate_ = true;
+    cv_.NotifyAll();
+  }
+  for (size_t i = 0; i < threads_.length(); i++)
+    threads_[i]->Join();
+  threads_.clear();
+
+  for (size_t i = 0; i < queue_.length(); i++)
+    queue_[i].method->setCompileQueued(false);
+  queue_.clear();
+}
+
+void
+CompileQueue::Enqueue(PluginRuntime *rt, MethodInfo *method)
+{
+  if (method->isCompileQueued())
+    return;
+
+  // The code cache is keyed by these, and they're computed on first use.
+  if (env_->code_cache()) {
+    rt->GetCodeHash();
+    rt->GetDataHash();
+  }
+  if (rt->writableCode())
+    ValidateCallees(rt, method);
+
+  Job job;
+  job.rt = rt;
+  job.method = method;
+
+  ke::AutoLock lock(&cv_);
+  if (!queue_.append(job))
+    return;
+  method->setCompileQueued(true);
+  cv_.Notify();
+}
+
+void
+CompileQueue::CancelRuntime(PluginRuntime *rt)
+{
+  ke::AutoLock lock(&cv_);
+  for (size_t i = 0; i < queue_.length(); ) {
+    if (queue_[i].rt == rt)
+      queue_.remove(i);
+    else
+      i++;
+  }
+  while (IsBusy(rt))
+    cv_.Wait();
+}
+
+bool
+CompileQueue::IsBusy(PluginRuntime *rt) const
+{
+  for (size_t i = 0; i < busy_.length(); i++) {
+    if (busy_[i] == rt)
+      return true;
+  }
+  return false;
+}
+
+void
+CompileQueue::Run()
+{
+  // The compiler allocates from the calling thread's pool.
+  PoolAllocator::InitDefault();
+
+  cv_.Lock();
+  while (!terminate_) {
+    if (queue_.empty()) {
+      cv_.Wait();
+      continue;
+    }
+
+    Job job = queue_[0];
+    queue_.remove(0);
+    busy_.append(job.rt);
+    cv_.Unlock();
+
+    int err = SP_ERROR_NONE;
+    if (CompiledFunction *fun = CompilerBase::CompileOffThread(job.rt, job.method, &err)) {
+      // The main thread also publishes under the lock, so this can't race
+      // with it.
+      ke::AutoLock lock(env_->lock());
+      if (job.method->jit())
+        delete fun;
+      else
+        job.method->setCompiledFunction(fun);
+    }
+
+    // If compiling failed, the method stays in the interpreter, which will
+    // report the error if the bad code is ever reached.
+
+    cv_.Lock();
+    for (size_t i = 0; i < busy_.length(); i++) {
+      if (busy_[i] == job.rt) {
+        busy_.remove(i);
+        break;
+      }
+    }
+    cv_.NotifyAll();
+  }
+  cv_.Unlock();
+
+  PoolAllocator::FreeDefault();
+}
@@ -0,0 +1,81 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_compile_queue_h_
+#define _include_sourcepawn_vm_compile_queue_h_
+
+#include <stddef.h>
+#include <am-thread-utils.h>
+#include <am-utility.h>
+#include <am-vector.h>
+
+namespace sp {
+
+class Environment;
+class MethodInfo;
+class PluginRuntime;
+
+// Compiles methods on background threads, so the main thread doesn't stall
+// in the JIT. Queued methods keep running in the interpreter; once a compile
+// thread finishes, it publishes the code through
+// MethodInfo::setCompiledFunction, under the environment lock, and the next
+// call picks it up.
+//
+// Compile threads only read a runtime's code and hold raw pointers to its
+// methods. A runtime must be cancelled before it is destroyed.
+class CompileQueue
+{
+ public:
+  CompileQueue(Environment *env);
+  ~CompileQueue();
+
+  bool Initialize(size_t threads);
+
+  // Stop all compile threads. Methods still in the queue are dropped, and
+  // can be queued again.
+  void Shutdown();
+
+  // Called from main thread.
+  void Enqueue(PluginRuntime *rt, MethodInfo *method);
+
+  // Drop |rt|'s methods from the queue, and wait for any that are being
+  // compiled. Must not be called with the environment lock held.
+  void CancelRuntime(PluginRuntime *rt);
+
+ private:
+  // Compile threads.
+  void Run();
+  bool IsBusy(PluginRuntime *rt) const;
+
+ private:
+  struct Job {
+    PluginRuntime *rt;
+    MethodInfo *method;
+  };
+
+  Environment *env_;
+
+  bool terminate_;
+  ke::Vector<ke::AutoPtr<ke::Thread>> threads_;
+
+  // Guards everything below.
+  ke::ConditionVariable cv_;
+
+  // Methods waiting for a thread, oldest first, and the runtimes of the
+  // methods being compiled right now.
+  ke::Vector<Job> queue_;
+  ke::Vector<PluginRuntime *> busy_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_compile_queue_h_
@@ -12,23 +12,34 @@
 //
 #include "compiled-function.h"
 #include "environment.h"
+#include "plugin-runtime.h"
+#if defined(SP_HAS_JIT)
+# include "gdb-jit.h"
+#endif
 #include <amtl/am-platform.h>
 
 using namespace sp;
 
 CompiledFunction::CompiledFunction(const CodeChunk& code,
                                    cell_t pcode_offs,
-                                   FixedArray<LoopEdge> *edges,
-                                   FixedArray<CipMapEntry> *cipmap)
+                                   FixedArray<CipMapEntry> *cipmap,
+                                   FixedArray<OsrEntry> *osr_entries,
+                                   FixedArray<CallSite> *call_sites)
   : code_(code),
     code_offset_(pcode_offs),
-    edges_(edges),
-    cip_map_(cipmap)
+    cip_map_(cipmap),
+    osr_entries_(osr_entries),
+    call_sites_(call_sites),
+    gdb_jit_entry_(nullptr)
 {
 }
 
 CompiledFunction::~CompiledFunction()
 {
+#if defined(SP_HAS_JIT)
+  if (gdb_jit_entry_)
+    GdbJitUnregister(gdb_jit_entry_);
+#endif
 }
 
 static int cip_map_entry_cmp(const void *a1, const void *aEntry)
@@ -42,15 +53,12 @@ static int cip_map_entry_cmp(const void *a1, const void *aEntry)
   return pcoffs > entry->pcoffs;
 }
 
-ucell_t
-CompiledFunction::FindCipByPc(void *pc)
+const CipMapEntry *
+CompiledFunction::FindCipMapEntry(void *pc)
 {
-  if (uintptr_t(pc) < uintptr_t(code_.address()))
-    return kInvalidCip;
-
-  uint32_t pcoffs = intptr_t(pc) - intptr_t(code_.address());
-  if (pcoffs > code_.bytes())
-    return kInvalidCip;
+  uint32_t pcoffs;
+  if (!code_.offsetOf(pc, &pcoffs))
+    return nullptr;
 
   void *ptr = bsearch(
     (void *)(uintptr_t)pcoffs,
@@ -58,6 +66,17 @@ CompiledFunction::FindCipByPc(void *pc)
     cip_map_->length(),
     sizeof(CipMapEntry),
     cip_map_entry_cmp);
+  return reinterpret_cast<const CipMapEntry *>(ptr);
+}
+
+ucell_t
+CompiledFunction::FindCipByPc(void *pc)
+{
+  uint32_t pcoffs;
+  if (!code_.offsetOf(pc, &pcoffs))
+    return kInvalidCip;
+
+  const CipMapEntry *ptr = FindCipMapEntry(pc);
   assert(ptr);
 
   if (!ptr) {
@@ -65,5 +84,71 @@ CompiledFunction::FindCipByPc(void *pc)
     return kInvalidCip;
   }
 
-  return code_offset_ + reinterpret_cast<CipMapEntry *>(ptr)->cipoffs;
+  return code_offset_ + ptr->cipoffs;
+}
+
+ucell_t
+CompiledFunction::FindInlinedCallByPc(void *pc)
+{
+  const CipMapEntry *entry = FindCipMapEntry(pc);
+  if (!entry || !entry->inlined_at)
+    return kInvalidCip;
+  return code_offset_ + entry->inlined_at;
+}
+
+void *
+CompiledFunction::FindOsrEntry(cell_t cip)
+{
+  // There are only as many entries as there are loops, so a linear search is
+  // fine.
+  for (size_t i = 0; i < osr_entries_->length(); i++) {
+    const OsrEntry &entry = osr_entries_->at(i);
+    if (code_offset_ + cell_t(entry.cipoffs) == cip)
+      return GetCodeAt(entry.pcoffs);
+  }
+  return nullptr;
+}
+
+ke::AString
+CompiledFunction::DescribeName(PluginRuntime* rt) const
+{
+  const char* function = rt->image()->LookupFunction(code_offset_);
+  if (!function)
+    function = "<unknown>";
+  return ke::AString::Sprintf("%s::%s", rt->Name(), function);
+}
+
+void
+CompiledFunction::GetSourceLines(PluginRuntime* rt, ke::Vector<SourceLine>* lines) const
+{
+  // Rows never describe code in both parts, so each part starts with one.
+  uint32_t cold_start = uint32_t(code_.bytes());
+  uint32_t start = 0;
+  for (size_t i = 0; i < cip_map_->length(); i++) {
+    const CipMapEntry& entry = cip_map_->at(i);
+    uint32_t pcoffs = start;
+    start = entry.pcoffs;
+
+    ucell_t cip = code_offset_ + entry.cipoffs;
+    uint32_t line;
+    if (!rt->image()->LookupLine(cip, &line))
+      continue;
+    const char* file = rt->image()->LookupFile(cip);
+    if (!file)
+      file = rt->Name();
+
+    // The first cold entry's code runs from the end of the hot code. The hot
+    // code after the last hot entry keeps the line it already has.
+    if (pcoffs < cold_start && entry.pcoffs > cold_start && code_.cold_bytes())
+      pcoffs = cold_start;
+
+    if (lines->empty() ||
+        lines->back().line != line ||
+        strcmp(lines->back().file, file) != 0 ||
+        (lines->back().pcoffs < cold_start) != (pcoffs < cold_start))
+    {
+      SourceLine source = { pcoffs, line, file };
+      lines->append(source);
+    }
+  }
 }
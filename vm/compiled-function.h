@@ -17,6 +17,8 @@
 #include <amtl/am-autoptr.h>
 #include <amtl/am-fixedarray.h>
 #include <amtl/am-refcounting.h>
+#include <amtl/am-string.h>
+#include <amtl/am-vector.h>
 #include "code-allocator.h"
 
 namespace sp {
@@ -25,55 +27,135 @@ using namespace ke;
 
 class PluginRuntime;
 
-struct LoopEdge
-{
-  // Offset to the patchable jump instruction, such that (base + offset - 4)
-  // yields a patchable location.
-  uint32_t offset;
-  // The displacement to either the timeout routine or the original
-  // displacement, depending on the timeout state.
-  int32_t disp32;
-};
+// Offsets into a function's code below count through its hot code and then
+// its cold code, in the order they were assembled. GetCodeAt() maps them to
+// addresses.
 
 struct CipMapEntry {
   // Offset from the first cip of the function.
   uint32_t cipoffs;
   // Offset from the first pc of the function.
   uint32_t pcoffs;
+  // If the cip belongs to a method inlined into this one, the offset from the
+  // first cip of the function to the CALL it replaced; otherwise 0. Stack
+  // traces show a frame for the inlined method above this one.
+  uint32_t inlined_at;
+};
+
+// An entry point for on-stack replacement, at the head of a loop.
+struct OsrEntry {
+  // Offset from the first cip of the function.
+  uint32_t cipoffs;
+  // Offset from the first pc of the function.
+  uint32_t pcoffs;
+};
+
+// A call to another method that goes through a call thunk, so it can be
+// patched into a direct call once the callee is compiled.
+struct CallSite {
+  // Offset of the return address from the first pc of the function, as
+  // PatchCallThunk expects.
+  uint32_t pcoffs;
+  // Pcode offset of the callee.
+  cell_t target;
 };
 
 static const ucell_t kInvalidCip = 0xffffffff;
 
+// A point in a function's code where the source line changes.
+struct SourceLine {
+  uint32_t pcoffs;
+  uint32_t line;
+  const char* file;
+};
+
+struct GdbJitEntry;
+
 class CompiledFunction
 {
  public:
   CompiledFunction(const CodeChunk& code,
                    cell_t pcode_offs,
-                   FixedArray<LoopEdge> *edges,
-                   FixedArray<CipMapEntry> *cip_map);
+                   FixedArray<CipMapEntry> *cip_map,
+                   FixedArray<OsrEntry> *osr_entries,
+                   FixedArray<CallSite> *call_sites);
   ~CompiledFunction();
 
  public:
   void *GetEntryAddress() const {
     return code_.address();
   }
+  size_t GetCodeSize() const {
+    return code_.bytes();
+  }
+
+  // Out-of-line paths, thunks and throw paths live apart from the rest of
+  // the code. The address is null if there are none.
+  void *GetColdCodeAddress() const {
+    return code_.cold_address();
+  }
+  size_t GetColdCodeSize() const {
+    return code_.cold_bytes();
+  }
+  uint8_t *GetCodeAt(uint32_t pcoffs) const {
+    return code_.addressOf(pcoffs);
+  }
+  // Returns false if |pc| is not in this function's code.
+  bool GetCodeOffset(const void *pc, uint32_t *pcoffs) const {
+    return code_.offsetOf(pc, pcoffs);
+  }
   cell_t GetCodeOffset() const {
     return code_offset_;
   }
-  uint32_t NumLoopEdges() const {
-    return edges_->length();
+  uint32_t NumCallSites() const {
+    return call_sites_->length();
+  }
+  const CallSite &GetCallSite(size_t i) const {
+    return call_sites_->at(i);
   }
-  LoopEdge &GetLoopEdge(size_t i) {
-    return edges_->at(i);
+  const FixedArray<CipMapEntry> &cip_map() const {
+    return *cip_map_;
+  }
+  const FixedArray<OsrEntry> &osr_entries() const {
+    return *osr_entries_;
   }
 
   ucell_t FindCipByPc(void *pc);
 
+  // Returns the cip of the CALL that was inlined to produce the code at |pc|,
+  // or kInvalidCip if it wasn't inlined or isn't in the cip map.
+  ucell_t FindInlinedCallByPc(void *pc);
+
+  // Returns the OSR entry point for the loop header at |cip|, or null if
+  // there is none.
+  void *FindOsrEntry(cell_t cip);
+
+  // The function's name for profilers and debuggers, "plugin.smx::function".
+  ke::AString DescribeName(PluginRuntime* rt) const;
+
+  // Where the source line changes, in code order. Lines come from the cip
+  // map, which only has calls and instructions that can throw, so the code
+  // since the previous mapped instruction is given each one's line. Cips
+  // from inlined methods have the inlined method's lines. If there is cold
+  // code, a line also starts where it does, and the hot code after the last
+  // hot entry keeps the line before it.
+  void GetSourceLines(PluginRuntime* rt, ke::Vector<SourceLine>* lines) const;
+
+  // Set when the function is registered with debuggers; see gdb-jit.h.
+  void setGdbJitEntry(GdbJitEntry* entry) {
+    gdb_jit_entry_ = entry;
+  }
+
+ private:
+  const CipMapEntry *FindCipMapEntry(void *pc);
+
  private:
   CodeChunk code_;
   cell_t code_offset_;
-  AutoPtr<FixedArray<LoopEdge>> edges_;
   AutoPtr<FixedArray<CipMapEntry>> cip_map_;
+  AutoPtr<FixedArray<OsrEntry>> osr_entries_;
+  AutoPtr<FixedArray<CallSite>> call_sites_;
+  GdbJitEntry* gdb_jit_entry_;
 };
 
 }
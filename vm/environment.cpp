@@ -23,6 +23,13 @@
 #include "jit.h"
 #endif
 #include "interpreter.h"
+#include "opcode-profiler.h"
+#if defined(SP_HAS_JIT)
+#include "code-cache.h"
+#include "compile-queue.h"
+#include "perf-map.h"
+#include "gdb-jit.h"
+#endif
 #include <stdarg.h>
 
 using namespace sp;
@@ -40,7 +47,16 @@ Environment::Environment()
 #else
    jit_enabled_(false),
 #endif
+   tiering_enabled_(false),
+   eager_compile_enabled_(false),
+   pcode_optimization_enabled_(true),
+   optimizing_jit_enabled_(false),
    profiling_enabled_(false),
+   interrupt_handler_(nullptr),
+   interrupts_(0),
+#if defined(SP_HAS_JIT)
+   gdb_jit_enabled_(false),
+#endif
    top_(nullptr)
 {
 }
@@ -92,7 +108,19 @@ Environment::Initialize()
 void
 Environment::Shutdown()
 {
+#if defined(SP_HAS_JIT)
+  if (compile_queue_) {
+    compile_queue_->Shutdown();
+    compile_queue_ = nullptr;
+  }
+  code_cache_ = nullptr;
+  perf_map_ = nullptr;
+#endif
   watchdog_timer_->Shutdown();
+  if (opcode_profiler_) {
+    opcode_profiler_->writeReport();
+    opcode_profiler_ = nullptr;
+  }
   code_stubs_ = nullptr;
   code_alloc_ = nullptr;
   PoolAllocator::FreeDefault();
@@ -107,6 +135,104 @@ Environment::SetJitEnabled(bool enabled)
   jit_enabled_ = enabled;
 }
 
+#if defined(SP_HAS_JIT)
+bool
+Environment::SetCompileThreads(size_t threads)
+{
+  if (compile_queue_) {
+    compile_queue_->Shutdown();
+    compile_queue_ = nullptr;
+  }
+  if (!threads)
+    return true;
+
+  compile_queue_ = new CompileQueue(this);
+  if (!compile_queue_->Initialize(threads)) {
+    compile_queue_->Shutdown();
+    compile_queue_ = nullptr;
+    return false;
+  }
+  return true;
+}
+
+bool
+Environment::SetCodeCachePath(const char* path)
+{
+#if defined(KE_ARCH_X64)
+  ke::AutoPtr<CodeCache> cache(new CodeCache(this));
+  if (!cache->Initialize(path))
+    return false;
+  code_cache_ = ke::Move(cache);
+  return true;
+#else
+  // Only the x64 assembler can emit relocatable code.
+  return false;
+#endif
+}
+
+bool
+Environment::EnablePerfMap(const char* jitdump_dir)
+{
+  ke::AutoPtr<PerfMap> map(new PerfMap());
+  if (!map->Initialize(jitdump_dir))
+    return false;
+
+  // The invoke stub is linked before the map can be enabled.
+  const CodeChunk& stub = code_stubs_->invoke_stub();
+  map->RecordCode("sp::InvokeStub", stub.address(), stub.bytes());
+
+  perf_map_ = ke::Move(map);
+  return true;
+}
+
+bool
+Environment::EnableGdbJitInterface()
+{
+  if (!GdbJitSupported())
+    return false;
+  gdb_jit_enabled_ = true;
+  return true;
+}
+#endif
+
+bool
+Environment::EnableOpcodeProfiling(const char* report_path)
+{
+  assert(!opcode_profiler_);
+
+  opcode_profiler_ = new OpcodeProfiler(report_path);
+  if (!opcode_profiler_->init()) {
+    opcode_profiler_ = nullptr;
+    return false;
+  }
+  return true;
+}
+
+bool
+Environment::RegisterIntrinsic(const sp_intrinsic_t* intrinsic)
+{
+  if (!intrinsic->name || !intrinsic->fallback)
+    return false;
+  // Emitters only get the arguments that fit in PRI and ALT.
+  if (intrinsic->emitter && intrinsic->nparams > 2)
+    return false;
+  if (intrinsic->nparams > SP_MAX_EXEC_PARAMS)
+    return false;
+  if (FindIntrinsic(intrinsic->name))
+    return false;
+  return intrinsics_.append(intrinsic);
+}
+
+const sp_intrinsic_t*
+Environment::FindIntrinsic(const char* name) const
+{
+  for (size_t i = 0; i < intrinsics_.length(); i++) {
+    if (strcmp(intrinsics_[i]->name, name) == 0)
+      return intrinsics_[i];
+  }
+  return nullptr;
+}
+
 void
 Environment::EnableProfiling()
 {
@@ -125,6 +251,33 @@ Environment::InstallWatchdogTimer(int timeout_ms)
   return watchdog_timer_->Initialize(timeout_ms);
 }
 
+int
+Environment::HandleInterrupts(PluginContext* cx)
+{
+  uint32_t reasons = interrupts_.exchange(0);
+  if (!reasons)
+    return SP_ERROR_NONE;
+
+  // The watchdog thread waits for this, so it has to hear back even if the
+  // host's handler runs for a long time.
+  int err = SP_ERROR_NONE;
+  if (reasons & kTimeoutInterrupt) {
+    watchdog_timer_->NotifyTimeoutReceived();
+    err = SP_ERROR_TIMEOUT;
+    reasons &= ~kTimeoutInterrupt;
+  }
+
+  if (reasons && interrupt_handler_) {
+    int rv = interrupt_handler_->OnInterrupt(cx, reasons);
+    if (err == SP_ERROR_NONE)
+      err = rv;
+  }
+
+  if (err != SP_ERROR_NONE)
+    cx->ReportErrorNumber(err);
+  return err;
+}
+
 ISourcePawnEngine *
 Environment::APIv1()
 {
@@ -183,9 +336,11 @@ Environment::GetErrorString(int error)
 }
 
 CodeChunk
-Environment::AllocateCode(size_t size)
+Environment::AllocateCode(size_t size, size_t cold_size)
 {
-  return code_alloc_->Allocate(size);
+  // Compile threads allocate code too.
+  ke::AutoLock lock(&mutex_);
+  return code_alloc_->Allocate(size, cold_size);
 }
 
 void
@@ -202,57 +357,6 @@ Environment::DeregisterRuntime(PluginRuntime *rt)
   runtimes_.remove(rt);
 }
 
-static inline void
-SwapLoopEdge(uint8_t *code, LoopEdge &e)
-{
-  int32_t *loc = reinterpret_cast<int32_t *>(code + e.offset - 4);
-  int32_t new_disp32 = e.disp32;
-  e.disp32 = *loc;
-  *loc = new_disp32;
-}
-
-void
-Environment::PatchAllJumpsForTimeout()
-{
-  mutex_.AssertCurrentThreadOwns();
-  for (ke::InlineList<PluginRuntime>::iterator iter = runtimes_.begin(); iter != runtimes_.end(); iter++) {
-    PluginRuntime *rt = *iter;
-
-    const Vector<RefPtr<MethodInfo>>& methods = rt->AllMethods();
-    for (size_t i = 0; i < methods.length(); i++) {
-      CompiledFunction *fun = methods[i]->jit();
-      if (!fun)
-        continue;
-
-      uint8_t *base = reinterpret_cast<uint8_t *>(fun->GetEntryAddress());
-
-      for (size_t j = 0; j < fun->NumLoopEdges(); j++)
-        SwapLoopEdge(base, fun->GetLoopEdge(j));
-    }
-  }
-}
-
-void
-Environment::UnpatchAllJumpsFromTimeout()
-{
-  mutex_.AssertCurrentThreadOwns();
-  for (ke::InlineList<PluginRuntime>::iterator iter = runtimes_.begin(); iter != runtimes_.end(); iter++) {
-    PluginRuntime *rt = *iter;
-
-    const Vector<RefPtr<MethodInfo>>& methods = rt->AllMethods();
-    for (size_t i = 0; i < methods.length(); i++) {
-      CompiledFunction *fun = methods[i]->jit();
-      if (!fun)
-        continue;
-
-      uint8_t *base = reinterpret_cast<uint8_t *>(fun->GetEntryAddress());
-
-      for (size_t j = 0; j < fun->NumLoopEdges(); j++)
-        SwapLoopEdge(base, fun->GetLoopEdge(j));
-    }
-  }
-}
-
 bool
 Environment::Invoke(PluginContext* cx,
                     const RefPtr<MethodInfo>& method,
@@ -260,29 +364,38 @@ Environment::Invoke(PluginContext* cx,
 {
 #if defined(SP_HAS_JIT)
   if (jit_enabled_) {
-    if (!method->jit()) {
-      int err = SP_ERROR_NONE;
-      if (!CompilerBase::Compile(cx, method, &err)) {
-        cx->ReportErrorNumber(err);
-        return false;
-      }
+    if (eager_compile_enabled_ || compile_queue_)
+      cx->runtime()->CompileOnFirstRun(cx);
+
+    int err = SP_ERROR_NONE;
+    if (CompiledFunction* fn = CompilerBase::CompileIfHot(cx, method, &err))
+      return InvokeCompiled(cx, fn, fn->GetEntryAddress(), result);
+    if (err != SP_ERROR_NONE) {
+      cx->ReportErrorNumber(err);
+      return false;
     }
+  }
+#endif
 
-    if (CompiledFunction* fn = method->jit()) {
-      JitInvokeFrame ivkframe(cx, fn->GetCodeOffset()); 
+  return Interpreter::Run(cx, method, result);
+}
 
-      assert(top_ && top_->cx() == cx);
+#if defined(SP_HAS_JIT)
+// The pcode stack must already hold the arguments, as it would for a CALL.
+// |entry| is either the function's entry point or one of its OSR entries.
+bool
+Environment::InvokeCompiled(PluginContext* cx, CompiledFunction* fn, void* entry, cell_t* result)
+{
+  JitInvokeFrame ivkframe(cx, fn->GetCodeOffset()); 
 
-      InvokeStubFn invoke = code_stubs_->InvokeStub();
-      invoke(cx, fn->GetEntryAddress(), result);
+  assert(top_ && top_->cx() == cx);
 
-      return exception_code_ == SP_ERROR_NONE;
-    }
-  }
-#endif
+  InvokeStubFn invoke = code_stubs_->InvokeStub();
+  invoke(cx, entry, result);
 
-  return Interpreter::Run(cx, method, result);
+  return exception_code_ == SP_ERROR_NONE;
 }
+#endif
 
 void
 Environment::ReportError(int code)
@@ -13,6 +13,7 @@
 #ifndef _include_sourcepawn_vm_environment_h_
 #define _include_sourcepawn_vm_environment_h_
 
+#include <atomic>
 #include <sp_vm_api.h>
 #include <amtl/am-cxx.h>
 #include <amtl/am-inlinelist.h>
@@ -29,6 +30,11 @@ class PluginRuntime;
 class CodeStubs;
 class WatchdogTimer;
 class ErrorReport;
+class OpcodeProfiler;
+class CompileQueue;
+class CompiledFunction;
+class CodeCache;
+class PerfMap;
 
 // An Environment encapsulates everything that's needed to load and run
 // instances of plugins on a single thread. There can be at most one
@@ -70,8 +76,9 @@ class Environment : public ISourcePawnEnvironment
   void ReportErrorVA(int code, const char *fmt, va_list ap);
   void BlamePluginErrorVA(SourcePawn::IPluginFunction *pf, const char *fmt, va_list ap);
 
-  // Allocate and free executable memory.
-  CodeChunk AllocateCode(size_t size);
+  // Allocate and free executable memory. |cold_size| bytes of cold code are
+  // placed apart from the rest; see CodePool.
+  CodeChunk AllocateCode(size_t size, size_t cold_size = 0);
 
   CodeStubs *stubs() {
     return code_stubs_;
@@ -80,13 +87,14 @@ class Environment : public ISourcePawnEnvironment
   // Runtime management.
   void RegisterRuntime(PluginRuntime *rt);
   void DeregisterRuntime(PluginRuntime *rt);
-  void PatchAllJumpsForTimeout();
-  void UnpatchAllJumpsFromTimeout();
   ke::Mutex *lock() {
     return &mutex_;
   }
 
   bool Invoke(PluginContext* cx, const RefPtr<MethodInfo>& method, cell_t* result);
+#if defined(SP_HAS_JIT)
+  bool InvokeCompiled(PluginContext* cx, CompiledFunction* fn, void* entry, cell_t* result);
+#endif
 
   // Helpers.
   void SetProfiler(IProfilingTool *profiler) {
@@ -105,6 +113,49 @@ class Environment : public ISourcePawnEnvironment
   bool IsJitEnabled() const {
     return jit_enabled_;
   }
+  void SetTieringEnabled(bool enabled) {
+    tiering_enabled_ = enabled;
+  }
+  bool IsTieringEnabled() const {
+    return tiering_enabled_;
+  }
+  // Compile each plugin in full when it first runs, rather than each method
+  // on its first call. Takes precedence over tiering and compile threads.
+  void SetEagerCompileEnabled(bool enabled) {
+    eager_compile_enabled_ = enabled;
+  }
+  bool IsEagerCompileEnabled() const {
+    return eager_compile_enabled_;
+  }
+  // Run each method through the PcodeOptimizer when it is first validated.
+  // Only affects plugins loaded afterward.
+  void SetPcodeOptimizationEnabled(bool enabled) {
+    pcode_optimization_enabled_ = enabled;
+  }
+  bool IsPcodeOptimizationEnabled() const {
+    return pcode_optimization_enabled_;
+  }
+  // Recompile methods that stay hot in baseline code with the optimizing
+  // tier. Only x64 has one.
+  void SetOptimizingJitEnabled(bool enabled) {
+#if defined(SP_HAS_JIT) && defined(KE_ARCH_X64)
+    optimizing_jit_enabled_ = enabled;
+#endif
+  }
+  bool IsOptimizingJitEnabled() const {
+    return optimizing_jit_enabled_;
+  }
+
+  // Count every opcode executed, and write a report to |report_path| (.txt
+  // and .json) on shutdown. This must be called before any plugin runs.
+  bool EnableOpcodeProfiling(const char* report_path);
+  OpcodeProfiler* opcode_profiler() const {
+    return opcode_profiler_;
+  }
+
+  // Replace calls to the native |intrinsic->name| in plugins loaded later.
+  bool RegisterIntrinsic(const sp_intrinsic_t* intrinsic);
+  const sp_intrinsic_t* FindIntrinsic(const char* name) const;
   void SetDebugger(IDebugListener *debugger) {
     debugger_ = debugger;
   }
@@ -116,6 +167,60 @@ class Environment : public ISourcePawnEnvironment
     return watchdog_timer_;
   }
 
+  // Interrupts. Any thread can request one, by setting a reason bit that
+  // running code polls for at each safepoint: loop backedges, calls, and
+  // entries into a plugin. The watchdog timer's timeout is the top bit, and
+  // the rest are the host's.
+  static const uint32_t kTimeoutInterrupt = 0x80000000;
+
+  void SetInterruptHandler(IInterruptHandler *handler) {
+    interrupt_handler_ = handler;
+  }
+  void RequestInterrupt(uint32_t reasons) {
+    interrupts_.fetch_or(reasons);
+  }
+  bool hasPendingInterrupt() const {
+    return interrupts_.load(std::memory_order_relaxed) != 0;
+  }
+
+  // Called at a safepoint in |cx|. Returns SP_ERROR_NONE, or an error that
+  // has been reported.
+  int HandleInterrupts(PluginContext* cx);
+
+#if defined(SP_HAS_JIT)
+  // Compile methods on |threads| background threads instead of on first
+  // call. Passing 0 stops the threads; methods still queued then run in the
+  // interpreter until they are called again.
+  bool SetCompileThreads(size_t threads);
+  CompileQueue* compile_queue() const {
+    return compile_queue_;
+  }
+
+  // Keep compiled methods in |path|, and reuse them when the same plugin is
+  // loaded again. This must be called before any plugin runs. Returns false
+  // if the directory can't be used, or if the JIT can't cache code for this
+  // platform.
+  bool SetCodeCachePath(const char* path);
+  CodeCache* code_cache() const {
+    return code_cache_;
+  }
+
+  // Record generated code for Linux perf in /tmp/perf-<pid>.map, and if
+  // |jitdump_dir| is given, in jitdump format there too. Returns false if
+  // the files can't be written, or this is not Linux.
+  bool EnablePerfMap(const char* jitdump_dir);
+  PerfMap* perf_map() const {
+    return perf_map_;
+  }
+
+  // Describe each method compiled from now on to debuggers, through GDB's
+  // JIT interface. Returns false if this platform is not supported.
+  bool EnableGdbJitInterface();
+  bool IsGdbJitInterfaceEnabled() const {
+    return gdb_jit_enabled_;
+  }
+#endif
+
   bool hasPendingException() const;
   void clearPendingException();
   int getPendingExceptionCode() const;
@@ -153,6 +258,9 @@ class Environment : public ISourcePawnEnvironment
   void* addressOfExceptionCode() {
     return &exception_code_;
   }
+  void* addressOfInterrupts() {
+    return &interrupts_;
+  }
 
  private:
   bool Initialize();
@@ -171,10 +279,25 @@ class Environment : public ISourcePawnEnvironment
 
   IProfilingTool *profiler_;
   bool jit_enabled_;
+  bool tiering_enabled_;
+  bool eager_compile_enabled_;
+  bool pcode_optimization_enabled_;
+  bool optimizing_jit_enabled_;
   bool profiling_enabled_;
 
+  IInterruptHandler *interrupt_handler_;
+  std::atomic<uint32_t> interrupts_;
+
   ke::AutoPtr<CodeAllocator> code_alloc_;
   ke::AutoPtr<CodeStubs> code_stubs_;
+  ke::AutoPtr<OpcodeProfiler> opcode_profiler_;
+  ke::Vector<const sp_intrinsic_t*> intrinsics_;
+#if defined(SP_HAS_JIT)
+  ke::AutoPtr<CompileQueue> compile_queue_;
+  ke::AutoPtr<CodeCache> code_cache_;
+  ke::AutoPtr<PerfMap> perf_map_;
+  bool gdb_jit_enabled_;
+#endif
 
   ke::InlineList<PluginRuntime> runtimes_;
 
@@ -0,0 +1,557 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <string.h>
+#include <amtl/am-platform.h>
+#include <amtl/am-string.h>
+#include <amtl/am-thread-utils.h>
+#include <amtl/am-vector.h>
+#include "gdb-jit.h"
+#include "compiled-function.h"
+#include "plugin-runtime.h"
+
+using namespace sp;
+
+#if defined(KE_LINUX)
+
+// The interface debuggers look for. See "JIT Compilation Interface" in the
+// GDB manual; the names and layout are fixed.
+extern "C" {
+
+enum jit_actions_t {
+  JIT_NOACTION = 0,
+  JIT_REGISTER_FN,
+  JIT_UNREGISTER_FN
+};
+
+struct jit_code_entry {
+  jit_code_entry* next_entry;
+  jit_code_entry* prev_entry;
+  const char* symfile_addr;
+  uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+  uint32_t version;
+  uint32_t action_flag;
+  jit_code_entry* relevant_entry;
+  jit_code_entry* first_entry;
+};
+
+// Debuggers set a breakpoint here, so it must not be inlined or folded.
+void __attribute__((noinline))
+__jit_debug_register_code()
+{
+  __asm__ __volatile__("" ::: "memory");
+}
+
+jit_descriptor __jit_debug_descriptor = { 1, JIT_NOACTION, nullptr, nullptr };
+
+} // extern "C"
+
+namespace sp {
+
+struct GdbJitEntry
+{
+  jit_code_entry entry;
+  ke::Vector<uint8_t> symfile;
+};
+
+} // namespace sp
+
+// The descriptor is shared with any other JIT in the process, but there's no
+// way to coordinate with them; this only keeps our own threads apart.
+static ke::Mutex sRegistrationLock;
+
+// ELF structures, for the host's word size.
+#if defined(KE_ARCH_X64)
+static const uint8_t kElfClass = 2;    // ELFCLASS64
+static const uint16_t kElfMachine = 62; // EM_X86_64
+#else
+static const uint8_t kElfClass = 1;    // ELFCLASS32
+static const uint16_t kElfMachine = 3;  // EM_386
+#endif
+
+struct ElfHeader {
+  uint8_t ident[16];
+  uint16_t type;
+  uint16_t machine;
+  uint32_t version;
+  uintptr_t entry;
+  uintptr_t phoff;
+  uintptr_t shoff;
+  uint32_t flags;
+  uint16_t ehsize;
+  uint16_t phentsize;
+  uint16_t phnum;
+  uint16_t shentsize;
+  uint16_t shnum;
+  uint16_t shstrndx;
+};
+
+struct ElfSection {
+  uint32_t name;
+  uint32_t type;
+  uintptr_t flags;
+  uintptr_t addr;
+  uintptr_t offset;
+  uintptr_t size;
+  uint32_t link;
+  uint32_t info;
+  uintptr_t addralign;
+  uintptr_t entsize;
+};
+
+#if defined(KE_ARCH_X64)
+struct ElfSymbol {
+  uint32_t name;
+  uint8_t info;
+  uint8_t other;
+  uint16_t shndx;
+  uint64_t value;
+  uint64_t size;
+};
+#else
+struct ElfSymbol {
+  uint32_t name;
+  uint32_t value;
+  uint32_t size;
+  uint8_t info;
+  uint8_t other;
+  uint16_t shndx;
+};
+#endif
+
+static const uint16_t ET_REL_ = 1;
+static const uint32_t SHT_PROGBITS_ = 1;
+static const uint32_t SHT_SYMTAB_ = 2;
+static const uint32_t SHT_STRTAB_ = 3;
+static const uint32_t SHT_NOBITS_ = 8;
+static const uintptr_t SHF_ALLOC_ = 0x2;
+static const uintptr_t SHF_EXECINSTR_ = 0x4;
+static const uint16_t SHN_ABS_ = 0xfff1;
+static const uint8_t STB_GLOBAL_ = 1;
+static const uint8_t STT_FUNC_ = 2;
+static const uint8_t STT_FILE_ = 4;
+
+// DWARF 2 constants.
+static const uint8_t DW_TAG_compile_unit = 0x11;
+static const uint8_t DW_CHILDREN_no = 0;
+static const uint8_t DW_AT_name = 0x03;
+static const uint8_t DW_AT_stmt_list = 0x10;
+static const uint8_t DW_AT_low_pc = 0x11;
+static const uint8_t DW_AT_high_pc = 0x12;
+static const uint8_t DW_FORM_addr = 0x01;
+static const uint8_t DW_FORM_data4 = 0x06;
+static const uint8_t DW_FORM_string = 0x08;
+static const uint8_t DW_LNS_copy = 1;
+static const uint8_t DW_LNS_advance_pc = 2;
+static const uint8_t DW_LNS_advance_line = 3;
+static const uint8_t DW_LNS_set_file = 4;
+static const uint8_t DW_LNE_end_sequence = 1;
+static const uint8_t DW_LNE_set_address = 2;
+
+enum SectionIndex {
+  kNullSection,
+  kTextSection,
+  kColdTextSection,
+  kShstrtabSection,
+  kStrtabSection,
+  kSymtabSection,
+  kDebugAbbrevSection,
+  kDebugInfoSection,
+  kDebugLineSection,
+  kNumSections
+};
+
+static const char* const kSectionNames[kNumSections] = {
+  "",
+  ".text",
+  ".text.cold",
+  ".shstrtab",
+  ".strtab",
+  ".symtab",
+  ".debug_abbrev",
+  ".debug_info",
+  ".debug_line"
+};
+
+// Appends little-endian values, as the hosts we support are.
+class ByteBuffer
+{
+ public:
+  size_t pos() const {
+    return bytes_.length();
+  }
+  void write(const void* data, size_t length) {
+    const uint8_t* ptr = reinterpret_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < length; i++)
+      bytes_.append(ptr[i]);
+  }
+  void u8(uint8_t value) {
+    bytes_.append(value);
+  }
+  void u16(uint16_t value) {
+    write(&value, sizeof(value));
+  }
+  void u32(uint32_t value) {
+    write(&value, sizeof(value));
+  }
+  void addr(uintptr_t value) {
+    write(&value, sizeof(value));
+  }
+  void str(const char* value) {
+    write(value, strlen(value) + 1);
+  }
+  void uleb128(uint32_t value) {
+    do {
+      uint8_t byte = value & 0x7f;
+      value >>= 7;
+      if (value)
+        byte |= 0x80;
+      u8(byte);
+    } while (value);
+  }
+  void sleb128(int32_t value) {
+    for (;;) {
+      uint8_t byte = value & 0x7f;
+      value >>= 7;
+      if ((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40))) {
+        u8(byte);
+        return;
+      }
+      u8(byte | 0x80);
+    }
+  }
+  void align(size_t alignment) {
+    while (pos() % alignment)
+      u8(0);
+  }
+  void patch32(size_t offset, uint32_t value) {
+    memcpy(&bytes_[offset], &value, sizeof(value));
+  }
+  const ke::Vector<uint8_t>& bytes() const {
+    return bytes_;
+  }
+  uint8_t* buffer() {
+    return bytes_.buffer();
+  }
+  ke::Vector<uint8_t> take() {
+    return ke::Move(bytes_);
+  }
+
+ private:
+  ke::Vector<uint8_t> bytes_;
+};
+
+static void
+WriteDebugAbbrev(ByteBuffer& buf)
+{
+  buf.uleb128(1);
+  buf.uleb128(DW_TAG_compile_unit);
+  buf.u8(DW_CHILDREN_no);
+  buf.uleb128(DW_AT_name);
+  buf.uleb128(DW_FORM_string);
+  buf.uleb128(DW_AT_low_pc);
+  buf.uleb128(DW_FORM_addr);
+  buf.uleb128(DW_AT_high_pc);
+  buf.uleb128(DW_FORM_addr);
+  buf.uleb128(DW_AT_stmt_list);
+  buf.uleb128(DW_FORM_data4);
+  buf.u8(0);
+  buf.u8(0);
+  buf.u8(0);
+}
+
+static void
+WriteDebugInfo(ByteBuffer& buf, const char* file, uintptr_t code, size_t code_size,
+               uint32_t stmt_list)
+{
+  size_t start = buf.pos();
+  buf.u32(0);
+  buf.u16(2);
+  buf.u32(0);
+  buf.u8(sizeof(uintptr_t));
+
+  buf.uleb128(1);
+  buf.str(file);
+  buf.addr(code);
+  buf.addr(code + code_size);
+  buf.u32(stmt_list);
+
+  buf.patch32(start, uint32_t(buf.pos() - start - sizeof(uint32_t)));
+}
+
+// Describes |lines| from |begin| to |end|, which cover |code_size| bytes at
+// |code|, starting at |code_offset| into the function.
+static void
+WriteDebugLine(ByteBuffer& buf, const ke::Vector<SourceLine>& lines, size_t begin,
+               size_t end, uintptr_t code, uint32_t code_offset, size_t code_size)
+{
+  // Number the source files, from 1.
+  ke::Vector<const char*> files;
+  ke::Vector<uint32_t> file_numbers;
+  for (size_t i = begin; i < end; i++) {
+    size_t number = 0;
+    while (number < files.length() && strcmp(files[number], lines[i].file) != 0)
+      number++;
+    if (number == files.length())
+      files.append(lines[i].file);
+    file_numbers.append(uint32_t(number + 1));
+  }
+
+  size_t start = buf.pos();
+  buf.u32(0);
+  buf.u16(2);
+  size_t header_length = buf.pos();
+  buf.u32(0);
+  buf.u8(1);   // minimum_instruction_length
+  buf.u8(1);   // default_is_stmt
+  buf.u8(uint8_t(-5)); // line_base
+  buf.u8(14);  // line_range
+  buf.u8(13);  // opcode_base
+
+  static const uint8_t kStandardOpcodeLengths[] = { 0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1 };
+  buf.write(kStandardOpcodeLengths, sizeof(kStandardOpcodeLengths));
+
+  // No include directories.
+  buf.u8(0);
+  for (size_t i = 0; i < files.length(); i++) {
+    buf.str(files[i]);
+    buf.uleb128(0);
+    buf.uleb128(0);
+    buf.uleb128(0);
+  }
+  buf.u8(0);
+  buf.patch32(header_length, uint32_t(buf.pos() - header_length - sizeof(uint32_t)));
+
+  buf.u8(0);
+  buf.uleb128(1 + sizeof(uintptr_t));
+  buf.u8(DW_LNE_set_address);
+  buf.addr(code);
+
+  uint32_t file = 1;
+  uint32_t pcoffs = code_offset;
+  int32_t line = 1;
+  for (size_t i = begin; i < end; i++) {
+    if (file_numbers[i - begin] != file) {
+      file = file_numbers[i - begin];
+      buf.u8(DW_LNS_set_file);
+      buf.uleb128(file);
+    }
+    if (lines[i].pcoffs != pcoffs) {
+      buf.u8(DW_LNS_advance_pc);
+      buf.uleb128(lines[i].pcoffs - pcoffs);
+      pcoffs = lines[i].pcoffs;
+    }
+    if (int32_t(lines[i].line) != line) {
+      buf.u8(DW_LNS_advance_line);
+      buf.sleb128(int32_t(lines[i].line) - line);
+      line = int32_t(lines[i].line);
+    }
+    buf.u8(DW_LNS_copy);
+  }
+
+  buf.u8(DW_LNS_advance_pc);
+  buf.uleb128(uint32_t(code_offset + code_size - pcoffs));
+  buf.u8(0);
+  buf.uleb128(1);
+  buf.u8(DW_LNE_end_sequence);
+
+  buf.patch32(start, uint32_t(buf.pos() - start - sizeof(uint32_t)));
+}
+
+// Build a relocatable object whose .text section is placed at the method's
+// code, and .text.cold at its cold code. They have no contents; debuggers read
+// the code from memory. Each part gets its own symbol and compilation unit.
+static void
+BuildSymbolFile(PluginRuntime* rt, CompiledFunction* fun, ByteBuffer& elf)
+{
+  uintptr_t code = uintptr_t(fun->GetEntryAddress());
+  size_t code_size = fun->GetCodeSize();
+  uintptr_t cold_code = uintptr_t(fun->GetColdCodeAddress());
+  size_t cold_size = fun->GetColdCodeSize();
+  ke::AString name = fun->DescribeName(rt);
+  ke::AString cold_name = ke::AString::Sprintf("%s.cold", name.chars());
+
+  ke::Vector<SourceLine> lines;
+  fun->GetSourceLines(rt, &lines);
+  const char* file = lines.empty() ? rt->Name() : lines[0].file;
+
+  size_t split = 0;
+  while (split < lines.length() && lines[split].pcoffs < code_size)
+    split++;
+
+  ByteBuffer sections[kNumSections];
+  uint32_t section_names[kNumSections];
+  for (size_t i = 0; i < kNumSections; i++) {
+    section_names[i] = uint32_t(sections[kShstrtabSection].pos());
+    sections[kShstrtabSection].str(kSectionNames[i]);
+  }
+
+  ByteBuffer& strtab = sections[kStrtabSection];
+  strtab.u8(0);
+  uint32_t file_name = uint32_t(strtab.pos());
+  strtab.str(rt->Name());
+  uint32_t function_name = uint32_t(strtab.pos());
+  strtab.str(name.chars());
+  uint32_t cold_function_name = uint32_t(strtab.pos());
+  strtab.str(cold_name.chars());
+
+  size_t num_symbols = cold_code ? 4 : 3;
+  ElfSymbol symbols[4];
+  memset(symbols, 0, sizeof(symbols));
+  symbols[1].name = file_name;
+  symbols[1].info = STT_FILE_;
+  symbols[1].shndx = SHN_ABS_;
+  symbols[2].name = function_name;
+  symbols[2].info = (STB_GLOBAL_ << 4) | STT_FUNC_;
+  symbols[2].shndx = kTextSection;
+  symbols[2].value = 0;
+  symbols[2].size = code_size;
+  symbols[3].name = cold_function_name;
+  symbols[3].info = (STB_GLOBAL_ << 4) | STT_FUNC_;
+  symbols[3].shndx = kColdTextSection;
+  symbols[3].value = 0;
+  symbols[3].size = cold_size;
+  sections[kSymtabSection].write(symbols, num_symbols * sizeof(ElfSymbol));
+
+  WriteDebugAbbrev(sections[kDebugAbbrevSection]);
+  WriteDebugInfo(sections[kDebugInfoSection], file, code, code_size, 0);
+  WriteDebugLine(sections[kDebugLineSection], lines, 0, split, code, 0, code_size);
+  if (cold_code) {
+    uint32_t stmt_list = uint32_t(sections[kDebugLineSection].pos());
+    WriteDebugInfo(sections[kDebugInfoSection], file, cold_code, cold_size, stmt_list);
+    WriteDebugLine(sections[kDebugLineSection], lines, split, lines.length(), cold_code,
+                   uint32_t(code_size), cold_size);
+  }
+
+  ElfSection headers[kNumSections];
+  memset(headers, 0, sizeof(headers));
+
+  elf.write(headers, sizeof(ElfHeader));
+  for (size_t i = 0; i < kNumSections; i++) {
+    headers[i].name = section_names[i];
+    if (i == kNullSection || i == kTextSection || i == kColdTextSection)
+      continue;
+    elf.align(sizeof(uintptr_t));
+    headers[i].offset = elf.pos();
+    headers[i].size = sections[i].pos();
+    headers[i].addralign = 1;
+    headers[i].type = SHT_PROGBITS_;
+    elf.write(sections[i].bytes().buffer(), sections[i].pos());
+  }
+
+  headers[kTextSection].type = SHT_NOBITS_;
+  headers[kTextSection].flags = SHF_ALLOC_ | SHF_EXECINSTR_;
+  headers[kTextSection].addr = code;
+  headers[kTextSection].size = code_size;
+  headers[kTextSection].addralign = 16;
+  headers[kColdTextSection].type = SHT_NOBITS_;
+  headers[kColdTextSection].flags = SHF_ALLOC_ | SHF_EXECINSTR_;
+  headers[kColdTextSection].addr = cold_code;
+  headers[kColdTextSection].size = cold_size;
+  headers[kColdTextSection].addralign = 16;
+  headers[kShstrtabSection].type = SHT_STRTAB_;
+  headers[kStrtabSection].type = SHT_STRTAB_;
+  headers[kSymtabSection].type = SHT_SYMTAB_;
+  headers[kSymtabSection].link = kStrtabSection;
+  headers[kSymtabSection].info = 2; // The first global symbol.
+  headers[kSymtabSection].addralign = sizeof(uintptr_t);
+  headers[kSymtabSection].entsize = sizeof(ElfSymbol);
+
+  elf.align(sizeof(uintptr_t));
+  size_t section_headers = elf.pos();
+  elf.write(headers, sizeof(headers));
+
+  ElfHeader header;
+  memset(&header, 0, sizeof(header));
+  static const uint8_t kIdent[] = { 0x7f, 'E', 'L', 'F', kElfClass, 1 /* LSB */, 1 /* current */ };
+  memcpy(header.ident, kIdent, sizeof(kIdent));
+  header.type = ET_REL_;
+  header.machine = kElfMachine;
+  header.version = 1;
+  header.shoff = section_headers;
+  header.ehsize = sizeof(ElfHeader);
+  header.shentsize = sizeof(ElfSection);
+  header.shnum = kNumSections;
+  header.shstrndx = kShstrtabSection;
+  memcpy(elf.buffer(), &header, sizeof(header));
+}
+
+bool
+sp::GdbJitSupported()
+{
+  return true;
+}
+
+GdbJitEntry*
+sp::GdbJitRegister(PluginRuntime* rt, CompiledFunction* fun)
+{
+  ByteBuffer elf;
+  BuildSymbolFile(rt, fun, elf);
+
+  GdbJitEntry* entry = new GdbJitEntry;
+  entry->symfile = elf.take();
+  entry->entry.symfile_addr = reinterpret_cast<const char*>(entry->symfile.buffer());
+  entry->entry.symfile_size = entry->symfile.length();
+
+  ke::AutoLock lock(&sRegistrationLock);
+  entry->entry.prev_entry = nullptr;
+  entry->entry.next_entry = __jit_debug_descriptor.first_entry;
+  if (entry->entry.next_entry)
+    entry->entry.next_entry->prev_entry = &entry->entry;
+  __jit_debug_descriptor.first_entry = &entry->entry;
+  __jit_debug_descriptor.relevant_entry = &entry->entry;
+  __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+  __jit_debug_register_code();
+  return entry;
+}
+
+void
+sp::GdbJitUnregister(GdbJitEntry* entry)
+{
+  {
+    ke::AutoLock lock(&sRegistrationLock);
+    if (entry->entry.prev_entry)
+      entry->entry.prev_entry->next_entry = entry->entry.next_entry;
+    else
+      __jit_debug_descriptor.first_entry = entry->entry.next_entry;
+    if (entry->entry.next_entry)
+      entry->entry.next_entry->prev_entry = entry->entry.prev_entry;
+    __jit_debug_descriptor.relevant_entry = &entry->entry;
+    __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+    __jit_debug_register_code();
+  }
+  delete entry;
+}
+
+#else // !KE_LINUX
+
+bool
+sp::GdbJitSupported()
+{
+  return false;
+}
+
+GdbJitEntry*
+sp::GdbJitRegister(PluginRuntime* rt, CompiledFunction* fun)
+{
+  return nullptr;
+}
+
+void
+sp::GdbJitUnregister(GdbJitEntry* entry)
+{
+}
+
+#endif // !KE_LINUX
@@ -0,0 +1,43 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_gdb_jit_h_
+#define _include_sourcepawn_vm_gdb_jit_h_
+
+namespace sp {
+
+class CompiledFunction;
+class PluginRuntime;
+struct GdbJitEntry;
+
+// Support for GDB's JIT interface, which lets debuggers symbolize generated
+// code, including in core dumps.
+//
+// Each compiled method is described by a small in-memory ELF object, with a
+// symbol for the method, named "plugin.smx::function", and a DWARF line table
+// built from its cip map; its cold code gets another, "function.cold". The
+// objects are linked into the list that debuggers read through
+// __jit_debug_descriptor, and __jit_debug_register_code() is called so an
+// attached debugger notices. A method is unregistered when its
+// CompiledFunction is destroyed.
+
+// Whether GDB's JIT interface is supported on this platform.
+bool GdbJitSupported();
+
+// Register |fun| with debuggers. Returns null on failure. Can be called from
+// compile threads.
+GdbJitEntry* GdbJitRegister(PluginRuntime* rt, CompiledFunction* fun);
+void GdbJitUnregister(GdbJitEntry* entry);
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_gdb_jit_h_
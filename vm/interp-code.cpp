@@ -0,0 +1,679 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include "interp-code.h"
+#include "method-info.h"
+#include "environment.h"
+#include "method-verifier.h"
+#include "pcode-reader.h"
+#include "plugin-runtime.h"
+#include <string.h>
+
+namespace sp {
+
+static const uint32_t kNoInsn = 0xffffffff;
+
+// Translates pcode into an InterpCode. Jump targets are recorded as pcode
+// offsets while decoding, and rewritten as instruction indexes once the
+// whole method has been seen.
+class InterpCodeBuilder final : public PcodeVisitor
+{
+ public:
+  InterpCodeBuilder(PluginRuntime* rt, uint32_t pcode_offset);
+
+  InterpCode* build();
+
+  int error() const {
+    return error_;
+  }
+
+ public:
+  bool visitLOAD(PawnReg dest, cell_t srcaddr) override {
+    return emit(dest == PawnReg::Pri ? InterpOp::LOAD_PRI : InterpOp::LOAD_ALT, srcaddr);
+  }
+  bool visitLOAD_S(PawnReg dest, cell_t srcoffs) override {
+    if (proven())
+      return emit(dest == PawnReg::Pri ? InterpOp::LOAD_S_PRI_UNCHECKED : InterpOp::LOAD_S_ALT_UNCHECKED, srcoffs);
+    return emit(dest == PawnReg::Pri ? InterpOp::LOAD_S_PRI : InterpOp::LOAD_S_ALT, srcoffs);
+  }
+  bool visitLREF_S(PawnReg dest, cell_t srcoffs) override {
+    return emit(dest == PawnReg::Pri ? InterpOp::LREF_S_PRI : InterpOp::LREF_S_ALT, srcoffs);
+  }
+  bool visitLOAD_I() override {
+    return emit(InterpOp::LOAD_I);
+  }
+  bool visitLODB_I(cell_t width) override {
+    if (width != 1 && width != 2 && width != 4)
+      return fail(SP_ERROR_INSTRUCTION_PARAM);
+    return emit(InterpOp::LODB_I, width);
+  }
+  bool visitCONST(PawnReg dest, cell_t imm) override {
+    return emit(dest == PawnReg::Pri ? InterpOp::CONST_PRI : InterpOp::CONST_ALT, imm);
+  }
+  bool visitADDR(PawnReg dest, cell_t offset) override {
+    return emit(dest == PawnReg::Pri ? InterpOp::ADDR_PRI : InterpOp::ADDR_ALT, offset);
+  }
+  bool visitSTOR(cell_t address, PawnReg src) override {
+    return emit(src == PawnReg::Pri ? InterpOp::STOR_PRI : InterpOp::STOR_ALT, address);
+  }
+  bool visitSTOR_S(cell_t offset, PawnReg src) override {
+    if (proven())
+      return emit(src == PawnReg::Pri ? InterpOp::STOR_S_PRI_UNCHECKED : InterpOp::STOR_S_ALT_UNCHECKED, offset);
+    return emit(src == PawnReg::Pri ? InterpOp::STOR_S_PRI : InterpOp::STOR_S_ALT, offset);
+  }
+  bool visitSREF_S(cell_t offset, PawnReg src) override {
+    return emit(src == PawnReg::Pri ? InterpOp::SREF_S_PRI : InterpOp::SREF_S_ALT, offset);
+  }
+  bool visitSTOR_I() override {
+    return emit(InterpOp::STOR_I);
+  }
+  bool visitSTRB_I(cell_t width) override {
+    if (width != 1 && width != 2 && width != 4)
+      return fail(SP_ERROR_INSTRUCTION_PARAM);
+    return emit(InterpOp::STRB_I, width);
+  }
+  bool visitLIDX() override {
+    return emit(InterpOp::LIDX);
+  }
+  bool visitIDXADDR() override {
+    return emit(InterpOp::IDXADDR);
+  }
+  bool visitMOVE(PawnReg reg) override {
+    return emit(reg == PawnReg::Pri ? InterpOp::MOVE_PRI : InterpOp::MOVE_ALT);
+  }
+  bool visitXCHG() override {
+    return emit(InterpOp::XCHG);
+  }
+  bool visitPUSH(PawnReg src) override {
+    return emit(src == PawnReg::Pri ? InterpOp::PUSH_PRI : InterpOp::PUSH_ALT);
+  }
+  bool visitPUSH_C(const cell_t* vals, size_t nvals) override {
+    return emitPushes(InterpOp::PUSH_C, InterpOp::PUSH2_C, vals, nvals);
+  }
+  bool visitPUSH(const cell_t* addresses, size_t nvals) override {
+    return emitPushes(InterpOp::PUSH, InterpOp::PUSH2, addresses, nvals);
+  }
+  bool visitPUSH_S(const cell_t* offsets, size_t nvals) override {
+    if (proven())
+      return emitPushes(InterpOp::PUSH_S_UNCHECKED, InterpOp::PUSH2_S_UNCHECKED, offsets, nvals);
+    return emitPushes(InterpOp::PUSH_S, InterpOp::PUSH2_S, offsets, nvals);
+  }
+  bool visitPUSH_ADR(const cell_t* offsets, size_t nvals) override {
+    return emitPushes(InterpOp::PUSH_ADR, InterpOp::PUSH2_ADR, offsets, nvals);
+  }
+  bool visitPOP(PawnReg dest) override {
+    if (proven())
+      return emit(dest == PawnReg::Pri ? InterpOp::POP_PRI_UNCHECKED : InterpOp::POP_ALT_UNCHECKED);
+    return emit(dest == PawnReg::Pri ? InterpOp::POP_PRI : InterpOp::POP_ALT);
+  }
+  bool visitSTACK(cell_t amount) override {
+    return emit(InterpOp::STACK, amount);
+  }
+  bool visitHEAP(cell_t amount) override {
+    return emit(InterpOp::HEAP, amount);
+  }
+  bool visitRETN() override {
+    return emit(InterpOp::RETN);
+  }
+  bool visitCALL(cell_t offset) override {
+    return emit(InterpOp::CALL, offset, ncalls_++);
+  }
+  bool visitJUMP(cell_t offset) override {
+    return emitJump(InterpOp::JUMP, offset);
+  }
+  bool visitJcmp(CompareOp op, cell_t offset) override {
+    switch (op) {
+      case CompareOp::Zero:
+        return emitJump(InterpOp::JZER, offset);
+      case CompareOp::NotZero:
+        return emitJump(InterpOp::JNZ, offset);
+      case CompareOp::Eq:
+        return emitJump(InterpOp::JEQ, offset);
+      case CompareOp::Neq:
+        return emitJump(InterpOp::JNEQ, offset);
+      case CompareOp::Sless:
+        return emitJump(InterpOp::JSLESS, offset);
+      case CompareOp::Sleq:
+        return emitJump(InterpOp::JSLEQ, offset);
+      case CompareOp::Sgrtr:
+        return emitJump(InterpOp::JSGRTR, offset);
+      case CompareOp::Sgeq:
+        return emitJump(InterpOp::JSGEQ, offset);
+    }
+    return fail(SP_ERROR_INVALID_INSTRUCTION);
+  }
+  bool visitSHL() override {
+    return emit(InterpOp::SHL);
+  }
+  bool visitSHR() override {
+    return emit(InterpOp::SHR);
+  }
+  bool visitSSHR() override {
+    return emit(InterpOp::SSHR);
+  }
+  bool visitSHL_C(PawnReg dest, cell_t amount) override {
+    return emit(dest == PawnReg::Pri ? InterpOp::SHL_C_PRI : InterpOp::SHL_C_ALT, amount);
+  }
+  bool visitSMUL() override {
+    return emit(InterpOp::SMUL);
+  }
+  bool visitSDIV(PawnReg dest) override {
+    return emit(dest == PawnReg::Pri ? InterpOp::SDIV : InterpOp::SDIV_ALT);
+  }
+  bool visitADD() override {
+    return emit(InterpOp::ADD);
+  }
+  bool visitSUB() override {
+    return emit(InterpOp::SUB);
+  }
+  bool visitSUB_ALT() override {
+    return emit(InterpOp::SUB_ALT);
+  }
+  bool visitAND() override {
+    return emit(InterpOp::AND);
+  }
+  bool visitOR() override {
+    return emit(InterpOp::OR);
+  }
+  bool visitXOR() override {
+    return emit(InterpOp::XOR);
+  }
+  bool visitNOT() override {
+    return emit(InterpOp::NOT);
+  }
+  bool visitNEG() override {
+    return emit(InterpOp::NEG);
+  }
+  bool visitINVERT() override {
+    return emit(InterpOp::INVERT);
+  }
+  bool visitADD_C(cell_t value) override {
+    return emit(InterpOp::ADD_C, value);
+  }
+  bool visitSMUL_C(cell_t value) override {
+    return emit(InterpOp::SMUL_C, value);
+  }
+  bool visitZERO(PawnReg dest) override {
+    return emit(dest == PawnReg::Pri ? InterpOp::ZERO_PRI : InterpOp::ZERO_ALT);
+  }
+  bool visitZERO(cell_t address) override {
+    return emit(InterpOp::ZERO, address);
+  }
+  bool visitZERO_S(cell_t offset) override {
+    return emit(proven() ? InterpOp::ZERO_S_UNCHECKED : InterpOp::ZERO_S, offset);
+  }
+  bool visitCompareOp(CompareOp op) override {
+    switch (op) {
+      case CompareOp::Eq:
+        return emit(InterpOp::EQ);
+      case CompareOp::Neq:
+        return emit(InterpOp::NEQ);
+      case CompareOp::Sless:
+        return emit(InterpOp::SLESS);
+      case CompareOp::Sleq:
+        return emit(InterpOp::SLEQ);
+      case CompareOp::Sgrtr:
+        return emit(InterpOp::SGRTR);
+      case CompareOp::Sgeq:
+        return emit(InterpOp::SGEQ);
+      default:
+        return fail(SP_ERROR_INVALID_INSTRUCTION);
+    }
+  }
+  bool visitEQ_C(PawnReg src, cell_t value) override {
+    return emit(src == PawnReg::Pri ? InterpOp::EQ_C_PRI : InterpOp::EQ_C_ALT, value);
+  }
+  bool visitINC(PawnReg dest) override {
+    return emit(dest == PawnReg::Pri ? InterpOp::INC_PRI : InterpOp::INC_ALT);
+  }
+  bool visitINC(cell_t address) override {
+    return emit(InterpOp::INC, address);
+  }
+  bool visitINC_S(cell_t offset) override {
+    return emit(proven() ? InterpOp::INC_S_UNCHECKED : InterpOp::INC_S, offset);
+  }
+  bool visitINC_I() override {
+    return emit(InterpOp::INC_I);
+  }
+  bool visitDEC(PawnReg dest) override {
+    return emit(dest == PawnReg::Pri ? InterpOp::DEC_PRI : InterpOp::DEC_ALT);
+  }
+  bool visitDEC(cell_t address) override {
+    return emit(InterpOp::DEC, address);
+  }
+  bool visitDEC_S(cell_t offset) override {
+    return emit(proven() ? InterpOp::DEC_S_UNCHECKED : InterpOp::DEC_S, offset);
+  }
+  bool visitDEC_I() override {
+    return emit(InterpOp::DEC_I);
+  }
+  bool visitMOVS(uint32_t amount) override {
+    return emit(InterpOp::MOVS, amount);
+  }
+  bool visitFILL(uint32_t amount) override {
+    return emit(InterpOp::FILL, amount);
+  }
+  bool visitBOUNDS(uint32_t limit) override {
+    return emit(InterpOp::BOUNDS, limit);
+  }
+  bool visitSYSREQ_C(uint32_t native_index) override {
+    return emit(InterpOp::SYSREQ_C, native_index);
+  }
+  bool visitSYSREQ_N(uint32_t native_index, uint32_t nparams) override {
+    return emit(InterpOp::SYSREQ_N, native_index, nparams);
+  }
+  bool visitINTRINSIC_N(uint32_t native_index, uint32_t nparams,
+                        const sp_intrinsic_t* intrinsic) override {
+    return emit(InterpOp::INTRINSIC_N, native_index, nparams);
+  }
+  bool visitSWAP(PawnReg dest) override {
+    return emit(dest == PawnReg::Pri ? InterpOp::SWAP_PRI : InterpOp::SWAP_ALT);
+  }
+  bool visitLOAD_BOTH(cell_t addressForPri, cell_t addressForAlt) override {
+    return emit(InterpOp::LOAD_BOTH, addressForPri, addressForAlt);
+  }
+  bool visitLOAD_S_BOTH(cell_t offsetForPri, cell_t offsetForAlt) override {
+    InterpOp op = proven() ? InterpOp::LOAD_S_BOTH_UNCHECKED : InterpOp::LOAD_S_BOTH;
+    return emit(op, offsetForPri, offsetForAlt);
+  }
+  bool visitCONST(cell_t address, cell_t value) override {
+    return emit(InterpOp::CONST, address, value);
+  }
+  bool visitCONST_S(cell_t offset, cell_t value) override {
+    return emit(proven() ? InterpOp::CONST_S_UNCHECKED : InterpOp::CONST_S, offset, value);
+  }
+  bool visitTRACKER_PUSH_C(cell_t amount) override {
+    return emit(InterpOp::TRACKER_PUSH_C, amount);
+  }
+  bool visitTRACKER_POP_SETHEAP() override {
+    return emit(InterpOp::TRACKER_POP_SETHEAP);
+  }
+  bool visitGENARRAY(uint32_t dims, bool autozero) override {
+    return emit(autozero ? InterpOp::GENARRAY_Z : InterpOp::GENARRAY, dims);
+  }
+  bool visitSTRADJUST_PRI() override {
+    return emit(InterpOp::STRADJUST_PRI);
+  }
+  bool visitFABS() override {
+    return emit(InterpOp::FABS);
+  }
+  bool visitFLOAT() override {
+    return emit(InterpOp::FLOAT);
+  }
+  bool visitFLOATADD() override {
+    return emit(InterpOp::FLOATADD);
+  }
+  bool visitFLOATSUB() override {
+    return emit(InterpOp::FLOATSUB);
+  }
+  bool visitFLOATMUL() override {
+    return emit(InterpOp::FLOATMUL);
+  }
+  bool visitFLOATDIV() override {
+    return emit(InterpOp::FLOATDIV);
+  }
+  bool visitRND_TO_NEAREST() override {
+    return emit(InterpOp::RND_TO_NEAREST);
+  }
+  bool visitRND_TO_FLOOR() override {
+    return emit(InterpOp::RND_TO_FLOOR);
+  }
+  bool visitRND_TO_CEIL() override {
+    return emit(InterpOp::RND_TO_CEIL);
+  }
+  bool visitRND_TO_ZERO() override {
+    return emit(InterpOp::RND_TO_ZERO);
+  }
+  bool visitFLOATCMP() override {
+    return emit(InterpOp::FLOATCMP);
+  }
+  bool visitFLOAT_CMP_OP(CompareOp op) override {
+    switch (op) {
+      case CompareOp::Sgrtr:
+        return emit(InterpOp::FLOAT_GT);
+      case CompareOp::Sgeq:
+        return emit(InterpOp::FLOAT_GE);
+      case CompareOp::Sleq:
+        return emit(InterpOp::FLOAT_LE);
+      case CompareOp::Sless:
+        return emit(InterpOp::FLOAT_LT);
+      case CompareOp::Eq:
+        return emit(InterpOp::FLOAT_EQ);
+      case CompareOp::Neq:
+        return emit(InterpOp::FLOAT_NE);
+      default:
+        return fail(SP_ERROR_INVALID_INSTRUCTION);
+    }
+  }
+  bool visitFLOAT_NOT() override {
+    return emit(InterpOp::FLOAT_NOT);
+  }
+  bool visitHALT(cell_t value) override {
+    return emit(InterpOp::HALT, value);
+  }
+  bool visitSWITCH(cell_t defaultOffset, const CaseTableEntry* cases, size_t ncases) override;
+
+ private:
+  bool emit(InterpOp op, cell_t a = 0, cell_t b = 0);
+  bool emitJump(InterpOp op, cell_t target);
+  bool emitPushes(InterpOp op1, InterpOp op2, const cell_t* vals, size_t nvals);
+  bool fail(int err) {
+    if (error_ == SP_ERROR_NONE)
+      error_ = err;
+    return false;
+  }
+  bool resolveTarget(cell_t offset, uint32_t* target);
+  void fuse();
+
+  // Whether the verifier proved the current instruction's stack accesses
+  // in bounds. Instructions are visited in order, as are the proofs.
+  bool proven() {
+    cell_t offset = (op_cip_ - code_) * sizeof(cell_t);
+    while (next_proof_ < proven_.length() && proven_[next_proof_] < offset)
+      next_proof_++;
+    return next_proof_ < proven_.length() && proven_[next_proof_] == offset;
+  }
+
+ private:
+  PluginRuntime* rt_;
+  uint32_t pcode_start_;
+  const cell_t* code_;
+  const cell_t* op_cip_;
+  int error_;
+  cell_t ncalls_;
+
+  Vector<InterpInsn> insns_;
+  Vector<cell_t> pcode_offsets_;
+  Vector<InterpSwitch> switches_;
+  Vector<InterpCase> cases_;
+
+  // Indexes of instructions whose |a| operand is a pcode jump target.
+  Vector<size_t> jumps_;
+
+  // Maps each cell of the method's pcode to the first instruction decoded
+  // at or after it, or kNoInsn if the cell is not an instruction boundary.
+  Vector<uint32_t> insn_map_;
+
+  // Pcode offsets of instructions with proven stack accesses, in order.
+  Vector<cell_t> proven_;
+  size_t next_proof_;
+};
+
+InterpCodeBuilder::InterpCodeBuilder(PluginRuntime* rt, uint32_t pcode_offset)
+ : rt_(rt),
+   pcode_start_(pcode_offset),
+   code_(reinterpret_cast<const cell_t*>(rt->code().bytes)),
+   op_cip_(nullptr),
+   error_(SP_ERROR_NONE),
+   ncalls_(0),
+   next_proof_(0)
+{
+}
+
+InterpCode*
+InterpCodeBuilder::build()
+{
+  MethodVerifier verifier(rt_, pcode_start_);
+  verifier.collectProvenAccesses([this](cell_t offset) -> void {
+    proven_.append(offset);
+  });
+  if (!verifier.verify()) {
+    fail(verifier.error());
+    return nullptr;
+  }
+
+  PcodeReader<InterpCodeBuilder> reader(rt_, pcode_start_, this);
+
+  reader.begin();
+  while (reader.more()) {
+    // If we reach the end of this function, or the beginning of a new
+    // procedure, then stop.
+    if (reader.peekOpcode() == OP_PROC || reader.peekOpcode() == OP_ENDPROC)
+      break;
+
+    op_cip_ = reader.cip();
+
+    // Every cell between the last boundary and this one is an operand.
+    size_t cell = (op_cip_ - code_) - (pcode_start_ / sizeof(cell_t));
+    while (insn_map_.length() < cell)
+      insn_map_.append(kNoInsn);
+    insn_map_.append(insns_.length());
+
+    if (!reader.visitNext() || error_ != SP_ERROR_NONE)
+      return nullptr;
+  }
+
+  // Falling off the end of the method, or jumping to its end, is an error.
+  op_cip_ = reader.more() ? reader.cip() : code_ + (rt_->code().length / sizeof(cell_t));
+  insn_map_.append(insns_.length());
+  pcode_offsets_.append((op_cip_ - code_) * sizeof(cell_t));
+  insns_.append(InterpInsn());
+  insns_.back().op = InterpOp::ENDPROC;
+
+  for (size_t i = 0; i < jumps_.length(); i++) {
+    InterpInsn& insn = insns_[jumps_[i]];
+    uint32_t target;
+    if (!resolveTarget(insn.a, &target))
+      return nullptr;
+    insn.a = target;
+  }
+  for (size_t i = 0; i < switches_.length(); i++) {
+    InterpSwitch& table = switches_[i];
+    if (!resolveTarget(table.default_target, &table.default_target))
+      return nullptr;
+    for (size_t j = 0; j < table.ncases; j++) {
+      InterpCase& entry = cases_[table.first_case + j];
+      if (!resolveTarget(entry.target, &entry.target))
+        return nullptr;
+    }
+  }
+
+  // Superinstructions would hide the instructions they stand for from
+  // opcode profiling.
+  if (!Environment::get()->opcode_profiler())
+    fuse();
+
+  InterpCode* code = new InterpCode();
+  code->insns_ = new FixedArray<InterpInsn>(insns_.length());
+  memcpy(code->insns_->buffer(), insns_.buffer(), insns_.length() * sizeof(InterpInsn));
+  code->pcode_offsets_ = new FixedArray<cell_t>(pcode_offsets_.length());
+  memcpy(code->pcode_offsets_->buffer(), pcode_offsets_.buffer(), pcode_offsets_.length() * sizeof(cell_t));
+  code->switches_ = new FixedArray<InterpSwitch>(switches_.length());
+  memcpy(code->switches_->buffer(), switches_.buffer(), switches_.length() * sizeof(InterpSwitch));
+  code->cases_ = new FixedArray<InterpCase>(cases_.length());
+  memcpy(code->cases_->buffer(), cases_.buffer(), cases_.length() * sizeof(InterpCase));
+  code->call_targets_ = new FixedArray<MethodInfo*>(ncalls_);
+  for (cell_t i = 0; i < ncalls_; i++)
+    code->call_targets_->at(i) = nullptr;
+  return code;
+}
+
+bool
+InterpCodeBuilder::emit(InterpOp op, cell_t a, cell_t b)
+{
+  InterpInsn insn;
+  insn.handler = nullptr;
+  insn.op = op;
+  insn.a = a;
+  insn.b = b;
+  insns_.append(insn);
+  pcode_offsets_.append((op_cip_ - code_) * sizeof(cell_t));
+  return true;
+}
+
+bool
+InterpCodeBuilder::emitJump(InterpOp op, cell_t target)
+{
+  jumps_.append(insns_.length());
+  return emit(op, target);
+}
+
+bool
+InterpCodeBuilder::emitPushes(InterpOp op1, InterpOp op2, const cell_t* vals, size_t nvals)
+{
+  size_t i = 0;
+  for (; i + 1 < nvals; i += 2)
+    emit(op2, vals[i], vals[i + 1]);
+  if (i < nvals)
+    emit(op1, vals[i]);
+  return true;
+}
+
+bool
+InterpCodeBuilder::visitSWITCH(cell_t defaultOffset, const CaseTableEntry* cases, size_t ncases)
+{
+  InterpSwitch table;
+  table.first_case = cases_.length();
+  table.default_target = defaultOffset;
+
+  // Cases are kept sorted by value, so they can be binary searched. Tables
+  // are usually sorted already, so a stable insertion sort is cheap. If a
+  // value appears more than once, only its first case can ever be taken.
+  for (size_t i = 0; i < ncases; i++) {
+    size_t pos = cases_.length();
+    while (pos > table.first_case && cases_[pos - 1].value > cases[i].value)
+      pos--;
+    if (pos > table.first_case && cases_[pos - 1].value == cases[i].value)
+      continue;
+
+    InterpCase entry;
+    entry.value = cases[i].value;
+    entry.target = cases[i].address;
+    cases_.insert(pos, entry);
+  }
+  table.ncases = cases_.length() - table.first_case;
+
+  switches_.append(table);
+  return emit(InterpOp::SWITCH, switches_.length() - 1);
+}
+
+bool
+InterpCodeBuilder::resolveTarget(cell_t offset, uint32_t* target)
+{
+  cell_t relative = offset - cell_t(pcode_start_);
+  if (relative < 0 || !IsAligned(relative, sizeof(cell_t)))
+    return fail(SP_ERROR_INSTRUCTION_PARAM);
+
+  size_t cell = relative / sizeof(cell_t);
+  if (cell >= insn_map_.length() || insn_map_[cell] == kNoInsn)
+    return fail(SP_ERROR_INSTRUCTION_PARAM);
+
+  *target = insn_map_[cell];
+  return true;
+}
+
+// Superinstructions for LOAD_S_PRI; CONST_ALT; Jcc.
+static InterpOp
+FusedCompareJump(InterpOp jump)
+{
+  switch (jump) {
+    case InterpOp::JEQ:
+      return InterpOp::LOAD_S_CONST_JEQ;
+    case InterpOp::JNEQ:
+      return InterpOp::LOAD_S_CONST_JNEQ;
+    case InterpOp::JSLESS:
+      return InterpOp::LOAD_S_CONST_JSLESS;
+    case InterpOp::JSLEQ:
+      return InterpOp::LOAD_S_CONST_JSLEQ;
+    case InterpOp::JSGRTR:
+      return InterpOp::LOAD_S_CONST_JSGRTR;
+    case InterpOp::JSGEQ:
+      return InterpOp::LOAD_S_CONST_JSGEQ;
+    default:
+      return InterpOp::TOTAL;
+  }
+}
+
+// Replace the first instruction of each common sequence with a
+// superinstruction. The rest of the sequence stays where it is: the
+// superinstruction reads its operands from there, and a jump into the middle
+// of the sequence still lands on ordinary instructions. Only sequences whose
+// stack accesses were proven in bounds are fused.
+void
+InterpCodeBuilder::fuse()
+{
+  for (size_t i = 0; i < insns_.length(); i++) {
+    InterpOp first = insns_[i].op;
+    InterpOp second = (i + 1 < insns_.length()) ? insns_[i + 1].op : InterpOp::TOTAL;
+    InterpOp third = (i + 2 < insns_.length()) ? insns_[i + 2].op : InterpOp::TOTAL;
+
+    InterpOp fused = InterpOp::TOTAL;
+    size_t length = 0;
+    if (first == InterpOp::LOAD_S_PRI_UNCHECKED && second == InterpOp::CONST_ALT &&
+        FusedCompareJump(third) != InterpOp::TOTAL)
+    {
+      fused = FusedCompareJump(third);
+      length = 3;
+    } else if (first == InterpOp::LOAD_S_PRI_UNCHECKED && second == InterpOp::ADD_C &&
+               third == InterpOp::STOR_S_PRI_UNCHECKED)
+    {
+      fused = InterpOp::LOAD_S_ADD_C_STOR_S;
+      length = 3;
+    } else if (first == InterpOp::LOAD_S_PRI_UNCHECKED && second == InterpOp::BOUNDS &&
+               third == InterpOp::IDXADDR)
+    {
+      fused = InterpOp::LOAD_S_BOUNDS_IDXADDR;
+      length = 3;
+    } else if (first == InterpOp::ADD && second == InterpOp::STOR_S_PRI_UNCHECKED) {
+      fused = InterpOp::ADD_STOR_S;
+      length = 2;
+    } else if (first == InterpOp::STOR_S_PRI_UNCHECKED && second == InterpOp::JUMP) {
+      fused = InterpOp::STOR_S_JUMP;
+      length = 2;
+    }
+
+    if (!length)
+      continue;
+    insns_[i].op = fused;
+    i += length - 1;
+  }
+}
+
+InterpCode::InterpCode()
+ : threaded_(false)
+{
+}
+
+InterpCode::~InterpCode()
+{
+}
+
+InterpCode*
+InterpCode::Build(PluginRuntime* rt, MethodInfo* method, int* err)
+{
+  InterpCodeBuilder builder(rt, method->pcode_offset());
+
+  InterpCode* code = builder.build();
+  if (!code) {
+    *err = builder.error() != SP_ERROR_NONE
+           ? builder.error()
+           : SP_ERROR_INVALID_INSTRUCTION;
+    return nullptr;
+  }
+  return code;
+}
+
+void
+InterpCode::thread(const void* const* table)
+{
+  assert(!threaded_);
+
+  for (size_t i = 0; i < insns_->length(); i++) {
+    InterpInsn& insn = insns_->at(i);
+    InterpOp op = insn.op;
+    assert(op < InterpOp::TOTAL);
+    insn.handler = table[uint32_t(op)];
+  }
+  threaded_ = true;
+}
+
+} // namespace sp
@@ -0,0 +1,299 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_interp_code_h_
+#define _include_sourcepawn_vm_interp_code_h_
+
+#include <sp_vm_types.h>
+#include <amtl/am-fixedarray.h>
+#include <amtl/am-refcounting.h>
+#include <amtl/am-vector.h>
+#include "pcode-visitor.h"
+
+namespace sp {
+
+using namespace ke;
+
+class PluginRuntime;
+class MethodInfo;
+
+// Opcodes understood by the interpreter's dispatch loop. These mirror the
+// SMX opcodes, except that register variants are always split out, packed
+// PUSHn forms are split into PUSH/PUSH2 pairs, and no-ops (BREAK, NOP) are
+// dropped entirely.
+//
+// The _UNCHECKED opcodes after FLOAT_NOT are stack accesses that the method
+// verifier has proven to be in bounds, so they skip the runtime checks.
+//
+// The opcodes after those are superinstructions: each one replaces the first
+// opcode of a common sequence, chosen from opcode-profile.txt, and runs the
+// whole sequence at once.
+#define INTERP_OPCODE_LIST(_)   \
+  _(LOAD_PRI)                   \
+  _(LOAD_ALT)                   \
+  _(LOAD_S_PRI)                 \
+  _(LOAD_S_ALT)                 \
+  _(LREF_S_PRI)                 \
+  _(LREF_S_ALT)                 \
+  _(LOAD_I)                     \
+  _(LODB_I)                     \
+  _(CONST_PRI)                  \
+  _(CONST_ALT)                  \
+  _(ADDR_PRI)                   \
+  _(ADDR_ALT)                   \
+  _(STOR_PRI)                   \
+  _(STOR_ALT)                   \
+  _(STOR_S_PRI)                 \
+  _(STOR_S_ALT)                 \
+  _(SREF_S_PRI)                 \
+  _(SREF_S_ALT)                 \
+  _(STOR_I)                     \
+  _(STRB_I)                     \
+  _(LIDX)                       \
+  _(IDXADDR)                    \
+  _(MOVE_PRI)                   \
+  _(MOVE_ALT)                   \
+  _(XCHG)                       \
+  _(PUSH_PRI)                   \
+  _(PUSH_ALT)                   \
+  _(PUSH_C)                     \
+  _(PUSH2_C)                    \
+  _(PUSH)                       \
+  _(PUSH2)                      \
+  _(PUSH_S)                     \
+  _(PUSH2_S)                    \
+  _(PUSH_ADR)                   \
+  _(PUSH2_ADR)                  \
+  _(POP_PRI)                    \
+  _(POP_ALT)                    \
+  _(STACK)                      \
+  _(HEAP)                       \
+  _(RETN)                       \
+  _(CALL)                       \
+  _(JUMP)                       \
+  _(JZER)                       \
+  _(JNZ)                        \
+  _(JEQ)                        \
+  _(JNEQ)                       \
+  _(JSLESS)                     \
+  _(JSLEQ)                      \
+  _(JSGRTR)                     \
+  _(JSGEQ)                      \
+  _(SHL)                        \
+  _(SHR)                        \
+  _(SSHR)                       \
+  _(SHL_C_PRI)                  \
+  _(SHL_C_ALT)                  \
+  _(SMUL)                       \
+  _(SDIV)                       \
+  _(SDIV_ALT)                   \
+  _(ADD)                        \
+  _(SUB)                        \
+  _(SUB_ALT)                    \
+  _(AND)                        \
+  _(OR)                         \
+  _(XOR)                        \
+  _(NOT)                        \
+  _(NEG)                        \
+  _(INVERT)                     \
+  _(ADD_C)                      \
+  _(SMUL_C)                     \
+  _(ZERO_PRI)                   \
+  _(ZERO_ALT)                   \
+  _(ZERO)                       \
+  _(ZERO_S)                     \
+  _(EQ)                         \
+  _(NEQ)                        \
+  _(SLESS)                      \
+  _(SLEQ)                       \
+  _(SGRTR)                      \
+  _(SGEQ)                       \
+  _(EQ_C_PRI)                   \
+  _(EQ_C_ALT)                   \
+  _(INC_PRI)                    \
+  _(INC_ALT)                    \
+  _(INC)                        \
+  _(INC_S)                      \
+  _(INC_I)                      \
+  _(DEC_PRI)                    \
+  _(DEC_ALT)                    \
+  _(DEC)                        \
+  _(DEC_S)                      \
+  _(DEC_I)                      \
+  _(MOVS)                       \
+  _(FILL)                       \
+  _(BOUNDS)                     \
+  _(SYSREQ_C)                   \
+  _(SYSREQ_N)                   \
+  _(INTRINSIC_N)                \
+  _(SWAP_PRI)                   \
+  _(SWAP_ALT)                   \
+  _(LOAD_BOTH)                  \
+  _(LOAD_S_BOTH)                \
+  _(CONST)                      \
+  _(CONST_S)                    \
+  _(TRACKER_PUSH_C)             \
+  _(TRACKER_POP_SETHEAP)        \
+  _(GENARRAY)                   \
+  _(GENARRAY_Z)                 \
+  _(STRADJUST_PRI)              \
+  _(FABS)                       \
+  _(FLOAT)                      \
+  _(FLOATADD)                   \
+  _(FLOATSUB)                   \
+  _(FLOATMUL)                   \
+  _(FLOATDIV)                   \
+  _(RND_TO_NEAREST)             \
+  _(RND_TO_FLOOR)               \
+  _(RND_TO_CEIL)                \
+  _(RND_TO_ZERO)                \
+  _(FLOATCMP)                   \
+  _(FLOAT_GT)                   \
+  _(FLOAT_GE)                   \
+  _(FLOAT_LE)                   \
+  _(FLOAT_LT)                   \
+  _(FLOAT_EQ)                   \
+  _(FLOAT_NE)                   \
+  _(FLOAT_NOT)                  \
+  _(LOAD_S_PRI_UNCHECKED)       \
+  _(LOAD_S_ALT_UNCHECKED)       \
+  _(STOR_S_PRI_UNCHECKED)       \
+  _(STOR_S_ALT_UNCHECKED)       \
+  _(PUSH_S_UNCHECKED)           \
+  _(PUSH2_S_UNCHECKED)          \
+  _(POP_PRI_UNCHECKED)          \
+  _(POP_ALT_UNCHECKED)          \
+  _(INC_S_UNCHECKED)            \
+  _(DEC_S_UNCHECKED)            \
+  _(ZERO_S_UNCHECKED)           \
+  _(CONST_S_UNCHECKED)          \
+  _(LOAD_S_BOTH_UNCHECKED)      \
+  _(LOAD_S_CONST_JEQ)           \
+  _(LOAD_S_CONST_JNEQ)          \
+  _(LOAD_S_CONST_JSLESS)        \
+  _(LOAD_S_CONST_JSLEQ)         \
+  _(LOAD_S_CONST_JSGRTR)        \
+  _(LOAD_S_CONST_JSGEQ)         \
+  _(LOAD_S_ADD_C_STOR_S)        \
+  _(LOAD_S_BOUNDS_IDXADDR)      \
+  _(ADD_STOR_S)                 \
+  _(STOR_S_JUMP)                \
+  _(SWITCH)                     \
+  _(HALT)                       \
+  _(ENDPROC)
+
+enum class InterpOp : uint32_t
+{
+#define _(name) name,
+  INTERP_OPCODE_LIST(_)
+#undef _
+  TOTAL
+};
+
+// A single pre-decoded instruction. Before the code is threaded, |op| holds
+// the opcode; afterward, |handler| holds the address of its handler in the
+// interpreter's dispatch loop.
+//
+// Jump targets are stored in |a| as an index into the instruction stream.
+// CALL stores the target's pcode offset in |a|, and its call site index in
+// |b|.
+struct InterpInsn
+{
+  union {
+    InterpOp op;
+    const void* handler;
+  };
+  cell_t a;
+  cell_t b;
+};
+
+struct InterpSwitch
+{
+  // Index of the first case in the case list. Cases are sorted by value.
+  uint32_t first_case;
+  uint32_t ncases;
+  // Instruction index of the default target.
+  uint32_t default_target;
+};
+
+struct InterpCase
+{
+  cell_t value;
+  // Instruction index of the target.
+  uint32_t target;
+};
+
+// The pre-decoded form of a single method, built once and cached on its
+// MethodInfo.
+class InterpCode
+{
+  friend class InterpCodeBuilder;
+
+ public:
+  ~InterpCode();
+
+  // Decode the method at |method|; on failure, returns null and sets |err|.
+  static InterpCode* Build(PluginRuntime* rt, MethodInfo* method, int* err);
+
+  const InterpInsn* insns() const {
+    return insns_->buffer();
+  }
+  const InterpInsn* at(cell_t index) const {
+    assert(size_t(index) < insns_->length());
+    return &insns_->at(index);
+  }
+  const InterpSwitch& switchAt(cell_t index) const {
+    return switches_->at(index);
+  }
+  const InterpCase* cases() const {
+    return cases_->buffer();
+  }
+
+  // Each CALL instruction caches the method it resolves to, so the callee is
+  // only looked up and validated the first time that call site runs.
+  MethodInfo* callTarget(cell_t index) const {
+    return call_targets_->at(index);
+  }
+  void setCallTarget(cell_t index, MethodInfo* method) {
+    assert(!call_targets_->at(index));
+    call_targets_->at(index) = method;
+  }
+
+  // Map an instruction back to the pcode offset (cip) it was decoded from.
+  cell_t cipOf(const InterpInsn* insn) const {
+    size_t index = insn - insns();
+    assert(index < insns_->length());
+    return pcode_offsets_->at(index);
+  }
+
+  // Replace every opcode with the matching entry from |table|. This is done
+  // by the dispatch loop, since only it can see its handler addresses.
+  bool threaded() const {
+    return threaded_;
+  }
+  void thread(const void* const* table);
+
+ private:
+  InterpCode();
+
+ private:
+  AutoPtr<FixedArray<InterpInsn>> insns_;
+  AutoPtr<FixedArray<cell_t>> pcode_offsets_;
+  AutoPtr<FixedArray<InterpSwitch>> switches_;
+  AutoPtr<FixedArray<InterpCase>> cases_;
+  AutoPtr<FixedArray<MethodInfo*>> call_targets_;
+  bool threaded_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_interp_code_h_
@@ -17,11 +17,16 @@
 //
 #include "interpreter.h"
 #include "environment.h"
+#include "interp-code.h"
+#if defined(SP_HAS_JIT)
+# include "compile-queue.h"
+# include "jit.h"
+#endif
 #include "method-info.h"
+#include "opcode-profiler.h"
 #include "plugin-context.h"
-#include "pcode-reader.h"
+#include "plugin-runtime.h"
 #include "runtime-helpers.h"
-#include "watchdog_timer.h"
 #include <amtl/am-algorithm.h>
 #include <amtl/am-float.h>
 #include <fenv.h>
@@ -30,9 +35,67 @@
 
 namespace sp {
 
+// GCC and Clang support "labels as values", which lets each handler jump
+// directly to the next one instead of going back through a switch.
+#if defined(__GNUC__)
+# define INTERP_USE_COMPUTED_GOTO
+#endif
+
+static inline bool
+DivideCells(PluginContext* cx, cell_t dividend, cell_t divisor,
+            cell_t* quotient, cell_t* remainder)
+{
+  if (divisor == 0) {
+    cx->ReportErrorNumber(SP_ERROR_DIVIDE_BY_ZERO);
+    return false;
+  }
+
+  // -INT_MIN / -1 is an overflow.
+  if (divisor == -1 && dividend == cell_t(0x80000000)) {
+    cx->ReportErrorNumber(SP_ERROR_INTEGER_OVERFLOW);
+    return false;
+  }
+
+  *quotient = dividend / divisor;
+  *remainder = dividend % divisor;
+  return true;
+}
+
+// Float opcodes take their operands from the stack, left-hand side first.
+static inline bool
+PopFloats(PluginContext* cx, float* left, float* right)
+{
+  cell_t leftVal, rightVal;
+  if (!cx->popStack(&leftVal) || !cx->popStack(&rightVal))
+    return false;
+  *left = sp_ctof(leftVal);
+  *right = sp_ctof(rightVal);
+  return true;
+}
+
+// Make sure a method has been decoded before it's entered.
+bool
+Interpreter::PrepareMethod(PluginContext* cx, MethodInfo* method)
+{
+  if (method->interp_code())
+    return true;
+
+  int err = SP_ERROR_NONE;
+  InterpCode* code = InterpCode::Build(cx->runtime(), method, &err);
+  if (!code) {
+    cx->ReportErrorNumber(err);
+    return false;
+  }
+  method->setInterpCode(code);
+  return true;
+}
+
 bool
 Interpreter::Run(PluginContext* cx, RefPtr<MethodInfo> method, cell_t* rval)
 {
+  if (!PrepareMethod(cx, method))
+    return false;
+
   Interpreter interpreter(cx, method);
   if (!interpreter.run())
     return false;
@@ -45,942 +108,1349 @@ Interpreter::Interpreter(PluginContext* cx, RefPtr<MethodInfo> method)
  : env_(Environment::get()),
    rt_(cx->runtime()),
    cx_(cx),
-   reader_(rt_, method->pcode_offset(), this),
    method_(method),
-   has_returned_(false),
-   return_value_(0)
+   return_value_(0),
+   ivk_(nullptr)
 {
 }
 
 bool
 Interpreter::run()
 {
-  assert(reader_.peekOpcode() == OP_PROC);
+#if defined(INTERP_USE_COMPUTED_GOTO)
+  static const void* const kDispatchTable[] = {
+# define _(name) &&op_##name,
+    INTERP_OPCODE_LIST(_)
+# undef _
+  };
+  static_assert(sizeof(kDispatchTable) / sizeof(kDispatchTable[0]) == size_t(InterpOp::TOTAL),
+                "dispatch table must cover every opcode");
+
+  // With opcode profiling on, code is threaded through these stubs instead,
+  // which count each instruction before running its handler.
+  static const void* const kProfilingTable[] = {
+# define _(name) &&profile_##name,
+    INTERP_OPCODE_LIST(_)
+# undef _
+  };
+
+# define OPCASE(name)   op_##name:
+# define DISPATCH()     goto *ip->handler
+# define THREAD(code)                                           \
+  do {                                                          \
+    if (!(code)->threaded())                                    \
+      (code)->thread(profiler ? kProfilingTable : kDispatchTable); \
+  } while (0)
+#else
+# define OPCASE(name)   case InterpOp::name:
+# define DISPATCH()     goto dispatch
+# define THREAD(code)   do {} while (0)
+#endif
+
+#define NEXT()                                                  \
+  do {                                                          \
+    ip++;                                                       \
+    DISPATCH();                                                 \
+  } while (0)
+
+#define JUMP_TO(index)                                          \
+  do {                                                          \
+    ip = insns + (index);                                       \
+    DISPATCH();                                                 \
+  } while (0)
+
+  // Handle interrupts at a safepoint: a backedge or a call.
+#define CHECK_INTERRUPTS()                                      \
+  do {                                                          \
+    if (env_->hasPendingInterrupt() &&                          \
+        env_->HandleInterrupts(cx_) != SP_ERROR_NONE)           \
+    {                                                           \
+      goto error;                                               \
+    }                                                           \
+  } while (0)
+
+  // Every so often a hot loop gets a chance to move into the JIT.
+#if defined(SP_HAS_JIT)
+# define LOOP_EDGE(target)                                      \
+  do {                                                          \
+    if (method->recordBackedge()) {                             \
+      osr_target = (target);                                    \
+      goto osr;                                                 \
+    }                                                           \
+  } while (0)
+#else
+# define LOOP_EDGE(target)  method->recordBackedge()
+#endif
+
+  // Count the backedge and check for interrupts if we're looping
+  // backwards.
+#define BRANCH(index)                                           \
+  do {                                                          \
+    const InterpInsn* target = insns + (index);                 \
+    if (target <= ip) {                                         \
+      CHECK_INTERRUPTS();                                       \
+      LOOP_EDGE(target);                                        \
+    }                                                           \
+    ip = target;                                                \
+    DISPATCH();                                                 \
+  } while (0)
+
+  OpcodeProfiler* profiler = env_->opcode_profiler();
+  MethodInfo* method = method_;
+  InterpCode* code = method->interp_code();
+  THREAD(code);
+
+  const InterpInsn* insns = code->insns();
+  const InterpInsn* ip = insns;
+
+  if (!frames_.append(InterpFrame(method_))) {
+    cx_->ReportErrorNumber(SP_ERROR_OUT_OF_MEMORY);
+    return false;
+  }
 
-  InterpInvokeFrame ivk(cx_, method_, reader_.cip());
+  InterpInvokeFrame ivk(cx_, frames_, ip);
   ke::SaveAndSet<InterpInvokeFrame*> enterIvk(&ivk_, &ivk);
 
-  reader_.begin();
-
   if (!cx_->pushAmxFrame())
     return false;
 
-  while (!has_returned_ && reader_.more()) {
-    if (reader_.peekOpcode() == OP_PROC || reader_.peekOpcode() == OP_ENDPROC)
-      break;
-    if (!reader_.visitNext())
-      return false;
+  cell_t pri = 0;
+  cell_t alt = 0;
+#if defined(SP_HAS_JIT)
+  const InterpInsn* osr_target = nullptr;
+#endif
+
+#if defined(INTERP_USE_COMPUTED_GOTO)
+  DISPATCH();
+  {
+#else
+ dispatch:
+  if (profiler)
+    recordOpcode(profiler, method, code, ip);
+  switch (ip->op) {
+#endif
+
+  // Data section addresses in instructions were checked by the method
+  // verifier, so they are used unchecked. Stack accesses are only unchecked
+  // in the _UNCHECKED forms, which the verifier has proven in bounds.
+  OPCASE(LOAD_PRI)
+    pri = cx_->getCellValueUnchecked(ip->a);
+    NEXT();
+
+  OPCASE(LOAD_ALT)
+    alt = cx_->getCellValueUnchecked(ip->a);
+    NEXT();
+
+  OPCASE(LOAD_S_PRI)
+  {
+    cell_t value;
+    if (!cx_->getFrameValue(ip->a, &value))
+      goto error;
+    pri = value;
+    NEXT();
   }
 
-  return true;
-}
-
-bool
-Interpreter::invokeNative(uint32_t native_index)
-{
-  NativeEntry* native = rt_->NativeAt(native_index);
+  OPCASE(LOAD_S_ALT)
+  {
+    cell_t value;
+    if (!cx_->getFrameValue(ip->a, &value))
+      goto error;
+    alt = value;
+    NEXT();
+  }
 
-  ivk_->enterNativeCall(native_index);
-  if (native->status == SP_NATIVE_BOUND) {
-    ke::SaveAndSet<cell_t> saveSp(cx_->addressOfSp(), cx_->sp());
-    ke::SaveAndSet<cell_t> saveHp(cx_->addressOfHp(), cx_->hp());
+  OPCASE(LOAD_S_PRI_UNCHECKED)
+    pri = cx_->getFrameValueUnchecked(ip->a);
+    NEXT();
+
+  OPCASE(LOAD_S_ALT_UNCHECKED)
+    alt = cx_->getFrameValueUnchecked(ip->a);
+    NEXT();
+
+  OPCASE(LREF_S_PRI)
+  {
+    cell_t address, value;
+    if (!cx_->getFrameValue(ip->a, &address))
+      goto error;
+    if (!cx_->getCellValue(address, &value))
+      goto error;
+    pri = value;
+    NEXT();
+  }
 
-    const cell_t* params = reinterpret_cast<const cell_t*>(cx_->memory() + cx_->sp());
+  OPCASE(LREF_S_ALT)
+  {
+    cell_t address, value;
+    if (!cx_->getFrameValue(ip->a, &address))
+      goto error;
+    if (!cx_->getCellValue(address, &value))
+      goto error;
+    alt = value;
+    NEXT();
+  }
 
-    regs_.pri() = native->legacy_fn(cx_, params);
-  } else {
-    cx_->ReportErrorNumber(SP_ERROR_INVALID_NATIVE);
+  OPCASE(LOAD_I)
+  {
+    cell_t value;
+    if (!cx_->getCellValue(pri, &value))
+      goto error;
+    pri = value;
+    NEXT();
   }
-  ivk_->leaveNativeCall();
 
-  return !env_->hasPendingException();
-}
+  OPCASE(LODB_I)
+  {
+    cell_t value;
+    if (!cx_->getCellValue(pri, &value))
+      goto error;
 
-bool
-Interpreter::visitRETN()
-{
-  if (!cx_->popAmxFrame())
-    return false;
+    switch (ip->a) {
+    case 1:
+      pri = value & 0xff;
+      break;
+    case 2:
+      pri = value & 0xffff;
+      break;
+    default:
+      pri = value;
+      break;
+    }
+    NEXT();
+  }
 
-  has_returned_ = true;
-  return_value_ = regs_.pri();
-  return true;
-}
+  OPCASE(CONST_PRI)
+    pri = ip->a;
+    NEXT();
+
+  OPCASE(CONST_ALT)
+    alt = ip->a;
+    NEXT();
+
+  OPCASE(ADDR_PRI)
+    pri = cx_->frm() + ip->a;
+    NEXT();
+
+  OPCASE(ADDR_ALT)
+    alt = cx_->frm() + ip->a;
+    NEXT();
+
+  OPCASE(STOR_PRI)
+    cx_->setCellValueUnchecked(ip->a, pri);
+    NEXT();
+
+  OPCASE(STOR_ALT)
+    cx_->setCellValueUnchecked(ip->a, alt);
+    NEXT();
+
+  OPCASE(STOR_S_PRI)
+    if (!cx_->setFrameValue(ip->a, pri))
+      goto error;
+    NEXT();
+
+  OPCASE(STOR_S_ALT)
+    if (!cx_->setFrameValue(ip->a, alt))
+      goto error;
+    NEXT();
+
+  OPCASE(STOR_S_PRI_UNCHECKED)
+    cx_->setFrameValueUnchecked(ip->a, pri);
+    NEXT();
+
+  OPCASE(STOR_S_ALT_UNCHECKED)
+    cx_->setFrameValueUnchecked(ip->a, alt);
+    NEXT();
+
+  OPCASE(SREF_S_PRI)
+  {
+    cell_t address;
+    if (!cx_->getFrameValue(ip->a, &address))
+      goto error;
+    if (!cx_->setCellValue(address, pri))
+      goto error;
+    NEXT();
+  }
 
-bool
-Interpreter::visitPUSH_C(const cell_t* vals, size_t nvals)
-{
-  for (size_t i = 0; i < nvals; i++) {
-    if (!cx_->pushStack(vals[i]))
-      return false;
+  OPCASE(SREF_S_ALT)
+  {
+    cell_t address;
+    if (!cx_->getFrameValue(ip->a, &address))
+      goto error;
+    if (!cx_->setCellValue(address, alt))
+      goto error;
+    NEXT();
   }
-  return true;
-}
 
-bool
-Interpreter::visitPUSH_ADR(const cell_t* offsets, size_t nvals)
-{
-  for (size_t i = 0; i < nvals; i++) {
-    cell_t address = cx_->frm() + offsets[i];
-    if (!cx_->pushStack(address))
-      return false;
+  OPCASE(STOR_I)
+    if (!cx_->setCellValue(alt, pri))
+      goto error;
+    NEXT();
+
+  OPCASE(STRB_I)
+  {
+    cell_t* addr = cx_->throwIfBadAddress(alt);
+    if (!addr)
+      goto error;
+
+    switch (ip->a) {
+    case 1:
+      *reinterpret_cast<uint8_t*>(addr) = uint8_t(pri);
+      break;
+    case 2:
+      *reinterpret_cast<uint16_t*>(addr) = uint16_t(pri);
+      break;
+    default:
+      *addr = pri;
+      break;
+    }
+    NEXT();
   }
-  return true;
-}
 
-bool
-Interpreter::visitPUSH(const cell_t* addresses, size_t nvals)
-{
-  for (size_t i = 0; i < nvals; i++) {
+  OPCASE(LIDX)
+  {
     cell_t value;
-    if (!cx_->getCellValue(addresses[i], &value))
-      return false;
-    if (!cx_->pushStack(value))
-      return false;
+    if (!cx_->getCellValue(alt + (pri * sizeof(cell_t)), &value))
+      goto error;
+    pri = value;
+    NEXT();
   }
-  return true;
-}
 
-bool
-Interpreter::visitCALL(cell_t offset)
-{
-  RefPtr<MethodInfo> target = cx_->runtime()->AcquireMethod(offset);
-  if (!target) {
-    cx_->ReportErrorNumber(SP_ERROR_INVALID_ADDRESS);
-    return false;
+  OPCASE(IDXADDR)
+    pri = alt + (pri * sizeof(cell_t));
+    NEXT();
+
+  OPCASE(MOVE_PRI)
+    pri = alt;
+    NEXT();
+
+  OPCASE(MOVE_ALT)
+    alt = pri;
+    NEXT();
+
+  OPCASE(XCHG)
+    ke::Swap(pri, alt);
+    NEXT();
+
+  OPCASE(PUSH_PRI)
+    if (!cx_->pushStack(pri))
+      goto error;
+    NEXT();
+
+  OPCASE(PUSH_ALT)
+    if (!cx_->pushStack(alt))
+      goto error;
+    NEXT();
+
+  OPCASE(PUSH2_C)
+    if (!cx_->pushStack(ip->a))
+      goto error;
+    if (!cx_->pushStack(ip->b))
+      goto error;
+    NEXT();
+
+  OPCASE(PUSH_C)
+    if (!cx_->pushStack(ip->a))
+      goto error;
+    NEXT();
+
+  OPCASE(PUSH2)
+    if (!cx_->pushStack(cx_->getCellValueUnchecked(ip->a)))
+      goto error;
+    if (!cx_->pushStack(cx_->getCellValueUnchecked(ip->b)))
+      goto error;
+    NEXT();
+
+  OPCASE(PUSH)
+    if (!cx_->pushStack(cx_->getCellValueUnchecked(ip->a)))
+      goto error;
+    NEXT();
+
+  OPCASE(PUSH2_S)
+  {
+    cell_t value;
+    if (!cx_->getFrameValue(ip->a, &value) || !cx_->pushStack(value))
+      goto error;
+    if (!cx_->getFrameValue(ip->b, &value) || !cx_->pushStack(value))
+      goto error;
+    NEXT();
   }
-  int err = target->Validate();
-  if (err != SP_ERROR_NONE) {
-    cx_->ReportErrorNumber(err);
-    return false;
+
+  OPCASE(PUSH_S)
+  {
+    cell_t value;
+    if (!cx_->getFrameValue(ip->a, &value) || !cx_->pushStack(value))
+      goto error;
+    NEXT();
   }
 
-  // We don't interleave between the interpreter and JIT (yet).
-  cell_t value = 0;
-  if (!Run(cx_, target, &value))
-    return false;
+  // Pushing still has to check for running into the heap.
+  OPCASE(PUSH2_S_UNCHECKED)
+    if (!cx_->pushStack(cx_->getFrameValueUnchecked(ip->a)))
+      goto error;
+    if (!cx_->pushStack(cx_->getFrameValueUnchecked(ip->b)))
+      goto error;
+    NEXT();
+
+  OPCASE(PUSH_S_UNCHECKED)
+    if (!cx_->pushStack(cx_->getFrameValueUnchecked(ip->a)))
+      goto error;
+    NEXT();
+
+  OPCASE(PUSH2_ADR)
+    if (!cx_->pushStack(cx_->frm() + ip->a))
+      goto error;
+    if (!cx_->pushStack(cx_->frm() + ip->b))
+      goto error;
+    NEXT();
+
+  OPCASE(PUSH_ADR)
+    if (!cx_->pushStack(cx_->frm() + ip->a))
+      goto error;
+    NEXT();
+
+  OPCASE(POP_PRI)
+  {
+    cell_t value;
+    if (!cx_->popStack(&value))
+      goto error;
+    pri = value;
+    NEXT();
+  }
 
-  regs_.pri() = value;
-  return true;
-}
+  OPCASE(POP_ALT)
+  {
+    cell_t value;
+    if (!cx_->popStack(&value))
+      goto error;
+    alt = value;
+    NEXT();
+  }
 
-bool
-Interpreter::visitHEAP(cell_t amount)
-{
-  return cx_->heapAlloc(amount, &regs_.alt());
-}
+  OPCASE(POP_PRI_UNCHECKED)
+    pri = cx_->popStackUnchecked();
+    NEXT();
 
-bool
-Interpreter::visitLOAD_I()
-{
-  return cx_->getCellValue(regs_.pri(), &regs_.pri());
-}
+  OPCASE(POP_ALT_UNCHECKED)
+    alt = cx_->popStackUnchecked();
+    NEXT();
 
-bool
-Interpreter::visitSTOR_I()
-{
-  return cx_->setCellValue(regs_.alt(), regs_.pri());
-}
+  OPCASE(STACK)
+    if (!cx_->addStack(ip->a))
+      goto error;
+    NEXT();
 
-bool
-Interpreter::visitPUSH(PawnReg src)
-{
-  return cx_->pushStack(regs_[src]);
-}
+  OPCASE(HEAP)
+  {
+    cell_t value;
+    if (!cx_->heapAlloc(ip->a, &value))
+      goto error;
+    alt = value;
+    NEXT();
+  }
 
-bool
-Interpreter::visitPOP(PawnReg dest)
-{
-  return cx_->popStack(&regs_[dest]);
-}
+  OPCASE(RETN)
+    if (!cx_->popAmxFrame())
+      goto error;
+    if (frames_.length() == 1) {
+      return_value_ = pri;
+      return true;
+    }
 
-bool
-Interpreter::visitSYSREQ_C(uint32_t native_index)
-{
-  return invokeNative(native_index);
-}
+    // Resume the caller just past its CALL; the return value is already in
+    // pri.
+    frames_.pop();
+    method = frames_.back().method;
+    code = method->interp_code();
+    insns = code->insns();
+    ip = frames_.back().ip;
+    NEXT();
+
+  OPCASE(CALL)
+  {
+    CHECK_INTERRUPTS();
+
+    MethodInfo* target = resolveCall(code, ip);
+    if (!target)
+      goto error;
+
+#if defined(SP_HAS_JIT)
+    if (env_->IsJitEnabled()) {
+      bool called;
+      cell_t value;
+      if (!tryCallCompiled(target, &value, &called))
+        goto error;
+      if (called) {
+        pri = value;
+        NEXT();
+      }
+    }
+#endif
 
-bool
-Interpreter::visitSYSREQ_N(uint32_t native_index, uint32_t nparams)
-{
-  if (!cx_->pushStack(nparams))
-    return false;
-  if (!invokeNative(native_index))
-    return false;
+    frames_.back().ip = ip;
+    if (!frames_.append(InterpFrame(target))) {
+      cx_->ReportErrorNumber(SP_ERROR_OUT_OF_MEMORY);
+      goto error;
+    }
+    if (!cx_->pushAmxFrame())
+      goto error;
+
+    method = target;
+    code = method->interp_code();
+    THREAD(code);
+    insns = code->insns();
+    ip = insns;
+    DISPATCH();
+  }
 
-  cell_t ignore;
-  for (size_t i = 0; i < nparams + 1; i++) {
-    if (!cx_->popStack(&ignore))
-      return false;
+  OPCASE(JUMP)
+    BRANCH(ip->a);
+
+  OPCASE(JZER)
+    if (pri == 0)
+      BRANCH(ip->a);
+    NEXT();
+
+  OPCASE(JNZ)
+    if (pri != 0)
+      BRANCH(ip->a);
+    NEXT();
+
+  OPCASE(JEQ)
+    if (pri == alt)
+      BRANCH(ip->a);
+    NEXT();
+
+  OPCASE(JNEQ)
+    if (pri != alt)
+      BRANCH(ip->a);
+    NEXT();
+
+  OPCASE(JSLESS)
+    if (pri < alt)
+      BRANCH(ip->a);
+    NEXT();
+
+  OPCASE(JSLEQ)
+    if (pri <= alt)
+      BRANCH(ip->a);
+    NEXT();
+
+  OPCASE(JSGRTR)
+    if (pri > alt)
+      BRANCH(ip->a);
+    NEXT();
+
+  OPCASE(JSGEQ)
+    if (pri >= alt)
+      BRANCH(ip->a);
+    NEXT();
+
+  OPCASE(SHL)
+    pri <<= alt;
+    NEXT();
+
+  OPCASE(SHR)
+    pri = uint32_t(pri) >> uint32_t(alt);
+    NEXT();
+
+  OPCASE(SSHR)
+    pri >>= alt;
+    NEXT();
+
+  OPCASE(SHL_C_PRI)
+    // Only generated without the peephole optimizer.
+    pri <<= ip->a;
+    NEXT();
+
+  OPCASE(SHL_C_ALT)
+    alt <<= ip->a;
+    NEXT();
+
+  OPCASE(SMUL)
+    pri *= alt;
+    NEXT();
+
+  OPCASE(SDIV)
+  {
+    cell_t quotient, remainder;
+    if (!DivideCells(cx_, pri, alt, &quotient, &remainder))
+      goto error;
+    pri = quotient;
+    alt = remainder;
+    NEXT();
   }
-  return true;
-}
 
-bool
-Interpreter::visitZERO(PawnReg dest)
-{
-  regs_[dest] = 0;
-  return true;
-}
+  OPCASE(SDIV_ALT)
+  {
+    cell_t quotient, remainder;
+    if (!DivideCells(cx_, alt, pri, &quotient, &remainder))
+      goto error;
+    pri = quotient;
+    alt = remainder;
+    NEXT();
+  }
 
-bool
-Interpreter::visitZERO(cell_t address)
-{
-  return cx_->setCellValue(address, 0);
-}
+  OPCASE(ADD)
+    pri += alt;
+    NEXT();
 
-bool
-Interpreter::visitZERO_S(cell_t offset)
-{
-  return cx_->setFrameValue(offset, 0);
-}
+  OPCASE(SUB)
+    pri -= alt;
+    NEXT();
 
-bool
-Interpreter::visitSTACK(cell_t amount)
-{
-  return cx_->addStack(amount);
-}
+  OPCASE(SUB_ALT)
+    pri = alt - pri;
+    NEXT();
 
-bool
-Interpreter::visitPUSH_S(const cell_t* offsets, size_t nvals)
-{
-  for (size_t i = 0; i < nvals; i++) {
-    cell_t value;
-    if (!cx_->getFrameValue(offsets[i], &value))
-      return false;
-    if (!cx_->pushStack(value))
-      return false;
+  OPCASE(AND)
+    pri &= alt;
+    NEXT();
+
+  OPCASE(OR)
+    pri |= alt;
+    NEXT();
+
+  OPCASE(XOR)
+    pri ^= alt;
+    NEXT();
+
+  OPCASE(NOT)
+    pri = pri ? 0 : 1;
+    NEXT();
+
+  OPCASE(NEG)
+    pri = -pri;
+    NEXT();
+
+  OPCASE(INVERT)
+    pri = ~pri;
+    NEXT();
+
+  OPCASE(ADD_C)
+    pri += ip->a;
+    NEXT();
+
+  OPCASE(SMUL_C)
+    pri *= ip->a;
+    NEXT();
+
+  OPCASE(ZERO_PRI)
+    pri = 0;
+    NEXT();
+
+  OPCASE(ZERO_ALT)
+    alt = 0;
+    NEXT();
+
+  OPCASE(ZERO)
+    cx_->setCellValueUnchecked(ip->a, 0);
+    NEXT();
+
+  OPCASE(ZERO_S)
+    if (!cx_->setFrameValue(ip->a, 0))
+      goto error;
+    NEXT();
+
+  OPCASE(ZERO_S_UNCHECKED)
+    cx_->setFrameValueUnchecked(ip->a, 0);
+    NEXT();
+
+  OPCASE(EQ)
+    pri = (pri == alt) ? 1 : 0;
+    NEXT();
+
+  OPCASE(NEQ)
+    pri = (pri != alt) ? 1 : 0;
+    NEXT();
+
+  OPCASE(SLESS)
+    pri = (pri < alt) ? 1 : 0;
+    NEXT();
+
+  OPCASE(SLEQ)
+    pri = (pri <= alt) ? 1 : 0;
+    NEXT();
+
+  OPCASE(SGRTR)
+    pri = (pri > alt) ? 1 : 0;
+    NEXT();
+
+  OPCASE(SGEQ)
+    pri = (pri >= alt) ? 1 : 0;
+    NEXT();
+
+  OPCASE(EQ_C_PRI)
+    pri = (pri == ip->a) ? 1 : 0;
+    NEXT();
+
+  OPCASE(EQ_C_ALT)
+    pri = (alt == ip->a) ? 1 : 0;
+    NEXT();
+
+  OPCASE(INC_PRI)
+    pri += 1;
+    NEXT();
+
+  OPCASE(INC_ALT)
+    alt += 1;
+    NEXT();
+
+  OPCASE(INC)
+    cx_->setCellValueUnchecked(ip->a, cx_->getCellValueUnchecked(ip->a) + 1);
+    NEXT();
+
+  OPCASE(INC_S)
+  {
+    cell_t* addr = cx_->throwIfBadAddress(cx_->frm() + ip->a);
+    if (!addr)
+      goto error;
+    *addr += 1;
+    NEXT();
   }
-  return true;
-}
 
-bool
-Interpreter::visitCONST(PawnReg dest, cell_t imm)
-{
-  regs_[dest] = imm;
-  return true;
-}
+  OPCASE(INC_S_UNCHECKED)
+    cx_->setFrameValueUnchecked(ip->a, cx_->getFrameValueUnchecked(ip->a) + 1);
+    NEXT();
+
+  OPCASE(INC_I)
+  {
+    cell_t* addr = cx_->throwIfBadAddress(pri);
+    if (!addr)
+      goto error;
+    *addr += 1;
+    NEXT();
+  }
 
-bool
-Interpreter::visitCONST(cell_t address, cell_t value)
-{
-  return cx_->setCellValue(address, value);
-}
+  OPCASE(DEC_PRI)
+    pri -= 1;
+    NEXT();
+
+  OPCASE(DEC_ALT)
+    alt -= 1;
+    NEXT();
+
+  OPCASE(DEC)
+    cx_->setCellValueUnchecked(ip->a, cx_->getCellValueUnchecked(ip->a) - 1);
+    NEXT();
+
+  OPCASE(DEC_S)
+  {
+    cell_t* addr = cx_->throwIfBadAddress(cx_->frm() + ip->a);
+    if (!addr)
+      goto error;
+    *addr -= 1;
+    NEXT();
+  }
 
-bool
-Interpreter::visitCONST_S(cell_t offset, cell_t value)
-{
-  return cx_->setFrameValue(offset, value);
-}
+  OPCASE(DEC_S_UNCHECKED)
+    cx_->setFrameValueUnchecked(ip->a, cx_->getFrameValueUnchecked(ip->a) - 1);
+    NEXT();
+
+  OPCASE(DEC_I)
+  {
+    cell_t* addr = cx_->throwIfBadAddress(pri);
+    if (!addr)
+      goto error;
+    *addr -= 1;
+    NEXT();
+  }
 
-bool
-Interpreter::visitLOAD_S(PawnReg dest, cell_t srcoffs)
-{
-  return cx_->getFrameValue(srcoffs, &regs_[dest]);
-}
+  OPCASE(MOVS)
+  {
+    uint32_t amount = ip->a;
+    cell_t* src = cx_->acquireAddrRange(pri, amount);
+    if (!src)
+      goto error;
+    cell_t* dest = cx_->acquireAddrRange(alt, amount);
+    if (!dest)
+      goto error;
+    memmove(dest, src, amount);
+    NEXT();
+  }
 
-bool
-Interpreter::visitSTOR_S(cell_t offset, PawnReg src)
-{
-  return cx_->setFrameValue(offset, regs_[src]);
-}
+  OPCASE(FILL)
+  {
+    uint32_t amount = ip->a;
+    cell_t* dest = cx_->acquireAddrRange(alt, amount);
+    if (!dest)
+      goto error;
+    for (size_t i = 0; i < (amount / sizeof(cell_t)); i++)
+      dest[i] = pri;
+    NEXT();
+  }
 
-bool
-Interpreter::visitJUMP(cell_t offset)
-{
-  if (offset < reader_.cip_offset()) {
-    // Check the watchdog timer if we're looping backwards.
-    if (!Environment::get()->watchdog()->HandleInterrupt()) {
-      cx_->ReportErrorNumber(SP_ERROR_TIMEOUT);
-      return false;
+  OPCASE(BOUNDS)
+    if (size_t(pri) > size_t(uint32_t(ip->a))) {
+      ReportOutOfBoundsError(pri, ip->a);
+      goto error;
     }
+    NEXT();
+
+  OPCASE(SYSREQ_C)
+  {
+    cell_t value;
+    if (!invokeNative(ip->a, &value))
+      goto error;
+    pri = value;
+    NEXT();
   }
 
-  reader_.jump(offset);
-  return true;
-}
+  OPCASE(SYSREQ_N)
+  {
+    cell_t nparams = ip->b;
+    if (!cx_->pushStack(nparams))
+      goto error;
 
-bool
-Interpreter::visitJcmp(CompareOp op, cell_t offset)
-{
-  bool jump = false;
-  switch (op) {
-  case CompareOp::Zero:
-    jump = regs_.pri() == 0;
-    break;
-  case CompareOp::NotZero:
-    jump = regs_.pri() != 0;
-    break;
-  case CompareOp::Eq:
-    jump = regs_.pri() == regs_.alt();
-    break;
-  case CompareOp::Neq:
-    jump = regs_.pri() != regs_.alt();
-    break;
-  case CompareOp::Sless:
-    jump = regs_.pri() < regs_.alt();
-    break;
-  case CompareOp::Sleq:
-    jump = regs_.pri() <= regs_.alt();
-    break;
-  case CompareOp::Sgrtr:
-    jump = regs_.pri() > regs_.alt();
-    break;
-  case CompareOp::Sgeq:
-    jump = regs_.pri() >= regs_.alt();
-    break;
-  default:
-    assert(false);
+    cell_t value;
+    if (!invokeNative(ip->a, &value))
+      goto error;
+    pri = value;
+
+    if (!cx_->addStack((nparams + 1) * sizeof(cell_t)))
+      goto error;
+    NEXT();
   }
 
-  if (jump) {
-    if (offset < reader_.cip_offset()) {
-      // Check the watchdog timer if we're looping backwards.
-      if (!Environment::get()->watchdog()->HandleInterrupt()) {
-        cx_->ReportErrorNumber(SP_ERROR_TIMEOUT);
-        return false;
-      }
-    }
+  OPCASE(INTRINSIC_N)
+  {
+    // Intrinsics are pure, so they skip the native call bookkeeping.
+    cell_t nparams = ip->b;
+    if (!cx_->pushStack(nparams))
+      goto error;
+
+    const cell_t* params = reinterpret_cast<const cell_t*>(cx_->memory() + cx_->sp());
+    pri = rt_->GetIntrinsic(ip->a)->fallback(params);
 
-    reader_.jump(offset);
+    if (!cx_->addStack((nparams + 1) * sizeof(cell_t)))
+      goto error;
+    NEXT();
   }
 
-  return true;
-}
+  OPCASE(SWAP_PRI)
+  {
+    cell_t value;
+    if (!cx_->popStack(&value))
+      goto error;
+    if (!cx_->pushStack(pri))
+      goto error;
+    pri = value;
+    NEXT();
+  }
 
-bool
-Interpreter::visitADD_C(cell_t value)
-{
-  regs_.pri() += value;
-  return true;
-}
+  OPCASE(SWAP_ALT)
+  {
+    cell_t value;
+    if (!cx_->popStack(&value))
+      goto error;
+    if (!cx_->pushStack(alt))
+      goto error;
+    alt = value;
+    NEXT();
+  }
 
-bool
-Interpreter::visitSMUL_C(cell_t value)
-{
-  regs_.pri() *= value;
-  return true;
-}
+  OPCASE(LOAD_BOTH)
+    pri = cx_->getCellValueUnchecked(ip->a);
+    alt = cx_->getCellValueUnchecked(ip->b);
+    NEXT();
 
-bool
-Interpreter::visitADD()
-{
-  regs_.pri() += regs_.alt();
-  return true;
-}
+  OPCASE(LOAD_S_BOTH)
+  {
+    cell_t value;
+    if (!cx_->getFrameValue(ip->a, &value))
+      goto error;
+    pri = value;
+    if (!cx_->getFrameValue(ip->b, &value))
+      goto error;
+    alt = value;
+    NEXT();
+  }
 
-bool
-Interpreter::visitNOT()
-{
-  regs_.pri() = regs_.pri() ? 0 : 1;
-  return true;
-}
+  OPCASE(LOAD_S_BOTH_UNCHECKED)
+    pri = cx_->getFrameValueUnchecked(ip->a);
+    alt = cx_->getFrameValueUnchecked(ip->b);
+    NEXT();
+
+  OPCASE(CONST)
+    cx_->setCellValueUnchecked(ip->a, ip->b);
+    NEXT();
+
+  OPCASE(CONST_S)
+    if (!cx_->setFrameValue(ip->a, ip->b))
+      goto error;
+    NEXT();
+
+  OPCASE(CONST_S_UNCHECKED)
+    cx_->setFrameValueUnchecked(ip->a, ip->b);
+    NEXT();
+
+  OPCASE(TRACKER_PUSH_C)
+  {
+    int err = cx_->pushTracker(ip->a);
+    if (err != SP_ERROR_NONE) {
+      cx_->ReportErrorNumber(err);
+      goto error;
+    }
+    NEXT();
+  }
 
-bool
-Interpreter::visitNEG()
-{
-  regs_.pri() = -regs_.pri();
-  return true;
-}
+  OPCASE(TRACKER_POP_SETHEAP)
+  {
+    int err = cx_->popTrackerAndSetHeap();
+    if (err != SP_ERROR_NONE) {
+      cx_->ReportErrorNumber(err);
+      goto error;
+    }
+    NEXT();
+  }
 
-bool
-Interpreter::visitINVERT()
-{
-  regs_.pri() = ~regs_.pri();
-  return true;
-}
+  OPCASE(GENARRAY)
+    if (!generateArray(ip->a, false))
+      goto error;
+    NEXT();
 
-bool
-Interpreter::visitINC(PawnReg dest)
-{
-  regs_.pri() += 1;
-  return true;
-}
+  OPCASE(GENARRAY_Z)
+    if (!generateArray(ip->a, true))
+      goto error;
+    NEXT();
 
-bool
-Interpreter::visitINC(cell_t address)
-{
-  cell_t* addr = cx_->throwIfBadAddress(address);
-  if (!addr)
-    return false;
-  *addr += 1;
-  return true;
-}
+  OPCASE(STRADJUST_PRI)
+    pri = (pri + 4) >> 2;
+    NEXT();
 
-bool
-Interpreter::visitINC_S(cell_t offset)
-{
-  cell_t value;
-  if (!cx_->getFrameValue(offset, &value))
-    return false;
-  return cx_->setFrameValue(offset, value + 1);
-}
+  OPCASE(FABS)
+  {
+    cell_t value;
+    if (!cx_->popStack(&value))
+      goto error;
+    pri = value & 0x7fffffff;
+    NEXT();
+  }
 
-bool
-Interpreter::visitINC_I()
-{
-  cell_t* addr = cx_->throwIfBadAddress(regs_.pri());
-  if (!addr)
-    return false;
-  *addr += 1;
-  return true;
-}
-
-bool
-Interpreter::visitDEC(PawnReg dest)
-{
-  regs_.pri() -= 1;
-  return true;
-}
-
-bool
-Interpreter::visitDEC(cell_t address)
-{
-  cell_t* addr = cx_->throwIfBadAddress(address);
-  if (!addr)
-    return false;
-  *addr -= 1;
-  return true;
-}
-
-bool
-Interpreter::visitDEC_S(cell_t offset)
-{
-  cell_t value;
-  if (!cx_->getFrameValue(offset, &value))
-    return false;
-  return cx_->setFrameValue(offset, value - 1);
-}
-
-bool
-Interpreter::visitDEC_I()
-{
-  cell_t* addr = cx_->throwIfBadAddress(regs_.pri());
-  if (!addr)
-    return false;
-  *addr -= 1;
-  return true;
-}
-
-bool
-Interpreter::visitLOAD_BOTH(cell_t addressForPri, cell_t addressForAlt)
-{
-  if (!cx_->getCellValue(addressForPri, &regs_.pri()))
-    return false;
-  if (!cx_->getCellValue(addressForAlt, &regs_.alt()))
-    return false;
-  return true;
-}
-
-bool
-Interpreter::visitLOAD_S_BOTH(cell_t offsetForPri, cell_t offsetForAlt)
-{
-  if (!cx_->getFrameValue(offsetForPri, &regs_.pri()))
-    return false;
-  if (!cx_->getFrameValue(offsetForAlt, &regs_.alt()))
-    return false;
-  return true;
-}
-
-bool
-Interpreter::visitAND()
-{
-  regs_.pri() &= regs_.alt();
-  return true;
-}
-
-bool
-Interpreter::visitOR()
-{
-  regs_.pri() |= regs_.alt();
-  return true;
-}
-
-bool
-Interpreter::visitXOR()
-{
-  regs_.pri() ^= regs_.alt();
-  return true;
-}
-
-bool
-Interpreter::visitSUB()
-{
-  regs_.pri() -= regs_.alt();
-  return true;
-}
-
-bool
-Interpreter::visitSUB_ALT()
-{
-  regs_.pri() = regs_.alt() - regs_.pri();
-  return true;
-}
-
-bool
-Interpreter::visitSMUL()
-{
-  regs_.pri() *= regs_.alt();
-  return true;
-}
-
-bool
-Interpreter::visitSDIV(PawnReg dest)
-{
-  PawnReg dividendReg = dest;
-  PawnReg divisorReg = (dest == PawnReg::Pri) ? PawnReg::Alt : PawnReg::Pri;
-
-  cell_t divisor = regs_[divisorReg];
-  cell_t dividend = regs_[dividendReg];
-
-  if (divisor == 0) {
-    cx_->ReportErrorNumber(SP_ERROR_DIVIDE_BY_ZERO);
-    return false;
+  OPCASE(FLOAT)
+  {
+    cell_t value;
+    if (!cx_->popStack(&value))
+      goto error;
+    pri = sp_ftoc(float(value));
+    NEXT();
   }
 
-  // -INT_MIN / -1 is an overflow.
-  if (divisor == -1 && dividend == cell_t(0x80000000)) {
-    cx_->ReportErrorNumber(SP_ERROR_INTEGER_OVERFLOW);
-    return false;
+  OPCASE(FLOATADD)
+  {
+    float left, right;
+    if (!PopFloats(cx_, &left, &right))
+      goto error;
+    pri = sp_ftoc(left + right);
+    NEXT();
   }
 
-  regs_.pri() = dividend / divisor;
-  regs_.alt() = dividend % divisor;
-  return true;
-}
+  OPCASE(FLOATSUB)
+  {
+    float left, right;
+    if (!PopFloats(cx_, &left, &right))
+      goto error;
+    pri = sp_ftoc(left - right);
+    NEXT();
+  }
 
-bool
-Interpreter::visitSHL()
-{
-  regs_.pri() <<= regs_.alt();
-  return true;
-}
+  OPCASE(FLOATMUL)
+  {
+    float left, right;
+    if (!PopFloats(cx_, &left, &right))
+      goto error;
+    pri = sp_ftoc(left * right);
+    NEXT();
+  }
 
-bool
-Interpreter::visitSHR()
-{
-  uint32_t left = regs_.pri();
-  uint32_t right = regs_.alt();
-  regs_.pri() = left >> right;
-  return true;
-}
+  OPCASE(FLOATDIV)
+  {
+    float left, right;
+    if (!PopFloats(cx_, &left, &right))
+      goto error;
+    pri = sp_ftoc(left / right);
+    NEXT();
+  }
 
-bool
-Interpreter::visitSSHR()
-{
-  regs_.pri() >>= regs_.alt();
-  return true;
-}
+  OPCASE(RND_TO_NEAREST)
+  {
+    cell_t value;
+    if (!cx_->popStack(&value))
+      goto error;
 
-bool
-Interpreter::visitSHL_C(PawnReg dest, cell_t amount)
-{
-  // Only generated without the peephole optimizer.
-  regs_[dest] <<= amount;
-  return true;
-}
+    int oldmethod = fegetround();
+    fesetround(FE_TONEAREST);
 
-bool
-Interpreter::visitEQ_C(PawnReg src, cell_t value)
-{
-  regs_.pri() = (regs_[src] == value) ? 1 : 0;
-  return true;
-}
+    float f = sp_ctof(value);
+    pri = lrintf(f);
 
-bool
-Interpreter::visitCompareOp(CompareOp op)
-{
-  switch (op) {
-  case CompareOp::Sgrtr:
-    regs_.pri() = (regs_.pri() > regs_.alt()) ? 1 : 0;
-    break;
-  case CompareOp::Sgeq:
-    regs_.pri() = (regs_.pri() >= regs_.alt()) ? 1 : 0;
-    break;
-  case CompareOp::Sleq:
-    regs_.pri() = (regs_.pri() <= regs_.alt()) ? 1 : 0;
-    break;
-  case CompareOp::Sless:
-    regs_.pri() = (regs_.pri() < regs_.alt()) ? 1 : 0;
-    break;
-  case CompareOp::Eq:
-    regs_.pri() = (regs_.pri() == regs_.alt()) ? 1 : 0;
-    break;
-  case CompareOp::Neq:
-    regs_.pri() = (regs_.pri() != regs_.alt()) ? 1 : 0;
-    break;
-  default:
-    assert(false);
+    fesetround(oldmethod);
+    NEXT();
   }
-  return true;
-}
 
-bool
-Interpreter::visitADDR(PawnReg dest, cell_t offset)
-{
-  regs_[dest] = cx_->frm() + offset;
-  return true;
-}
+  OPCASE(RND_TO_FLOOR)
+  {
+    cell_t value;
+    if (!cx_->popStack(&value))
+      goto error;
 
-bool
-Interpreter::visitMOVS(uint32_t amount)
-{
-  cell_t* src = cx_->acquireAddrRange(regs_.pri(), amount);
-  if (!src)
-    return false;
-  cell_t* dest = cx_->acquireAddrRange(regs_.alt(), amount);
-  if (!dest)
-    return false;
-  memmove(dest, src, amount);
-  return true;
-}
+    float f = sp_ctof(value);
+    pri = int(floor(f));
+    NEXT();
+  }
 
-bool
-Interpreter::visitFILL(uint32_t amount)
-{
-  cell_t* dest = cx_->acquireAddrRange(regs_.alt(), amount);
-  if (!dest)
-    return false;
-  for (size_t i = 0; i < (amount / sizeof(cell_t)); i++)
-    dest[i] = regs_.pri();
-  return true;
-}
+  OPCASE(RND_TO_CEIL)
+  {
+    cell_t value;
+    if (!cx_->popStack(&value))
+      goto error;
 
-bool
-Interpreter::visitSWITCH(cell_t defaultOffset, const CaseTableEntry* cases, size_t ncases)
-{
-  for (size_t i = 0; i < ncases; i++) {
-    if (cases[i].value == regs_.pri()) {
-      reader_.jump(cases[i].address);
-      return true;
-    }
+    float f = sp_ctof(value);
+    pri = int(ceil(f));
+    NEXT();
   }
 
-  reader_.jump(defaultOffset);
-  return true;
-}
-
-bool
-Interpreter::visitBOUNDS(uint32_t limit)
-{
-  if (size_t(regs_.pri()) > limit) {
-    ReportOutOfBoundsError(regs_.pri(), limit);
-    return false;
+  OPCASE(RND_TO_ZERO)
+  {
+    cell_t value;
+    if (!cx_->popStack(&value))
+      goto error;
+
+    float f = sp_ctof(value);
+    if (f >= 0.0f)
+      pri = int(floor(f));
+    else
+      pri = int(ceil(f));
+    NEXT();
   }
-  return true;
-}
 
-bool
-Interpreter::visitIDXADDR()
-{
-  regs_.pri() = regs_.alt() + (regs_.pri() * sizeof(cell_t));
-  return true;
-}
+  OPCASE(FLOATCMP)
+  {
+    float left, right;
+    if (!PopFloats(cx_, &left, &right))
+      goto error;
+
+    if (left > right)
+      pri = 1;
+    else if (left < right)
+      pri = -1;
+    else
+      pri = 0;
+    NEXT();
+  }
 
-bool
-Interpreter::visitLIDX()
-{
-  cell_t address = regs_.alt() + (regs_.pri() * sizeof(cell_t));
-  return cx_->getCellValue(address, &regs_.pri());
-}
+  // Comparisons involving NaN are always false.
+#define FLOAT_CMP_CASE(name, op)                                \
+  OPCASE(name)                                                  \
+  {                                                             \
+    float left, right;                                          \
+    if (!PopFloats(cx_, &left, &right))                         \
+      goto error;                                               \
+    if (ke::IsNaN(left) || ke::IsNaN(right))                    \
+      pri = 0;                                                  \
+    else                                                        \
+      pri = (left op right) ? 1 : 0;                            \
+    NEXT();                                                     \
+  }
 
-bool
-Interpreter::visitLREF_S(PawnReg dest, cell_t srcoffs)
-{
-  cell_t address;
-  if (!cx_->getFrameValue(srcoffs, &address))
-    return false;
-  return cx_->getCellValue(address, &regs_[dest]);
-}
+  FLOAT_CMP_CASE(FLOAT_GT, >)
+  FLOAT_CMP_CASE(FLOAT_GE, >=)
+  FLOAT_CMP_CASE(FLOAT_LE, <=)
+  FLOAT_CMP_CASE(FLOAT_LT, <)
+  FLOAT_CMP_CASE(FLOAT_EQ, ==)
+  FLOAT_CMP_CASE(FLOAT_NE, !=)
 
-bool
-Interpreter::visitSREF_S(cell_t destoffs, PawnReg src)
-{
-  cell_t address;
-  if (!cx_->getFrameValue(destoffs, &address))
-    return false;
-  return cx_->setCellValue(address, regs_[src]);
-}
+#undef FLOAT_CMP_CASE
 
-bool
-Interpreter::visitLODB_I(cell_t width)
-{
-  if (!cx_->getCellValue(regs_.pri(), &regs_.pri()))
-    return false;
+  OPCASE(FLOAT_NOT)
+  {
+    cell_t value;
+    if (!cx_->popStack(&value))
+      goto error;
+
+    float f = sp_ctof(value);
+    if (ke::IsNaN(f))
+      pri = 1;
+    else
+      pri = f ? 0 : 1;
+    NEXT();
+  }
 
-  switch (width) {
-  case 1:
-    regs_.pri() &= 0xff;
-    break;
-  case 2:
-    regs_.pri() &= 0xffff;
-    break;
-  case 4:
-    break;
-  default:
-    assert(false);
+  OPCASE(SWITCH)
+  {
+    const InterpSwitch& table = code->switchAt(ip->a);
+    const InterpCase* cases = code->cases() + table.first_case;
+
+    uint32_t target = table.default_target;
+    size_t lo = 0;
+    size_t hi = table.ncases;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (cases[mid].value < pri) {
+        lo = mid + 1;
+      } else if (cases[mid].value > pri) {
+        hi = mid;
+      } else {
+        target = cases[mid].target;
+        break;
+      }
+    }
+    JUMP_TO(target);
   }
-  return true;
-}
 
-bool
-Interpreter::visitSTRB_I(cell_t width)
-{
-  cell_t* addr = cx_->throwIfBadAddress(regs_.alt());
-  if (!addr)
-    return false;
+  // Superinstructions (see InterpCodeBuilder::fuse). The instructions they
+  // stand for follow them in the stream, so operands are read from there.
+  // Only proven stack accesses are fused, so these are all unchecked; |ip|
+  // is moved along to any step that can still fail.
+#define LOAD_S_CONST_JCMP_CASE(name, cond)                      \
+  OPCASE(name)                                                  \
+  {                                                             \
+    pri = cx_->getFrameValueUnchecked(ip[0].a);                 \
+    alt = ip[1].a;                                              \
+    ip += 2;                                                    \
+    if (cond)                                                   \
+      BRANCH(ip->a);                                            \
+    NEXT();                                                     \
+  }
 
-  switch (width) {
-  case 1:
-    *reinterpret_cast<uint8_t*>(addr) = uint8_t(regs_.pri());
-    break;
-  case 2:
-    *reinterpret_cast<uint16_t*>(addr) = uint16_t(regs_.pri());
-    break;
-  case 4:
-    *addr = regs_.pri();
-    break;
+  LOAD_S_CONST_JCMP_CASE(LOAD_S_CONST_JEQ, pri == alt)
+  LOAD_S_CONST_JCMP_CASE(LOAD_S_CONST_JNEQ, pri != alt)
+  LOAD_S_CONST_JCMP_CASE(LOAD_S_CONST_JSLESS, pri < alt)
+  LOAD_S_CONST_JCMP_CASE(LOAD_S_CONST_JSLEQ, pri <= alt)
+  LOAD_S_CONST_JCMP_CASE(LOAD_S_CONST_JSGRTR, pri > alt)
+  LOAD_S_CONST_JCMP_CASE(LOAD_S_CONST_JSGEQ, pri >= alt)
+
+#undef LOAD_S_CONST_JCMP_CASE
+
+  OPCASE(LOAD_S_ADD_C_STOR_S)
+    pri = cx_->getFrameValueUnchecked(ip[0].a) + ip[1].a;
+    ip += 2;
+    cx_->setFrameValueUnchecked(ip->a, pri);
+    NEXT();
+
+  OPCASE(LOAD_S_BOUNDS_IDXADDR)
+    pri = cx_->getFrameValueUnchecked(ip->a);
+    ip++;
+    if (size_t(pri) > size_t(uint32_t(ip->a))) {
+      ReportOutOfBoundsError(pri, ip->a);
+      goto error;
+    }
+    ip++;
+    pri = alt + (pri * sizeof(cell_t));
+    NEXT();
+
+  OPCASE(ADD_STOR_S)
+    pri += alt;
+    ip++;
+    cx_->setFrameValueUnchecked(ip->a, pri);
+    NEXT();
+
+  OPCASE(STOR_S_JUMP)
+    cx_->setFrameValueUnchecked(ip->a, pri);
+    ip++;
+    BRANCH(ip->a);
+
+  OPCASE(HALT)
+  OPCASE(ENDPROC)
+    // We don't support HALT. It's included in the bytestream by default, but
+    // it must be unreachable. Likewise, control must never fall off the end
+    // of a method.
+    cx_->ReportErrorNumber(SP_ERROR_INVALID_INSTRUCTION);
+    goto error;
+
+#if !defined(INTERP_USE_COMPUTED_GOTO)
   default:
     assert(false);
+    cx_->ReportErrorNumber(SP_ERROR_INVALID_INSTRUCTION);
+    goto error;
+#endif
   }
-  return true;
-}
-
-bool
-Interpreter::visitLOAD(PawnReg dest, cell_t srcaddr)
-{
-  return cx_->getCellValue(srcaddr, &regs_[dest]);
-}
 
-bool
-Interpreter::visitSTOR(cell_t address, PawnReg src)
-{
-  return cx_->setCellValue(address, regs_[src]);
-}
+#if defined(INTERP_USE_COMPUTED_GOTO)
+# define _(name)                                                \
+ profile_##name:                                                \
+  recordOpcode(profiler, method, code, ip);                     \
+  goto op_##name;
+  INTERP_OPCODE_LIST(_)
+# undef _
+#endif
+
+#if defined(SP_HAS_JIT)
+ osr:
+  {
+    // A loop in the current method is hot. If the JIT has an entry point for
+    // its header, the rest of the method runs there instead (on-stack
+    // replacement).
+    CompiledFunction* fn;
+    void* entry;
+    if (!findOsrEntry(method, code->cipOf(osr_target), &fn, &entry))
+      goto error;
+    if (!entry) {
+      ip = osr_target;
+      DISPATCH();
+    }
 
-bool
-Interpreter::visitMOVE(PawnReg reg)
-{
-  PawnReg other = (reg == PawnReg::Pri) ? PawnReg::Alt : PawnReg::Pri;
-  regs_[reg] = regs_[other];
-  return true;
-}
+    // The frame is already on the pcode stack; the entry picks up the
+    // registers from there too.
+    if (!cx_->pushStack(alt) || !cx_->pushStack(pri))
+      goto error;
+
+    // From here on the JIT owns this frame, so make the caller current again.
+    // The compiled code returns to it just as RETN would.
+    frames_.pop();
+    if (!frames_.empty()) {
+      method = frames_.back().method;
+      code = method->interp_code();
+      insns = code->insns();
+      ip = frames_.back().ip;
+    }
 
-bool
-Interpreter::visitXCHG()
-{
-  ke::Swap(regs_.pri(), regs_.alt());
-  return true;
-}
+    cell_t value;
+    if (!env_->InvokeCompiled(cx_, fn, entry, &value))
+      goto error;
 
-bool
-Interpreter::visitSWAP(PawnReg dest)
-{
-  cell_t temp = regs_[dest];
-  if (!cx_->popStack(&regs_[dest]))
-    return false;
-  return cx_->pushStack(temp);
-}
+    if (frames_.empty()) {
+      return_value_ = value;
+      return true;
+    }
+    pri = value;
+    NEXT();
+  }
+#endif
 
-bool
-Interpreter::visitFABS()
-{
-  if (!cx_->popStack(&regs_.pri()))
-    return false;
-  regs_.pri() &= 0x7fffffff;
-  return true;
-}
+#undef BRANCH
+#undef LOOP_EDGE
+#undef JUMP_TO
+#undef NEXT
+#undef THREAD
+#undef DISPATCH
+#undef OPCASE
 
-bool
-Interpreter::visitFLOAT()
-{
-  cell_t value;
-  if (!cx_->popStack(&value))
-    return false;
-  regs_.pri() = sp_ftoc(float(value));
-  return true;
+ error:
+  return false;
 }
 
-bool
-Interpreter::visitFLOATADD()
+// Count the pcode instruction |insn| was decoded from. Packed pushes are
+// decoded to several instructions, so only the first of them counts.
+void
+Interpreter::recordOpcode(OpcodeProfiler* profiler, MethodInfo* method, InterpCode* code,
+                          const InterpInsn* insn)
 {
-  cell_t leftVal, rightVal;
-  if (!cx_->popStack(&leftVal) || !cx_->popStack(&rightVal))
-    return false;
-  float left = sp_ctof(leftVal);
-  float right = sp_ctof(rightVal);
-  regs_.pri() = sp_ftoc(left + right);
-  return true;
-}
+  cell_t cip = code->cipOf(insn);
+  if (insn != code->insns() && code->cipOf(insn - 1) == cip)
+    return;
 
-bool
-Interpreter::visitFLOATSUB()
-{
-  cell_t leftVal, rightVal;
-  if (!cx_->popStack(&leftVal) || !cx_->popStack(&rightVal))
-    return false;
-  float left = sp_ctof(leftVal);
-  float right = sp_ctof(rightVal);
-  regs_.pri() = sp_ftoc(left - right);
-  return true;
-}
+  // The instruction past the end of the method isn't part of it.
+  if (size_t(cip) >= rt_->code().length)
+    return;
+  cell_t op = *reinterpret_cast<const cell_t*>(rt_->code().bytes + cip);
+  if (op == OP_PROC || op == OP_ENDPROC)
+    return;
 
-bool
-Interpreter::visitFLOATMUL()
-{
-  cell_t leftVal, rightVal;
-  if (!cx_->popStack(&leftVal) || !cx_->popStack(&rightVal))
-    return false;
-  float left = sp_ctof(leftVal);
-  float right = sp_ctof(rightVal);
-  regs_.pri() = sp_ftoc(left * right);
-  return true;
+  profiler->record(profiler->countsFor(rt_, method), OPCODE(op));
 }
 
 bool
-Interpreter::visitFLOATDIV()
+Interpreter::invokeNative(uint32_t native_index, cell_t* result)
 {
-  cell_t leftVal, rightVal;
-  if (!cx_->popStack(&leftVal) || !cx_->popStack(&rightVal))
-    return false;
-  float left = sp_ctof(leftVal);
-  float right = sp_ctof(rightVal);
-  regs_.pri() = sp_ftoc(left / right);
-  return true;
-}
+  NativeEntry* native = rt_->NativeAt(native_index);
 
-bool
-Interpreter::visitRND_TO_NEAREST()
-{
-  cell_t value;
-  if (!cx_->popStack(&value))
-    return false;
+  ivk_->enterNativeCall(native_index);
+  if (native->status == SP_NATIVE_BOUND) {
+    ke::SaveAndSet<cell_t> saveSp(cx_->addressOfSp(), cx_->sp());
+    ke::SaveAndSet<cell_t> saveHp(cx_->addressOfHp(), cx_->hp());
 
-  int oldmethod = fegetround();
-  fesetround(FE_TONEAREST);
+    const cell_t* params = reinterpret_cast<const cell_t*>(cx_->memory() + cx_->sp());
 
-  float f = sp_ctof(value);
-  regs_.pri() = lrintf(f);
+    *result = native->legacy_fn(cx_, params);
+  } else {
+    cx_->ReportErrorNumber(SP_ERROR_INVALID_NATIVE);
+  }
+  ivk_->leaveNativeCall();
 
-  fesetround(oldmethod);
-  return true;
+  return !env_->hasPendingException();
 }
 
-bool
-Interpreter::visitRND_TO_FLOOR()
+// Find the method a CALL instruction targets. The first time a call site
+// runs, the target is looked up, validated, and decoded; after that it is
+// read straight from the caller's call site cache. Methods are owned by the
+// runtime, so the cache can hold weak references.
+MethodInfo*
+Interpreter::resolveCall(InterpCode* code, const InterpInsn* insn)
 {
-  cell_t value;
-  if (!cx_->popStack(&value))
-    return false;
+  if (MethodInfo* target = code->callTarget(insn->b))
+    return target;
 
-  float f = sp_ctof(value);
-  regs_.pri() = int(floor(f));
-  return true;
-}
-
-bool
-Interpreter::visitRND_TO_CEIL()
-{
-  cell_t value;
-  if (!cx_->popStack(&value))
-    return false;
+  RefPtr<MethodInfo> target = rt_->AcquireMethod(insn->a);
+  if (!target) {
+    cx_->ReportErrorNumber(SP_ERROR_INVALID_ADDRESS);
+    return nullptr;
+  }
+  int err = target->Validate();
+  if (err != SP_ERROR_NONE) {
+    cx_->ReportErrorNumber(err);
+    return nullptr;
+  }
+  if (!PrepareMethod(cx_, target))
+    return nullptr;
 
-  float f = sp_ctof(value);
-  regs_.pri() = int(ceil(f));
-  return true;
+  code->setCallTarget(insn->b, target);
+  return target;
 }
 
+#if defined(SP_HAS_JIT)
+// Find the entry point for the loop header at |cip| in the compiled form of
+// |method|, compiling it first if needed. |entry| is null if the method can't
+// be entered there, including when the JIT is disabled, or while the method
+// waits for a compile thread; the loop tries again after more backedges.
 bool
-Interpreter::visitRND_TO_ZERO()
+Interpreter::findOsrEntry(MethodInfo* method, cell_t cip, CompiledFunction** fn, void** entry)
 {
-  cell_t value;
-  if (!cx_->popStack(&value))
-    return false;
-
-  float f = sp_ctof(value);
-  if (f >= 0.0f)
-    regs_.pri() = int(floor(f));
-  else
-    regs_.pri() = int(ceil(f));
-  return true;
-}
+  *entry = nullptr;
+  if (!env_->IsJitEnabled())
+    return true;
 
-bool
-Interpreter::visitFLOATCMP()
-{
-  cell_t leftVal, rightVal;
-  if (!cx_->popStack(&leftVal) || !cx_->popStack(&rightVal))
-    return false;
+  if (!method->jit()) {
+    CompileQueue* queue = env_->compile_queue();
+    if (queue && !env_->opcode_profiler()) {
+      queue->Enqueue(cx_->runtime(), method);
+      return true;
+    }
 
-  float left = sp_ctof(leftVal);
-  float right = sp_ctof(rightVal);
+    int err = SP_ERROR_NONE;
+    if (!CompilerBase::Compile(cx_, method, &err)) {
+      cx_->ReportErrorNumber(err);
+      return false;
+    }
+  }
 
-  if (left > right)
-    regs_.pri() = 1;
-  else if (left < right)
-    regs_.pri() = -1;
-  else
-    regs_.pri() = 0;
+  *fn = method->jit();
+  *entry = (*fn)->FindOsrEntry(cip);
   return true;
 }
 
+// Call |target| through the JIT if it's already compiled, or has become hot
+// enough to compile. Otherwise, |called| is false and the caller should run
+// it in the interpreter.
 bool
-Interpreter::visitFLOAT_CMP_OP(CompareOp op)
+Interpreter::tryCallCompiled(MethodInfo* target, cell_t* result, bool* called)
 {
-  cell_t leftVal, rightVal;
-  if (!cx_->popStack(&leftVal) || !cx_->popStack(&rightVal))
-    return false;
-
-  float left = sp_ctof(leftVal);
-  float right = sp_ctof(rightVal);
-  if (ke::IsNaN(left) || ke::IsNaN(right)) {
-    regs_.pri() = 0;
+  int err = SP_ERROR_NONE;
+  CompiledFunction* fn = CompilerBase::CompileIfHot(cx_, target, &err);
+  if (!fn) {
+    if (err != SP_ERROR_NONE) {
+      cx_->ReportErrorNumber(err);
+      return false;
+    }
+    *called = false;
     return true;
   }
 
-  switch (op) {
-  case CompareOp::Eq:
-    regs_.pri() = left == right;
-    break;
-  case CompareOp::Neq:
-    regs_.pri() = left != right;
-    break;
-  case CompareOp::Sless:
-    regs_.pri() = left < right;
-    break;
-  case CompareOp::Sleq:
-    regs_.pri() = left <= right;
-    break;
-  case CompareOp::Sgrtr:
-    regs_.pri() = left > right;
-    break;
-  case CompareOp::Sgeq:
-    regs_.pri() = left >= right;
-    break;
-  default:
-    assert(false);
-  }
-
-  return true;
-}
-
-bool
-Interpreter::visitFLOAT_NOT()
-{
-  cell_t value;
-  if (!cx_->popStack(&value))
-    return false;
-
-  float f = sp_ctof(value);
-  if (ke::IsNaN(f))
-    regs_.pri() = 1;
-  else
-    regs_.pri() = f ? 0 : 1;
-  return true;
+  *called = true;
+  return env_->InvokeCompiled(cx_, fn, fn->GetEntryAddress(), result);
 }
+#endif
 
 bool
-Interpreter::visitGENARRAY(uint32_t dims, bool autozero)
+Interpreter::generateArray(uint32_t dims, bool autozero)
 {
   cell_t* stack = cx_->acquireAddrRange(cx_->sp(), dims * sizeof(cell_t));
   if (!stack)
@@ -994,51 +1464,7 @@ Interpreter::visitGENARRAY(uint32_t dims, bool autozero)
 
   // Remove all but the last argument, which is where the new address is
   // stored.
-  cell_t ignore;
-  for (size_t i = 0; i < dims - 1; i++) {
-    if (!cx_->popStack(&ignore))
-      return false;
-  }
-
-  return true;
-}
-
-bool
-Interpreter::visitTRACKER_PUSH_C(cell_t amount)
-{
-  int err = cx_->pushTracker(amount);
-  if (err != SP_ERROR_NONE) {
-    cx_->ReportErrorNumber(err);
-    return false;
-  }
-  return true;
-}
-
-bool
-Interpreter::visitTRACKER_POP_SETHEAP()
-{
-  int err = cx_->popTrackerAndSetHeap();
-  if (err != SP_ERROR_NONE) {
-    cx_->ReportErrorNumber(err);
-    return false;
-  }
-  return true;
-}
-
-bool
-Interpreter::visitSTRADJUST_PRI()
-{
-  regs_.pri() = (regs_.pri() + 4) >> 2;
-  return true;
-}
-
-bool
-Interpreter::visitHALT(cell_t value)
-{
-  // We don't support this. It's included in the bytestream by default, but it
-  // must be unreachable.
-  cx_->ReportErrorNumber(SP_ERROR_INVALID_INSTRUCTION);
-  return false;
+  return cx_->addStack((dims - 1) * sizeof(cell_t));
 }
 
 } // namespace sp
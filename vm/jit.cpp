@@ -15,18 +15,29 @@
 // You should have received a copy of the GNU General Public License
 // along with SourcePawn.  If not, see <http://www.gnu.org/licenses/>.
 //
+#include <stdlib.h>
 #include "jit.h"
+#include "bounds-analysis.h"
+#include "code-cache.h"
+#include "compile-queue.h"
 #include "environment.h"
+#include "interpreter.h"
 #include "linking.h"
 #include "method-info.h"
+#include "method-verifier.h"
+#include "opcode-profiler.h"
 #include "opcodes.h"
 #include "outofline-asm.h"
 #include "pcode-reader.h"
+#include "perf-map.h"
+#include "gdb-jit.h"
 #include "plugin-runtime.h"
 #include "stack-frames.h"
-#include "watchdog_timer.h"
 #if defined(KE_ARCH_X86)
 # include "x86/jit_x86.h"
+#elif defined(KE_ARCH_X64)
+# include "x64/jit_x64.h"
+# include "x64/jit_opt_x64.h"
 #endif
 
 namespace sp {
@@ -40,15 +51,22 @@ CompilerBase::CompilerBase(PluginRuntime *rt, cell_t pcode_offs)
    rt_(rt),
    context_(rt->GetBaseContext()),
    image_(rt_->image()),
+   method_(nullptr),
    error_(SP_ERROR_NONE),
    pcode_start_(pcode_offs),
+   pcode_end_(pcode_offs),
    code_start_(reinterpret_cast<const cell_t *>(rt_->code().bytes + pcode_start_)),
    op_cip_(nullptr),
    code_end_(reinterpret_cast<const cell_t *>(rt_->code().bytes + rt_->code().length)),
-   jump_map_(nullptr)
+   opcode_counts_(nullptr),
+   off_thread_(false),
+   for_cache_(false),
+   uses_intrinsics_(false),
+   jump_map_(nullptr),
+   inline_(nullptr),
+   next_block_(0),
+   next_redundant_bounds_(0)
 {
-  size_t nmaxops = rt_->code().length / sizeof(cell_t) + 1;
-  jump_map_ = new Label[nmaxops];
 }
 
 CompilerBase::~CompilerBase()
@@ -59,7 +77,56 @@ CompilerBase::~CompilerBase()
 CompiledFunction *
 CompilerBase::Compile(PluginContext* cx, RefPtr<MethodInfo> method, int *err)
 {
-  Compiler cc(cx->runtime(), method->pcode_offset());
+  CompiledFunction *fun = CompileMethod(cx->runtime(), method, false, err);
+  if (!fun)
+    return nullptr;
+
+  // Publish under the lock, like the compile threads, in case one of them
+  // got here first.
+  ke::AutoLock lock(Environment::get()->lock());
+  if (CompiledFunction* existing = method->jit()) {
+    delete fun;
+    return existing;
+  }
+  method->setCompiledFunction(fun);
+  return fun;
+}
+
+CompiledFunction *
+CompilerBase::CompileOffThread(PluginRuntime* rt, MethodInfo* method, int *err)
+{
+  return CompileMethod(rt, method, true, err);
+}
+
+CompiledFunction *
+CompilerBase::CompileMethod(PluginRuntime* rt, MethodInfo* method, bool off_thread, int *err)
+{
+  Environment* env = Environment::get();
+  OpcodeProfiler* profiler = off_thread ? nullptr : env->opcode_profiler();
+
+  // Cached code has no opcode counters.
+  CodeCache* cache = profiler ? nullptr : env->code_cache();
+  if (cache) {
+    if (CompiledFunction* fun = cache->Load(rt, method->pcode_offset())) {
+      if (PerfMap* map = env->perf_map())
+        map->RecordMethod(rt, fun);
+      if (env->IsGdbJitInterfaceEnabled())
+        fun->setGdbJitEntry(GdbJitRegister(rt, fun));
+      return fun;
+    }
+  }
+
+  Compiler cc(rt, method->pcode_offset());
+  cc.method_ = method;
+  cc.off_thread_ = off_thread;
+  if (profiler)
+    cc.opcode_counts_ = profiler->countsFor(rt, method);
+#if defined(KE_ARCH_X64)
+  if (cache) {
+    cc.for_cache_ = true;
+    cc.masm.setRelocatable();
+  }
+#endif
 
   CompiledFunction *fun = cc.emit();
   if (!fun) {
@@ -67,10 +134,147 @@ CompilerBase::Compile(PluginContext* cx, RefPtr<MethodInfo> method, int *err)
     return nullptr;
   }
 
-  method->setCompiledFunction(fun);
+#if defined(KE_ARCH_X64)
+  if (cache && !cc.uses_intrinsics_)
+    cache->Save(rt, fun, cc.masm.absoluteRefs(), cc.masm.absoluteCodeRefs(),
+                cc.masm.splitRefs());
+#endif
+  if (PerfMap* map = env->perf_map())
+    map->RecordMethod(rt, fun);
+  if (env->IsGdbJitInterfaceEnabled())
+    fun->setGdbJitEntry(GdbJitRegister(rt, fun));
   return fun;
 }
 
+void
+CompilerBase::CompileAll(PluginContext* cx)
+{
+  PluginRuntime* rt = cx->runtime();
+
+  // Walk the call graph from the publics, as the verifier tool does. Callees
+  // are found after their callers, so compiling in reverse order links most
+  // calls directly; only cycles need patching afterward.
+  Vector<uint8_t> seen;
+  Vector<cell_t> work;
+  auto visit = [&seen, &work](cell_t offset) -> void {
+    size_t index = offset / sizeof(cell_t);
+    while (seen.length() <= index)
+      seen.append(0);
+    if (seen[index])
+      return;
+    seen[index] = 1;
+    work.append(offset);
+  };
+
+  for (size_t i = 0; i < rt->image()->NumPublics(); i++) {
+    uint32_t offset;
+    rt->image()->GetPublic(i, &offset, nullptr);
+    visit(offset);
+  }
+
+  Vector<RefPtr<MethodInfo>> methods;
+  for (size_t i = 0; i < work.length(); i++) {
+    RefPtr<MethodInfo> method = rt->AcquireMethod(work[i]);
+    if (!method || method->Validate() != SP_ERROR_NONE)
+      continue;
+
+    MethodVerifier verifier(rt, work[i]);
+    verifier.collectExternalFuncRefs(visit);
+    if (!verifier.verify())
+      continue;
+    methods.append(method);
+  }
+
+  for (size_t i = methods.length(); i > 0; i--) {
+    const RefPtr<MethodInfo>& method = methods[i - 1];
+    if (method->jit())
+      continue;
+
+    int err = SP_ERROR_NONE;
+    Compile(cx, method, &err);
+  }
+
+  // With the optimizing tier, everything it can handle is optimized up
+  // front too, so nothing has to tier up later.
+  if (Environment::get()->IsOptimizingJitEnabled()) {
+    for (size_t i = methods.length(); i > 0; i--) {
+      const RefPtr<MethodInfo>& method = methods[i - 1];
+      if (!method->jit() || method->optimized())
+        continue;
+
+      int err = SP_ERROR_NONE;
+      if (CompiledFunction* fun = CompileOptimized(rt, method, &err))
+        method->setOptimizedFunction(fun);
+      else
+        method->disableTierUp();
+    }
+  }
+
+  for (size_t i = 0; i < methods.length(); i++) {
+    CompiledFunction* tiers[] = { methods[i]->jit(), methods[i]->optimized() };
+    for (CompiledFunction* fun : tiers) {
+      if (!fun)
+        continue;
+
+      for (size_t j = 0; j < fun->NumCallSites(); j++) {
+        const CallSite& site = fun->GetCallSite(j);
+        RefPtr<MethodInfo> callee = rt->GetMethod(site.target);
+        if (!callee || !callee->bestJit())
+          continue;
+        PatchCallThunk(fun->GetCodeAt(site.pcoffs), callee->bestJit()->GetEntryAddress());
+      }
+    }
+  }
+}
+
+CompiledFunction *
+CompilerBase::CompileOptimized(PluginRuntime* rt, MethodInfo* method, int *err)
+{
+#if defined(KE_ARCH_X64)
+  Environment* env = Environment::get();
+
+  OptimizingCompiler cc(rt, method->pcode_offset());
+  CompiledFunction *fun = cc.compile();
+  if (!fun) {
+    *err = cc.error();
+    return nullptr;
+  }
+
+  if (PerfMap* map = env->perf_map())
+    map->RecordMethod(rt, fun);
+  if (env->IsGdbJitInterfaceEnabled())
+    fun->setGdbJitEntry(GdbJitRegister(rt, fun));
+  return fun;
+#else
+  return nullptr;
+#endif
+}
+
+CompiledFunction *
+CompilerBase::CompileIfHot(PluginContext* cx, MethodInfo* method, int *err)
+{
+  if (CompiledFunction* fun = method->bestJit())
+    return fun;
+
+  Environment* env = Environment::get();
+  if (env->IsTieringEnabled()) {
+    method->recordInvocation();
+    if (!method->isHot())
+      return nullptr;
+  }
+
+  // With compile threads, the method keeps running in the interpreter until
+  // its code is published. Opcode profiles need every count from the first
+  // call, so they always compile here.
+  if (CompileQueue* queue = env->compile_queue()) {
+    if (!env->opcode_profiler()) {
+      queue->Enqueue(cx->runtime(), method);
+      return nullptr;
+    }
+  }
+  return Compile(cx, method, err);
+}
+
 CompiledFunction*
 CompilerBase::emit()
 {
@@ -85,7 +289,8 @@ CompilerBase::emit()
   SpewOpcode(rt_, code_start_, reader.cip());
 #endif
 
-  const cell_t *codeseg = reinterpret_cast<const cell_t *>(rt_->code().bytes);
+  if (!findBlocks())
+    return nullptr;
 
   emitPrologue();
 
@@ -100,17 +305,71 @@ CompilerBase::emit()
     SpewOpcode(rt_, code_start_, reader.cip());
 #endif
 
-    // We assume every instruction is a jump target, so before emitting
-    // an opcode, we bind its corresponding label.
-    __ bind(&jump_map_[reader.cip() - codeseg]);
-
     // Save the start of the opcode for emitCipMap().
     op_cip_ = reader.cip();
 
+    // If this instruction starts a block, bind its label. A target we've
+    // passed without binding points into the middle of an instruction.
+    cell_t cip_offset = reader.cip_offset();
+    bool block_start = false;
+    if (next_block_ < block_starts_.length() && block_starts_[next_block_] <= cip_offset) {
+      if (block_starts_[next_block_] != cip_offset) {
+        reportError(SP_ERROR_INSTRUCTION_PARAM);
+        return nullptr;
+      }
+      block_start = true;
+    }
+
+    emitBeforeInstruction(reader.peekOpcode(), block_start);
+
+    if (block_start) {
+      __ bind(labelAt(cip_offset));
+      while (next_block_ < block_starts_.length() && block_starts_[next_block_] == cip_offset)
+        next_block_++;
+    }
+
+    if (opcode_counts_) {
+      OPCODE op = reader.peekOpcode();
+      if (op != OP_BREAK && op != OP_NOP)
+        emitOpcodeCount(op);
+    }
+
     if (!reader.visitNext() || error_)
       return nullptr;
   }
 
+  op_cip_ = reader.cip();
+  emitBeforeInstruction(OP_ENDPROC, true);
+
+  // The verifier allows jumping to the end of the method. As in the
+  // interpreter, reaching it is an error.
+  if (next_block_ < block_starts_.length()) {
+    if (block_starts_[next_block_] != cell_t(pcode_end_)) {
+      reportError(SP_ERROR_INSTRUCTION_PARAM);
+      return nullptr;
+    }
+    __ bind(labelAt(pcode_end_));
+
+    ErrorPath* path = new ErrorPath(op_cip_, nullptr, SP_ERROR_INVALID_INSTRUCTION);
+    if (!ool_paths_.append(path)) {
+      reportError(SP_ERROR_OUT_OF_MEMORY);
+      return nullptr;
+    }
+    __ jmp(path->label());
+  }
+
+  return finish();
+}
+
+CompiledFunction*
+CompilerBase::finish()
+{
+  // Everything from here on only runs on slow paths, errors and interrupts,
+  // so it goes in cold code. Nothing may fall through into it, and the trap
+  // keeps any label bound at the end of the hot code inside it.
+  __ breakpoint();
+  masm.startColdCode();
+
   for (size_t i = 0; i < ool_paths_.length(); i++) {
     OutOfLinePath* path = ool_paths_[i];
     __ bind(path->label());
@@ -118,14 +377,8 @@ CompilerBase::emit()
       return nullptr;
   }
 
-  // For each backward jump, emit a little thunk so we can exit from a timeout.
-  // Track the offset of where the thunk is, so the watchdog timer can patch it.
-  for (size_t i = 0; i < backward_jumps_.length(); i++) {
-    BackwardJump &jump = backward_jumps_[i];
-    jump.timeout_offset = masm.pc();
-    __ call(&throw_timeout_);
-    emitCipMapping(jump.cip);
-  }
+  if (!emitOsrEntries())
+    return nullptr;
 
   // These have to come last.
   emitThrowPathIfNeeded(SP_ERROR_DIVIDE_BY_ZERO);
@@ -135,8 +388,10 @@ CompilerBase::emit()
   emitThrowPathIfNeeded(SP_ERROR_MEMACCESS);
   emitThrowPathIfNeeded(SP_ERROR_HEAPLOW);
   emitThrowPathIfNeeded(SP_ERROR_HEAPMIN);
+  emitThrowPathIfNeeded(SP_ERROR_ARRAY_TOO_BIG);
   emitThrowPathIfNeeded(SP_ERROR_INTEGER_OVERFLOW);
   emitThrowPathIfNeeded(SP_ERROR_INVALID_NATIVE);
+  emitThrowPathIfNeeded(SP_ERROR_INVALID_INSTRUCTION);
 
   // This has to come very, very last, since it checks whether return paths
   // are used.
@@ -145,26 +400,339 @@ CompilerBase::emit()
   if (error_)
     return nullptr;
 
-  CodeChunk code = LinkCode(env_, masm);
+  CodeChunk code = LinkCode(env_, masm, nullptr);
   if (!code.address()) {
     reportError(SP_ERROR_OUT_OF_MEMORY);
     return nullptr;
   }
 
-  AutoPtr<FixedArray<LoopEdge>> edges(
-    new FixedArray<LoopEdge>(backward_jumps_.length()));
-  for (size_t i = 0; i < backward_jumps_.length(); i++) {
-    const BackwardJump &jump = backward_jumps_[i];
-    edges->at(i).offset = jump.pc;
-    edges->at(i).disp32 = int32_t(jump.timeout_offset) - int32_t(jump.pc);
-  }
-
   AutoPtr<FixedArray<CipMapEntry>> cipmap(
     new FixedArray<CipMapEntry>(cip_map_.length()));
   memcpy(cipmap->buffer(), cip_map_.buffer(), cip_map_.length() * sizeof(CipMapEntry));
 
+  AutoPtr<FixedArray<OsrEntry>> osr(
+    new FixedArray<OsrEntry>(osr_entries_.length()));
+  memcpy(osr->buffer(), osr_entries_.buffer(), osr_entries_.length() * sizeof(OsrEntry));
+
+  AutoPtr<FixedArray<CallSite>> call_sites(
+    new FixedArray<CallSite>(call_sites_.length()));
+  memcpy(call_sites->buffer(), call_sites_.buffer(), call_sites_.length() * sizeof(CallSite));
+
   assert(error_ == SP_ERROR_NONE);
-  return new CompiledFunction(code, pcode_start_, edges.take(), cipmap.take());
+  return new CompiledFunction(code, pcode_start_, cipmap.take(), osr.take(), call_sites.take());
+}
+
+void
+CompilerBase::emitLoopEdge(cell_t loop_header)
+{
+  emitInterruptCheck();
+  if (!loop_headers_.append(loop_header))
+    reportError(SP_ERROR_OUT_OF_MEMORY);
+}
+
+// Each loop header also gets an entry point, so a loop that gets hot in the
+// interpreter can finish running here. Several jumps may share a header.
+bool
+CompilerBase::emitOsrEntries()
+{
+  for (size_t i = 0; i < loop_headers_.length(); i++) {
+    cell_t target = loop_headers_[i];
+
+    // The interpreter drops no-ops, so it knows the header by the first real
+    // instruction. The label is the same either way.
+    const cell_t *cip = reinterpret_cast<const cell_t *>(rt_->code().bytes + target);
+    while (*cip == OP_BREAK || *cip == OP_NOP)
+      cip++;
+    uint32_t cipoffs = uintptr_t(cip) - uintptr_t(code_start_);
+
+    bool seen = false;
+    for (size_t j = 0; j < osr_entries_.length(); j++) {
+      if (osr_entries_[j].cipoffs == cipoffs) {
+        seen = true;
+        break;
+      }
+    }
+    if (seen)
+      continue;
+
+    OsrEntry entry;
+    entry.cipoffs = cipoffs;
+    entry.pcoffs = masm.pc();
+    if (!osr_entries_.append(entry)) {
+      reportError(SP_ERROR_OUT_OF_MEMORY);
+      return false;
+    }
+    emitOsrEntry(labelAt(target));
+  }
+
+  return true;
+}
+
+static int
+CompareOffsets(const void* a, const void* b)
+{
+  cell_t left = *reinterpret_cast<const cell_t*>(a);
+  cell_t right = *reinterpret_cast<const cell_t*>(b);
+  if (left < right)
+    return -1;
+  return left > right ? 1 : 0;
+}
+
+// Find the end of the method and where its blocks start, so labels are only
+// allocated for the method's own code, rather than the whole code section,
+// and only bound where control can actually arrive from elsewhere.
+bool
+CompilerBase::findBlocks()
+{
+  MethodVerifier verifier(rt_, pcode_start_);
+  verifier.collectJumpTargets([this](cell_t offset) -> void {
+    block_starts_.append(offset);
+  });
+  verifier.collectStackDepths([this](cell_t offset, int32_t depth) -> void {
+    size_t index = (offset - pcode_start_) / sizeof(cell_t);
+    while (stack_depths_.length() <= index)
+      stack_depths_.append(-1);
+    stack_depths_[index] = depth;
+  });
+  if (!verifier.verify()) {
+    reportError(verifier.error());
+    return false;
+  }
+  pcode_end_ = verifier.endOffset();
+
+  qsort(block_starts_.buffer(), block_starts_.length(), sizeof(cell_t), CompareOffsets);
+
+  // If the analysis gives up, every check stays.
+  BoundsAnalysis bounds(rt_, pcode_start_, pcode_end_, block_starts_, stack_depths_);
+  if (bounds.analyze()) {
+    const ke::Vector<cell_t>& redundant = bounds.redundantChecks();
+    for (size_t i = 0; i < redundant.length(); i++)
+      redundant_bounds_.append(redundant[i]);
+  }
+
+  // The extra label is for the end of the method.
+  jump_map_ = new Label[(pcode_end_ - pcode_start_) / sizeof(cell_t) + 1];
+  return true;
+}
+
+// Methods this size or smaller, in cells, can be inlined. This is enough for
+// getters, min/max/clamp, and validity checks.
+static const size_t kMaxInlineCells = 48;
+
+bool
+CompilerBase::canInline(cell_t offset, InlineScope* scope)
+{
+  // Profiles count by method, and a method can't inline itself.
+  if (inline_ || opcode_counts_ || offset == cell_t(pcode_start_))
+    return false;
+
+  // Validation can rewrite the callee's pcode, so it has to come first.
+  // Compile threads can't validate; CompileQueue::Enqueue did it for them.
+  if (!off_thread_) {
+    RefPtr<MethodInfo> callee = rt_->AcquireMethod(offset);
+    if (!callee || callee->Validate() != SP_ERROR_NONE)
+      return false;
+  }
+
+  const cell_t* code = reinterpret_cast<const cell_t*>(rt_->code().bytes);
+
+  bool leaf = true;
+  cell_t last_op_offset = -1;
+  MethodVerifier verifier(rt_, offset);
+  verifier.collectJumpTargets([scope](cell_t target) -> void {
+    scope->block_starts.append(target);
+  });
+  verifier.collectOpcodes([&](cell_t op_offset, OPCODE op) -> void {
+    last_op_offset = op_offset;
+    switch (op) {
+    case OP_CALL:
+    case OP_SYSREQ_C:
+    case OP_SYSREQ_N:
+    case OP_GENARRAY:
+    case OP_GENARRAY_Z:
+    case OP_HALT:
+    case OP_SWITCH:
+      leaf = false;
+      break;
+    case OP_JUMP:
+    case OP_JZER:
+    case OP_JNZ:
+    case OP_JEQ:
+    case OP_JNEQ:
+    case OP_JSLESS:
+    case OP_JSLEQ:
+    case OP_JSGRTR:
+    case OP_JSGEQ:
+      // Loops would need interrupt checks and OSR entries of their own.
+      if (code[op_offset / sizeof(cell_t) + 1] <= op_offset)
+        leaf = false;
+      break;
+    default:
+      break;
+    }
+  });
+  if (!verifier.verify() || !leaf)
+    return false;
+
+  uint32_t end = verifier.endOffset();
+  if ((end - offset) / sizeof(cell_t) > kMaxInlineCells)
+    return false;
+
+  // The method must end in a RETN; falling or jumping past the end is an
+  // error that only a real call reports correctly.
+  if (last_op_offset < 0 || code[last_op_offset / sizeof(cell_t)] != OP_RETN ||
+      last_op_offset + cell_t(sizeof(cell_t)) != cell_t(end))
+  {
+    return false;
+  }
+  for (size_t i = 0; i < scope->block_starts.length(); i++) {
+    if (scope->block_starts[i] >= cell_t(end))
+      return false;
+  }
+
+  qsort(scope->block_starts.buffer(), scope->block_starts.length(), sizeof(cell_t),
+        CompareOffsets);
+
+  scope->pcode_start = offset;
+  scope->pcode_end = end;
+  return true;
+}
+
+bool
+CompilerBase::emitInlineCall(cell_t offset)
+{
+  InlineScope scope;
+  if (!canInline(offset, &scope))
+    return false;
+
+  scope.call_cip = op_cip_;
+  scope.jump_map = new Label[(scope.pcode_end - scope.pcode_start) / sizeof(cell_t) + 1];
+
+  // The arguments and their count are already on the stack, as for a call.
+  inline_ = &scope;
+  emitPushFrame();
+
+  PcodeReader<CompilerBase> reader(rt_, offset, this);
+  reader.begin();
+  while (reader.more()) {
+    if (reader.peekOpcode() == OP_PROC || reader.peekOpcode() == OP_ENDPROC)
+      break;
+
+    op_cip_ = reader.cip();
+
+    cell_t cip_offset = reader.cip_offset();
+    bool block_start = false;
+    if (scope.next_block < scope.block_starts.length() &&
+        scope.block_starts[scope.next_block] <= cip_offset)
+    {
+      if (scope.block_starts[scope.next_block] != cip_offset) {
+        reportError(SP_ERROR_INSTRUCTION_PARAM);
+        break;
+      }
+      block_start = true;
+    }
+
+    emitBeforeInstruction(reader.peekOpcode(), block_start);
+
+    if (block_start) {
+      __ bind(labelAt(cip_offset));
+      while (scope.next_block < scope.block_starts.length() &&
+             scope.block_starts[scope.next_block] == cip_offset)
+      {
+        scope.next_block++;
+      }
+    }
+
+    if (!reader.visitNext() || error_)
+      break;
+  }
+
+  if (!error_) {
+    emitBeforeInstruction(OP_RETN, true);
+    __ bind(&scope.exit);
+  }
+
+  inline_ = nullptr;
+  op_cip_ = scope.call_cip;
+  return true;
+}
+
+void
+CompilerBase::emitInlineReturn()
+{
+  assert(inline_);
+
+  // The last RETN falls through to the code after the call.
+  const cell_t* next = op_cip_ + 1;
+  if (next == reinterpret_cast<const cell_t*>(rt_->code().bytes + inline_->pcode_end))
+    return;
+  __ jmp(&inline_->exit);
+}
+
+// A jump table must be at least this full, and no larger than this, to be
+// used over compares.
+static const size_t kMinJumpTableCases = 4;
+static const int64_t kMinJumpTableDensity = 40;
+static const int64_t kMaxJumpTableSize = 4096;
+
+void
+CompilerBase::PlanSwitch(const CaseTableEntry* cases, size_t ncases,
+                         ke::Vector<CaseTableEntry>* sorted,
+                         ke::Vector<SwitchCluster>* clusters)
+{
+  // Tables are usually sorted already, so a stable insertion sort is cheap.
+  for (size_t i = 0; i < ncases; i++) {
+    size_t pos = sorted->length();
+    while (pos > 0 && sorted->at(pos - 1).value > cases[i].value)
+      pos--;
+    if (pos > 0 && sorted->at(pos - 1).value == cases[i].value)
+      continue;
+    sorted->insert(pos, cases[i]);
+  }
+
+  // Grow each cluster while its table would stay dense enough.
+  for (size_t i = 0; i < sorted->length(); i++) {
+    cell_t value = sorted->at(i).value;
+    if (!clusters->empty()) {
+      SwitchCluster& cluster = clusters->back();
+      int64_t size = int64_t(value) - int64_t(cluster.low) + 1;
+      int64_t count = int64_t(cluster.ncases) + 1;
+      if (size <= kMaxJumpTableSize && count * 100 >= size * kMinJumpTableDensity) {
+        cluster.high = value;
+        cluster.ncases++;
+        continue;
+      }
+    }
+
+    SwitchCluster cluster;
+    cluster.first = i;
+    cluster.ncases = 1;
+    cluster.low = value;
+    cluster.high = value;
+    cluster.jump_table = false;
+    clusters->append(cluster);
+  }
+
+  // Small clusters are cheaper as compares, so neighbouring ones are merged
+  // into a single run of compares.
+  ke::Vector<SwitchCluster> merged;
+  for (size_t i = 0; i < clusters->length(); i++) {
+    SwitchCluster cluster = clusters->at(i);
+    cluster.jump_table = cluster.ncases >= kMinJumpTableCases;
+    if (!cluster.jump_table && !merged.empty()) {
+      SwitchCluster& prev = merged.back();
+      if (!prev.jump_table && prev.ncases + cluster.ncases < kMinJumpTableCases) {
+        prev.ncases += cluster.ncases;
+        prev.high = cluster.high;
+        continue;
+      }
+    }
+    merged.append(cluster);
+  }
+
+  clusters->clear();
+  for (size_t i = 0; i < merged.length(); i++)
+    clusters->append(merged[i]);
 }
 
 void
@@ -197,7 +765,7 @@ CompilerBase::emitErrorPath(ErrorPath* path)
   else
     __ call(&throw_error_code_[path->err]);
 
-  emitCipMapping(path->cip);
+  emitCipMapping(path->cip, path->inlined_at);
 }
 
 void
@@ -222,12 +790,6 @@ CompilerBase::reportError(int err)
 int
 CompilerBase::CompileFromThunk(PluginContext* cx, cell_t pcode_offs, void **addrp, uint8_t* pc)
 {
-  // If the watchdog timer has declared a timeout, we must process it now,
-  // and possibly refuse to compile, since otherwise we will compile a
-  // function that is not patched for timeouts.
-  if (!Environment::get()->watchdog()->HandleInterrupt())
-    return SP_ERROR_TIMEOUT;
-
   RefPtr<MethodInfo> method = cx->runtime()->AcquireMethod(pcode_offs);
   if (!method)
     return SP_ERROR_INVALID_ADDRESS;
@@ -236,11 +798,15 @@ CompilerBase::CompileFromThunk(PluginContext* cx, cell_t pcode_offs, void **addr
   if (err != SP_ERROR_NONE)
     return err;
 
-  CompiledFunction *fn = method->jit();
+  CompiledFunction *fn = CompileIfHot(cx, method, &err);
   if (!fn) {
-    fn = Compile(cx, method, &err);
-    if (!fn)
+    if (err != SP_ERROR_NONE)
       return err;
+
+    // The method is still cold. Leave the thunk unpatched, so it runs in the
+    // interpreter and we get to count the next call as well.
+    *addrp = nullptr;
+    return SP_ERROR_NONE;
   }
 
 #if defined JIT_SPEW
@@ -257,6 +823,39 @@ CompilerBase::CompileFromThunk(PluginContext* cx, cell_t pcode_offs, void **addr
   return SP_ERROR_NONE;
 }
 
+// Exit frame is a JitExitFrameForHelper. The thunk has already synced the
+// context's stack pointer, and checks for a pending exception afterward.
+void
+CompilerBase::InterpretFromThunk(PluginContext* cx, cell_t pcode_offs, cell_t* rval)
+{
+  RefPtr<MethodInfo> method = cx->runtime()->GetMethod(pcode_offs);
+  assert(method);
+
+  if (!Interpreter::Run(cx, method, rval))
+    *rval = 0;
+}
+
+// Exit frame is a JitExitFrameForHelper. Baseline code calls this from its
+// prologue once its tier-up counter runs out, and jumps to the result unless
+// it is null.
+void*
+CompilerBase::TierUpFromBaseline(PluginContext* cx, MethodInfo* method)
+{
+  if (CompiledFunction* fun = method->optimized())
+    return fun->GetEntryAddress();
+
+  // Errors are left for the baseline code to report when it reaches them.
+  int err = SP_ERROR_NONE;
+  CompiledFunction* fun = CompileOptimized(cx->runtime(), method, &err);
+  if (!fun) {
+    method->disableTierUp();
+    return nullptr;
+  }
+
+  method->setOptimizedFunction(fun);
+  return fun->GetEntryAddress();
+}
+
 // Find the |ebp| associated with the entry frame. We use this to drop out of
 // the entire scripted call stack.
 void*
@@ -282,13 +881,12 @@ CompilerBase::InvokeReportError(int err)
   Environment::get()->ReportError(err);
 }
 
-// Exit frame is a JitExitFrameForHelper. This is a special function since we
-// have to notify the watchdog timer that we're unblocked.
-void
-CompilerBase::InvokeReportTimeout()
+// Exit frame is a JitExitFrameForHelper. Returns non-zero if an error was
+// reported.
+int
+CompilerBase::InvokeHandleInterrupts(PluginContext* cx)
 {
-  Environment::get()->watchdog()->NotifyTimeoutReceived();
-  InvokeReportError(SP_ERROR_TIMEOUT);
+  return Environment::get()->HandleInterrupts(cx);
 }
 
 bool
@@ -305,4 +903,11 @@ OutOfBoundsErrorPath::emit(Compiler* cc)
   return true;
 }
 
+bool
+InterruptPath::emit(Compiler* cc)
+{
+  cc->emitInterruptPath(this);
+  return true;
+}
+
 } // namespace sp
@@ -34,21 +34,42 @@ using namespace SourcePawn;
 class PluginRuntime;
 class PluginContext;
 class LegacyImage;
+struct OpcodeCounts;
 
-struct BackwardJump {
-  // The pc at the jump instruction (i.e. after it).
-  uint32_t pc;
-  // The cip of the jump.
-  const cell_t *cip;
-  // The offset of the timeout thunk. This is filled in at the end.
-  uint32_t timeout_offset;
+// A small leaf method whose code is being emitted in place of a CALL to it.
+struct InlineScope {
+  // The CALL being replaced.
+  const cell_t *call_cip;
+  uint32_t pcode_start;
+  uint32_t pcode_end;
+  // Labels for the method's own code, as with CompilerBase::labelAt().
+  Label *jump_map;
+  ke::Vector<cell_t> block_starts;
+  size_t next_block;
+  // Where the method's RETNs go.
+  Label exit;
 
-  BackwardJump()
-  {}
-  BackwardJump(uint32_t pc, const cell_t *cip)
-   : pc(pc),
-     cip(cip)
+  InlineScope()
+   : call_cip(nullptr),
+     pcode_start(0),
+     pcode_end(0),
+     jump_map(nullptr),
+     next_block(0)
   {}
+  ~InlineScope() {
+    delete [] jump_map;
+  }
+};
+
+// A run of switch cases, by index into the sorted case list. Runs dense
+// enough to be worth it are dispatched through a jump table, the rest with
+// compares.
+struct SwitchCluster {
+  size_t first;
+  size_t ncases;
+  cell_t low;
+  cell_t high;
+  bool jump_table;
 };
 
 class CompilerBase : public PcodeVisitor
@@ -61,23 +82,137 @@ class CompilerBase : public PcodeVisitor
 
   static CompiledFunction *Compile(PluginContext* cx, RefPtr<MethodInfo> method, int *err);
 
+  // Return the compiled form of a method, compiling it if it has not been
+  // compiled yet. With tiering enabled, this counts an invocation and only
+  // compiles hot methods; if the method is still cold, this returns null
+  // and leaves |err| untouched.
+  static CompiledFunction *CompileIfHot(PluginContext* cx, MethodInfo* method, int *err);
+
+  // Compile a method on a background compile thread. The result is not
+  // published; the caller must hand it to MethodInfo::setCompiledFunction.
+  // Code compiled this way never looks at other methods or at native
+  // bindings, since those change on the main thread: calls always go
+  // through thunks, and natives are always looked up when called.
+  static CompiledFunction *CompileOffThread(PluginRuntime* rt, MethodInfo* method, int *err);
+
+  // Compile every method reachable through calls from the runtime's publics,
+  // callees first, then link their calls to each other directly. Methods
+  // that fail to compile are left alone: calling them reports the error, as
+  // it would without eager compilation.
+  static void CompileAll(PluginContext* cx);
+
+  // Compile a method with the optimizing tier, which only exists on x64.
+  // Returns null if the method can't be optimized; |err| is only set if it
+  // has an error. The result is not published; the caller must hand it to
+  // MethodInfo::setOptimizedFunction.
+  static CompiledFunction *CompileOptimized(PluginRuntime* rt, MethodInfo* method, int *err);
+
   int error() const {
     return error_;
   }
 
  protected:
+  // Load a method from the code cache, or compile it, saving the result to
+  // the cache if there is one. The result is not published.
+  static CompiledFunction *CompileMethod(PluginRuntime* rt, MethodInfo* method, bool off_thread,
+                                         int *err);
+
+  // Whether calls may jump straight into other methods' code, and natives
+  // may be called directly. Code compiled on compile threads or for the code
+  // cache can't rely on either.
+  bool linksDirectly() const {
+    return !off_thread_ && !for_cache_;
+  }
+
+  // If a SYSREQ.N passing |nparams| arguments can call |native|'s fast
+  // function, return its signature. Like direct native calls, this needs
+  // a binding that can't change.
+  const sp_fastnativeinfo_t* fastNativeFor(NativeEntry* native, uint32_t nparams) const {
+    if (!linksDirectly() || !native->fast || native->fast->nparams != nparams)
+      return nullptr;
+    if (native->status != SP_NATIVE_BOUND ||
+        (native->flags & (SP_NTVFLAG_EPHEMERAL|SP_NTVFLAG_OPTIONAL)))
+    {
+      return nullptr;
+    }
+    return native->fast;
+  }
+
   CompiledFunction* emit();
+  bool findBlocks();
+
+  // Emit the out-of-line paths, OSR entries, and error handlers after the
+  // method's code, then link it.
+  CompiledFunction* finish();
+
+  // Emit an entry point for each loop header reached by a backward jump.
+  virtual bool emitOsrEntries();
 
   virtual void emitPrologue() = 0;
+
+  // Push a pcode frame for the method being entered, and point frm at it.
+  // The prologue does this, as does an inlined method, which has no native
+  // frame of its own.
+  virtual void emitPushFrame() = 0;
   virtual void emitThrowPath(int err) = 0;
   virtual void emitErrorHandlers() = 0;
   virtual void emitOutOfBoundsErrorPath(OutOfBoundsErrorPath* path) = 0;
 
+  // Poll for interrupts. This is done at calls, inlined or not, and at loop
+  // edges. It clobbers the flags, but no registers.
+  virtual void emitInterruptCheck() = 0;
+  virtual void emitInterruptPath(InterruptPath* path) = 0;
+
+  // Called before a backward jump to |loop_header|. This polls for
+  // interrupts, and records the header for OSR.
+  void emitLoopEdge(cell_t loop_header);
+
+  // Emit an entry point that resumes an interpreted frame at |target|. It is
+  // reached through the invoke stub, with the interpreter's frame already on
+  // the pcode stack, followed by pri and alt.
+  virtual void emitOsrEntry(Label* target) = 0;
+
+  // Emit code that counts |op| for the opcode profiler. Only used when
+  // opcode profiling is enabled.
+  virtual void emitOpcodeCount(OPCODE op) = 0;
+
+  // Called before each instruction, and before its label is bound if it
+  // starts a block. Backends that keep frame state in registers write it
+  // back here.
+  virtual void emitBeforeInstruction(OPCODE op, bool block_start) {}
+
+  // Sort a switch's cases by value and split them into clusters, so it can be
+  // lowered to a binary search over the clusters. If a value appears more
+  // than once, its first case wins, as in the interpreter.
+  static void PlanSwitch(const CaseTableEntry* cases, size_t ncases,
+                         ke::Vector<CaseTableEntry>* sorted,
+                         ke::Vector<SwitchCluster>* clusters);
+
+  // If the method at |offset| is a small leaf (no calls, natives, GENARRAY,
+  // or loops), emit its code in place of a call to it and return true.
+  // Otherwise return false, having emitted nothing unless error() is set.
+  bool emitInlineCall(cell_t offset);
+  bool canInline(cell_t offset, InlineScope* scope);
+
+  // Called from RETN in an inlined method, after its frame is popped.
+  void emitInlineReturn();
+
+  bool inlining() const {
+    return !!inline_;
+  }
+
+  // The CALL that the current instruction was inlined at, or null.
+  const cell_t *inlinedAt() const {
+    return inline_ ? inline_->call_cip : nullptr;
+  }
+
   // Helpers.
   static int CompileFromThunk(PluginContext* cx, cell_t pcode_offs, void **addrp, uint8_t* pc);
+  static void InterpretFromThunk(PluginContext* cx, cell_t pcode_offs, cell_t* rval);
+  static void* TierUpFromBaseline(PluginContext* cx, MethodInfo* method);
   static void* find_entry_fp();
   static void InvokeReportError(int err);
-  static void InvokeReportTimeout();
+  static int InvokeHandleInterrupts(PluginContext* cx);
   static void PatchCallThunk(uint8_t* pc, void* target);
 
  protected:
@@ -86,12 +221,25 @@ class CompilerBase : public PcodeVisitor
   // Map a return address (i.e. an exit point from a function) to its source
   // cip. This lets us avoid tracking the cip during runtime. These are
   // sorted by definition since we assemble and emit in forward order.
-  void emitCipMapping(const cell_t *cip) {
+  void emitCipMapping(const cell_t *cip, const cell_t *inlined_at) {
     CipMapEntry entry;
     entry.cipoffs = uintptr_t(cip) - uintptr_t(code_start_);
     entry.pcoffs = masm.pc();
+    entry.inlined_at = inlined_at ? uintptr_t(inlined_at) - uintptr_t(code_start_) : 0;
     cip_map_.append(entry);
   }
+  void emitCipMapping(const cell_t *cip) {
+    emitCipMapping(cip, inlinedAt());
+  }
+
+  // Record a call that goes through a call thunk, right after the call, so
+  // it can be linked directly later.
+  void emitCallSite(cell_t target) {
+    CallSite site;
+    site.pcoffs = masm.pc();
+    site.target = target;
+    call_sites_.append(site);
+  }
 
  protected:
   void emitErrorPath(ErrorPath* path);
@@ -99,31 +247,96 @@ class CompilerBase : public PcodeVisitor
 
   void reportError(int err);
 
+  // The number of bytes below frm at the start of the current instruction,
+  // as computed by the verifier, or -1 if it isn't known.
+  int32_t stackDepth() const {
+    if (inline_)
+      return -1;
+    size_t index = (op_cip_ - code_start_);
+    if (index >= stack_depths_.length())
+      return -1;
+    return stack_depths_[index];
+  }
+
+  // Whether the BOUNDS at the current instruction was shown to never fail,
+  // so it can be left out.
+  bool boundsCheckIsRedundant() {
+    if (inline_)
+      return false;
+    cell_t offset = cell_t(pcode_start_ + (op_cip_ - code_start_) * sizeof(cell_t));
+    while (next_redundant_bounds_ < redundant_bounds_.length() &&
+           redundant_bounds_[next_redundant_bounds_] < offset)
+    {
+      next_redundant_bounds_++;
+    }
+    return next_redundant_bounds_ < redundant_bounds_.length() &&
+           redundant_bounds_[next_redundant_bounds_] == offset;
+  }
+
+  // Labels only exist for the method's own code, or an inlined method's while
+  // it is emitted, and are only bound at the start of a block, i.e. at jump
+  // and switch targets.
+  Label *labelAt(size_t offset) {
+    assert(ke::IsAligned(offset, sizeof(cell_t)));
+    if (inline_) {
+      assert(offset > inline_->pcode_start);
+      assert(offset <= inline_->pcode_end);
+      return &inline_->jump_map[(offset - inline_->pcode_start) / sizeof(cell_t)];
+    }
+    assert(offset > pcode_start_);
+    assert(offset <= pcode_end_);
+    return &jump_map_[(offset - pcode_start_) / sizeof(cell_t)];
+  }
+
  protected:
   Environment *env_;
   PluginRuntime *rt_;
   PluginContext *context_;
   LegacyImage *image_;
+  // The method whose baseline code is being compiled, if any.
+  MethodInfo *method_;
   PoolScope scope_;
   int error_;
   uint32_t pcode_start_;
+  uint32_t pcode_end_;
   const cell_t *code_start_;
   const cell_t *op_cip_;
   const cell_t *code_end_;
+  OpcodeCounts *opcode_counts_;
+  bool off_thread_;
+  bool for_cache_;
+  // Set when host intrinsics were emitted, since the host may change them.
+  bool uses_intrinsics_;
 
   MacroAssembler masm;
 
   Label *jump_map_;
+  InlineScope *inline_;
+
+  // Pcode offsets of every jump and switch target in the method, sorted,
+  // and the index of the next one to bind.
+  ke::Vector<cell_t> block_starts_;
+  size_t next_block_;
+
+  // Stack depth at each cell of the method, or -1.
+  ke::Vector<int32_t> stack_depths_;
+
+  // Pcode offsets of BOUNDS checks that can't fail, sorted, and the index of
+  // the next one.
+  ke::Vector<cell_t> redundant_bounds_;
+  size_t next_redundant_bounds_;
 
   ke::Vector<OutOfLinePath*> ool_paths_;
 
-  Label throw_timeout_;
   Label throw_error_code_[SP_MAX_ERROR_CODES];
   Label report_error_;
   Label return_reported_error_;
 
-  ke::Vector<BackwardJump> backward_jumps_;
+  // Pcode offsets of the targets of backward jumps, i.e. loop headers.
+  ke::Vector<cell_t> loop_headers_;
   ke::Vector<CipMapEntry> cip_map_;
+  ke::Vector<OsrEntry> osr_entries_;
+  ke::Vector<CallSite> call_sites_;
 };
 
 } // namespace sp
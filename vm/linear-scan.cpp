@@ -0,0 +1,343 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <stdlib.h>
+#include "linear-scan.h"
+
+namespace sp {
+
+using namespace ke;
+
+LinearScan::LinearScan(SsaGraph* graph, uint32_t nregs, uint32_t preserved)
+ : graph_(graph),
+   nregs_(nregs),
+   preserved_(preserved),
+   num_spill_slots_(0),
+   words_(0)
+{
+}
+
+bool
+LinearScan::needsInterval(const SsaInsn* insn) const
+{
+  if (!insn->hasResult() || insn->uses.empty())
+    return false;
+  return insn->op != SsaOp::Constant && insn->op != SsaOp::Undefined;
+}
+
+// Each instruction gets two positions: its operands are read at the first,
+// and its result is written at the second. Phis are written at the start of
+// their block, and their operands are read at the end of each predecessor.
+void
+LinearScan::numberInstructions()
+{
+  uint32_t pos = 0;
+  const Vector<SsaBlock*>& order = graph_->order();
+  for (size_t i = 0; i < order.length(); i++) {
+    SsaBlock* block = order[i];
+    block->start_pos = pos;
+    for (size_t j = 0; j < block->phis.length(); j++)
+      block->phis[j]->pos = pos;
+    pos += 2;
+    for (size_t j = 0; j < block->insns.length(); j++) {
+      SsaInsn* insn = block->insns[j];
+      insn->pos = pos;
+      if (insn->clobbersRegisters())
+        clobbers_.append(pos);
+      pos += 2;
+    }
+    block->end_pos = pos;
+  }
+}
+
+static inline void
+SetBit(Vector<uint64_t>& set, uint32_t bit)
+{
+  set[bit / 64] |= uint64_t(1) << (bit % 64);
+}
+
+static inline void
+ClearBit(Vector<uint64_t>& set, uint32_t bit)
+{
+  set[bit / 64] &= ~(uint64_t(1) << (bit % 64));
+}
+
+static inline bool
+TestBit(const Vector<uint64_t>& set, uint32_t bit)
+{
+  return !!(set[bit / 64] & (uint64_t(1) << (bit % 64)));
+}
+
+void
+LinearScan::computeLiveness()
+{
+  words_ = (graph_->numInsns() + 63) / 64;
+  size_t nblocks = graph_->blocks().length();
+  live_in_.resize(nblocks);
+  live_out_.resize(nblocks);
+  for (size_t i = 0; i < nblocks; i++) {
+    live_in_[i].resize(words_);
+    live_out_[i].resize(words_);
+    for (size_t j = 0; j < words_; j++) {
+      live_in_[i][j] = 0;
+      live_out_[i][j] = 0;
+    }
+  }
+
+  Vector<uint64_t> live;
+  live.resize(words_);
+
+  const Vector<SsaBlock*>& order = graph_->order();
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = order.length(); i > 0; i--) {
+      SsaBlock* block = order[i - 1];
+      for (size_t j = 0; j < words_; j++)
+        live[j] = 0;
+
+      for (size_t j = 0; j < block->succs.length(); j++) {
+        SsaBlock* succ = block->succs[j];
+        const Vector<uint64_t>& in = live_in_[succ->id];
+        for (size_t k = 0; k < words_; k++)
+          live[k] |= in[k];
+
+        size_t index = 0;
+        while (succ->preds[index] != block)
+          index++;
+        for (size_t k = 0; k < succ->phis.length(); k++) {
+          SsaInsn* operand = succ->phis[k]->operand(index);
+          if (needsInterval(operand))
+            SetBit(live, operand->id);
+        }
+      }
+      for (size_t j = 0; j < words_; j++)
+        live_out_[block->id][j] = live[j];
+
+      for (size_t j = block->insns.length(); j > 0; j--) {
+        SsaInsn* insn = block->insns[j - 1];
+        ClearBit(live, insn->id);
+        for (size_t k = 0; k < insn->numOperands(); k++) {
+          if (needsInterval(insn->operand(k)))
+            SetBit(live, insn->operand(k)->id);
+        }
+      }
+      for (size_t j = 0; j < block->phis.length(); j++)
+        ClearBit(live, block->phis[j]->id);
+
+      Vector<uint64_t>& in = live_in_[block->id];
+      for (size_t j = 0; j < words_; j++) {
+        if (in[j] != live[j]) {
+          in[j] = live[j];
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+void
+LinearScan::buildIntervals()
+{
+  // Interval index by instruction id.
+  Vector<int32_t> index;
+  index.resize(graph_->numInsns());
+  for (size_t i = 0; i < index.length(); i++)
+    index[i] = -1;
+
+  auto define = [&, this](SsaInsn* insn, uint32_t pos) -> void {
+    if (!needsInterval(insn))
+      return;
+    index[insn->id] = int32_t(intervals_.length());
+    intervals_.append(Interval{insn, pos, pos});
+  };
+  auto extend = [&, this](uint32_t id, uint32_t pos) -> void {
+    Interval& interval = intervals_[index[id]];
+    if (pos > interval.end)
+      interval.end = pos;
+  };
+
+  // Definitions dominate their uses, so they come first in the order.
+  const Vector<SsaBlock*>& order = graph_->order();
+  for (size_t i = 0; i < order.length(); i++) {
+    SsaBlock* block = order[i];
+    for (size_t j = 0; j < block->phis.length(); j++)
+      define(block->phis[j], block->start_pos);
+    for (size_t j = 0; j < block->insns.length(); j++)
+      define(block->insns[j], block->insns[j]->pos + 1);
+  }
+
+  for (size_t i = 0; i < order.length(); i++) {
+    SsaBlock* block = order[i];
+    for (size_t j = 0; j < block->insns.length(); j++) {
+      SsaInsn* insn = block->insns[j];
+      for (size_t k = 0; k < insn->numOperands(); k++) {
+        if (needsInterval(insn->operand(k)))
+          extend(insn->operand(k)->id, insn->pos);
+      }
+    }
+
+    const Vector<uint64_t>& in = live_in_[block->id];
+    const Vector<uint64_t>& out = live_out_[block->id];
+    for (size_t j = 0; j < words_; j++) {
+      uint64_t bits = in[j] | out[j];
+      while (bits) {
+        uint32_t bit = 0;
+        while (!(bits & (uint64_t(1) << bit)))
+          bit++;
+        bits &= ~(uint64_t(1) << bit);
+
+        uint32_t id = uint32_t(j * 64 + bit);
+        if (TestBit(out, id))
+          extend(id, block->end_pos);
+        else
+          extend(id, block->start_pos);
+      }
+    }
+  }
+
+  qsort(intervals_.buffer(), intervals_.length(), sizeof(Interval),
+        [](const void* a, const void* b) -> int {
+    const Interval* left = reinterpret_cast<const Interval*>(a);
+    const Interval* right = reinterpret_cast<const Interval*>(b);
+    if (left->start != right->start)
+      return left->start < right->start ? -1 : 1;
+    if (left->value->id != right->value->id)
+      return left->value->id < right->value->id ? -1 : 1;
+    return 0;
+  });
+}
+
+bool
+LinearScan::crossesClobber(const Interval& interval) const
+{
+  // Find the first clobber after the start.
+  size_t lo = 0, hi = clobbers_.length();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (clobbers_[mid] <= interval.start)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < clobbers_.length() && clobbers_[lo] < interval.end;
+}
+
+void
+LinearScan::spill(Interval* interval)
+{
+  SsaInsn* value = interval->value;
+  value->alloc.kind = SsaAllocation::Spill;
+
+  // Parameters already have a home.
+  if (value->op == SsaOp::Param) {
+    value->alloc.index = -1;
+    return;
+  }
+
+  // A victim started before the current interval, so a slot freed since then
+  // may still be in use by it.
+  for (size_t i = 0; i < free_slots_.length(); i++) {
+    if (free_slots_[i].end < interval->start) {
+      value->alloc.index = int32_t(free_slots_[i].slot);
+      free_slots_.remove(i);
+      return;
+    }
+  }
+  value->alloc.index = int32_t(num_spill_slots_++);
+}
+
+void
+LinearScan::allocate()
+{
+  numberInstructions();
+  computeLiveness();
+  buildIntervals();
+
+  Vector<Interval*> active;
+  Vector<Interval*> spilled;
+  Vector<uint8_t> free_regs;
+  free_regs.resize(nregs_);
+  for (size_t i = 0; i < nregs_; i++)
+    free_regs[i] = 1;
+
+  for (size_t i = 0; i < intervals_.length(); i++) {
+    Interval* cur = &intervals_[i];
+
+    // Expire intervals that ended before this one starts.
+    for (size_t j = active.length(); j > 0; j--) {
+      Interval* other = active[j - 1];
+      if (other->end < cur->start) {
+        free_regs[other->value->alloc.index] = 1;
+        active.remove(j - 1);
+      }
+    }
+    for (size_t j = spilled.length(); j > 0; j--) {
+      Interval* other = spilled[j - 1];
+      if (other->end < cur->start) {
+        if (other->value->alloc.index >= 0)
+          free_slots_.append(FreeSlot{uint32_t(other->value->alloc.index), other->end});
+        spilled.remove(j - 1);
+      }
+    }
+
+    bool only_preserved = crossesClobber(*cur);
+
+    // The preserved register is the last choice, since it's the only one
+    // that can hold values across calls.
+    int32_t reg = -1;
+    if (!only_preserved) {
+      for (uint32_t r = 0; r < nregs_; r++) {
+        if (r != preserved_ && free_regs[r]) {
+          reg = int32_t(r);
+          break;
+        }
+      }
+    }
+    if (reg < 0 && free_regs[preserved_])
+      reg = int32_t(preserved_);
+
+    if (reg >= 0) {
+      free_regs[reg] = 0;
+      cur->value->alloc.kind = SsaAllocation::Register;
+      cur->value->alloc.index = reg;
+      active.append(cur);
+      continue;
+    }
+
+    // Take the register of the interval that ends last, if it ends after
+    // this one.
+    Interval* victim = nullptr;
+    size_t victim_index = 0;
+    for (size_t j = 0; j < active.length(); j++) {
+      Interval* other = active[j];
+      if (only_preserved && uint32_t(other->value->alloc.index) != preserved_)
+        continue;
+      if (!victim || other->end > victim->end) {
+        victim = other;
+        victim_index = j;
+      }
+    }
+    if (victim && victim->end > cur->end) {
+      cur->value->alloc = victim->value->alloc;
+      active.remove(victim_index);
+      active.append(cur);
+      spill(victim);
+      spilled.append(victim);
+    } else {
+      spill(cur);
+      spilled.append(cur);
+    }
+  }
+}
+
+} // namespace sp
@@ -0,0 +1,81 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_linear_scan_h_
+#define _include_sourcepawn_vm_linear_scan_h_
+
+#include <amtl/am-vector.h>
+#include "ssa-graph.h"
+
+namespace sp {
+
+// Assigns each value of an optimized SsaGraph a register or a spill slot,
+// with Poletto and Sarkar's linear scan. Blocks are laid out in reverse
+// postorder, and each value gets one interval, from its definition to the
+// last position where it is live. When registers run out, the interval that
+// ends last is spilled for its whole length.
+//
+// Registers are numbered from 0 to |nregs| - 1, and only |preserved|
+// survives instructions that clobber registers, so values live across them
+// either get it or are spilled. Constants have no interval, and a spilled
+// parameter lives in its argument slot.
+class LinearScan final
+{
+ public:
+  LinearScan(SsaGraph* graph, uint32_t nregs, uint32_t preserved);
+
+  void allocate();
+
+  uint32_t numSpillSlots() const {
+    return num_spill_slots_;
+  }
+
+ private:
+  struct Interval {
+    SsaInsn* value;
+    uint32_t start;
+    uint32_t end;
+  };
+
+  void numberInstructions();
+  void computeLiveness();
+  void buildIntervals();
+  bool needsInterval(const SsaInsn* insn) const;
+  bool crossesClobber(const Interval& interval) const;
+  void spill(Interval* interval);
+
+ private:
+  SsaGraph* graph_;
+  uint32_t nregs_;
+  uint32_t preserved_;
+  uint32_t num_spill_slots_;
+
+  // Live values at the start and end of each block, as bit sets over
+  // instruction ids, by block id.
+  size_t words_;
+  ke::Vector<ke::Vector<uint64_t>> live_in_;
+  ke::Vector<ke::Vector<uint64_t>> live_out_;
+
+  ke::Vector<Interval> intervals_;
+  ke::Vector<uint32_t> clobbers_;
+
+  // Spill slots whose last interval has ended, and where.
+  struct FreeSlot {
+    uint32_t slot;
+    uint32_t end;
+  };
+  ke::Vector<FreeSlot> free_slots_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_linear_scan_h_
@@ -12,33 +12,45 @@
 //
 #include "environment.h"
 #include "linking.h"
+#include "perf-map.h"
 
 using namespace sp;
 
 CodeChunk
-sp::LinkCode(Environment *env, Assembler &masm)
+sp::LinkCode(Environment *env, Assembler &masm, const char *name)
 {
   if (masm.outOfMemory())
     return CodeChunk();
 
-  CodeChunk code = env->AllocateCode(masm.length());
+  CodeChunk code = env->AllocateCode(masm.hotLength(), masm.coldLength());
   if (!code.address())
     return code;
 
-  masm.emitToExecutableMemory(code.address());
+  masm.emitToExecutableMemory(code.address(), code.cold_address());
+  if (PerfMap* map = env->perf_map()) {
+    if (name)
+      map->RecordCode(name, code.address(), code.bytes());
+  }
   return code;
 }
 
 uint8_t *
-sp::LinkCodeToLegacyPtr(Environment *env, Assembler &masm)
+sp::LinkCodeToLegacyPtr(Environment *env, Assembler &masm, const char *name)
 {
   if (masm.outOfMemory())
     return nullptr;
 
+  // Legacy code is a single block.
+  assert(!masm.hasColdCode());
+
   void *code = env->APIv1()->AllocatePageMemory(masm.length());
   if (!code)
     return nullptr;
 
   masm.emitToExecutableMemory(code);
+  if (PerfMap* map = env->perf_map()) {
+    if (name)
+      map->RecordCode(name, code, masm.length());
+  }
   return reinterpret_cast<uint8_t *>(code);
 }
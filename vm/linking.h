@@ -20,8 +20,11 @@ namespace sp {
 
 class Environment;
 
-CodeChunk LinkCode(Environment *env, Assembler& masm);
-uint8_t *LinkCodeToLegacyPtr(Environment *env, Assembler& masm);
+// Copy generated code to executable memory. If perf maps are enabled, code
+// with a |name| is recorded under it. Methods pass null, since they are
+// recorded along with their line info once compiled.
+CodeChunk LinkCode(Environment *env, Assembler& masm, const char *name);
+uint8_t *LinkCodeToLegacyPtr(Environment *env, Assembler& masm, const char *name);
 
 }
 
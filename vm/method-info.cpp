@@ -10,42 +10,80 @@
 // You should have received a copy of the GNU General Public License along with
 // SourcePawn. If not, see http://www.gnu.org/licenses/.
 //
-#include "environment.h"
 #include "compiled-function.h"
+#include "environment.h"
+#include "interp-code.h"
 #include "method-info.h"
 #include "method-verifier.h"
+#include "pcode-optimizer.h"
+#include "plugin-runtime.h"
 
 namespace sp {
 
 MethodInfo::MethodInfo(PluginRuntime* rt, uint32_t codeOffset)
  : rt_(rt),
    pcode_offset_(codeOffset),
+   jit_(nullptr),
+   optimized_(nullptr),
+   optimized_entry_(nullptr),
+   tier_up_counter_(kTierUpBudget),
    checked_(false),
-   validation_error_(SP_ERROR_NONE)
+   validation_error_(SP_ERROR_NONE),
+   compile_queued_(false),
+   invocation_count_(0),
+   backedge_count_(0),
+   opcode_counts_(nullptr)
 {
 }
 
 MethodInfo::~MethodInfo()
 {
+  delete jit_.load();
+  delete optimized_;
 }
 
 void
 MethodInfo::setCompiledFunction(CompiledFunction* fun)
 {
-  assert(!jit_);
+  Environment::get()->lock()->AssertCurrentThreadOwns();
+  assert(!jit());
+  jit_.store(fun, std::memory_order_release);
+}
+
+void
+MethodInfo::setOptimizedFunction(CompiledFunction* fun)
+{
+  assert(!optimized_);
+  optimized_ = fun;
+  optimized_entry_ = fun->GetEntryAddress();
+}
+
+CompiledFunction*
+MethodInfo::jitContaining(const void* pc) const
+{
+  uint32_t pcoffs;
+  if (optimized_ && optimized_->GetCodeOffset(pc, &pcoffs))
+    return optimized_;
+  return jit();
+}
 
-  // Grab the lock before linking code in, since the watchdog timer will look
-  // at this on another thread.
-  ke::AutoLock lock(Environment::get()->lock());
-  jit_ = fun;
+void
+MethodInfo::setInterpCode(InterpCode* code)
+{
+  assert(!interp_code_);
+  interp_code_ = code;
 }
 
 void
 MethodInfo::InternalValidate()
 {
   MethodVerifier verifier(rt_, pcode_offset_);
-  if (!verifier.verify())
+  if (!verifier.verify()) {
     validation_error_ = verifier.error();
+  } else if (rt_->writableCode()) {
+    PcodeOptimizer optimizer(rt_, pcode_offset_, verifier.endOffset());
+    optimizer.optimize();
+  }
 
   checked_ = true;
 }
@@ -15,11 +15,15 @@
 
 #include <sp_vm_types.h>
 #include <amtl/am-refcounting.h>
+#include <atomic>
+#include <limits.h>
 
 namespace sp {
 
 class PluginRuntime;
 class CompiledFunction;
+class InterpCode;
+struct OpcodeCounts;
 
 class MethodInfo final : public ke::Refcounted<MethodInfo>
 {
@@ -37,9 +41,88 @@ class MethodInfo final : public ke::Refcounted<MethodInfo>
     return pcode_offset_;
   }
 
+  // Compiled code may be published from a compile thread, so it is read
+  // with acquire semantics: code seen here is always fully written. It must
+  // be set with the environment lock held, after checking that jit() is
+  // still null, since the main thread and compile threads can race.
   void setCompiledFunction(CompiledFunction* fun);
   CompiledFunction* jit() const {
-    return jit_;
+    return jit_.load(std::memory_order_acquire);
+  }
+
+  // Code from the optimizing tier, which is only ever compiled and published
+  // on the main thread.
+  void setOptimizedFunction(CompiledFunction* fun);
+  CompiledFunction* optimized() const {
+    return optimized_;
+  }
+
+  // The fastest compiled form of the method, or null.
+  CompiledFunction* bestJit() const {
+    if (optimized_)
+      return optimized_;
+    return jit();
+  }
+
+  // The compiled form of the method containing |pc|, or null.
+  CompiledFunction* jitContaining(const void* pc) const;
+
+  // With the optimizing tier enabled, baseline code spends this budget,
+  // kTierUpCallCost per call and one per backedge taken, then asks for
+  // optimized code and jumps to it from its prologue.
+  static const int32_t kTierUpBudget = 20000;
+  static const int32_t kTierUpCallCost = 20;
+
+  int32_t* addressOfTierUpCounter() {
+    return &tier_up_counter_;
+  }
+  void** addressOfOptimizedEntry() {
+    return &optimized_entry_;
+  }
+
+  // Called when the method can't be optimized, so baseline code stops asking.
+  void disableTierUp() {
+    tier_up_counter_ = INT_MAX;
+  }
+
+  // Whether the method has been handed to the background compiler. Only
+  // used on the main thread.
+  bool isCompileQueued() const {
+    return compile_queued_;
+  }
+  void setCompileQueued(bool queued) {
+    compile_queued_ = queued;
+  }
+
+  void setInterpCode(InterpCode* code);
+  InterpCode* interp_code() const {
+    return interp_code_;
+  }
+
+  // When tiered compilation is enabled, methods are interpreted until one of
+  // these counters crosses its threshold, and are then compiled.
+  static const uint32_t kHotInvocationCount = 500;
+  static const uint32_t kHotBackedgeCount = 20000;
+
+  void recordInvocation() {
+    invocation_count_++;
+  }
+  // Returns true each time another kHotBackedgeCount backedges have been
+  // taken, as a hint to try on-stack replacement.
+  bool recordBackedge() {
+    return ++backedge_count_ % kHotBackedgeCount == 0;
+  }
+  bool isHot() const {
+    return invocation_count_ >= kHotInvocationCount ||
+           backedge_count_ >= kHotBackedgeCount;
+  }
+
+  // Counters for opcode profiling, owned by the OpcodeProfiler.
+  OpcodeCounts* opcode_counts() const {
+    return opcode_counts_;
+  }
+  void setOpcodeCounts(OpcodeCounts* counts) {
+    opcode_counts_ = counts;
   }
 
  private:
@@ -48,10 +131,19 @@ class MethodInfo final : public ke::Refcounted<MethodInfo>
  private:
   PluginRuntime* rt_;
   uint32_t pcode_offset_;
-  ke::AutoPtr<CompiledFunction> jit_;
+  std::atomic<CompiledFunction*> jit_;
+  CompiledFunction* optimized_;
+  void* optimized_entry_;
+  int32_t tier_up_counter_;
+  ke::AutoPtr<InterpCode> interp_code_;
 
   bool checked_;
   int validation_error_;
+  bool compile_queued_;
+
+  uint32_t invocation_count_;
+  uint32_t backedge_count_;
+  OpcodeCounts* opcode_counts_;
 };
 
 } // namespace sp
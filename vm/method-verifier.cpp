@@ -20,6 +20,11 @@ namespace sp {
 
 using namespace ke;
 
+// Depth sentinels: no path to the instruction has been seen yet, or paths
+// disagree or can't be followed statically.
+static const int32_t kNoDepth = -1;
+static const int32_t kUnknownDepth = -2;
+
 MethodVerifier::MethodVerifier(PluginRuntime* rt, uint32_t startOffset)
  : rt_(rt),
    startOffset_(startOffset),
@@ -29,8 +34,14 @@ MethodVerifier::MethodVerifier(PluginRuntime* rt, uint32_t startOffset)
    code_(nullptr),
    cip_(nullptr),
    stop_at_(nullptr),
+   method_end_(nullptr),
    highest_jump_target_(nullptr),
-   error_(SP_ERROR_NONE)
+   error_(SP_ERROR_NONE),
+   depth_(0),
+   guess_depth_(kUnknownDepth),
+   push_c_end_(nullptr),
+   push_c_value_(0),
+   depth_conflict_(false)
 {
   assert(datSize_ < memSize_);
   assert(heapSize_ <= memSize_ - datSize_);
@@ -49,6 +60,7 @@ MethodVerifier::verify()
   }
 
   method_ = code_ + (startOffset_ / sizeof(cell_t));
+  method_end_ = stop_at_;
   cip_ = method_;
 
   {
@@ -62,12 +74,21 @@ MethodVerifier::verify()
   }
 
   while (more()) {
+    const cell_t* op_cip = cip_;
     OPCODE op = (OPCODE)*cip_++;
-    if (op == OP_PROC || op == OP_ENDPROC)
+    if (op == OP_PROC || op == OP_ENDPROC) {
+      method_end_ = op_cip;
       break;
+    }
 
+    if (collect_opcodes_)
+      collect_opcodes_(cell_t(op_cip - code_) * sizeof(cell_t), op);
+    if (trackingStack())
+      enterInstruction(op_cip);
     if (!verifyOp(op))
       return false;
+    if (trackingStack())
+      trackStack(op, op_cip);
   }
 
   // Jumps past the method boundaries are invalid.
@@ -76,6 +97,20 @@ MethodVerifier::verify()
     return false;
   }
 
+  if (collect_proven_ && !depth_conflict_) {
+    for (size_t i = 0; i < proven_.length(); i++)
+      collect_proven_(proven_[i]);
+  }
+  if (collect_depths_ && !depth_conflict_) {
+    for (size_t i = 0; i < depths_.length(); i++) {
+      if (depths_[i] >= 0)
+        collect_depths_(cell_t((method_ - code_) + i) * sizeof(cell_t), depths_[i]);
+    }
+  }
+  if (collect_jump_targets_) {
+    for (size_t i = 0; i < jump_targets_.length(); i++)
+      collect_jump_targets_(jump_targets_[i]);
+  }
   return true;
 }
 
@@ -270,9 +305,10 @@ MethodVerifier::verifyOp(OPCODE op)
   case OP_JSGEQ:
   {
     cell_t offset;
-    if (!readCell(&offset))
+    if (!readCell(&offset) || !verifyJumpOffset(offset))
       return false;
-    return verifyJumpOffset(offset);
+    addJumpTarget(offset);
+    return true;
   }
 
   case OP_SHL_C_PRI:
@@ -441,6 +477,7 @@ MethodVerifier::verifyOp(OPCODE op)
         return false;
       if (!readCell(&defaultOffset) || !verifyJumpOffset(defaultOffset))
         return false;
+      addJumpTarget(defaultOffset);
       if (ncases >= INT_MAX || ncases < 0) {
         reportError(SP_ERROR_INVALID_INSTRUCTION);
         return false;
@@ -454,6 +491,7 @@ MethodVerifier::verifyOp(OPCODE op)
         {
           return true;
         }
+        addJumpTarget(offset);
       }
     }
     return true;
@@ -631,6 +669,370 @@ MethodVerifier::collectExternalFuncRefs(const ExternalFuncRefCallback& callback)
   collect_func_refs_ = callback;
 }
 
+void
+MethodVerifier::collectProvenAccesses(const ProvenAccessCallback& callback)
+{
+  collect_proven_ = callback;
+}
+
+void
+MethodVerifier::collectJumpTargets(const JumpTargetCallback& callback)
+{
+  collect_jump_targets_ = callback;
+}
+
+void
+MethodVerifier::collectStackDepths(const StackDepthCallback& callback)
+{
+  collect_depths_ = callback;
+}
+
+void
+MethodVerifier::collectOpcodes(const OpcodeCallback& callback)
+{
+  collect_opcodes_ = callback;
+}
+
+void
+MethodVerifier::addJumpTarget(cell_t offset)
+{
+  if (collect_jump_targets_)
+    jump_targets_.append(offset);
+}
+
+static inline int32_t
+MergeDepth(int32_t a, int32_t b)
+{
+  if (a == b || b == kNoDepth)
+    return a;
+  if (a == kNoDepth)
+    return b;
+  return kUnknownDepth;
+}
+
+void
+MethodVerifier::enterInstruction(const cell_t* cip)
+{
+  size_t index = cip - method_;
+  while (depths_.length() <= index)
+    depths_.append(kNoDepth);
+
+  // Merge the fallthrough depth with any forward jumps to here. If neither
+  // reaches this instruction, only a later backward jump can (for example,
+  // the increment of a for loop). Guess that it has the depth the last block
+  // ended with; trackJump() checks the guess when the jump is seen.
+  if (depths_[index] != kNoDepth)
+    push_c_end_ = nullptr;
+  depth_ = MergeDepth(depth_, depths_[index]);
+  if (depth_ == kNoDepth)
+    depth_ = guess_depth_;
+  depths_[index] = depth_;
+}
+
+void
+MethodVerifier::trackJump(const cell_t* cip, cell_t target)
+{
+  if (target < 0 || !IsAligned(target, sizeof(cell_t))) {
+    depth_conflict_ = true;
+    return;
+  }
+  const cell_t* dest = code_ + (target / sizeof(cell_t));
+  if (dest <= method_ || dest >= stop_at_) {
+    depth_conflict_ = true;
+    return;
+  }
+
+  size_t index = dest - method_;
+  if (dest > cip) {
+    while (depths_.length() <= index)
+      depths_.append(kNoDepth);
+    depths_[index] = MergeDepth(depths_[index], depth_);
+    return;
+  }
+
+  // Anything proven at the target assumed the depth recorded there.
+  if (index < depths_.length() && depths_[index] >= 0 && depths_[index] != depth_)
+    depth_conflict_ = true;
+}
+
+bool
+MethodVerifier::isProvenFrameOffset(cell_t offset) const
+{
+  if (!IsAligned(offset, sizeof(cell_t)))
+    return false;
+
+  // The frame header (saved cip, saved frm, and argument count) is always
+  // there. Arguments are not, since callers may pass fewer than the method
+  // reads.
+  if (offset >= 0)
+    return offset < cell_t(3 * sizeof(cell_t));
+  return depth_ >= 0 && -offset <= depth_;
+}
+
+void
+MethodVerifier::endBlock()
+{
+  guess_depth_ = depth_;
+  depth_ = kNoDepth;
+}
+
+void
+MethodVerifier::adjustDepth(int32_t delta)
+{
+  if (depth_ < 0)
+    return;
+  depth_ += delta;
+  if (depth_ < 0)
+    depth_ = kUnknownDepth;
+}
+
+void
+MethodVerifier::trackStack(OPCODE op, const cell_t* cip)
+{
+  const cell_t* params = cip + 1;
+  cell_t offset = (cip - code_) * sizeof(cell_t);
+
+  switch (op) {
+  case OP_LOAD_S_PRI:
+  case OP_LOAD_S_ALT:
+  case OP_STOR_S_PRI:
+  case OP_STOR_S_ALT:
+  case OP_INC_S:
+  case OP_DEC_S:
+  case OP_ZERO_S:
+  case OP_CONST_S:
+    if (isProvenFrameOffset(params[0]))
+      proven_.append(offset);
+    break;
+
+  case OP_LOAD_S_BOTH:
+    if (isProvenFrameOffset(params[0]) && isProvenFrameOffset(params[1]))
+      proven_.append(offset);
+    break;
+
+  case OP_PUSH_S:
+  case OP_PUSH2_S:
+  case OP_PUSH3_S:
+  case OP_PUSH4_S:
+  case OP_PUSH5_S:
+  {
+    // Pushing only makes the stack deeper, so offsets proven at the start of
+    // the instruction stay proven.
+    size_t n = 1;
+    if (op >= OP_PUSH2_S)
+      n = ((op - OP_PUSH2_S) / 4) + 2;
+
+    bool proven = true;
+    for (size_t i = 0; i < n; i++)
+      proven &= isProvenFrameOffset(params[i]);
+    if (proven)
+      proven_.append(offset);
+    adjustDepth(int32_t(n * sizeof(cell_t)));
+    break;
+  }
+
+  case OP_PUSH_PRI:
+  case OP_PUSH_ALT:
+    adjustDepth(sizeof(cell_t));
+    break;
+
+  case OP_PUSH_C:
+  case OP_PUSH2_C:
+  case OP_PUSH3_C:
+  case OP_PUSH4_C:
+  case OP_PUSH5_C:
+  {
+    size_t n = 1;
+    if (op >= OP_PUSH2_C)
+      n = ((op - OP_PUSH2_C) / 4) + 2;
+    adjustDepth(int32_t(n * sizeof(cell_t)));
+    push_c_end_ = params + n;
+    push_c_value_ = params[n - 1];
+    return;
+  }
+
+  case OP_PUSH:
+  case OP_PUSH2:
+  case OP_PUSH3:
+  case OP_PUSH4:
+  case OP_PUSH5:
+  {
+    size_t n = 1;
+    if (op >= OP_PUSH2)
+      n = ((op - OP_PUSH2) / 4) + 2;
+    adjustDepth(int32_t(n * sizeof(cell_t)));
+    break;
+  }
+
+  case OP_PUSH_ADR:
+  case OP_PUSH2_ADR:
+  case OP_PUSH3_ADR:
+  case OP_PUSH4_ADR:
+  case OP_PUSH5_ADR:
+  {
+    size_t n = 1;
+    if (op >= OP_PUSH2_ADR)
+      n = ((op - OP_PUSH2_ADR) / 4) + 2;
+    adjustDepth(int32_t(n * sizeof(cell_t)));
+    break;
+  }
+
+  case OP_POP_PRI:
+  case OP_POP_ALT:
+    if (depth_ >= cell_t(sizeof(cell_t)))
+      proven_.append(offset);
+    adjustDepth(-int32_t(sizeof(cell_t)));
+    break;
+
+  case OP_STACK:
+    // Bad amounts are caught at runtime; they just make the depth unknown.
+    if (size_t((params[0] < 0) ? -params[0] : params[0]) >= heapSize_)
+      depth_ = kUnknownDepth;
+    else
+      adjustDepth(-params[0]);
+    break;
+
+  case OP_CALL:
+    // The callee pops its arguments and their count.
+    if (push_c_end_ == cip && push_c_value_ >= 0 && push_c_value_ <= SP_MAX_CALL_ARGUMENTS)
+      adjustDepth(-int32_t((push_c_value_ + 1) * sizeof(cell_t)));
+    else
+      depth_ = kUnknownDepth;
+    break;
+
+  case OP_SYSREQ_N:
+    // The argument count is pushed and popped along with the arguments.
+    adjustDepth(-int32_t(params[1] * sizeof(cell_t)));
+    break;
+
+  case OP_JUMP:
+    trackJump(cip, params[0]);
+    endBlock();
+    break;
+
+  case OP_JZER:
+  case OP_JNZ:
+  case OP_JEQ:
+  case OP_JNEQ:
+  case OP_JSLESS:
+  case OP_JSLEQ:
+  case OP_JSGRTR:
+  case OP_JSGEQ:
+    trackJump(cip, params[0]);
+    break;
+
+  case OP_SWITCH:
+  {
+    cell_t table_offset = params[0];
+    const cell_t* table = code_ + (table_offset / sizeof(cell_t));
+    if (table + 3 > stop_at_ || table[0] != OP_CASETBL || table[1] < 0 ||
+        size_t(stop_at_ - (table + 3)) / 2 < size_t(table[1]))
+    {
+      depth_conflict_ = true;
+      break;
+    }
+    trackJump(cip, table[2]);
+    for (cell_t i = 0; i < table[1]; i++)
+      trackJump(cip, table[3 + i * 2 + 1]);
+    endBlock();
+    break;
+  }
+
+  case OP_RETN:
+    endBlock();
+    break;
+
+  // These have no effect on the stack.
+  case OP_NOP:
+  case OP_BREAK:
+  case OP_LOAD_PRI:
+  case OP_LOAD_ALT:
+  case OP_LREF_S_PRI:
+  case OP_LREF_S_ALT:
+  case OP_LOAD_I:
+  case OP_LODB_I:
+  case OP_CONST_PRI:
+  case OP_CONST_ALT:
+  case OP_ADDR_PRI:
+  case OP_ADDR_ALT:
+  case OP_STOR_PRI:
+  case OP_STOR_ALT:
+  case OP_SREF_S_PRI:
+  case OP_SREF_S_ALT:
+  case OP_STOR_I:
+  case OP_STRB_I:
+  case OP_LIDX:
+  case OP_IDXADDR:
+  case OP_MOVE_PRI:
+  case OP_MOVE_ALT:
+  case OP_XCHG:
+  case OP_HEAP:
+  case OP_SHL:
+  case OP_SHR:
+  case OP_SSHR:
+  case OP_SHL_C_PRI:
+  case OP_SHL_C_ALT:
+  case OP_SMUL:
+  case OP_SDIV:
+  case OP_SDIV_ALT:
+  case OP_ADD:
+  case OP_SUB:
+  case OP_SUB_ALT:
+  case OP_AND:
+  case OP_OR:
+  case OP_XOR:
+  case OP_NOT:
+  case OP_NEG:
+  case OP_INVERT:
+  case OP_ADD_C:
+  case OP_SMUL_C:
+  case OP_ZERO_PRI:
+  case OP_ZERO_ALT:
+  case OP_ZERO:
+  case OP_EQ:
+  case OP_NEQ:
+  case OP_SLESS:
+  case OP_SLEQ:
+  case OP_SGRTR:
+  case OP_SGEQ:
+  case OP_EQ_C_PRI:
+  case OP_EQ_C_ALT:
+  case OP_INC_PRI:
+  case OP_INC_ALT:
+  case OP_INC:
+  case OP_INC_I:
+  case OP_DEC_PRI:
+  case OP_DEC_ALT:
+  case OP_DEC:
+  case OP_DEC_I:
+  case OP_MOVS:
+  case OP_FILL:
+  case OP_BOUNDS:
+  case OP_SYSREQ_C:
+  case OP_SWAP_PRI:
+  case OP_SWAP_ALT:
+  case OP_LOAD_BOTH:
+  case OP_CONST:
+  case OP_TRACKER_PUSH_C:
+  case OP_TRACKER_POP_SETHEAP:
+  case OP_STRADJUST_PRI:
+  case OP_CASETBL:
+    break;
+
+  case OP_GENARRAY:
+  case OP_GENARRAY_Z:
+    // All but the last dimension are popped.
+    adjustDepth(-int32_t((params[0] - 1) * sizeof(cell_t)));
+    break;
+
+  default:
+    depth_ = kUnknownDepth;
+    break;
+  }
+
+  push_c_end_ = nullptr;
+}
+
 void
 MethodVerifier::reportError(int err)
 {
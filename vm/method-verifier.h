@@ -16,6 +16,7 @@
 #include <sp_vm_types.h>
 #include <smx/smx-v1-opcodes.h>
 #include <amtl/am-function.h>
+#include <amtl/am-vector.h>
 
 namespace sp {
 
@@ -29,8 +30,41 @@ class MethodVerifier final
   typedef ke::Lambda<void(cell_t)> ExternalFuncRefCallback;
   void collectExternalFuncRefs(const ExternalFuncRefCallback& callback);
 
+  // After a successful verify(), the callback is given the pcode offset of
+  // every instruction whose stack accesses are proven in bounds: frame
+  // offsets that land between sp and the frame header, and pops of cells the
+  // method itself pushed. Data section accesses need no proof, since
+  // verify() already rejects offsets outside the data section.
+  typedef ke::Lambda<void(cell_t)> ProvenAccessCallback;
+  void collectProvenAccesses(const ProvenAccessCallback& callback);
+
+  // After a successful verify(), the callback is given the pcode offset of
+  // every jump and switch case target in the method. Targets are not sorted,
+  // and may be reported more than once.
+  typedef ke::Lambda<void(cell_t)> JumpTargetCallback;
+  void collectJumpTargets(const JumpTargetCallback& callback);
+
+  // After a successful verify(), the callback is given the pcode offset of
+  // every instruction where the stack depth is known, in order, along with
+  // the number of bytes below frm at the start of the instruction. As with
+  // proofs, nothing is given if paths to an instruction disagree.
+  typedef ke::Lambda<void(cell_t, int32_t)> StackDepthCallback;
+  void collectStackDepths(const StackDepthCallback& callback);
+
+  // During verify(), the callback is given the pcode offset and opcode of
+  // every instruction in the method, in order. What it was given can only be
+  // trusted if verify() succeeds.
+  typedef ke::Lambda<void(cell_t, OPCODE)> OpcodeCallback;
+  void collectOpcodes(const OpcodeCallback& callback);
+
   bool verify();
 
+  // After a successful verify(), the pcode offset of the instruction that
+  // ends the method: the next PROC or ENDPROC, or the end of the code.
+  cell_t endOffset() const {
+    return cell_t(method_end_ - code_) * sizeof(cell_t);
+  }
+
   int error() const {
     return error_;
   }
@@ -39,6 +73,9 @@ class MethodVerifier final
   bool more() const {
     return cip_ < stop_at_;
   }
+  bool trackingStack() const {
+    return collect_proven_ || collect_depths_;
+  }
 
  private:
   bool verifyOp(OPCODE op);
@@ -51,10 +88,18 @@ class MethodVerifier final
   bool verifyHeapAmount(cell_t amount);
   bool verifyMemAmount(cell_t amount);
   bool verifyCallOffset(cell_t offset);
+  void addJumpTarget(cell_t offset);
   bool readCell(cell_t* out);
   bool getCells(const cell_t** out, size_t ncells);
   void reportError(int err);
 
+  void enterInstruction(const cell_t* cip);
+  void trackStack(OPCODE op, const cell_t* cip);
+  void trackJump(const cell_t* cip, cell_t target);
+  bool isProvenFrameOffset(cell_t offset) const;
+  void adjustDepth(int32_t delta);
+  void endBlock();
+
  private:
   PluginRuntime* rt_;
   uint32_t startOffset_;
@@ -65,9 +110,37 @@ class MethodVerifier final
   const cell_t* method_;
   const cell_t* cip_;
   const cell_t* stop_at_;
+  const cell_t* method_end_;
   const cell_t* highest_jump_target_;
   ExternalFuncRefCallback collect_func_refs_;
   int error_;
+
+  // Number of bytes below frm at the current instruction, counting locals
+  // and pushed temporaries, or one of the sentinels in method-verifier.cpp.
+  // Only tracked when proofs or depths are being collected.
+  int32_t depth_;
+
+  // Depth at the end of the last block, assumed for code that only a later
+  // backward jump reaches.
+  int32_t guess_depth_;
+
+  // Depth at each cell of the method that is an instruction or a forward
+  // jump target.
+  ke::Vector<int32_t> depths_;
+
+  // If a PUSH.C immediately precedes a CALL, it is the argument count.
+  const cell_t* push_c_end_;
+  cell_t push_c_value_;
+
+  // Set if a backward jump arrives with a depth different from the one its
+  // target was proven with.
+  bool depth_conflict_;
+  ke::Vector<cell_t> proven_;
+  ProvenAccessCallback collect_proven_;
+  ke::Vector<cell_t> jump_targets_;
+  JumpTargetCallback collect_jump_targets_;
+  StackDepthCallback collect_depths_;
+  OpcodeCallback collect_opcodes_;
 };
 
 } // namespace sp
@@ -0,0 +1,427 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include "opcode-profiler.h"
+#include "method-info.h"
+#include "opcodes.h"
+#include "plugin-runtime.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace sp {
+
+OpcodeCounts::OpcodeCounts(const char* plugin, const char* method)
+ : plugin(plugin),
+   method(method)
+{
+  memset(ops, 0, sizeof(ops));
+}
+
+OpcodeProfiler::OpcodeProfiler(const char* report_path)
+ : report_path_(report_path)
+{
+  history_.prev = OPCODES_TOTAL;
+  history_.prev2 = OPCODES_TOTAL;
+  memset(triple_cache_, 0, sizeof(triple_cache_));
+}
+
+OpcodeProfiler::~OpcodeProfiler()
+{
+}
+
+bool
+OpcodeProfiler::init()
+{
+  // One extra row, for the first opcode executed.
+  size_t npairs = (OPCODES_TOTAL + 1) * OPCODES_TOTAL;
+  pairs_ = new uint64_t[npairs];
+  memset(pairs_.get(), 0, npairs * sizeof(uint64_t));
+  return triples_.init(1024);
+}
+
+OpcodeCounts*
+OpcodeProfiler::countsFor(PluginRuntime* rt, MethodInfo* method)
+{
+  if (OpcodeCounts* counts = method->opcode_counts())
+    return counts;
+
+  const char* name = rt->image()->LookupFunction(method->pcode_offset());
+  if (!name)
+    name = "<unknown>";
+
+  OpcodeCounts* counts = nullptr;
+  for (size_t i = 0; i < methods_.length(); i++) {
+    if (methods_[i]->plugin == rt->Name() && methods_[i]->method == name) {
+      counts = methods_[i].get();
+      break;
+    }
+  }
+  if (!counts) {
+    counts = new OpcodeCounts(rt->Name(), name);
+    methods_.append(ke::AutoPtr<OpcodeCounts>(counts));
+  }
+
+  method->setOpcodeCounts(counts);
+  return counts;
+}
+
+void
+OpcodeProfiler::recordTriple(OPCODE op)
+{
+  uint32_t key = (history_.prev2 * OPCODES_TOTAL + history_.prev) * OPCODES_TOTAL + op;
+
+  CachedTriple& slot = triple_cache_[ke::HashInteger<4>(key) % kTripleCacheSize];
+  if (slot.key == key) {
+    slot.count++;
+    return;
+  }
+
+  if (slot.count)
+    addTriple(slot.key, slot.count);
+  slot.key = key;
+  slot.count = 1;
+}
+
+void
+OpcodeProfiler::flushTriples()
+{
+  for (size_t i = 0; i < kTripleCacheSize; i++) {
+    CachedTriple& slot = triple_cache_[i];
+    if (!slot.count)
+      continue;
+    addTriple(slot.key, slot.count);
+    slot.count = 0;
+  }
+}
+
+void
+OpcodeProfiler::addTriple(uint32_t key, uint64_t count)
+{
+  TripleMap::Insert p = triples_.findForAdd(key);
+  if (p.found())
+    p->value += count;
+  else
+    triples_.add(p, key, count);
+}
+
+namespace {
+
+struct CountEntry
+{
+  uint64_t count;
+  uint32_t key;
+  const char* name;
+};
+
+int
+CompareCounts(const void* a, const void* b)
+{
+  const CountEntry* left = reinterpret_cast<const CountEntry*>(a);
+  const CountEntry* right = reinterpret_cast<const CountEntry*>(b);
+  if (left->count != right->count)
+    return left->count > right->count ? -1 : 1;
+  if (left->key != right->key)
+    return left->key < right->key ? -1 : 1;
+  return 0;
+}
+
+void
+SortCounts(ke::Vector<CountEntry>& entries)
+{
+  if (entries.length())
+    qsort(entries.buffer(), entries.length(), sizeof(CountEntry), CompareCounts);
+}
+
+struct PluginCounts
+{
+  const char* name;
+  uint64_t ops[OPCODES_TOTAL];
+};
+
+uint64_t
+Total(const uint64_t* ops)
+{
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < OPCODES_TOTAL; i++)
+    total += ops[i];
+  return total;
+}
+
+void
+CollectOpcodes(const uint64_t* ops, ke::Vector<CountEntry>* out)
+{
+  for (uint32_t i = 0; i < OPCODES_TOTAL; i++) {
+    if (!ops[i])
+      continue;
+    CountEntry entry = { ops[i], i, OpcodeNames[i] };
+    out->append(entry);
+  }
+  SortCounts(*out);
+}
+
+void
+CollectPairs(const uint64_t* pairs, ke::Vector<CountEntry>* out)
+{
+  for (uint32_t key = 0; key < OPCODES_TOTAL * OPCODES_TOTAL; key++) {
+    if (!pairs[key])
+      continue;
+    CountEntry entry = { pairs[key], key, nullptr };
+    out->append(entry);
+  }
+  SortCounts(*out);
+}
+
+template <typename Map>
+void
+CollectTriples(Map& triples, ke::Vector<CountEntry>* out)
+{
+  for (typename Map::iterator iter = triples.iter(); !iter.empty(); iter.next()) {
+    CountEntry entry = { iter->value, iter->key, nullptr };
+    out->append(entry);
+  }
+  SortCounts(*out);
+}
+
+} // anonymous namespace
+
+bool
+OpcodeProfiler::writeReport()
+{
+  flushTriples();
+
+  ke::AString text_path = ke::AString::Sprintf("%s.txt", report_path_.chars());
+  ke::AString json_path = ke::AString::Sprintf("%s.json", report_path_.chars());
+
+  FILE* fp = fopen(text_path.chars(), "wt");
+  if (!fp)
+    return false;
+  writeText(fp);
+  fclose(fp);
+
+  if ((fp = fopen(json_path.chars(), "wt")) == nullptr)
+    return false;
+  writeJson(fp);
+  fclose(fp);
+  return true;
+}
+
+// Roll method counts up into plugins, in the order plugins were first seen.
+static void
+CollectPlugins(const ke::Vector<ke::AutoPtr<OpcodeCounts>>& methods,
+               ke::Vector<ke::AutoPtr<PluginCounts>>* plugins)
+{
+  for (size_t i = 0; i < methods.length(); i++) {
+    const OpcodeCounts* counts = methods[i].get();
+
+    PluginCounts* plugin = nullptr;
+    for (size_t j = 0; j < plugins->length(); j++) {
+      if (strcmp(plugins->at(j)->name, counts->plugin.chars()) == 0) {
+        plugin = plugins->at(j).get();
+        break;
+      }
+    }
+    if (!plugin) {
+      plugin = new PluginCounts;
+      plugin->name = counts->plugin.chars();
+      memset(plugin->ops, 0, sizeof(plugin->ops));
+      plugins->append(ke::AutoPtr<PluginCounts>(plugin));
+    }
+
+    for (uint32_t op = 0; op < OPCODES_TOTAL; op++)
+      plugin->ops[op] += counts->ops[op];
+  }
+}
+
+void
+OpcodeProfiler::writeText(FILE* fp)
+{
+  ke::Vector<ke::AutoPtr<PluginCounts>> plugins;
+  CollectPlugins(methods_, &plugins);
+
+  uint64_t all[OPCODES_TOTAL];
+  memset(all, 0, sizeof(all));
+  for (size_t i = 0; i < plugins.length(); i++) {
+    for (uint32_t op = 0; op < OPCODES_TOTAL; op++)
+      all[op] += plugins[i]->ops[op];
+  }
+
+  fprintf(fp, "# Executed opcodes, as \"count<TAB>name\", most frequent first.\n");
+  fprintf(fp, "# Total: %" PRIu64 "\n", Total(all));
+
+  fprintf(fp, "\n# Plugins\n");
+  {
+    ke::Vector<CountEntry> entries;
+    for (size_t i = 0; i < plugins.length(); i++) {
+      CountEntry entry = { Total(plugins[i]->ops), uint32_t(i), plugins[i]->name };
+      entries.append(entry);
+    }
+    SortCounts(entries);
+    for (size_t i = 0; i < entries.length(); i++)
+      fprintf(fp, "%" PRIu64 "\t%s\n", entries[i].count, entries[i].name);
+  }
+
+  fprintf(fp, "\n# Methods\n");
+  {
+    ke::Vector<CountEntry> entries;
+    for (size_t i = 0; i < methods_.length(); i++) {
+      CountEntry entry = { Total(methods_[i]->ops), uint32_t(i), nullptr };
+      entries.append(entry);
+    }
+    SortCounts(entries);
+    for (size_t i = 0; i < entries.length(); i++) {
+      const OpcodeCounts* counts = methods_[entries[i].key].get();
+      fprintf(fp, "%" PRIu64 "\t%s::%s\n", entries[i].count, counts->plugin.chars(),
+              counts->method.chars());
+    }
+  }
+
+  fprintf(fp, "\n# Opcodes\n");
+  {
+    ke::Vector<CountEntry> entries;
+    CollectOpcodes(all, &entries);
+    for (size_t i = 0; i < entries.length(); i++)
+      fprintf(fp, "%" PRIu64 "\t%s\n", entries[i].count, entries[i].name);
+  }
+
+  for (size_t i = 0; i < plugins.length(); i++) {
+    fprintf(fp, "\n# Opcodes in %s\n", plugins[i]->name);
+
+    ke::Vector<CountEntry> entries;
+    CollectOpcodes(plugins[i]->ops, &entries);
+    for (size_t j = 0; j < entries.length(); j++)
+      fprintf(fp, "%" PRIu64 "\t%s\n", entries[j].count, entries[j].name);
+  }
+
+  fprintf(fp, "\n# Pairs\n");
+  {
+    ke::Vector<CountEntry> entries;
+    CollectPairs(pairs_.get(), &entries);
+    for (size_t i = 0; i < entries.length(); i++) {
+      uint32_t key = entries[i].key;
+      fprintf(fp, "%" PRIu64 "\t%s %s\n", entries[i].count,
+              OpcodeNames[key / OPCODES_TOTAL],
+              OpcodeNames[key % OPCODES_TOTAL]);
+    }
+  }
+
+  fprintf(fp, "\n# Triples\n");
+  {
+    ke::Vector<CountEntry> entries;
+    CollectTriples(triples_, &entries);
+    for (size_t i = 0; i < entries.length(); i++) {
+      uint32_t key = entries[i].key;
+      fprintf(fp, "%" PRIu64 "\t%s %s %s\n", entries[i].count,
+              OpcodeNames[key / (OPCODES_TOTAL * OPCODES_TOTAL)],
+              OpcodeNames[(key / OPCODES_TOTAL) % OPCODES_TOTAL],
+              OpcodeNames[key % OPCODES_TOTAL]);
+    }
+  }
+}
+
+static void
+WriteJsonString(FILE* fp, const char* str)
+{
+  fputc('"', fp);
+  for (const char* p = str; *p; p++) {
+    unsigned char c = *p;
+    if (c == '"' || c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(fp, "\\u%04x", c);
+    else
+      fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+static void
+WriteJsonOpcodes(FILE* fp, const uint64_t* ops)
+{
+  ke::Vector<CountEntry> entries;
+  CollectOpcodes(ops, &entries);
+
+  fprintf(fp, "{");
+  for (size_t i = 0; i < entries.length(); i++) {
+    fprintf(fp, "%s", i ? ", " : "");
+    WriteJsonString(fp, entries[i].name);
+    fprintf(fp, ": %" PRIu64, entries[i].count);
+  }
+  fprintf(fp, "}");
+}
+
+void
+OpcodeProfiler::writeJson(FILE* fp)
+{
+  ke::Vector<ke::AutoPtr<PluginCounts>> plugins;
+  CollectPlugins(methods_, &plugins);
+
+  fprintf(fp, "{\n  \"plugins\": [");
+  for (size_t i = 0; i < plugins.length(); i++) {
+    const PluginCounts* plugin = plugins[i].get();
+
+    fprintf(fp, "%s\n    {\"name\": ", i ? "," : "");
+    WriteJsonString(fp, plugin->name);
+    fprintf(fp, ", \"total\": %" PRIu64 ", \"opcodes\": ", Total(plugin->ops));
+    WriteJsonOpcodes(fp, plugin->ops);
+    fprintf(fp, ",\n     \"methods\": [");
+
+    bool first = true;
+    for (size_t j = 0; j < methods_.length(); j++) {
+      const OpcodeCounts* counts = methods_[j].get();
+      if (strcmp(counts->plugin.chars(), plugin->name) != 0)
+        continue;
+
+      fprintf(fp, "%s\n       {\"name\": ", first ? "" : ",");
+      WriteJsonString(fp, counts->method.chars());
+      fprintf(fp, ", \"total\": %" PRIu64 ", \"opcodes\": ", Total(counts->ops));
+      WriteJsonOpcodes(fp, counts->ops);
+      fprintf(fp, "}");
+      first = false;
+    }
+    fprintf(fp, "]}");
+  }
+  fprintf(fp, "\n  ],\n");
+
+  fprintf(fp, "  \"pairs\": [");
+  {
+    ke::Vector<CountEntry> entries;
+    CollectPairs(pairs_.get(), &entries);
+    for (size_t i = 0; i < entries.length(); i++) {
+      uint32_t key = entries[i].key;
+      fprintf(fp, "%s\n    {\"ops\": [\"%s\", \"%s\"], \"count\": %" PRIu64 "}",
+              i ? "," : "",
+              OpcodeNames[key / OPCODES_TOTAL],
+              OpcodeNames[key % OPCODES_TOTAL],
+              entries[i].count);
+    }
+  }
+  fprintf(fp, "\n  ],\n");
+
+  fprintf(fp, "  \"triples\": [");
+  {
+    ke::Vector<CountEntry> entries;
+    CollectTriples(triples_, &entries);
+    for (size_t i = 0; i < entries.length(); i++) {
+      uint32_t key = entries[i].key;
+      fprintf(fp, "%s\n    {\"ops\": [\"%s\", \"%s\", \"%s\"], \"count\": %" PRIu64 "}",
+              i ? "," : "",
+              OpcodeNames[key / (OPCODES_TOTAL * OPCODES_TOTAL)],
+              OpcodeNames[(key / OPCODES_TOTAL) % OPCODES_TOTAL],
+              OpcodeNames[key % OPCODES_TOTAL],
+              entries[i].count);
+    }
+  }
+  fprintf(fp, "\n  ]\n}\n");
+}
+
+} // namespace sp
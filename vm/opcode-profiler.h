@@ -0,0 +1,131 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_opcode_profiler_h_
+#define _include_sourcepawn_vm_opcode_profiler_h_
+
+#include <stdio.h>
+#include <sp_vm_types.h>
+#include <smx/smx-v1-opcodes.h>
+#include <amtl/am-autoptr.h>
+#include <amtl/am-hashmap.h>
+#include <amtl/am-string.h>
+#include <amtl/am-vector.h>
+
+namespace sp {
+
+class MethodInfo;
+class PluginRuntime;
+
+// Execution counts for a single method, indexed by opcode.
+struct OpcodeCounts
+{
+  OpcodeCounts(const char* plugin, const char* method);
+
+  ke::AString plugin;
+  ke::AString method;
+  uint64_t ops[OPCODES_TOTAL];
+};
+
+// When opcode profiling is enabled (see Environment::EnableOpcodeProfiling),
+// the interpreter and the JIT report every opcode they execute here. Counts
+// are kept per method, and consecutive opcodes are also counted as pairs and
+// triples. The report is written, as text and as JSON, when the environment
+// shuts down.
+//
+// The JIT counts opcodes and pairs inline, and keeps the history up to date,
+// but only the interpreter counts triples, since they need a lookup. Run
+// with the JIT off for a full triple profile.
+//
+// Profiling must be enabled before any code runs, since it changes how
+// methods are decoded and compiled. When it is off, nothing is counted and
+// no instrumentation is generated.
+class OpcodeProfiler
+{
+ public:
+  explicit OpcodeProfiler(const char* report_path);
+  ~OpcodeProfiler();
+
+  bool init();
+
+  // Find the counters for a method, creating them the first time. Methods
+  // from a plugin that was reloaded share counters with the old copy.
+  OpcodeCounts* countsFor(PluginRuntime* rt, MethodInfo* method);
+
+  void record(OpcodeCounts* counts, OPCODE op) {
+    counts->ops[op]++;
+    pairs_[history_.prev * OPCODES_TOTAL + op]++;
+    if (history_.prev2 != OPCODES_TOTAL)
+      recordTriple(op);
+    history_.prev2 = history_.prev;
+    history_.prev = op;
+  }
+
+  // Write "<path>.txt" and "<path>.json".
+  bool writeReport();
+
+  // The previous two opcodes executed, or OPCODES_TOTAL at the start. Calls
+  // and returns don't reset these, so sequences can span methods.
+  struct History {
+    uint32_t prev;
+    uint32_t prev2;
+  };
+
+  // For JIT code, which updates these inline.
+  History* history() {
+    return &history_;
+  }
+  uint64_t* pairs() {
+    return pairs_.get();
+  }
+
+ private:
+  void recordTriple(OPCODE op);
+  void flushTriples();
+  void addTriple(uint32_t key, uint64_t count);
+  void writeText(FILE* fp);
+  void writeJson(FILE* fp);
+
+ private:
+  struct TriplePolicy {
+    static inline uint32_t hash(uint32_t key) {
+      return ke::HashInteger<4>(key);
+    }
+    static inline bool matches(uint32_t a, uint32_t b) {
+      return a == b;
+    }
+  };
+  typedef ke::HashMap<uint32_t, uint64_t, TriplePolicy> TripleMap;
+
+  ke::AString report_path_;
+  ke::Vector<ke::AutoPtr<OpcodeCounts>> methods_;
+
+  History history_;
+
+  // Indexed by (first * OPCODES_TOTAL + second).
+  ke::AutoPtr<uint64_t[]> pairs_;
+
+  // Triples are counted in a small direct-mapped cache first, and only go
+  // to the map when they are evicted, since hot loops repeat a handful of
+  // them.
+  struct CachedTriple {
+    uint32_t key;
+    uint64_t count;
+  };
+  static const size_t kTripleCacheSize = 1024;
+  CachedTriple triple_cache_[kTripleCacheSize];
+  TripleMap triples_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_opcode_profiler_h_
@@ -40,6 +40,170 @@ const char *OpcodeNames[] = {
   NULL
 };
 
+size_t
+sp::InstructionLength(const cell_t* cip, const cell_t* end)
+{
+  OPCODE op = (OPCODE)*cip;
+  switch (op) {
+  case OP_PUSH2_C:
+  case OP_PUSH2:
+  case OP_PUSH2_S:
+  case OP_PUSH2_ADR:
+  case OP_PUSH3_C:
+  case OP_PUSH3:
+  case OP_PUSH3_S:
+  case OP_PUSH3_ADR:
+  case OP_PUSH4_C:
+  case OP_PUSH4:
+  case OP_PUSH4_S:
+  case OP_PUSH4_ADR:
+  case OP_PUSH5_C:
+  case OP_PUSH5:
+  case OP_PUSH5_S:
+  case OP_PUSH5_ADR:
+    return 1 + ((op - OP_PUSH2_C) / 4) + 2;
+
+  case OP_SYSREQ_N:
+  case OP_LOAD_BOTH:
+  case OP_LOAD_S_BOTH:
+  case OP_CONST:
+  case OP_CONST_S:
+    return 3;
+
+  case OP_CASETBL:
+    if (cip + 3 > end || cip[1] < 0 || size_t(end - (cip + 3)) / 2 < size_t(cip[1]))
+      return 0;
+    return 3 + cip[1] * 2;
+
+  case OP_LOAD_PRI:
+  case OP_LOAD_ALT:
+  case OP_LOAD_S_PRI:
+  case OP_LOAD_S_ALT:
+  case OP_LREF_S_PRI:
+  case OP_LREF_S_ALT:
+  case OP_LODB_I:
+  case OP_CONST_PRI:
+  case OP_CONST_ALT:
+  case OP_ADDR_PRI:
+  case OP_ADDR_ALT:
+  case OP_STOR_PRI:
+  case OP_STOR_ALT:
+  case OP_STOR_S_PRI:
+  case OP_STOR_S_ALT:
+  case OP_SREF_S_PRI:
+  case OP_SREF_S_ALT:
+  case OP_STRB_I:
+  case OP_PUSH_C:
+  case OP_PUSH:
+  case OP_PUSH_S:
+  case OP_STACK:
+  case OP_HEAP:
+  case OP_CALL:
+  case OP_JUMP:
+  case OP_JZER:
+  case OP_JNZ:
+  case OP_JEQ:
+  case OP_JNEQ:
+  case OP_JSLESS:
+  case OP_JSLEQ:
+  case OP_JSGRTR:
+  case OP_JSGEQ:
+  case OP_SHL_C_PRI:
+  case OP_SHL_C_ALT:
+  case OP_ADD_C:
+  case OP_SMUL_C:
+  case OP_ZERO:
+  case OP_ZERO_S:
+  case OP_EQ_C_PRI:
+  case OP_EQ_C_ALT:
+  case OP_INC:
+  case OP_INC_S:
+  case OP_DEC:
+  case OP_DEC_S:
+  case OP_MOVS:
+  case OP_FILL:
+  case OP_HALT:
+  case OP_BOUNDS:
+  case OP_SYSREQ_C:
+  case OP_SWITCH:
+  case OP_PUSH_ADR:
+  case OP_TRACKER_PUSH_C:
+  case OP_GENARRAY:
+  case OP_GENARRAY_Z:
+    return 2;
+
+  case OP_NOP:
+  case OP_BREAK:
+  case OP_LOAD_I:
+  case OP_STOR_I:
+  case OP_LIDX:
+  case OP_IDXADDR:
+  case OP_MOVE_PRI:
+  case OP_MOVE_ALT:
+  case OP_XCHG:
+  case OP_PUSH_PRI:
+  case OP_PUSH_ALT:
+  case OP_POP_PRI:
+  case OP_POP_ALT:
+  case OP_RETN:
+  case OP_SHL:
+  case OP_SHR:
+  case OP_SSHR:
+  case OP_SMUL:
+  case OP_SDIV:
+  case OP_SDIV_ALT:
+  case OP_ADD:
+  case OP_SUB:
+  case OP_SUB_ALT:
+  case OP_AND:
+  case OP_OR:
+  case OP_XOR:
+  case OP_NOT:
+  case OP_NEG:
+  case OP_INVERT:
+  case OP_ZERO_PRI:
+  case OP_ZERO_ALT:
+  case OP_EQ:
+  case OP_NEQ:
+  case OP_SLESS:
+  case OP_SLEQ:
+  case OP_SGRTR:
+  case OP_SGEQ:
+  case OP_INC_PRI:
+  case OP_INC_ALT:
+  case OP_INC_I:
+  case OP_DEC_PRI:
+  case OP_DEC_ALT:
+  case OP_DEC_I:
+  case OP_SWAP_PRI:
+  case OP_SWAP_ALT:
+  case OP_TRACKER_POP_SETHEAP:
+  case OP_STRADJUST_PRI:
+  case OP_FABS:
+  case OP_FLOAT:
+  case OP_FLOATADD:
+  case OP_FLOATSUB:
+  case OP_FLOATMUL:
+  case OP_FLOATDIV:
+  case OP_RND_TO_NEAREST:
+  case OP_RND_TO_FLOOR:
+  case OP_RND_TO_CEIL:
+  case OP_RND_TO_ZERO:
+  case OP_FLOATCMP:
+  case OP_FLOAT_GT:
+  case OP_FLOAT_GE:
+  case OP_FLOAT_LT:
+  case OP_FLOAT_LE:
+  case OP_FLOAT_NE:
+  case OP_FLOAT_EQ:
+  case OP_FLOAT_NOT:
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
 #ifdef JIT_SPEW
 void
 SourcePawn::SpewOpcode(PluginRuntime *runtime, const cell_t *start, const cell_t *cip)
@@ -36,6 +36,15 @@
 #include <sp_vm_types.h>
 #include "plugin-runtime.h"
 
+// Opcode names, as written in disassembly, indexed by OPCODE.
+extern const char *OpcodeNames[];
+
+namespace sp {
+	// Return the number of cells in the instruction at |cip|, or 0 if it
+	// can't be decoded. The method has already been verified.
+	size_t InstructionLength(const cell_t *cip, const cell_t *end);
+}
+
 namespace SourcePawn {
 #ifdef JIT_SPEW
 	void SpewOpcode(sp::PluginRuntime *runtime, const cell_t *start, const cell_t *cip);
@@ -45,31 +45,57 @@ private:
 class ErrorPath : public OutOfLinePath
 {
  public:
-  ErrorPath(const cell_t* cip, int err)
+  ErrorPath(const cell_t* cip, const cell_t* inlined_at, int err)
   : cip(cip),
+    inlined_at(inlined_at),
     err(err)
   {}
 
   bool emit(Compiler* cc) override;
 
   const cell_t *cip;
+  const cell_t *inlined_at;
   int err;
 };
 
 class OutOfBoundsErrorPath : public OutOfLinePath
 {
  public:
-  OutOfBoundsErrorPath(const cell_t* cip, cell_t bounds)
+  OutOfBoundsErrorPath(const cell_t* cip, const cell_t* inlined_at, cell_t bounds)
    : cip(cip),
+     inlined_at(inlined_at),
      bounds(bounds)
   {}
 
   bool emit(Compiler* cc) override;
 
   const cell_t* cip;
+  const cell_t* inlined_at;
   cell_t bounds;
 };
 
+// Handles pending interrupts, then returns to the code after the poll.
+class InterruptPath : public OutOfLinePath
+{
+ public:
+  InterruptPath(const cell_t* cip, const cell_t* inlined_at)
+   : cip(cip),
+     inlined_at(inlined_at)
+  {}
+
+  bool emit(Compiler* cc) override;
+
+  Label* rejoin() {
+    return &rejoin_;
+  }
+
+  const cell_t* cip;
+  const cell_t* inlined_at;
+
+ private:
+  Label rejoin_;
+};
+
 } // namespace sp
 
 #endif // _include_sourcepawn_outofline_asm_h__
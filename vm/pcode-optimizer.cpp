@@ -0,0 +1,1215 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include "pcode-optimizer.h"
+#include "method-verifier.h"
+#include "opcodes.h"
+#include "plugin-runtime.h"
+#include <assert.h>
+#include <string.h>
+
+namespace sp {
+
+using namespace ke;
+
+// Each pass can expose more work for the others, but methods settle quickly;
+// this is a limit for pathological code.
+static const size_t kMaxRounds = 8;
+
+// Jumps are threaded through at most this many other jumps.
+static const size_t kMaxJumpHops = 8;
+
+static const uint32_t kNoInsn = 0xffffffff;
+
+// Register masks.
+static const uint8_t kPri = 0x1;
+static const uint8_t kAlt = 0x2;
+static const uint8_t kBoth = kPri | kAlt;
+
+struct OpEffects
+{
+  // Registers the instruction reads, a superset.
+  uint8_t uses;
+  // Registers the instruction always overwrites, a subset.
+  uint8_t defs;
+  // Registers that may hold something else afterward, a superset of defs.
+  uint8_t clobbers;
+  // No side effects, including on the stack, and can't fail. Such an
+  // instruction can be removed if what it defines is dead.
+  bool pure;
+};
+
+static OpEffects
+Effects(uint8_t uses, uint8_t defs, uint8_t clobbers, bool pure)
+{
+  OpEffects fx = { uses, defs, clobbers, pure };
+  return fx;
+}
+
+static OpEffects
+EffectsOf(OPCODE op)
+{
+  switch (op) {
+  case OP_NOP:
+  case OP_BREAK:
+    return Effects(0, 0, 0, true);
+
+  case OP_CONST_PRI:
+  case OP_ZERO_PRI:
+  case OP_ADDR_PRI:
+  case OP_LOAD_PRI:
+  case OP_LOAD_S_PRI:
+    return Effects(0, kPri, kPri, true);
+  case OP_CONST_ALT:
+  case OP_ZERO_ALT:
+  case OP_ADDR_ALT:
+  case OP_LOAD_ALT:
+  case OP_LOAD_S_ALT:
+    return Effects(0, kAlt, kAlt, true);
+  case OP_LOAD_BOTH:
+  case OP_LOAD_S_BOTH:
+    return Effects(0, kBoth, kBoth, true);
+
+  case OP_MOVE_PRI:
+    return Effects(kAlt, kPri, kPri, true);
+  case OP_MOVE_ALT:
+    return Effects(kPri, kAlt, kAlt, true);
+  case OP_XCHG:
+    return Effects(kBoth, kBoth, kBoth, true);
+
+  case OP_IDXADDR:
+  case OP_SHL:
+  case OP_SHR:
+  case OP_SSHR:
+  case OP_SMUL:
+  case OP_ADD:
+  case OP_SUB:
+  case OP_SUB_ALT:
+  case OP_AND:
+  case OP_OR:
+  case OP_XOR:
+  case OP_EQ:
+  case OP_NEQ:
+  case OP_SLESS:
+  case OP_SLEQ:
+  case OP_SGRTR:
+  case OP_SGEQ:
+    return Effects(kBoth, kPri, kPri, true);
+
+  case OP_SHL_C_PRI:
+  case OP_ADD_C:
+  case OP_SMUL_C:
+  case OP_NOT:
+  case OP_NEG:
+  case OP_INVERT:
+  case OP_EQ_C_PRI:
+  case OP_INC_PRI:
+  case OP_DEC_PRI:
+  case OP_STRADJUST_PRI:
+    return Effects(kPri, kPri, kPri, true);
+  case OP_SHL_C_ALT:
+  case OP_INC_ALT:
+  case OP_DEC_ALT:
+    return Effects(kAlt, kAlt, kAlt, true);
+  case OP_EQ_C_ALT:
+    return Effects(kAlt, kPri, kPri, true);
+
+  case OP_LREF_S_PRI:
+  case OP_POP_PRI:
+    return Effects(0, kPri, kPri, false);
+  case OP_LREF_S_ALT:
+  case OP_POP_ALT:
+    return Effects(0, kAlt, kAlt, false);
+  case OP_LOAD_I:
+  case OP_LODB_I:
+  case OP_SWAP_PRI:
+    return Effects(kPri, kPri, kPri, false);
+  case OP_SWAP_ALT:
+    return Effects(kAlt, kAlt, kAlt, false);
+  case OP_LIDX:
+    return Effects(kBoth, kPri, kPri, false);
+  case OP_SDIV:
+  case OP_SDIV_ALT:
+    return Effects(kBoth, kBoth, kBoth, false);
+  case OP_HEAP:
+    return Effects(0, kAlt, kBoth, false);
+
+  case OP_STOR_PRI:
+  case OP_STOR_S_PRI:
+  case OP_SREF_S_PRI:
+  case OP_PUSH_PRI:
+  case OP_INC_I:
+  case OP_DEC_I:
+  case OP_BOUNDS:
+  case OP_JZER:
+  case OP_JNZ:
+  case OP_SWITCH:
+  case OP_RETN:
+  case OP_HALT:
+    return Effects(kPri, 0, 0, false);
+  case OP_STOR_ALT:
+  case OP_STOR_S_ALT:
+  case OP_SREF_S_ALT:
+  case OP_PUSH_ALT:
+    return Effects(kAlt, 0, 0, false);
+  case OP_STOR_I:
+  case OP_STRB_I:
+  case OP_JEQ:
+  case OP_JNEQ:
+  case OP_JSLESS:
+  case OP_JSLEQ:
+  case OP_JSGRTR:
+  case OP_JSGEQ:
+    return Effects(kBoth, 0, 0, false);
+
+  case OP_ZERO:
+  case OP_ZERO_S:
+  case OP_CONST:
+  case OP_CONST_S:
+  case OP_INC:
+  case OP_INC_S:
+  case OP_DEC:
+  case OP_DEC_S:
+  case OP_PUSH_C:
+  case OP_PUSH:
+  case OP_PUSH_S:
+  case OP_PUSH_ADR:
+  case OP_PUSH2_C:
+  case OP_PUSH2:
+  case OP_PUSH2_S:
+  case OP_PUSH2_ADR:
+  case OP_PUSH3_C:
+  case OP_PUSH3:
+  case OP_PUSH3_S:
+  case OP_PUSH3_ADR:
+  case OP_PUSH4_C:
+  case OP_PUSH4:
+  case OP_PUSH4_S:
+  case OP_PUSH4_ADR:
+  case OP_PUSH5_C:
+  case OP_PUSH5:
+  case OP_PUSH5_S:
+  case OP_PUSH5_ADR:
+  case OP_JUMP:
+    return Effects(0, 0, 0, false);
+
+  // These leave the registers alone in the interpreter, but the JIT may use
+  // them as scratch.
+  case OP_STACK:
+  case OP_MOVS:
+  case OP_FILL:
+  case OP_TRACKER_PUSH_C:
+  case OP_TRACKER_POP_SETHEAP:
+  case OP_GENARRAY:
+  case OP_GENARRAY_Z:
+    return Effects(kBoth, 0, kBoth, false);
+
+  // Float opcodes pop their operands, and return in pri.
+  case OP_FABS:
+  case OP_FLOAT:
+  case OP_FLOATADD:
+  case OP_FLOATSUB:
+  case OP_FLOATMUL:
+  case OP_FLOATDIV:
+  case OP_RND_TO_NEAREST:
+  case OP_RND_TO_FLOOR:
+  case OP_RND_TO_CEIL:
+  case OP_RND_TO_ZERO:
+  case OP_FLOATCMP:
+  case OP_FLOAT_GT:
+  case OP_FLOAT_GE:
+  case OP_FLOAT_LT:
+  case OP_FLOAT_LE:
+  case OP_FLOAT_NE:
+  case OP_FLOAT_EQ:
+  case OP_FLOAT_NOT:
+    return Effects(0, kPri, kBoth, false);
+
+  case OP_CALL:
+  case OP_SYSREQ_C:
+  case OP_SYSREQ_N:
+    return Effects(kBoth, kPri, kBoth, false);
+
+  default:
+    return Effects(kBoth, 0, kBoth, false);
+  }
+}
+
+static bool
+IsJump(OPCODE op)
+{
+  switch (op) {
+  case OP_JUMP:
+  case OP_JZER:
+  case OP_JNZ:
+  case OP_JEQ:
+  case OP_JNEQ:
+  case OP_JSLESS:
+  case OP_JSLEQ:
+  case OP_JSGRTR:
+  case OP_JSGEQ:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool
+IsNop(OPCODE op)
+{
+  return op == OP_NOP || op == OP_BREAK;
+}
+
+// The number of cells pushed by a PUSHn_* opcode, or 0.
+static size_t
+PushCount(OPCODE op)
+{
+  if (op >= OP_PUSH2_C && op <= OP_PUSH5_ADR)
+    return ((op - OP_PUSH2_C) / 4) + 2;
+  return 0;
+}
+
+static bool
+IsMultiPushOf(OPCODE op, OPCODE base)
+{
+  return PushCount(op) && (op - OP_PUSH2_C) % 4 == base - OP_PUSH2_C;
+}
+
+// What is known about pri and alt.
+struct RegState
+{
+  bool known[2];
+  cell_t value[2];
+
+  void clear() {
+    known[0] = known[1] = false;
+  }
+  void clear(uint8_t regs) {
+    if (regs & kPri)
+      known[0] = false;
+    if (regs & kAlt)
+      known[1] = false;
+  }
+  bool has(uint8_t regs) const {
+    return (!(regs & kPri) || known[0]) && (!(regs & kAlt) || known[1]);
+  }
+  cell_t pri() const {
+    return value[0];
+  }
+  cell_t alt() const {
+    return value[1];
+  }
+};
+
+static cell_t
+Wrap(uint32_t value)
+{
+  return cell_t(value);
+}
+
+// Compute the value of the one register a pure instruction defines, if its
+// inputs are known.
+static bool
+Evaluate(OPCODE op, const cell_t* cip, const RegState& in, cell_t* out)
+{
+  if (!in.has(EffectsOf(op).uses))
+    return false;
+
+  uint32_t pri = uint32_t(in.known[0] ? in.pri() : 0);
+  uint32_t alt = uint32_t(in.known[1] ? in.alt() : 0);
+  switch (op) {
+  case OP_CONST_PRI:
+  case OP_CONST_ALT:
+    *out = cip[1];
+    return true;
+  case OP_ZERO_PRI:
+  case OP_ZERO_ALT:
+    *out = 0;
+    return true;
+  case OP_MOVE_PRI:
+    *out = Wrap(alt);
+    return true;
+  case OP_MOVE_ALT:
+    *out = Wrap(pri);
+    return true;
+  case OP_IDXADDR:
+    *out = Wrap(alt + pri * sizeof(cell_t));
+    return true;
+  case OP_ADD:
+    *out = Wrap(pri + alt);
+    return true;
+  case OP_SUB:
+    *out = Wrap(pri - alt);
+    return true;
+  case OP_SUB_ALT:
+    *out = Wrap(alt - pri);
+    return true;
+  case OP_AND:
+    *out = Wrap(pri & alt);
+    return true;
+  case OP_OR:
+    *out = Wrap(pri | alt);
+    return true;
+  case OP_XOR:
+    *out = Wrap(pri ^ alt);
+    return true;
+  case OP_SMUL:
+    *out = Wrap(pri * alt);
+    return true;
+  case OP_EQ:
+    *out = pri == alt;
+    return true;
+  case OP_NEQ:
+    *out = pri != alt;
+    return true;
+  case OP_SLESS:
+    *out = cell_t(pri) < cell_t(alt);
+    return true;
+  case OP_SLEQ:
+    *out = cell_t(pri) <= cell_t(alt);
+    return true;
+  case OP_SGRTR:
+    *out = cell_t(pri) > cell_t(alt);
+    return true;
+  case OP_SGEQ:
+    *out = cell_t(pri) >= cell_t(alt);
+    return true;
+  case OP_ADD_C:
+    *out = Wrap(pri + uint32_t(cip[1]));
+    return true;
+  case OP_SMUL_C:
+    *out = Wrap(pri * uint32_t(cip[1]));
+    return true;
+  case OP_NOT:
+    *out = pri ? 0 : 1;
+    return true;
+  case OP_NEG:
+    *out = Wrap(0 - pri);
+    return true;
+  case OP_INVERT:
+    *out = Wrap(~pri);
+    return true;
+  case OP_EQ_C_PRI:
+    *out = cell_t(pri) == cip[1];
+    return true;
+  case OP_EQ_C_ALT:
+    *out = cell_t(alt) == cip[1];
+    return true;
+  case OP_INC_PRI:
+    *out = Wrap(pri + 1);
+    return true;
+  case OP_DEC_PRI:
+    *out = Wrap(pri - 1);
+    return true;
+  case OP_INC_ALT:
+    *out = Wrap(alt + 1);
+    return true;
+  case OP_DEC_ALT:
+    *out = Wrap(alt - 1);
+    return true;
+  case OP_STRADJUST_PRI:
+    *out = cell_t(pri + 4) >> 2;
+    return true;
+
+  // The tiers disagree on out of range shift counts, so those are left to
+  // run.
+  case OP_SHL:
+  case OP_SHR:
+  case OP_SSHR:
+    if (alt >= 32)
+      return false;
+    if (op == OP_SHL)
+      *out = Wrap(pri << alt);
+    else if (op == OP_SHR)
+      *out = Wrap(pri >> alt);
+    else
+      *out = cell_t(pri) >> alt;
+    return true;
+  case OP_SHL_C_PRI:
+  case OP_SHL_C_ALT:
+    if (uint32_t(cip[1]) >= 32)
+      return false;
+    *out = Wrap((op == OP_SHL_C_PRI ? pri : alt) << cip[1]);
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+// Whether a conditional jump is taken, if its inputs are known.
+static bool
+EvaluateJump(OPCODE op, const RegState& in, bool* taken)
+{
+  if (!in.has(EffectsOf(op).uses))
+    return false;
+
+  cell_t pri = in.known[0] ? in.pri() : 0;
+  cell_t alt = in.known[1] ? in.alt() : 0;
+  switch (op) {
+  case OP_JZER:
+    *taken = pri == 0;
+    return true;
+  case OP_JNZ:
+    *taken = pri != 0;
+    return true;
+  case OP_JEQ:
+    *taken = pri == alt;
+    return true;
+  case OP_JNEQ:
+    *taken = pri != alt;
+    return true;
+  case OP_JSLESS:
+    *taken = pri < alt;
+    return true;
+  case OP_JSLEQ:
+    *taken = pri <= alt;
+    return true;
+  case OP_JSGRTR:
+    *taken = pri > alt;
+    return true;
+  case OP_JSGEQ:
+    *taken = pri >= alt;
+    return true;
+  default:
+    return false;
+  }
+}
+
+PcodeOptimizer::PcodeOptimizer(PluginRuntime* rt, uint32_t startOffset, uint32_t endOffset)
+ : rt_(rt),
+   code_(rt->writableCode()),
+   method_(code_ + startOffset / sizeof(cell_t)),
+   end_(code_ + endOffset / sizeof(cell_t)),
+   changed_(false),
+   lowest_local_escape_(0)
+{
+}
+
+bool
+PcodeOptimizer::optimize()
+{
+  size_t ncells = end_ - method_;
+  Vector<cell_t> original;
+  for (size_t i = 0; i < ncells; i++)
+    original.append(method_[i]);
+
+  bool ok = true;
+  bool changed = false;
+  for (size_t round = 0; round < kMaxRounds; round++) {
+    changed_ = false;
+    if (!collectDepths() || !decode()) {
+      ok = false;
+      break;
+    }
+    propagateCopies();
+    if (!decode()) {
+      ok = false;
+      break;
+    }
+    propagateConstants();
+    if (!decode()) {
+      ok = false;
+      break;
+    }
+    foldBranches();
+    if (!decode()) {
+      ok = false;
+      break;
+    }
+    removeDeadCode();
+    if (!collectDepths() || !decode()) {
+      ok = false;
+      break;
+    }
+    removeDeadStores();
+
+    if (!changed_)
+      break;
+    changed = true;
+  }
+
+  if (ok && changed) {
+    MethodVerifier verifier(rt_, uint32_t(method_ - code_) * sizeof(cell_t));
+    ok = verifier.verify() && verifier.endOffset() == cell_t(end_ - code_) * cell_t(sizeof(cell_t));
+  }
+  if (!ok) {
+    memcpy(method_, original.buffer(), ncells * sizeof(cell_t));
+    return false;
+  }
+  return changed;
+}
+
+bool
+PcodeOptimizer::collectDepths()
+{
+  depths_.clear();
+  for (size_t i = 0; i < size_t(end_ - method_); i++)
+    depths_.append(-1);
+
+  cell_t start = cell_t(method_ - code_) * sizeof(cell_t);
+  MethodVerifier verifier(rt_, start);
+  verifier.collectStackDepths([this, start](cell_t offset, int32_t depth) -> void {
+    depths_[(offset - start) / sizeof(cell_t)] = depth;
+  });
+  return verifier.verify();
+}
+
+bool
+PcodeOptimizer::decode()
+{
+  insns_.clear();
+  blocks_.clear();
+  insn_map_.clear();
+
+  // The first cell is the PROC.
+  size_t ncells = end_ - method_;
+  insn_map_.append(kNoInsn);
+  for (cell_t* cip = method_ + 1; cip < end_; ) {
+    size_t length = InstructionLength(cip, end_);
+    if (!length || length > size_t(end_ - cip))
+      return false;
+
+    while (insn_map_.length() < size_t(cip - method_))
+      insn_map_.append(kNoInsn);
+    insn_map_.append(uint32_t(insns_.length()));
+
+    Insn insn = { cip, OPCODE(*cip), uint32_t(length), false };
+    insns_.append(insn);
+    cip += length;
+  }
+  while (insn_map_.length() < ncells)
+    insn_map_.append(kNoInsn);
+  // Jumping to the end of the method is allowed, though running into it
+  // is an error.
+  insn_map_.append(uint32_t(insns_.length()));
+
+  if (insns_.empty())
+    return false;
+
+  insns_[0].block_start = true;
+  for (size_t i = 0; i < insns_.length(); i++) {
+    const Insn& insn = insns_[i];
+    bool ends_block = false;
+    if (IsJump(insn.op)) {
+      size_t target = insnAt(insn.cip[1]);
+      if (target == kNoInsn)
+        return false;
+      if (target < insns_.length())
+        insns_[target].block_start = true;
+      ends_block = true;
+    } else if (insn.op == OP_SWITCH) {
+      size_t table = insnAt(insn.cip[1]);
+      if (table >= insns_.length() || insns_[table].op != OP_CASETBL)
+        return false;
+      const cell_t* cases = insns_[table].cip;
+      for (cell_t j = 0; j <= cases[1]; j++) {
+        size_t target = insnAt(cases[2 + j * 2]);
+        if (target == kNoInsn)
+          return false;
+        if (target < insns_.length())
+          insns_[target].block_start = true;
+      }
+      ends_block = true;
+    } else if (insn.op == OP_RETN || insn.op == OP_HALT || insn.op == OP_CASETBL) {
+      ends_block = true;
+    }
+    if (ends_block && i + 1 < insns_.length())
+      insns_[i + 1].block_start = true;
+  }
+
+  for (size_t i = 0; i < insns_.length(); i++) {
+    if (insns_[i].block_start) {
+      Block block = { i, i, 0, 0 };
+      blocks_.append(block);
+    }
+    blocks_.back().end = i + 1;
+  }
+  return true;
+}
+
+// The instruction at a pcode offset, insns_.length() for the end of the
+// method, or kNoInsn.
+size_t
+PcodeOptimizer::insnAt(cell_t offset) const
+{
+  if (offset < 0 || !ke::IsAligned(offset, sizeof(cell_t)))
+    return kNoInsn;
+  size_t cell = offset / sizeof(cell_t);
+  size_t first = method_ - code_;
+  if (cell < first || cell - first >= insn_map_.length())
+    return kNoInsn;
+  return insn_map_[cell - first];
+}
+
+// Skip no-ops, starting at |index|.
+size_t
+PcodeOptimizer::realInsnAt(size_t index) const
+{
+  while (index < insns_.length() && IsNop(insns_[index].op))
+    index++;
+  return index;
+}
+
+int32_t
+PcodeOptimizer::depthAt(size_t index) const
+{
+  return depths_[insns_[index].cip - method_];
+}
+
+void
+PcodeOptimizer::computeLiveness()
+{
+  // Map instructions to their blocks, to find successors.
+  Vector<uint32_t> block_of;
+  for (size_t b = 0; b < blocks_.length(); b++) {
+    for (size_t i = blocks_[b].first; i < blocks_[b].end; i++)
+      block_of.append(uint32_t(b));
+  }
+
+  auto live_at = [&, this](cell_t offset) -> uint8_t {
+    size_t target = insnAt(offset);
+    if (target >= insns_.length())
+      return 0;
+    return blocks_[block_of[target]].live_in;
+  };
+  auto live_out = [&, this](size_t b) -> uint8_t {
+    const Insn& last = insns_[blocks_[b].end - 1];
+    bool falls_through = b + 1 < blocks_.length();
+    uint8_t live = 0;
+    switch (last.op) {
+    case OP_RETN:
+    case OP_HALT:
+    case OP_CASETBL:
+      return 0;
+    case OP_JUMP:
+      return live_at(last.cip[1]);
+    case OP_SWITCH:
+    {
+      const cell_t* cases = insns_[insnAt(last.cip[1])].cip;
+      for (cell_t j = 0; j <= cases[1]; j++)
+        live |= live_at(cases[2 + j * 2]);
+      return live;
+    }
+    default:
+      if (IsJump(last.op))
+        live |= live_at(last.cip[1]);
+      if (falls_through)
+        live |= blocks_[b + 1].live_in;
+      return live;
+    }
+  };
+  auto transfer = [this](size_t b, uint8_t live) -> uint8_t {
+    for (size_t i = blocks_[b].end; i > blocks_[b].first; i--) {
+      OpEffects fx = EffectsOf(insns_[i - 1].op);
+      live = (live & ~fx.defs) | fx.uses;
+    }
+    return live;
+  };
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t b = blocks_.length(); b > 0; b--) {
+      Block& block = blocks_[b - 1];
+      block.live_out = live_out(b - 1);
+      uint8_t live_in = transfer(b - 1, block.live_out);
+      if (live_in != block.live_in) {
+        block.live_in = live_in;
+        changed = true;
+      }
+    }
+  }
+
+  live_after_.clear();
+  for (size_t i = 0; i < insns_.length(); i++)
+    live_after_.append(0);
+  for (size_t b = 0; b < blocks_.length(); b++) {
+    uint8_t live = blocks_[b].live_out;
+    for (size_t i = blocks_[b].end; i > blocks_[b].first; i--) {
+      live_after_[i - 1] = live;
+      OpEffects fx = EffectsOf(insns_[i - 1].op);
+      live = (live & ~fx.defs) | fx.uses;
+    }
+  }
+}
+
+// A push, then code that leaves the stack and one register alone, then a pop
+// into that register, becomes a move or load into the register.
+bool
+PcodeOptimizer::propagateCopies()
+{
+  bool changed = false;
+  for (size_t i = 0; i < insns_.length(); i++) {
+    const Insn& push = insns_[i];
+    switch (push.op) {
+    case OP_PUSH_PRI:
+    case OP_PUSH_ALT:
+    case OP_PUSH_C:
+    case OP_PUSH:
+    case OP_PUSH_S:
+    case OP_PUSH_ADR:
+      break;
+    default:
+      continue;
+    }
+
+    // The cell being pushed is the only one below this depth, so frame
+    // reads above it can't see it.
+    int32_t depth = depthAt(i);
+
+    uint8_t touched = 0;
+    size_t j = i + 1;
+    for (; j < insns_.length(); j++) {
+      const Insn& insn = insns_[j];
+      if (insn.block_start || insn.op == OP_POP_PRI || insn.op == OP_POP_ALT)
+        break;
+      OpEffects fx = EffectsOf(insn.op);
+      if (!fx.pure)
+        break;
+      if (insn.op == OP_LOAD_S_PRI || insn.op == OP_LOAD_S_ALT || insn.op == OP_LOAD_S_BOTH) {
+        cell_t lowest = insn.cip[1];
+        if (insn.op == OP_LOAD_S_BOTH && insn.cip[2] < lowest)
+          lowest = insn.cip[2];
+        if (lowest < 0 && (depth < 0 || lowest < -depth))
+          break;
+      }
+      touched |= fx.uses | fx.clobbers;
+    }
+    if (j >= insns_.length() || insns_[j].block_start)
+      continue;
+
+    OPCODE pop = insns_[j].op;
+    if (pop != OP_POP_PRI && pop != OP_POP_ALT)
+      continue;
+    bool to_pri = pop == OP_POP_PRI;
+    if (touched & (to_pri ? kPri : kAlt))
+      continue;
+
+    switch (push.op) {
+    case OP_PUSH_PRI:
+      if (to_pri)
+        remove(i);
+      else
+        rewrite(i, OP_MOVE_ALT);
+      break;
+    case OP_PUSH_ALT:
+      if (to_pri)
+        rewrite(i, OP_MOVE_PRI);
+      else
+        remove(i);
+      break;
+    case OP_PUSH_C:
+      rewrite(i, to_pri ? OP_CONST_PRI : OP_CONST_ALT, push.cip[1]);
+      break;
+    case OP_PUSH:
+      rewrite(i, to_pri ? OP_LOAD_PRI : OP_LOAD_ALT, push.cip[1]);
+      break;
+    case OP_PUSH_S:
+      rewrite(i, to_pri ? OP_LOAD_S_PRI : OP_LOAD_S_ALT, push.cip[1]);
+      break;
+    case OP_PUSH_ADR:
+      rewrite(i, to_pri ? OP_ADDR_PRI : OP_ADDR_ALT, push.cip[1]);
+      break;
+    default:
+      assert(false);
+    }
+    remove(j);
+    changed = true;
+  }
+
+  // spcomp swaps operands into place with a move, a load, and an exchange;
+  // the load can go straight into the other register instead.
+  for (size_t i = 0; i < insns_.length(); i++) {
+    OPCODE move = insns_[i].op;
+    if (move != OP_MOVE_ALT && move != OP_MOVE_PRI)
+      continue;
+
+    size_t j = realInsnAt(i + 1);
+    if (j >= insns_.length())
+      continue;
+    size_t k = realInsnAt(j + 1);
+    if (k >= insns_.length() || insns_[k].op != OP_XCHG)
+      continue;
+    bool straight = true;
+    for (size_t n = i + 1; n <= k; n++)
+      straight &= !insns_[n].block_start;
+    if (!straight)
+      continue;
+
+    // The load must define the register the move copied from, without
+    // reading anything.
+    OPCODE twin;
+    switch (insns_[j].op) {
+    case OP_CONST_PRI: twin = OP_CONST_ALT; break;
+    case OP_LOAD_PRI: twin = OP_LOAD_ALT; break;
+    case OP_LOAD_S_PRI: twin = OP_LOAD_S_ALT; break;
+    case OP_ADDR_PRI: twin = OP_ADDR_ALT; break;
+    case OP_ZERO_PRI: twin = OP_ZERO_ALT; break;
+    case OP_CONST_ALT: twin = OP_CONST_PRI; break;
+    case OP_LOAD_ALT: twin = OP_LOAD_PRI; break;
+    case OP_LOAD_S_ALT: twin = OP_LOAD_S_PRI; break;
+    case OP_ADDR_ALT: twin = OP_ADDR_PRI; break;
+    case OP_ZERO_ALT: twin = OP_ZERO_PRI; break;
+    default:
+      continue;
+    }
+    if (EffectsOf(insns_[j].op).defs != EffectsOf(move).uses)
+      continue;
+
+    remove(i);
+    if (insns_[j].length == 1)
+      rewrite(j, twin);
+    else
+      rewrite(j, twin, insns_[j].cip[1]);
+    remove(k);
+    changed = true;
+  }
+  return changed;
+}
+
+bool
+PcodeOptimizer::propagateConstants()
+{
+  bool changed = false;
+  RegState state;
+  state.clear();
+  for (size_t i = 0; i < insns_.length(); i++) {
+    Insn& insn = insns_[i];
+    if (insn.block_start)
+      state.clear();
+
+    bool taken;
+    if (IsJump(insn.op) && insn.op != OP_JUMP && EvaluateJump(insn.op, state, &taken)) {
+      if (taken)
+        rewrite(i, OP_JUMP, insn.cip[1]);
+      else
+        remove(i);
+      changed = true;
+      continue;
+    }
+
+    OpEffects fx = EffectsOf(insn.op);
+    if (!fx.pure || !fx.defs) {
+      state.clear(fx.clobbers);
+      continue;
+    }
+
+    if (insn.op == OP_XCHG) {
+      RegState swapped = state;
+      swapped.known[0] = state.known[1];
+      swapped.value[0] = state.value[1];
+      swapped.known[1] = state.known[0];
+      swapped.value[1] = state.value[0];
+      state = swapped;
+      continue;
+    }
+    if (fx.defs == kBoth) {
+      state.clear(kBoth);
+      continue;
+    }
+
+    size_t reg = fx.defs == kPri ? 0 : 1;
+    cell_t value;
+    if (!Evaluate(insn.op, insn.cip, state, &value)) {
+      // Identities need no inputs.
+      bool identity = (insn.op == OP_ADD_C && insn.cip[1] == 0) ||
+                      (insn.op == OP_SMUL_C && insn.cip[1] == 1) ||
+                      ((insn.op == OP_SHL_C_PRI || insn.op == OP_SHL_C_ALT) && insn.cip[1] == 0);
+      if (identity) {
+        remove(i);
+        changed = true;
+      }
+      state.clear(fx.defs);
+      continue;
+    }
+
+    if (state.known[reg] && state.value[reg] == value) {
+      // The register already holds this.
+      remove(i);
+      changed = true;
+    } else if (insn.op != OP_CONST_PRI && insn.op != OP_CONST_ALT &&
+               insn.op != OP_ZERO_PRI && insn.op != OP_ZERO_ALT)
+    {
+      if (value == 0) {
+        rewrite(i, reg == 0 ? OP_ZERO_PRI : OP_ZERO_ALT);
+        changed = true;
+      } else if (insn.length >= 2) {
+        rewrite(i, reg == 0 ? OP_CONST_PRI : OP_CONST_ALT, value);
+        changed = true;
+      }
+    }
+    state.known[reg] = true;
+    state.value[reg] = value;
+  }
+  return changed;
+}
+
+bool
+PcodeOptimizer::foldBranches()
+{
+  bool changed = false;
+  for (size_t i = 0; i < insns_.length(); i++) {
+    Insn& insn = insns_[i];
+    if (!IsJump(insn.op))
+      continue;
+
+    // Thread through jumps. Every cycle still has a backward jump in it, so
+    // timeouts still catch infinite loops.
+    cell_t target = insn.cip[1];
+    for (size_t hops = 0; hops < kMaxJumpHops; hops++) {
+      size_t next = realInsnAt(insnAt(target));
+      if (next >= insns_.length() || next == i || insns_[next].op != OP_JUMP)
+        break;
+      if (insns_[next].cip[1] == target)
+        break;
+      target = insns_[next].cip[1];
+    }
+    if (target != insn.cip[1]) {
+      insn.cip[1] = target;
+      changed_ = true;
+      changed = true;
+    }
+
+    // A jump to the next instruction does nothing, whether or not it's
+    // taken.
+    if (realInsnAt(insnAt(target)) == realInsnAt(i + 1)) {
+      remove(i);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+bool
+PcodeOptimizer::removeDeadCode()
+{
+  computeLiveness();
+
+  bool changed = false;
+  for (size_t i = 0; i < insns_.length(); i++) {
+    Insn& insn = insns_[i];
+    OpEffects fx = EffectsOf(insn.op);
+    if (fx.pure && fx.defs && !(fx.defs & live_after_[i])) {
+      remove(i);
+      changed = true;
+      continue;
+    }
+
+    // A constant loaded into alt just to be an operand can be folded into
+    // the operation, if alt isn't needed after it.
+    if (insn.op != OP_CONST_ALT)
+      continue;
+    size_t j = realInsnAt(i + 1);
+    if (j >= insns_.length() || (live_after_[j] & kAlt))
+      continue;
+    bool straight = true;
+    for (size_t n = i + 1; n <= j; n++)
+      straight &= !insns_[n].block_start;
+    if (!straight)
+      continue;
+
+    cell_t value = insn.cip[1];
+    switch (insns_[j].op) {
+    case OP_ADD:
+      rewrite(i, OP_ADD_C, value);
+      break;
+    case OP_SUB:
+      rewrite(i, OP_ADD_C, Wrap(0 - uint32_t(value)));
+      break;
+    case OP_SMUL:
+      rewrite(i, OP_SMUL_C, value);
+      break;
+    case OP_EQ:
+      rewrite(i, OP_EQ_C_PRI, value);
+      break;
+    case OP_SHL:
+      if (uint32_t(value) >= 32)
+        continue;
+      rewrite(i, OP_SHL_C_PRI, value);
+      break;
+    default:
+      continue;
+    }
+    remove(j);
+    changed = true;
+  }
+  return changed;
+}
+
+// Frame offsets that overlap.
+static bool
+Overlaps(cell_t a, cell_t b)
+{
+  return a > b - cell_t(sizeof(cell_t)) && a < b + cell_t(sizeof(cell_t));
+}
+
+bool
+PcodeOptimizer::removeDeadStores()
+{
+  // Any local at or above the lowest address taken may be reached through
+  // it, as an array element. Without LCTRL, which can't be decoded here,
+  // there is no other way to get at the frame.
+  lowest_local_escape_ = 0;
+  for (size_t i = 0; i < insns_.length(); i++) {
+    const Insn& insn = insns_[i];
+    size_t count = 0;
+    if (insn.op == OP_ADDR_PRI || insn.op == OP_ADDR_ALT || insn.op == OP_PUSH_ADR)
+      count = 1;
+    else if (IsMultiPushOf(insn.op, OP_PUSH2_ADR))
+      count = PushCount(insn.op);
+    for (size_t n = 1; n <= count; n++) {
+      cell_t offset = insn.cip[n];
+      if (offset < 0 && (!lowest_local_escape_ || offset < lowest_local_escape_))
+        lowest_local_escape_ = offset;
+    }
+  }
+
+  bool changed = false;
+  for (size_t i = 0; i < insns_.length(); i++) {
+    const Insn& insn = insns_[i];
+    switch (insn.op) {
+    case OP_ZERO_S:
+    case OP_STOR_S_PRI:
+    case OP_STOR_S_ALT:
+    case OP_CONST_S:
+      break;
+    default:
+      continue;
+    }
+
+    // Only locals are considered; they die with the frame.
+    cell_t offset = insn.cip[1];
+    if (offset >= 0)
+      continue;
+    if (lowest_local_escape_ && offset > lowest_local_escape_ - cell_t(sizeof(cell_t)))
+      continue;
+    int32_t depth = depthAt(i);
+    if (depth < 0 || offset < -depth)
+      continue;
+
+    if (isDeadStore(i, offset)) {
+      remove(i);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// Whether a store to a local at |offset| is overwritten, or the method
+// returns, before anything could read it. Only straight-line code is
+// followed.
+bool
+PcodeOptimizer::isDeadStore(size_t index, cell_t offset)
+{
+  // Once the stack is popped past locals, pushes could land on them.
+  bool freed = false;
+
+  for (size_t i = index + 1; i < insns_.length(); i++) {
+    const Insn& insn = insns_[i];
+    if (insn.block_start)
+      return false;
+
+    switch (insn.op) {
+    case OP_NOP:
+    case OP_BREAK:
+      continue;
+
+    case OP_RETN:
+      return true;
+
+    case OP_STACK:
+      freed = true;
+      continue;
+
+    case OP_ZERO_S:
+    case OP_STOR_S_PRI:
+    case OP_STOR_S_ALT:
+    case OP_CONST_S:
+      if (Overlaps(insn.cip[1], offset))
+        return !freed && insn.cip[1] == offset;
+      continue;
+
+    case OP_LOAD_S_PRI:
+    case OP_LOAD_S_ALT:
+    case OP_LREF_S_PRI:
+    case OP_LREF_S_ALT:
+    case OP_SREF_S_PRI:
+    case OP_SREF_S_ALT:
+    case OP_INC_S:
+    case OP_DEC_S:
+      if (Overlaps(insn.cip[1], offset))
+        return false;
+      continue;
+
+    case OP_LOAD_S_BOTH:
+      if (Overlaps(insn.cip[1], offset) || Overlaps(insn.cip[2], offset))
+        return false;
+      continue;
+
+    default:
+    {
+      size_t count = insn.op == OP_PUSH_S ? 1 : 0;
+      if (IsMultiPushOf(insn.op, OP_PUSH2_S))
+        count = PushCount(insn.op);
+      if (count) {
+        if (freed)
+          return false;
+        for (size_t n = 1; n <= count; n++) {
+          if (Overlaps(insn.cip[n], offset))
+            return false;
+        }
+        continue;
+      }
+
+      // Other instructions may only work on registers.
+      OpEffects fx = EffectsOf(insn.op);
+      if (!fx.pure)
+        return false;
+      continue;
+    }
+    }
+  }
+  return false;
+}
+
+void
+PcodeOptimizer::rewrite(size_t index, OPCODE op)
+{
+  Insn& insn = insns_[index];
+  insn.cip[0] = op;
+  for (size_t i = 1; i < insn.length; i++)
+    insn.cip[i] = OP_NOP;
+  insn.op = op;
+  changed_ = true;
+}
+
+void
+PcodeOptimizer::rewrite(size_t index, OPCODE op, cell_t operand)
+{
+  Insn& insn = insns_[index];
+  assert(insn.length >= 2);
+  insn.cip[0] = op;
+  insn.cip[1] = operand;
+  for (size_t i = 2; i < insn.length; i++)
+    insn.cip[i] = OP_NOP;
+  insn.op = op;
+  changed_ = true;
+}
+
+void
+PcodeOptimizer::remove(size_t index)
+{
+  rewrite(index, OP_NOP);
+}
+
+} // namespace sp
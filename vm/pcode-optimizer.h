@@ -0,0 +1,122 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_pcode_optimizer_h_
+#define _include_sourcepawn_vm_pcode_optimizer_h_
+
+#include <sp_vm_types.h>
+#include <smx/smx-v1-opcodes.h>
+#include <amtl/am-vector.h>
+
+namespace sp {
+
+class PluginRuntime;
+
+// Cleans up a verified method's pcode before either tier sees it. Plugins
+// built by old compilers, or with -O0, are full of pushes and pops that only
+// move a value between registers, constants loaded just to be used by the
+// next instruction, branches on known values, and stores that are never
+// read.
+//
+// The method is rewritten in place, and every instruction keeps its length:
+// a rewrite is never longer than what it replaces, and NOPs fill the rest.
+// Each instruction that remains is therefore still at its original cip, so
+// line lookup, stack traces, and the code cache need no mapping back. Both
+// tiers already skip NOPs.
+//
+// The passes are:
+//  - copy propagation: a push whose pop is only separated from it by code
+//    that leaves the popped register and the stack alone becomes a move or
+//    load into that register;
+//  - constant propagation: within a block, instructions whose result is
+//    known become constants, and conditional jumps on known values become
+//    jumps or go away;
+//  - branch folding: jumps to jumps are threaded, and jumps to the next
+//    instruction are removed;
+//  - dead code elimination: instructions without side effects that define
+//    only dead registers are removed, and stores to frame slots that are
+//    stored again, or that die with the frame, before being read.
+//
+// They repeat until nothing changes. The result is verified again, and if
+// that ever fails, the method is put back as it was.
+class PcodeOptimizer final
+{
+ public:
+  // |endOffset| is the end of the method, as found by the verifier. The
+  // runtime's code must be writable.
+  PcodeOptimizer(PluginRuntime* rt, uint32_t startOffset, uint32_t endOffset);
+
+  // Returns true if the method was changed.
+  bool optimize();
+
+ private:
+  struct Insn {
+    cell_t* cip;
+    OPCODE op;
+    uint32_t length;
+    bool block_start;
+  };
+
+  struct Block {
+    size_t first;
+    size_t end;
+    uint8_t live_in;
+    uint8_t live_out;
+  };
+
+  bool decode();
+  bool collectDepths();
+  int32_t depthAt(size_t index) const;
+  size_t insnAt(cell_t offset) const;
+  size_t realInsnAt(size_t index) const;
+  void computeLiveness();
+
+  bool propagateCopies();
+  bool propagateConstants();
+  bool foldBranches();
+  bool removeDeadCode();
+  bool removeDeadStores();
+  bool isDeadStore(size_t index, cell_t offset);
+
+  void rewrite(size_t index, OPCODE op);
+  void rewrite(size_t index, OPCODE op, cell_t operand);
+  void remove(size_t index);
+
+ private:
+  PluginRuntime* rt_;
+  cell_t* code_;
+  cell_t* method_;
+  cell_t* end_;
+  bool changed_;
+
+  ke::Vector<Insn> insns_;
+  ke::Vector<Block> blocks_;
+
+  // For each cell of the method, the index of the instruction starting
+  // there, or kNoInsn.
+  ke::Vector<uint32_t> insn_map_;
+
+  // The registers live after each instruction.
+  ke::Vector<uint8_t> live_after_;
+
+  // For each cell of the method, the verifier's stack depth there, or -1 if
+  // it isn't known.
+  ke::Vector<int32_t> depths_;
+
+  // The lowest local whose address is taken, or 0. Every local from there
+  // up may be reached through it.
+  cell_t lowest_local_escape_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_pcode_optimizer_h_
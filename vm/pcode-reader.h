@@ -479,6 +479,8 @@ class PcodeReader
         uint32_t replacement = rt_->GetNativeReplacement(index);
         if (replacement != OP_NOP)
           return visitOp((OPCODE)replacement);
+        if (const sp_intrinsic_t* intrinsic = rt_->GetIntrinsic(index))
+          return visitor_->visitINTRINSIC_N(index, nparams, intrinsic);
       }
 
       return visitor_->visitSYSREQ_N(index, nparams);
@@ -110,6 +110,9 @@ class PcodeVisitor
   virtual bool visitSWAP(PawnReg dest) = 0;
   virtual bool visitPUSH_ADR(const cell_t* offsets, size_t nvals) = 0;
   virtual bool visitSYSREQ_N(uint32_t native_index, uint32_t nparams) = 0;
+  // A SYSREQ.N to a native replaced by a host intrinsic.
+  virtual bool visitINTRINSIC_N(uint32_t native_index, uint32_t nparams,
+                                const sp_intrinsic_t* intrinsic) = 0;
   virtual bool visitLOAD_BOTH(cell_t addressForPri, cell_t addressForAlt) = 0;
   virtual bool visitLOAD_S_BOTH(cell_t offsetForPri, cell_t offsetForAlt) = 0;
   virtual bool visitCONST(cell_t address, cell_t value) = 0;
@@ -394,6 +397,11 @@ class IncompletePcodeVisitor : public PcodeVisitor
     assert(false);
     return false;
   }
+  virtual bool visitINTRINSIC_N(uint32_t native_index, uint32_t nparams,
+                                const sp_intrinsic_t* intrinsic) override {
+    assert(false);
+    return false;
+  }
   virtual bool visitLOAD_BOTH(cell_t offsetForPri, cell_t offsetForAlt) override {
     assert(false);
     return false;
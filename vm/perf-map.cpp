@@ -0,0 +1,258 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <string.h>
+#include <amtl/am-platform.h>
+#include <amtl/am-string.h>
+#include <amtl/am-vector.h>
+#if defined(KE_LINUX)
+# include <elf.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <time.h>
+# include <unistd.h>
+#endif
+#include "perf-map.h"
+#include "compiled-function.h"
+#include "plugin-runtime.h"
+
+using namespace sp;
+
+// See tools/perf/Documentation/jitdump-specification.txt in the Linux tree.
+static const uint32_t kJitdumpMagic = 0x4a695444;
+static const uint32_t kJitdumpVersion = 1;
+
+enum JitdumpRecordId : uint32_t {
+  JIT_CODE_LOAD = 0,
+  JIT_CODE_DEBUG_INFO = 2
+};
+
+struct JitdumpHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+};
+
+struct JitdumpRecord {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+};
+
+// Followed by the name, NUL-terminated, and the code.
+struct JitdumpCodeLoad {
+  JitdumpRecord header;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+};
+
+// Followed by |nr_entry| entries.
+struct JitdumpDebugInfo {
+  JitdumpRecord header;
+  uint64_t code_addr;
+  uint64_t nr_entry;
+};
+
+// Followed by the source file name, NUL-terminated.
+struct JitdumpDebugEntry {
+  uint64_t addr;
+  int32_t lineno;
+  int32_t discrim;
+};
+
+#if defined(KE_LINUX)
+// perf orders jitdump records against its samples with this clock.
+static uint64_t
+Timestamp()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+PerfMap::PerfMap()
+ : map_(nullptr),
+   dump_(nullptr),
+   marker_(nullptr),
+   marker_size_(0),
+   code_index_(0)
+{
+}
+
+PerfMap::~PerfMap()
+{
+#if defined(KE_LINUX)
+  if (marker_)
+    munmap(marker_, marker_size_);
+#endif
+  if (dump_)
+    fclose(dump_);
+  if (map_)
+    fclose(map_);
+}
+
+bool
+PerfMap::Initialize(const char* jitdump_dir)
+{
+#if defined(KE_LINUX)
+  ke::AString map_path = ke::AString::Sprintf("/tmp/perf-%d.map", int(getpid()));
+  if ((map_ = fopen(map_path.chars(), "w")) == nullptr)
+    return false;
+
+  if (!jitdump_dir)
+    return true;
+
+  ke::AString dump_path = ke::AString::Sprintf("%s/jit-%d.dump", jitdump_dir, int(getpid()));
+  if ((dump_ = fopen(dump_path.chars(), "w+")) == nullptr)
+    return false;
+
+  JitdumpHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kJitdumpMagic;
+  header.version = kJitdumpVersion;
+  header.total_size = sizeof(header);
+#if defined(KE_ARCH_X64)
+  header.elf_mach = EM_X86_64;
+#else
+  header.elf_mach = EM_386;
+#endif
+  header.pid = getpid();
+  header.timestamp = Timestamp();
+  if (fwrite(&header, sizeof(header), 1, dump_) != 1 || fflush(dump_) != 0)
+    return false;
+
+  // perf finds the dump through an executable mapping of it, which it sees
+  // in the process's mmap events.
+  marker_size_ = sysconf(_SC_PAGESIZE);
+  marker_ = mmap(nullptr, marker_size_, PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(dump_), 0);
+  if (marker_ == MAP_FAILED) {
+    marker_ = nullptr;
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+void
+PerfMap::RecordCode(const char* name, const void* address, size_t length)
+{
+  ke::AutoLock lock(&lock_);
+  writeCodeLoad(name, address, length);
+  writeMapEntry(name, address, length);
+}
+
+void
+PerfMap::RecordMethod(PluginRuntime* rt, CompiledFunction* fun)
+{
+  ke::AString name = fun->DescribeName(rt);
+
+  ke::Vector<SourceLine> lines;
+  if (dump_)
+    fun->GetSourceLines(rt, &lines);
+
+  // The cold part is recorded as if it were a function of its own.
+  size_t hot_size = fun->GetCodeSize();
+  size_t split = 0;
+  while (split < lines.length() && lines[split].pcoffs < hot_size)
+    split++;
+
+  ke::AutoLock lock(&lock_);
+  // Line info has to come before the code it describes.
+  writeDebugInfo(fun, fun->GetEntryAddress(), lines, 0, split);
+  writeCodeLoad(name.chars(), fun->GetEntryAddress(), hot_size);
+  writeMapEntry(name.chars(), fun->GetEntryAddress(), hot_size);
+
+  if (void* cold = fun->GetColdCodeAddress()) {
+    ke::AString cold_name = ke::AString::Sprintf("%s.cold", name.chars());
+    writeDebugInfo(fun, cold, lines, split, lines.length());
+    writeCodeLoad(cold_name.chars(), cold, fun->GetColdCodeSize());
+    writeMapEntry(cold_name.chars(), cold, fun->GetColdCodeSize());
+  }
+}
+
+void
+PerfMap::writeMapEntry(const char* name, const void* address, size_t length)
+{
+  fprintf(map_, "%llx %llx %s\n",
+          (unsigned long long)uintptr_t(address), (unsigned long long)length, name);
+  fflush(map_);
+}
+
+void
+PerfMap::writeCodeLoad(const char* name, const void* address, size_t length)
+{
+#if defined(KE_LINUX)
+  if (!dump_)
+    return;
+
+  size_t name_length = strlen(name) + 1;
+
+  JitdumpCodeLoad record;
+  record.header.id = JIT_CODE_LOAD;
+  record.header.total_size = uint32_t(sizeof(record) + name_length + length);
+  record.header.timestamp = Timestamp();
+  record.pid = getpid();
+  record.tid = uint32_t(syscall(SYS_gettid));
+  record.vma = uintptr_t(address);
+  record.code_addr = uintptr_t(address);
+  record.code_size = length;
+  record.code_index = code_index_++;
+
+  fwrite(&record, sizeof(record), 1, dump_);
+  fwrite(name, name_length, 1, dump_);
+  fwrite(address, length, 1, dump_);
+  fflush(dump_);
+#endif
+}
+
+void
+PerfMap::writeDebugInfo(CompiledFunction* fun, const void* address,
+                        const ke::Vector<SourceLine>& lines, size_t begin, size_t end)
+{
+#if defined(KE_LINUX)
+  if (!dump_ || begin == end)
+    return;
+
+  size_t size = sizeof(JitdumpDebugInfo);
+  for (size_t i = begin; i < end; i++)
+    size += sizeof(JitdumpDebugEntry) + strlen(lines[i].file) + 1;
+
+  JitdumpDebugInfo record;
+  record.header.id = JIT_CODE_DEBUG_INFO;
+  record.header.total_size = uint32_t(size);
+  record.header.timestamp = Timestamp();
+  record.code_addr = uintptr_t(address);
+  record.nr_entry = end - begin;
+  fwrite(&record, sizeof(record), 1, dump_);
+
+  for (size_t i = begin; i < end; i++) {
+    JitdumpDebugEntry entry;
+    entry.addr = uintptr_t(fun->GetCodeAt(lines[i].pcoffs));
+    entry.lineno = int32_t(lines[i].line);
+    entry.discrim = 0;
+    fwrite(&entry, sizeof(entry), 1, dump_);
+    fwrite(lines[i].file, strlen(lines[i].file) + 1, 1, dump_);
+  }
+#endif
+}
@@ -0,0 +1,72 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_perf_map_h_
+#define _include_sourcepawn_vm_perf_map_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <amtl/am-thread-utils.h>
+#include <amtl/am-vector.h>
+
+namespace sp {
+
+class CompiledFunction;
+class PluginRuntime;
+struct SourceLine;
+
+// Tells Linux perf where generated code lives, so samples in it are reported
+// as "plugin.smx::function" instead of [unknown].
+//
+// Every method and code stub is appended to /tmp/perf-<pid>.map as it is
+// linked. Optionally, the same code is also written in perf's jitdump format,
+// which includes a copy of the code and each method's source lines, taken
+// from its cip map; "perf inject --jit" merges it into a recording. A
+// method's cold code is recorded separately, as "plugin.smx::function.cold".
+//
+// Code is recorded from compile threads too, so recording takes a lock.
+class PerfMap
+{
+ public:
+  PerfMap();
+  ~PerfMap();
+
+  // Open the perf map, and if |jitdump_dir| is not null, jit-<pid>.dump in
+  // that directory. Returns false if either can't be written, or if this is
+  // not Linux.
+  bool Initialize(const char* jitdump_dir);
+
+  // Record a code stub, or any code without source lines.
+  void RecordCode(const char* name, const void* address, size_t length);
+
+  // Record a compiled method, named after its plugin and function.
+  void RecordMethod(PluginRuntime* rt, CompiledFunction* fun);
+
+ private:
+  void writeMapEntry(const char* name, const void* address, size_t length);
+  void writeCodeLoad(const char* name, const void* address, size_t length);
+  void writeDebugInfo(CompiledFunction* fun, const void* address,
+                      const ke::Vector<SourceLine>& lines, size_t begin, size_t end);
+
+ private:
+  ke::Mutex lock_;
+  FILE* map_;
+  FILE* dump_;
+  void* marker_;
+  size_t marker_size_;
+  uint64_t code_index_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_perf_map_h_
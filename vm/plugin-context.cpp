@@ -16,7 +16,6 @@
 #include <limits.h>
 #include <sp_vm_api.h>
 #include "plugin-context.h"
-#include "watchdog_timer.h"
 #include "environment.h"
 #include "method-info.h"
 
@@ -54,6 +53,7 @@ PluginContext::PluginContext(PluginRuntime *pRuntime)
   tracker_.pBase = (ucell_t *)malloc(1024);
   tracker_.pCur = tracker_.pBase;
   tracker_.size = 1024 / sizeof(cell_t);
+  tracker_.pLimit = tracker_.pBase + tracker_.size - 1;
 }
 
 PluginContext::~PluginContext()
@@ -400,10 +400,8 @@ PluginContext::Invoke(funcid_t fnid, const cell_t *params, unsigned int num_para
 {
   EnterProfileScope profileScope("SourcePawn", "EnterJIT");
 
-  if (!env_->watchdog()->HandleInterrupt()) {
-    ReportErrorNumber(SP_ERROR_TIMEOUT);
+  if (env_->hasPendingInterrupt() && env_->HandleInterrupts(this) != SP_ERROR_NONE)
     return false;
-  }
 
   assert((fnid & 1) != 0);
 
@@ -533,6 +531,7 @@ PluginContext::pushTracker(uint32_t amount)
       return SP_ERROR_TRACKER_BOUNDS;
 
     tracker_.pCur = tracker_.pBase + disp;
+    tracker_.pLimit = tracker_.pBase + tracker_.size - 1;
   }
 
   *tracker_.pCur++ = amount;
@@ -678,8 +677,9 @@ PluginContext::generateArray(cell_t dims, cell_t *stk, bool autozero)
     if (int err = pushTracker(bytes))
       return err;
 
+    // *stk is the base of the array.
     if (autozero)
-      memset(memory_ + hp_, 0, bytes);
+      memset(memory_ + *stk, 0, bytes);
 
     return SP_ERROR_NONE;
   }
@@ -726,85 +726,6 @@ PluginContext::popAmxFrame()
   return true;
 }
 
-bool
-PluginContext::pushStack(cell_t value)
-{
-  if (sp_ <= cell_t(hp_ + sizeof(cell_t))) {
-    ReportErrorNumber(SP_ERROR_STACKLOW);
-    return false;
-  }
-  sp_ -= sizeof(cell_t);
-
-  *reinterpret_cast<cell_t*>(memory_ + sp_) = value;
-  return true;
-}
-
-bool
-PluginContext::popStack(cell_t* out)
-{
-  if (sp_ >= stp_) {
-    ReportErrorNumber(SP_ERROR_STACKMIN);
-    return false;
-  }
-  *out = *reinterpret_cast<cell_t*>(memory_ + sp_);
-
-  sp_ += sizeof(cell_t);
-  return true;
-}
-
-bool
-PluginContext::getFrameValue(cell_t offset, cell_t* out)
-{
-  cell_t* addr = throwIfBadAddress(frm_ + offset);
-  if (!addr)
-    return false;
-
-  *out = *addr;
-  return true;
-}
-
-bool
-PluginContext::setFrameValue(cell_t offset, cell_t value)
-{
-  cell_t* addr = throwIfBadAddress(frm_ + offset);
-  if (!addr)
-    return false;
-
-  *addr = value;
-  return true;
-}
-
-bool
-PluginContext::getCellValue(cell_t address, cell_t* out)
-{
-  assert((uintptr_t)(const void *)out % sizeof(cell_t) == 0);
-
-  cell_t* ptr = throwIfBadAddress(address);
-  if (!ptr)
-    return false;
-
-  if ((uintptr_t)(const void*)ptr % sizeof(cell_t) == 0) {
-    *out = *ptr;
-  } else {
-    for (size_t i = 0; i < sizeof(cell_t); ++i) {
-      ((unsigned char*)out)[i] = ((unsigned char*)ptr)[i];
-    }
-  }
-
-  return true;
-}
-
-bool
-PluginContext::setCellValue(cell_t address, cell_t value)
-{
-  cell_t* ptr = throwIfBadAddress(address);
-  if (!ptr)
-    return false;
-
-  *ptr = value;
-  return true;
-}
-
 bool
 PluginContext::heapAlloc(cell_t amount, cell_t* out)
 {
@@ -839,19 +760,6 @@ PluginContext::acquireAddrRange(cell_t address, uint32_t bounds)
   return addr;
 }
 
-cell_t*
-PluginContext::throwIfBadAddress(cell_t addr)
-{
-  if (addr < 0 ||
-      (addr >= hp_ && addr < sp_) ||
-      addr >= stp_)
-  {
-    ReportErrorNumber(SP_ERROR_INVALID_ADDRESS);
-    return nullptr;
-  }
-  return reinterpret_cast<cell_t*>(memory_ + addr);
-}
-
 bool
 PluginContext::addStack(cell_t amount)
 {
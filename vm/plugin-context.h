@@ -16,6 +16,7 @@
 #include "base-context.h"
 #include "scripted-invoker.h"
 #include "plugin-runtime.h"
+#include <string.h>
 
 namespace sp {
 
@@ -24,11 +25,14 @@ struct HeapTracker
   HeapTracker()
    : size(0),
      pBase(nullptr),
-     pCur(nullptr)
+     pCur(nullptr),
+     pLimit(nullptr)
   {}
   size_t size; 
   ucell_t *pBase; 
   ucell_t *pCur;
+  // Pushes below this don't grow the tracker, so the JIT can inline them.
+  ucell_t *pLimit;
 };
 
 static const size_t SP_MAX_RETURN_STACK = 1024;
@@ -100,6 +104,18 @@ class PluginContext : public BasePluginContext
   static inline size_t offsetOfMemory() {
     return offsetof(PluginContext, memory_);
   }
+  static inline size_t offsetOfHp() {
+    return offsetof(PluginContext, hp_);
+  }
+  static inline size_t offsetOfFrm() {
+    return offsetof(PluginContext, frm_);
+  }
+  static inline size_t offsetOfTrackerCur() {
+    return offsetof(PluginContext, tracker_) + offsetof(HeapTracker, pCur);
+  }
+  static inline size_t offsetOfTrackerLimit() {
+    return offsetof(PluginContext, tracker_) + offsetof(HeapTracker, pLimit);
+  }
 
   int32_t *addressOfSp() {
     return &sp_;
@@ -110,6 +126,12 @@ class PluginContext : public BasePluginContext
   cell_t *addressOfHp() {
     return &hp_;
   }
+  ucell_t **addressOfTrackerCur() {
+    return &tracker_.pCur;
+  }
+  ucell_t **addressOfTrackerLimit() {
+    return &tracker_.pLimit;
+  }
 
   cell_t frm() const {
     return frm_;
@@ -127,20 +149,123 @@ class PluginContext : public BasePluginContext
   int generateArray(cell_t dims, cell_t *stk, bool autozero);
   int generateFullArray(uint32_t argc, cell_t *argv, int autozero);
 
-  // These functions will report an error on failure.
+  // These functions will report an error on failure. The small ones are
+  // inline since the interpreter calls them for almost every instruction.
   bool pushAmxFrame();
   bool popAmxFrame();
-  bool pushStack(cell_t value);
-  bool popStack(cell_t* out);
   bool addStack(cell_t amount);
-  bool getFrameValue(cell_t offset, cell_t* out);
-  bool setFrameValue(cell_t offset, cell_t value);
-  bool getCellValue(cell_t address, cell_t* out);
-  bool setCellValue(cell_t address, cell_t value);
   bool heapAlloc(cell_t amount, cell_t* out);
   cell_t* acquireAddrRange(cell_t address, uint32_t bounds);
 
-  cell_t* throwIfBadAddress(cell_t addr);
+  bool pushStack(cell_t value) {
+    if (sp_ <= cell_t(hp_ + sizeof(cell_t))) {
+      ReportErrorNumber(SP_ERROR_STACKLOW);
+      return false;
+    }
+    sp_ -= sizeof(cell_t);
+
+    *reinterpret_cast<cell_t*>(memory_ + sp_) = value;
+    return true;
+  }
+
+  bool popStack(cell_t* out) {
+    if (sp_ >= stp_) {
+      ReportErrorNumber(SP_ERROR_STACKMIN);
+      return false;
+    }
+    *out = *reinterpret_cast<cell_t*>(memory_ + sp_);
+
+    sp_ += sizeof(cell_t);
+    return true;
+  }
+
+  bool getFrameValue(cell_t offset, cell_t* out) {
+    cell_t* addr = throwIfBadAddress(frm_ + offset);
+    if (!addr)
+      return false;
+
+    *out = *addr;
+    return true;
+  }
+
+  bool setFrameValue(cell_t offset, cell_t value) {
+    cell_t* addr = throwIfBadAddress(frm_ + offset);
+    if (!addr)
+      return false;
+
+    *addr = value;
+    return true;
+  }
+
+  bool getCellValue(cell_t address, cell_t* out) {
+    assert((uintptr_t)(const void *)out % sizeof(cell_t) == 0);
+
+    cell_t* ptr = throwIfBadAddress(address);
+    if (!ptr)
+      return false;
+
+    if ((uintptr_t)(const void*)ptr % sizeof(cell_t) == 0) {
+      *out = *ptr;
+    } else {
+      for (size_t i = 0; i < sizeof(cell_t); ++i) {
+        ((unsigned char*)out)[i] = ((unsigned char*)ptr)[i];
+      }
+    }
+
+    return true;
+  }
+
+  bool setCellValue(cell_t address, cell_t value) {
+    cell_t* ptr = throwIfBadAddress(address);
+    if (!ptr)
+      return false;
+
+    *ptr = value;
+    return true;
+  }
+
+  // Unchecked forms of the accessors above, for accesses the method verifier
+  // has proven to be in bounds.
+  cell_t popStackUnchecked() {
+    assert(sp_ < stp_);
+    cell_t value = *reinterpret_cast<cell_t*>(memory_ + sp_);
+    sp_ += sizeof(cell_t);
+    return value;
+  }
+
+  cell_t getFrameValueUnchecked(cell_t offset) const {
+    assert(frm_ + offset >= sp_ && frm_ + offset < stp_);
+    return *reinterpret_cast<cell_t*>(memory_ + frm_ + offset);
+  }
+
+  void setFrameValueUnchecked(cell_t offset, cell_t value) {
+    assert(frm_ + offset >= sp_ && frm_ + offset < stp_);
+    *reinterpret_cast<cell_t*>(memory_ + frm_ + offset) = value;
+  }
+
+  // Data section addresses may be unaligned.
+  cell_t getCellValueUnchecked(cell_t address) const {
+    assert(address >= 0 && address < hp_);
+    cell_t value;
+    memcpy(&value, memory_ + address, sizeof(cell_t));
+    return value;
+  }
+
+  void setCellValueUnchecked(cell_t address, cell_t value) {
+    assert(address >= 0 && address < hp_);
+    memcpy(memory_ + address, &value, sizeof(cell_t));
+  }
+
+  cell_t* throwIfBadAddress(cell_t addr) {
+    if (addr < 0 ||
+        (addr >= hp_ && addr < sp_) ||
+        addr >= stp_)
+    {
+      ReportErrorNumber(SP_ERROR_INVALID_ADDRESS);
+      return nullptr;
+    }
+    return reinterpret_cast<cell_t*>(memory_ + addr);
+  }
 
  private:
   PluginRuntime *m_pRuntime;
@@ -20,6 +20,10 @@
 #include "environment.h"
 #include "method-info.h"
 #include "plugin-context.h"
+#if defined(SP_HAS_JIT)
+# include "compile-queue.h"
+# include "jit.h"
+#endif
 
 #include "md5/md5.h"
 
@@ -29,6 +33,8 @@ using namespace SourcePawn;
 PluginRuntime::PluginRuntime(LegacyImage *image)
  : image_(image),
    paused_(false),
+   ran_(false),
+   optimizes_code_(false),
    computed_code_hash_(false),
    computed_data_hash_(false)
 {
@@ -43,6 +49,13 @@ PluginRuntime::PluginRuntime(LegacyImage *image)
 
 PluginRuntime::~PluginRuntime()
 {
+#if defined(SP_HAS_JIT)
+  // Compile threads publish code under the lock, so stop them from looking
+  // at this runtime before taking it.
+  if (CompileQueue* queue = Environment::get()->compile_queue())
+    queue->CancelRuntime(this);
+#endif
+
   // The watchdog thread takes the global JIT lock while it patches all
   // runtimes. It is not enough to ensure that the unlinking of the runtime is
   // protected; we cannot delete functions or code while the watchdog might be
@@ -58,14 +71,16 @@ PluginRuntime::~PluginRuntime()
 bool
 PluginRuntime::Initialize()
 {
-  if (!ke::IsAligned(code_.bytes, sizeof(cell_t))) {
-    // Align the code section.
-    aligned_code_ = MakeUnique<uint8_t[]>(code_.length);
-    if (!aligned_code_)
+  // The code is copied if it has to be aligned, or if the pcode optimizer
+  // will rewrite it.
+  optimizes_code_ = Environment::get()->IsPcodeOptimizationEnabled();
+  if (optimizes_code_ || !ke::IsAligned(code_.bytes, sizeof(cell_t))) {
+    owned_code_ = MakeUnique<uint8_t[]>(code_.length);
+    if (!owned_code_)
       return false;
 
-    memcpy(aligned_code_.get(), code_.bytes, code_.length);
-    code_.bytes = aligned_code_.get();
+    memcpy(owned_code_.get(), code_.bytes, code_.length);
+    code_.bytes = owned_code_.get();
   }
 
   natives_ = MakeUnique<NativeEntry[]>(image_->NumNatives());
@@ -91,7 +106,7 @@ PluginRuntime::Initialize()
   if (!context_->Initialize())
     return false;
 
-  SetupFloatNativeRemapping();
+  SetupNativeRemapping();
 
   if (!function_map_.init(32))
     return false;
@@ -99,6 +114,41 @@ PluginRuntime::Initialize()
   return true;
 }
 
+#if defined(SP_HAS_JIT)
+// With eager compilation, the whole plugin is compiled when it first runs.
+// Otherwise, without tiering every method is compiled on its first call
+// anyway, so with compile threads, all publics start compiling then. Neither
+// happens at load: the compiler replaces some natives with opcodes, depending
+// on how they are bound, and natives are bound after loading.
+void
+PluginRuntime::CompileOnFirstRun(PluginContext* cx)
+{
+  if (ran_)
+    return;
+  ran_ = true;
+
+  Environment* env = Environment::get();
+  if (env->IsEagerCompileEnabled()) {
+    CompilerBase::CompileAll(cx);
+    return;
+  }
+
+  CompileQueue* queue = env->compile_queue();
+  if (!queue || env->IsTieringEnabled() || env->opcode_profiler())
+    return;
+
+  for (size_t i = 0; i < image_->NumPublics(); i++) {
+    uint32_t offset;
+    image_->GetPublic(i, &offset, nullptr);
+
+    RefPtr<MethodInfo> method = AcquireMethod(offset);
+    if (!method || method->Validate() != SP_ERROR_NONE)
+      continue;
+    queue->Enqueue(this, method);
+  }
+}
+#endif
+
 struct NativeMapping {
   const char *name;
   unsigned opcode;
@@ -127,8 +177,10 @@ static const NativeMapping sNativeMap[] = {
 };
 
 void
-PluginRuntime::SetupFloatNativeRemapping()
+PluginRuntime::SetupNativeRemapping()
 {
+  Environment* env = Environment::get();
+
   float_table_ = MakeUnique<floattbl_t[]>(image_->NumNatives());
   for (size_t i = 0; i < image_->NumNatives(); i++) {
     const char *name = image_->GetNative(i);
@@ -141,6 +193,8 @@ PluginRuntime::SetupFloatNativeRemapping()
       }
       iter++;
     }
+    if (!float_table_[i].found)
+      float_table_[i].intrinsic = env->FindIntrinsic(name);
   }
 }
 
@@ -155,7 +209,7 @@ void
 PluginRuntime::InstallBuiltinNatives()
 {
   for (size_t i = 0; i < image_->NumNatives(); i++) {
-    if (!float_table_[i].found)
+    if (!float_table_[i].found && !float_table_[i].intrinsic)
       continue;
 
     UpdateNativeBinding(i, NativeMustBeReplaced, 0, nullptr);
@@ -170,6 +224,12 @@ PluginRuntime::GetNativeReplacement(size_t index)
   return float_table_[index].index;
 }
 
+const sp_intrinsic_t*
+PluginRuntime::GetIntrinsic(size_t index)
+{
+  return float_table_[index].intrinsic;
+}
+
 void
 PluginRuntime::SetNames(const char *fullname, const char *name)
 {
@@ -265,6 +325,7 @@ PluginRuntime::UpdateNativeBinding(uint32_t index, SPVM_NATIVE_FUNC pfn, uint32_
   }
 
   native->legacy_fn = pfn;
+  native->fast = nullptr;
   native->status = pfn
                    ? SP_NATIVE_BOUND
                    : SP_NATIVE_UNBOUND;
@@ -273,6 +334,27 @@ PluginRuntime::UpdateNativeBinding(uint32_t index, SPVM_NATIVE_FUNC pfn, uint32_
   return SP_ERROR_NONE;
 }
 
+int
+PluginRuntime::UpdateFastNativeBinding(uint32_t index, const sp_fastnativeinfo_t *info,
+                                       uint32_t flags, void *data)
+{
+  if (!info->func || !info->fast || info->nparams > SP_MAX_FASTNATIVE_PARAMS)
+    return SP_ERROR_PARAM;
+  for (unsigned i = 0; i < info->nparams; i++) {
+    if (info->param_kinds[i] > SP_FASTARG_FLOAT)
+      return SP_ERROR_PARAM;
+  }
+  if (info->return_kind > SP_FASTARG_FLOAT)
+    return SP_ERROR_PARAM;
+
+  int err = UpdateNativeBinding(index, info->func, flags, data);
+  if (err != SP_ERROR_NONE)
+    return err;
+
+  natives_[index].fast = info;
+  return SP_ERROR_NONE;
+}
+
 const sp_native_t *
 PluginRuntime::GetNative(uint32_t index)
 {
@@ -462,7 +544,7 @@ PluginRuntime::GetMemUsage()
   return sizeof(*this) +
          sizeof(PluginContext) +
          image_->ImageSize() +
-         (aligned_code_ ? code_.length : 0) +
+         (owned_code_ ? code_.length : 0) +
          context_->HeapSize();
 }
 
@@ -470,8 +552,10 @@ unsigned char *
 PluginRuntime::GetCodeHash()
 {
   if (!computed_code_hash_) {
+    // Hash the code as it was loaded, before any of it was optimized.
+    LegacyImage::Code original = image_->DescribeCode();
     MD5 md5_pcode;
-    md5_pcode.update((const unsigned char *)code_.bytes, code_.length);
+    md5_pcode.update((const unsigned char *)original.bytes, original.length);
     md5_pcode.finalize();
     md5_pcode.raw_digest(code_hash_);
     computed_code_hash_ = true;
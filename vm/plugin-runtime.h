@@ -34,17 +34,23 @@ struct floattbl_t
   floattbl_t() {
     found = false;
     index = 0;
+    intrinsic = nullptr;
   }
   bool found;
   unsigned int index;
+  const sp_intrinsic_t* intrinsic;
 };
 
 struct NativeEntry : public sp_native_t
 {
   NativeEntry()
-   : legacy_fn(nullptr)
+   : legacy_fn(nullptr),
+     fast(nullptr)
   {}
   SPVM_NATIVE_FUNC legacy_fn;
+
+  // Set if the native was bound with a fast function.
+  const sp_fastnativeinfo_t* fast;
 };
 
 /* Jit wants fast access to this so we expose things as public */
@@ -83,8 +89,11 @@ class PluginRuntime
   virtual unsigned char *GetDataHash() override;
   void SetNames(const char *fullname, const char *name);
   unsigned GetNativeReplacement(size_t index);
+  const sp_intrinsic_t* GetIntrinsic(size_t index);
   ScriptedInvoker *GetPublicFunction(size_t index);
   int UpdateNativeBinding(uint32_t index, SPVM_NATIVE_FUNC pfn, uint32_t flags, void *data) override;
+  int UpdateFastNativeBinding(uint32_t index, const sp_fastnativeinfo_t *info,
+                              uint32_t flags, void *data) override;
   const sp_native_t *GetNative(uint32_t index) override;
   int LookupLine(ucell_t addr, uint32_t *line) override;
   int LookupFunction(ucell_t addr, const char **name) override;
@@ -93,7 +102,7 @@ class PluginRuntime
     return full_name_.chars();
   }
 
-  // Mark builtin natives as bound.
+  // Mark builtin natives and natives replaced by intrinsics as bound.
   void InstallBuiltinNatives();
 
   // Return the method if it was previously analyzed; null otherwise.
@@ -102,6 +111,9 @@ class PluginRuntime
   // If there is no method at the given offset, return null. If there is a
   // method, return it.
   RefPtr<MethodInfo> AcquireMethod(cell_t pcode_offset);
+#if defined(SP_HAS_JIT)
+  void CompileOnFirstRun(PluginContext* cx);
+#endif
 
   // Return a list of all methods. The caller must own the environment lock.
   const ke::Vector<RefPtr<MethodInfo>>& AllMethods() const;
@@ -127,6 +139,14 @@ class PluginRuntime
   const Code &code() const {
     return code_;
   }
+
+  // The code, when the runtime keeps its own copy of it for the pcode
+  // optimizer; otherwise null. Each method is rewritten in place when it is
+  // validated, so only the main thread may use this, and no other thread may
+  // read a method until it has been validated.
+  cell_t* writableCode() const {
+    return optimizes_code_ ? reinterpret_cast<cell_t*>(owned_code_.get()) : nullptr;
+  }
   const Data &data() const {
     return data_;
   }
@@ -138,11 +158,11 @@ class PluginRuntime
   }
 
  private:
-  void SetupFloatNativeRemapping();
+  void SetupNativeRemapping();
 
  private:
   ke::AutoPtr<sp::LegacyImage> image_;
-  ke::AutoPtr<uint8_t[]> aligned_code_;
+  ke::AutoPtr<uint8_t[]> owned_code_;
   ke::AutoPtr<floattbl_t[]> float_table_;
   ke::AString name_;
   ke::AString full_name_;
@@ -170,6 +190,12 @@ class PluginRuntime
   // Pause state.
   bool paused_;
 
+  // Whether any function has been invoked yet.
+  bool ran_;
+
+  // Whether methods are run through the pcode optimizer.
+  bool optimizes_code_;
+
   // Checksumming.
   bool computed_code_hash_;
   bool computed_data_hash_;
@@ -17,6 +17,9 @@
 #include "dll_exports.h"
 #include "environment.h"
 #include "stack-frames.h"
+#if defined(SP_HAS_JIT)
+# include "macro-assembler.h"
+#endif
 
 #ifdef __EMSCRIPTEN__
 # include <emscripten.h>
@@ -120,6 +123,44 @@ static cell_t DoNothing(IPluginContext *cx, const cell_t *params)
   return 1;
 }
 
+static cell_t MinFallback(const cell_t *params)
+{
+  return params[1] < params[2] ? params[1] : params[2];
+}
+
+#if defined(SP_HAS_JIT)
+static bool EmitMin(MacroAssembler &masm)
+{
+# if defined(KE_ARCH_X64)
+  Register pri = rax, alt = rdx;
+# else
+  Register pri = eax, alt = edx;
+# endif
+  Label done;
+  masm.cmpl(pri, alt);
+  masm.j(less_equal, &done);
+  masm.movl(pri, alt);
+  masm.bind(&done);
+  return true;
+}
+#else
+# define EmitMin nullptr
+#endif
+
+static cell_t PopcountFallback(const cell_t *params)
+{
+  ucell_t value = params[1];
+  cell_t count = 0;
+  for (; value; value &= value - 1)
+    count++;
+  return count;
+}
+
+static const sp_intrinsic_t sIntrinsics[] = {
+  { "imin", MinFallback, EmitMin, 2 },
+  { "popcount", PopcountFallback, nullptr, 1 },
+};
+
 static void BindNative(IPluginRuntime *rt, const char *name, SPVM_NATIVE_FUNC fn)
 {
   int err;
@@ -140,6 +181,29 @@ static cell_t WriteFloat(IPluginContext *cx, const cell_t *params)
   return printf("%f", sp_ctof(params[1]));
 }
 
+// Reason 1 calls the plugin's on_interrupt(), if it has one; reason 2 aborts
+// the script.
+class ShellInterruptHandler : public IInterruptHandler
+{
+public:
+  int OnInterrupt(IPluginContext *cx, uint32_t reasons) override {
+    fprintf(stdout, "interrupt: %d\n", int(reasons));
+    if (reasons & 1) {
+      if (IPluginFunction *fn = cx->GetFunctionByName("on_interrupt"))
+        fn->Invoke();
+    }
+    if (reasons & 2)
+      return SP_ERROR_ABORTED;
+    return SP_ERROR_NONE;
+  }
+};
+
+static cell_t RequestInterrupt(IPluginContext *cx, const cell_t *params)
+{
+  sEnv->APIv2()->RequestInterrupt(params[1]);
+  return 0;
+}
+
 static cell_t DoExecute(IPluginContext *cx, const cell_t *params)
 {
   int32_t ok = 0;
@@ -177,6 +241,54 @@ static cell_t ReportError(IPluginContext* cx, const cell_t *params)
   return 0;
 }
 
+static bool CanDivide(cell_t a, cell_t b)
+{
+  return b != 0 && !(a == INT32_MIN && b == -1);
+}
+
+static cell_t CheckedDiv(IPluginContext *cx, const cell_t *params)
+{
+  if (!CanDivide(params[1], params[2]))
+    return cx->ThrowNativeError("Cannot divide %d by %d", params[1], params[2]);
+  return params[1] / params[2];
+}
+
+static cell_t FastCheckedDiv(int *fallback, cell_t a, cell_t b)
+{
+  if (!CanDivide(a, b)) {
+    *fallback = 1;
+    return 0;
+  }
+  return a / b;
+}
+
+static cell_t ScaleFloat(IPluginContext *cx, const cell_t *params)
+{
+  return sp_ftoc(sp_ctof(params[1]) * params[2]);
+}
+
+static float FastScaleFloat(int *fallback, float value, cell_t factor)
+{
+  return value * factor;
+}
+
+static const sp_fastnativeinfo_t sFastNatives[] = {
+  { "checked_div", CheckedDiv, (void *)FastCheckedDiv, 2,
+    { SP_FASTARG_CELL, SP_FASTARG_CELL }, SP_FASTARG_CELL },
+  { "scale", ScaleFloat, (void *)FastScaleFloat, 2,
+    { SP_FASTARG_FLOAT, SP_FASTARG_CELL }, SP_FASTARG_FLOAT },
+};
+
+static void BindFastNatives(IPluginRuntime *rt)
+{
+  for (size_t i = 0; i < sizeof(sFastNatives) / sizeof(sFastNatives[0]); i++) {
+    uint32_t index;
+    if (rt->FindNativeByName(sFastNatives[i].name, &index) != SP_ERROR_NONE)
+      continue;
+    rt->UpdateFastNativeBinding(index, &sFastNatives[i], 0, nullptr);
+  }
+}
+
 static int Execute(const char *file)
 {
   char error[255];
@@ -199,6 +311,8 @@ static int Execute(const char *file)
   BindNative(rt, "invoke", DoInvoke);
   BindNative(rt, "dump_stack_trace", DumpStackTrace);
   BindNative(rt, "report_error", ReportError);
+  BindNative(rt, "request_interrupt", RequestInterrupt);
+  BindFastNatives(rt);
 
   IPluginFunction *fun = rt->GetFunctionByName("main");
   if (!fun)
@@ -242,13 +356,53 @@ int main(int argc, char **argv)
 
   if (getenv("DISABLE_JIT") && getenv("DISABLE_JIT")[0] == '1')
     sEnv->SetJitEnabled(false);
+  if (getenv("TIERED_JIT") && getenv("TIERED_JIT")[0] == '1')
+    sEnv->SetTieringEnabled(true);
+  if (getenv("EAGER_JIT") && getenv("EAGER_JIT")[0] == '1')
+    sEnv->SetEagerCompileEnabled(true);
+  if (getenv("DISABLE_PCODE_OPT") && getenv("DISABLE_PCODE_OPT")[0] == '1')
+    sEnv->SetPcodeOptimizationEnabled(false);
+  if (getenv("OPTIMIZING_JIT") && getenv("OPTIMIZING_JIT")[0] == '1')
+    sEnv->SetOptimizingJitEnabled(true);
+#if defined(SP_HAS_JIT)
+  if (getenv("JIT_THREADS") && atoi(getenv("JIT_THREADS")) > 0) {
+    if (!sEnv->SetCompileThreads(atoi(getenv("JIT_THREADS"))))
+      fprintf(stderr, "Could not start compile threads\n");
+  }
+  if (getenv("JIT_CACHE") && getenv("JIT_CACHE")[0]) {
+    if (!sEnv->SetCodeCachePath(getenv("JIT_CACHE")))
+      fprintf(stderr, "Could not use code cache directory\n");
+  }
+  const char* jitdump_dir = getenv("JITDUMP_DIR");
+  if (jitdump_dir && !jitdump_dir[0])
+    jitdump_dir = nullptr;
+  if ((getenv("PERF_MAP") && getenv("PERF_MAP")[0] == '1') || jitdump_dir) {
+    if (!sEnv->EnablePerfMap(jitdump_dir))
+      fprintf(stderr, "Could not enable perf map\n");
+  }
+  if (getenv("GDB_JIT") && getenv("GDB_JIT")[0] == '1') {
+    if (!sEnv->EnableGdbJitInterface())
+      fprintf(stderr, "Could not enable the GDB JIT interface\n");
+  }
+#endif
+  if (getenv("OPCODE_PROFILE") && getenv("OPCODE_PROFILE")[0]) {
+    if (!sEnv->EnableOpcodeProfiling(getenv("OPCODE_PROFILE")))
+      fprintf(stderr, "Could not enable opcode profiling\n");
+  }
+
+  for (size_t i = 0; i < sizeof(sIntrinsics) / sizeof(sIntrinsics[0]); i++)
+    sEnv->RegisterIntrinsic(&sIntrinsics[i]);
 
   ShellDebugListener debug;
   sEnv->SetDebugger(&debug);
   sEnv->InstallWatchdogTimer(5000);
 
+  ShellInterruptHandler interrupts;
+  sEnv->APIv2()->SetInterruptHandler(&interrupts);
+
   int errcode = Execute(argv[1]);
 
+  sEnv->APIv2()->SetInterruptHandler(nullptr);
   sEnv->SetDebugger(NULL);
   sEnv->Shutdown();
   delete sEnv;
@@ -0,0 +1,1449 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <limits.h>
+#include <stdlib.h>
+#include "ssa-builder.h"
+#include "opcodes.h"
+#include "pcode-reader.h"
+#include "plugin-runtime.h"
+
+namespace sp {
+
+using namespace ke;
+
+// Larger methods aren't worth the time or memory, in cells.
+static const size_t kMaxMethodCells = 32768;
+
+// The most blocks times variables the builder keeps current values for.
+static const size_t kMaxDefs = 1 << 20;
+
+// Arguments past this many stay in memory.
+static const uint32_t kMaxPromotedArgs = 32;
+
+SsaBuilder::SsaBuilder(PluginRuntime* rt, uint32_t startOffset, uint32_t endOffset,
+                       const Vector<cell_t>& block_starts,
+                       const Vector<int32_t>& stack_depths,
+                       const Vector<cell_t>& redundant_bounds,
+                       SsaGraph* graph)
+ : rt_(rt),
+   code_(reinterpret_cast<const cell_t*>(rt->code().bytes)),
+   method_(code_ + startOffset / sizeof(cell_t)),
+   end_(code_ + endOffset / sizeof(cell_t)),
+   pcode_start_(startOffset),
+   pcode_end_(endOffset),
+   block_starts_(block_starts),
+   stack_depths_(stack_depths),
+   redundant_bounds_(redundant_bounds),
+   graph_(graph),
+   failed_(false),
+   throw_block_(nullptr),
+   num_locals_(0),
+   num_args_(0),
+   lowest_local_escape_(0),
+   lowest_arg_escape_(INT_MAX),
+   writes_args_(false),
+   calls_natives_(false),
+   cur_(nullptr),
+   cip_(nullptr),
+   depth_(0),
+   next_redundant_bounds_(0)
+{
+}
+
+static int
+CompareOffsets(const void* a, const void* b)
+{
+  cell_t left = *reinterpret_cast<const cell_t*>(a);
+  cell_t right = *reinterpret_cast<const cell_t*>(b);
+  if (left < right)
+    return -1;
+  return left > right ? 1 : 0;
+}
+
+static bool
+IsConditionalJump(OPCODE op)
+{
+  switch (op) {
+  case OP_JZER:
+  case OP_JNZ:
+  case OP_JEQ:
+  case OP_JNEQ:
+  case OP_JSLESS:
+  case OP_JSLEQ:
+  case OP_JSGRTR:
+  case OP_JSGEQ:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool
+SsaBuilder::build()
+{
+  if (size_t(end_ - method_) > kMaxMethodCells)
+    return false;
+  if (!scan() || !buildBlocks())
+    return false;
+
+  for (size_t i = 0; i < states_.length(); i++) {
+    if (!fill(states_[i]))
+      return false;
+  }
+  return !failed_;
+}
+
+// Find where blocks start, and which frame slots can become variables.
+bool
+SsaBuilder::scan()
+{
+  Vector<uint8_t> insn_starts;
+  insn_starts.resize(end_ - method_ + 1);
+  for (size_t i = 0; i < insn_starts.length(); i++)
+    insn_starts[i] = 0;
+
+  int32_t max_depth = 0;
+  for (size_t i = 0; i < stack_depths_.length(); i++)
+    max_depth = ke::Max(max_depth, stack_depths_[i]);
+
+  cell_t max_arg = 0;
+  leaders_.append(cell_t(pcode_start_ + sizeof(cell_t)));
+
+  const cell_t* cip = method_ + 1;
+  while (cip < end_) {
+    size_t length = InstructionLength(cip, end_);
+    if (!length)
+      return false;
+    insn_starts[cip - method_] = 1;
+
+    OPCODE op = (OPCODE)*cip;
+    const cell_t* params = cip + 1;
+    cell_t next = cell_t((cip + length - code_) * sizeof(cell_t));
+    switch (op) {
+    case OP_LOAD_S_PRI:
+    case OP_LOAD_S_ALT:
+    case OP_LREF_S_PRI:
+    case OP_LREF_S_ALT:
+    case OP_SREF_S_PRI:
+    case OP_SREF_S_ALT:
+    case OP_LOAD_S_BOTH:
+    case OP_PUSH_S:
+    case OP_PUSH2_S:
+    case OP_PUSH3_S:
+    case OP_PUSH4_S:
+    case OP_PUSH5_S:
+      for (size_t i = 1; i < length; i++)
+        max_arg = ke::Max(max_arg, params[i - 1]);
+      break;
+
+    case OP_STOR_S_PRI:
+    case OP_STOR_S_ALT:
+    case OP_ZERO_S:
+    case OP_CONST_S:
+    case OP_INC_S:
+    case OP_DEC_S:
+      max_arg = ke::Max(max_arg, params[0]);
+      if (params[0] >= 12)
+        writes_args_ = true;
+      break;
+
+    case OP_ADDR_PRI:
+    case OP_ADDR_ALT:
+    case OP_PUSH_ADR:
+    case OP_PUSH2_ADR:
+    case OP_PUSH3_ADR:
+    case OP_PUSH4_ADR:
+    case OP_PUSH5_ADR:
+      for (size_t i = 1; i < length; i++) {
+        cell_t offset = params[i - 1];
+        if (offset < 0) {
+          if (!lowest_local_escape_ || offset < lowest_local_escape_)
+            lowest_local_escape_ = offset;
+        } else {
+          lowest_arg_escape_ = ke::Min(lowest_arg_escape_, ke::Max(offset, cell_t(12)));
+        }
+      }
+      break;
+
+    case OP_SYSREQ_C:
+    case OP_SYSREQ_N:
+      calls_natives_ = true;
+      break;
+
+    case OP_JUMP:
+    case OP_SWITCH:
+    case OP_RETN:
+      leaders_.append(next);
+      break;
+
+    default:
+      if (IsConditionalJump(op))
+        leaders_.append(next);
+      break;
+    }
+    cip += length;
+  }
+
+  for (size_t i = 0; i < block_starts_.length(); i++)
+    leaders_.append(block_starts_[i]);
+  qsort(leaders_.buffer(), leaders_.length(), sizeof(cell_t), CompareOffsets);
+
+  // Drop duplicates and the end of the method, and check that every block
+  // starts on an instruction.
+  Vector<cell_t> leaders;
+  for (size_t i = 0; i < leaders_.length(); i++) {
+    cell_t offset = leaders_[i];
+    if (offset >= cell_t(pcode_end_))
+      break;
+    if (!leaders.empty() && leaders.back() == offset)
+      continue;
+    if (offset <= cell_t(pcode_start_) || !ke::IsAligned(offset, sizeof(cell_t)))
+      return false;
+    if (!insn_starts[(offset - pcode_start_) / sizeof(cell_t)])
+      return false;
+    leaders.append(offset);
+  }
+  leaders.append(cell_t(pcode_end_));
+  leaders_ = ke::Move(leaders);
+
+  num_locals_ = uint32_t(max_depth / sizeof(cell_t)) + 6;
+  if (max_arg >= 12)
+    num_args_ = ke::Min(uint32_t((max_arg - 12) / sizeof(cell_t)) + 1, kMaxPromotedArgs);
+  if ((leaders_.length() + 2) * (2 + num_locals_ + num_args_) > kMaxDefs)
+    return false;
+  return true;
+}
+
+void
+SsaBuilder::successorsOf(const cell_t* cip, Vector<cell_t>* targets)
+{
+  OPCODE op = (OPCODE)*cip;
+  cell_t next = cell_t((cip + InstructionLength(cip, end_) - code_) * sizeof(cell_t));
+  switch (op) {
+  case OP_JUMP:
+    targets->append(cip[1]);
+    break;
+  case OP_RETN:
+    break;
+  case OP_SWITCH:
+  {
+    const cell_t* table = code_ + cip[1] / sizeof(cell_t);
+    cell_t ncases = table[1];
+    targets->append(table[2]);
+    for (cell_t i = 0; i < ncases; i++)
+      targets->append(table[3 + i * 2 + 1]);
+    break;
+  }
+  default:
+    if (IsConditionalJump(op))
+      targets->append(cip[1]);
+    targets->append(next);
+    break;
+  }
+}
+
+SsaBlock*
+SsaBuilder::blockAt(cell_t offset)
+{
+  if (offset == cell_t(pcode_end_)) {
+    if (!throw_block_)
+      throw_block_ = graph_->newBlock(offset);
+    return throw_block_;
+  }
+
+  // Blocks are created in pcode order, after the entry block.
+  size_t lo = 1, hi = states_.length();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    cell_t start = states_[mid].start;
+    if (start == offset)
+      return states_[mid].block;
+    if (start < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  assert(false);
+  return nullptr;
+}
+
+bool
+SsaBuilder::buildBlocks()
+{
+  size_t nregions = leaders_.length() - 1;
+
+  // Find the last instruction of each region.
+  Vector<const cell_t*> last;
+  for (size_t i = 0; i < nregions; i++) {
+    const cell_t* cip = code_ + leaders_[i] / sizeof(cell_t);
+    const cell_t* stop = code_ + leaders_[i + 1] / sizeof(cell_t);
+    const cell_t* prev = cip;
+    while (cip < stop) {
+      prev = cip;
+      cip += InstructionLength(cip, end_);
+    }
+    if (cip != stop)
+      return false;
+    last.append(prev);
+  }
+
+  auto regionOf = [this](cell_t offset) -> size_t {
+    size_t lo = 0, hi = leaders_.length() - 1;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (leaders_[mid] == offset)
+        return mid;
+      if (leaders_[mid] < offset)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return leaders_.length() - 1;
+  };
+
+  // Only blocks reachable from the start are translated.
+  Vector<uint8_t> reachable;
+  reachable.resize(nregions);
+  for (size_t i = 0; i < nregions; i++)
+    reachable[i] = 0;
+  Vector<size_t> work;
+  reachable[0] = 1;
+  work.append(0);
+  while (!work.empty()) {
+    size_t region = work.popCopy();
+    Vector<cell_t> targets;
+    successorsOf(last[region], &targets);
+    for (size_t i = 0; i < targets.length(); i++) {
+      size_t target = regionOf(targets[i]);
+      if (target == nregions) {
+        if (targets[i] != cell_t(pcode_end_))
+          return false;
+        continue;
+      }
+      if (!reachable[target]) {
+        reachable[target] = 1;
+        work.append(target);
+      }
+    }
+  }
+
+  SsaBlock* entry = graph_->newBlock(pcode_start_);
+  SsaInsn* jump = graph_->newInsn(SsaOp::Jump, entry, method_);
+  entry->insns.append(jump);
+
+  Vector<size_t> regions;
+  for (size_t i = 0; i < nregions; i++) {
+    if (!reachable[i])
+      continue;
+    regions.append(i);
+  }
+
+  states_.resize(regions.length() + 1);
+  states_[0].block = entry;
+  states_[0].start = pcode_start_;
+  states_[0].end = pcode_start_;
+  for (size_t i = 0; i < regions.length(); i++) {
+    BlockState& state = states_[i + 1];
+    state.start = leaders_[regions[i]];
+    state.end = leaders_[regions[i] + 1];
+    state.block = graph_->newBlock(state.start);
+  }
+
+  graph_->addEdge(entry, states_[1].block);
+  for (size_t i = 0; i < regions.length(); i++) {
+    SsaBlock* block = states_[i + 1].block;
+    Vector<cell_t> targets;
+    successorsOf(last[regions[i]], &targets);
+    for (size_t j = 0; j < targets.length(); j++) {
+      SsaBlock* succ = blockAt(targets[j]);
+      bool seen = false;
+      for (size_t k = 0; k < block->succs.length(); k++) {
+        if (block->succs[k] == succ) {
+          seen = true;
+          break;
+        }
+      }
+      if (!seen)
+        graph_->addEdge(block, succ);
+    }
+  }
+
+  if (throw_block_) {
+    BlockState state;
+    state.block = throw_block_;
+    state.start = pcode_end_;
+    state.end = pcode_end_;
+    states_.append(ke::Move(state));
+  }
+
+  size_t nvars = 2 + num_locals_ + num_args_;
+  for (size_t i = 0; i < states_.length(); i++) {
+    BlockState& state = states_[i];
+    assert(state.block->id == i);
+    state.defs.resize(nvars);
+    for (size_t j = 0; j < nvars; j++)
+      state.defs[j] = nullptr;
+    state.filled_preds = 0;
+    state.filled = false;
+    state.sealed = false;
+  }
+  states_[0].sealed = true;
+  return true;
+}
+
+bool
+SsaBuilder::fill(BlockState& state)
+{
+  cur_ = &state;
+  if (!state.sealed && state.filled_preds == state.block->preds.length())
+    seal(state);
+
+  if (state.block == throw_block_) {
+    cip_ = end_;
+    depth_ = 0;
+    SsaInsn* insn = emit(SsaOp::Throw);
+    insn->imm = SP_ERROR_INVALID_INSTRUCTION;
+  } else if (state.block != graph_->entry()) {
+    PcodeReader<SsaBuilder> reader(rt_, state.start, this);
+    while (reader.cip_offset() < state.end) {
+      OPCODE op = reader.peekOpcode();
+      if (op != OP_NOP && op != OP_BREAK && op != OP_CASETBL) {
+        cip_ = reader.cip();
+        size_t index = (reader.cip_offset() - pcode_start_) / sizeof(cell_t);
+        if (index >= stack_depths_.length() || stack_depths_[index] < 0)
+          return false;
+        depth_ = stack_depths_[index];
+      }
+      if (!reader.visitNext() || failed_)
+        return false;
+    }
+    SsaInsn* last = state.block->terminator();
+    if (!last || !last->isTerminator()) {
+      assert(state.block->succs.length() == 1);
+      emit(SsaOp::Jump);
+    }
+  }
+
+  finishBlock(state);
+  return true;
+}
+
+void
+SsaBuilder::finishBlock(BlockState& state)
+{
+  state.filled = true;
+  for (size_t i = 0; i < state.block->succs.length(); i++) {
+    BlockState& succ = states_[state.block->succs[i]->id];
+    succ.filled_preds++;
+    if (succ.filled_preds == succ.block->preds.length() && !succ.sealed)
+      seal(succ);
+  }
+}
+
+void
+SsaBuilder::seal(BlockState& state)
+{
+  state.sealed = true;
+  for (size_t i = 0; i < state.incomplete.length(); i++) {
+    const IncompletePhi& entry = state.incomplete[i];
+    addPhiOperands(entry.var, entry.phi, state);
+  }
+  state.incomplete.clear();
+}
+
+bool
+SsaBuilder::isPromoted(cell_t offset) const
+{
+  if (!ke::IsAligned(offset, sizeof(cell_t)))
+    return false;
+  if (offset < 0) {
+    if (uint32_t(-offset / sizeof(cell_t)) > num_locals_)
+      return false;
+    return !lowest_local_escape_ || offset < lowest_local_escape_;
+  }
+  if (offset < 12 || uint32_t((offset - 12) / sizeof(cell_t)) >= num_args_)
+    return false;
+  // Natives can read the caller's arguments, so writes have to be visible.
+  if (writes_args_ && calls_natives_)
+    return false;
+  return offset < lowest_arg_escape_;
+}
+
+uint32_t
+SsaBuilder::slotVar(cell_t offset) const
+{
+  assert(isPromoted(offset));
+  if (offset < 0)
+    return 2 + uint32_t(-offset / sizeof(cell_t)) - 1;
+  return 2 + num_locals_ + uint32_t((offset - 12) / sizeof(cell_t));
+}
+
+cell_t
+SsaBuilder::varOffset(uint32_t var) const
+{
+  assert(var >= 2);
+  if (var < 2 + num_locals_)
+    return -cell_t((var - 2 + 1) * sizeof(cell_t));
+  return 12 + cell_t((var - 2 - num_locals_) * sizeof(cell_t));
+}
+
+void
+SsaBuilder::writeVar(uint32_t var, BlockState& state, SsaInsn* value)
+{
+  state.defs[var] = value;
+}
+
+SsaInsn*
+SsaBuilder::readVar(uint32_t var, BlockState& state)
+{
+  if (SsaInsn* value = state.defs[var])
+    return value;
+  return readVarRecursive(var, state);
+}
+
+SsaInsn*
+SsaBuilder::readVarRecursive(uint32_t var, BlockState& state)
+{
+  SsaBlock* block = state.block;
+  SsaInsn* value;
+  if (block == graph_->entry()) {
+    value = initialValue(var);
+  } else if (!state.sealed) {
+    // Not every predecessor is known yet; fill in the phi once they are.
+    value = graph_->newInsn(SsaOp::Phi, block, nullptr);
+    block->phis.append(value);
+    state.incomplete.append(IncompletePhi{var, value});
+  } else if (block->preds.length() == 1) {
+    value = readVar(var, states_[block->preds[0]->id]);
+  } else {
+    // Break cycles by writing the phi before reading the predecessors.
+    value = graph_->newInsn(SsaOp::Phi, block, nullptr);
+    block->phis.append(value);
+    writeVar(var, state, value);
+    addPhiOperands(var, value, state);
+  }
+  writeVar(var, state, value);
+  return value;
+}
+
+void
+SsaBuilder::addPhiOperands(uint32_t var, SsaInsn* phi, BlockState& state)
+{
+  SsaBlock* block = state.block;
+  for (size_t i = 0; i < block->preds.length(); i++)
+    phi->addOperand(readVar(var, states_[block->preds[i]->id]));
+}
+
+// At the start of the method, arguments are in their slots, and locals hold
+// whatever was there before.
+SsaInsn*
+SsaBuilder::initialValue(uint32_t var)
+{
+  if (var == kPri || var == kAlt)
+    return constant(0);
+
+  cell_t offset = varOffset(var);
+  if (offset < 0)
+    return graph_->undefined();
+
+  size_t index = (offset - 12) / sizeof(cell_t);
+  while (params_.length() <= index)
+    params_.append(nullptr);
+  if (!params_[index]) {
+    SsaInsn* param = graph_->newInsn(SsaOp::Param, graph_->entry(), method_);
+    param->imm = offset;
+    graph_->entry()->insertBeforeTerminator(param);
+    params_[index] = param;
+  }
+  return params_[index];
+}
+
+SsaInsn*
+SsaBuilder::get(PawnReg reg)
+{
+  return readVar(reg == PawnReg::Pri ? kPri : kAlt, *cur_);
+}
+
+void
+SsaBuilder::set(PawnReg reg, SsaInsn* value)
+{
+  writeVar(reg == PawnReg::Pri ? kPri : kAlt, *cur_, value);
+}
+
+SsaInsn*
+SsaBuilder::readSlot(cell_t offset)
+{
+  if (isPromoted(offset))
+    return readVar(slotVar(offset), *cur_);
+  SsaInsn* insn = emit(SsaOp::LoadSlot);
+  insn->imm = offset;
+  return insn;
+}
+
+void
+SsaBuilder::writeSlot(cell_t offset, SsaInsn* value)
+{
+  if (isPromoted(offset)) {
+    writeVar(slotVar(offset), *cur_, value);
+    return;
+  }
+  SsaInsn* insn = emit(SsaOp::StoreSlot, value);
+  insn->imm = offset;
+}
+
+// Locals are only valid above the stack pointer.
+bool
+SsaBuilder::checkSlot(cell_t offset)
+{
+  if (offset < 0 && -offset > depth_)
+    return fail();
+  return true;
+}
+
+void
+SsaBuilder::materialize(cell_t lo, cell_t hi)
+{
+  for (cell_t offset = lo; offset < hi; offset += sizeof(cell_t)) {
+    if (!isPromoted(offset))
+      continue;
+    SsaInsn* store = emit(SsaOp::StoreSlot, readVar(slotVar(offset), *cur_));
+    store->imm = offset;
+  }
+}
+
+void
+SsaBuilder::forgetBelow(int32_t depth_after)
+{
+  for (uint32_t i = uint32_t(depth_after / sizeof(cell_t)); i < num_locals_; i++)
+    writeVar(2 + i, *cur_, graph_->undefined());
+}
+
+SsaInsn*
+SsaBuilder::emit(SsaOp op)
+{
+  SsaInsn* insn = graph_->newInsn(op, cur_->block, cip_);
+  insn->depth = depth_;
+  cur_->block->insns.append(insn);
+  return insn;
+}
+
+SsaInsn*
+SsaBuilder::emit(SsaOp op, SsaInsn* a)
+{
+  SsaInsn* insn = emit(op);
+  insn->addOperand(a);
+  return insn;
+}
+
+SsaInsn*
+SsaBuilder::emit(SsaOp op, SsaInsn* a, SsaInsn* b)
+{
+  SsaInsn* insn = emit(op);
+  insn->addOperand(a);
+  insn->addOperand(b);
+  return insn;
+}
+
+bool
+SsaBuilder::visitLOAD(PawnReg dest, cell_t srcaddr)
+{
+  set(dest, emit(SsaOp::Load, constant(srcaddr)));
+  return true;
+}
+
+bool
+SsaBuilder::visitLOAD_S(PawnReg dest, cell_t srcoffs)
+{
+  if (!checkSlot(srcoffs))
+    return false;
+  set(dest, readSlot(srcoffs));
+  return true;
+}
+
+bool
+SsaBuilder::visitLREF_S(PawnReg dest, cell_t srcoffs)
+{
+  if (!checkSlot(srcoffs))
+    return false;
+  set(dest, emit(SsaOp::Load, readSlot(srcoffs)));
+  return true;
+}
+
+bool
+SsaBuilder::visitLOAD_I()
+{
+  SsaInsn* insn = emit(SsaOp::LoadChecked, get(PawnReg::Pri));
+  insn->imm = 4;
+  set(PawnReg::Pri, insn);
+  return true;
+}
+
+bool
+SsaBuilder::visitLODB_I(cell_t width)
+{
+  SsaInsn* insn = emit(SsaOp::LoadChecked, get(PawnReg::Pri));
+  insn->imm = width;
+  set(PawnReg::Pri, insn);
+  return true;
+}
+
+bool
+SsaBuilder::visitCONST(PawnReg dest, cell_t imm)
+{
+  set(dest, constant(imm));
+  return true;
+}
+
+bool
+SsaBuilder::visitADDR(PawnReg dest, cell_t offset)
+{
+  SsaInsn* insn = emit(SsaOp::FrameAddr);
+  insn->imm = offset;
+  set(dest, insn);
+  return true;
+}
+
+bool
+SsaBuilder::visitSTOR(cell_t address, PawnReg src)
+{
+  emit(SsaOp::Store, constant(address), get(src));
+  return true;
+}
+
+bool
+SsaBuilder::visitSTOR_S(cell_t offset, PawnReg src)
+{
+  if (!checkSlot(offset))
+    return false;
+  writeSlot(offset, get(src));
+  return true;
+}
+
+bool
+SsaBuilder::visitSREF_S(cell_t offset, PawnReg src)
+{
+  if (!checkSlot(offset))
+    return false;
+  emit(SsaOp::Store, readSlot(offset), get(src));
+  return true;
+}
+
+bool
+SsaBuilder::visitSTOR_I()
+{
+  SsaInsn* insn = emit(SsaOp::StoreChecked, get(PawnReg::Alt), get(PawnReg::Pri));
+  insn->imm = 4;
+  return true;
+}
+
+bool
+SsaBuilder::visitSTRB_I(cell_t width)
+{
+  SsaInsn* insn = emit(SsaOp::StoreChecked, get(PawnReg::Alt), get(PawnReg::Pri));
+  insn->imm = width;
+  return true;
+}
+
+bool
+SsaBuilder::visitLIDX()
+{
+  SsaInsn* addr = emit(SsaOp::IndexAddr, get(PawnReg::Alt), get(PawnReg::Pri));
+  set(PawnReg::Pri, emit(SsaOp::Load, addr));
+  return true;
+}
+
+bool
+SsaBuilder::visitIDXADDR()
+{
+  set(PawnReg::Pri, emit(SsaOp::IndexAddr, get(PawnReg::Alt), get(PawnReg::Pri)));
+  return true;
+}
+
+bool
+SsaBuilder::visitMOVE(PawnReg reg)
+{
+  if (reg == PawnReg::Pri)
+    set(PawnReg::Pri, get(PawnReg::Alt));
+  else
+    set(PawnReg::Alt, get(PawnReg::Pri));
+  return true;
+}
+
+bool
+SsaBuilder::visitXCHG()
+{
+  SsaInsn* pri = get(PawnReg::Pri);
+  set(PawnReg::Pri, get(PawnReg::Alt));
+  set(PawnReg::Alt, pri);
+  return true;
+}
+
+bool
+SsaBuilder::visitPUSH(PawnReg src)
+{
+  writeSlot(-(depth_ + 4), get(src));
+  return true;
+}
+
+bool
+SsaBuilder::visitPUSH_C(const cell_t* vals, size_t nvals)
+{
+  for (size_t i = 0; i < nvals; i++)
+    writeSlot(-(depth_ + cell_t((i + 1) * sizeof(cell_t))), constant(vals[i]));
+  return true;
+}
+
+bool
+SsaBuilder::visitPUSH(const cell_t* addresses, size_t nvals)
+{
+  for (size_t i = 0; i < nvals; i++) {
+    SsaInsn* value = emit(SsaOp::Load, constant(addresses[i]));
+    writeSlot(-(depth_ + cell_t((i + 1) * sizeof(cell_t))), value);
+  }
+  return true;
+}
+
+bool
+SsaBuilder::visitPUSH_S(const cell_t* offsets, size_t nvals)
+{
+  for (size_t i = 0; i < nvals; i++) {
+    if (!checkSlot(offsets[i]))
+      return false;
+    writeSlot(-(depth_ + cell_t((i + 1) * sizeof(cell_t))), readSlot(offsets[i]));
+  }
+  return true;
+}
+
+bool
+SsaBuilder::visitPUSH_ADR(const cell_t* offsets, size_t nvals)
+{
+  for (size_t i = 0; i < nvals; i++) {
+    SsaInsn* addr = emit(SsaOp::FrameAddr);
+    addr->imm = offsets[i];
+    writeSlot(-(depth_ + cell_t((i + 1) * sizeof(cell_t))), addr);
+  }
+  return true;
+}
+
+bool
+SsaBuilder::visitPOP(PawnReg dest)
+{
+  set(dest, readSlot(-depth_));
+  return true;
+}
+
+bool
+SsaBuilder::visitSTACK(cell_t amount)
+{
+  // Popping can't go past frm, since the verifier knew the depth.
+  if (amount < 0) {
+    SsaInsn* check = emit(SsaOp::StackCheck);
+    check->depth = depth_ - amount;
+  }
+  return true;
+}
+
+bool
+SsaBuilder::visitHEAP(cell_t amount)
+{
+  SsaInsn* insn = emit(SsaOp::Heap);
+  insn->imm = amount;
+  set(PawnReg::Alt, insn);
+  return true;
+}
+
+bool
+SsaBuilder::visitRETN()
+{
+  emit(SsaOp::Return, get(PawnReg::Pri));
+  return true;
+}
+
+bool
+SsaBuilder::visitCALL(cell_t offset)
+{
+  SsaInsn* nargs = readSlot(-depth_);
+  if (!nargs->isConstant() || nargs->imm < 0 || nargs->imm > depth_ / 4)
+    return fail();
+
+  // Functions that return arrays also read the buffer address pushed before
+  // the arguments, which the caller pops.
+  int32_t popped = (nargs->imm + 1) * sizeof(cell_t);
+  materialize(-depth_, ke::Min(-depth_ + popped + int32_t(sizeof(cell_t)), 0));
+
+  SsaInsn* call = emit(SsaOp::Call);
+  call->imm = offset;
+  forgetBelow(depth_ - popped);
+  set(PawnReg::Pri, call);
+  set(PawnReg::Alt, constant(0));
+  return true;
+}
+
+bool
+SsaBuilder::visitJUMP(cell_t offset)
+{
+  emit(SsaOp::Jump);
+  return true;
+}
+
+bool
+SsaBuilder::visitJcmp(CompareOp op, cell_t offset)
+{
+  if (cur_->block->succs.length() == 1) {
+    emit(SsaOp::Jump);
+    return true;
+  }
+
+  SsaInsn* insn;
+  switch (op) {
+  case CompareOp::Zero:
+    insn = emit(SsaOp::Branch, get(PawnReg::Pri), constant(0));
+    insn->cond = CompareOp::Eq;
+    break;
+  case CompareOp::NotZero:
+    insn = emit(SsaOp::Branch, get(PawnReg::Pri), constant(0));
+    insn->cond = CompareOp::Neq;
+    break;
+  default:
+    insn = emit(SsaOp::Branch, get(PawnReg::Pri), get(PawnReg::Alt));
+    insn->cond = op;
+    break;
+  }
+  assert(cur_->block->succs[0] == blockAt(offset));
+  return true;
+}
+
+bool
+SsaBuilder::visitSHL()
+{
+  set(PawnReg::Pri, emit(SsaOp::Shl, get(PawnReg::Pri), get(PawnReg::Alt)));
+  return true;
+}
+
+bool
+SsaBuilder::visitSHR()
+{
+  set(PawnReg::Pri, emit(SsaOp::Shr, get(PawnReg::Pri), get(PawnReg::Alt)));
+  return true;
+}
+
+bool
+SsaBuilder::visitSSHR()
+{
+  set(PawnReg::Pri, emit(SsaOp::Sar, get(PawnReg::Pri), get(PawnReg::Alt)));
+  return true;
+}
+
+bool
+SsaBuilder::visitSHL_C(PawnReg dest, cell_t amount)
+{
+  set(dest, emit(SsaOp::Shl, get(dest), constant(amount)));
+  return true;
+}
+
+bool
+SsaBuilder::visitSMUL()
+{
+  set(PawnReg::Pri, emit(SsaOp::Mul, get(PawnReg::Pri), get(PawnReg::Alt)));
+  return true;
+}
+
+bool
+SsaBuilder::visitSDIV(PawnReg dest)
+{
+  SsaInsn* dividend = get(dest);
+  SsaInsn* divisor = get(dest == PawnReg::Pri ? PawnReg::Alt : PawnReg::Pri);
+  SsaInsn* quotient = emit(SsaOp::Div, dividend, divisor);
+  SsaInsn* remainder = emit(SsaOp::Mod, dividend, divisor);
+  set(PawnReg::Pri, quotient);
+  set(PawnReg::Alt, remainder);
+  return true;
+}
+
+bool
+SsaBuilder::visitADD()
+{
+  set(PawnReg::Pri, emit(SsaOp::Add, get(PawnReg::Pri), get(PawnReg::Alt)));
+  return true;
+}
+
+bool
+SsaBuilder::visitSUB()
+{
+  set(PawnReg::Pri, emit(SsaOp::Sub, get(PawnReg::Pri), get(PawnReg::Alt)));
+  return true;
+}
+
+bool
+SsaBuilder::visitSUB_ALT()
+{
+  set(PawnReg::Pri, emit(SsaOp::Sub, get(PawnReg::Alt), get(PawnReg::Pri)));
+  return true;
+}
+
+bool
+SsaBuilder::visitAND()
+{
+  set(PawnReg::Pri, emit(SsaOp::And, get(PawnReg::Pri), get(PawnReg::Alt)));
+  return true;
+}
+
+bool
+SsaBuilder::visitOR()
+{
+  set(PawnReg::Pri, emit(SsaOp::Or, get(PawnReg::Pri), get(PawnReg::Alt)));
+  return true;
+}
+
+bool
+SsaBuilder::visitXOR()
+{
+  set(PawnReg::Pri, emit(SsaOp::Xor, get(PawnReg::Pri), get(PawnReg::Alt)));
+  return true;
+}
+
+bool
+SsaBuilder::visitNOT()
+{
+  set(PawnReg::Pri, emit(SsaOp::Not, get(PawnReg::Pri)));
+  return true;
+}
+
+bool
+SsaBuilder::visitNEG()
+{
+  set(PawnReg::Pri, emit(SsaOp::Neg, get(PawnReg::Pri)));
+  return true;
+}
+
+bool
+SsaBuilder::visitINVERT()
+{
+  set(PawnReg::Pri, emit(SsaOp::Invert, get(PawnReg::Pri)));
+  return true;
+}
+
+bool
+SsaBuilder::visitADD_C(cell_t value)
+{
+  set(PawnReg::Pri, emit(SsaOp::Add, get(PawnReg::Pri), constant(value)));
+  return true;
+}
+
+bool
+SsaBuilder::visitSMUL_C(cell_t value)
+{
+  set(PawnReg::Pri, emit(SsaOp::Mul, get(PawnReg::Pri), constant(value)));
+  return true;
+}
+
+bool
+SsaBuilder::visitZERO(PawnReg dest)
+{
+  set(dest, constant(0));
+  return true;
+}
+
+bool
+SsaBuilder::visitZERO(cell_t address)
+{
+  emit(SsaOp::Store, constant(address), constant(0));
+  return true;
+}
+
+bool
+SsaBuilder::visitZERO_S(cell_t offset)
+{
+  if (!checkSlot(offset))
+    return false;
+  writeSlot(offset, constant(0));
+  return true;
+}
+
+bool
+SsaBuilder::visitCompareOp(CompareOp op)
+{
+  SsaInsn* insn = emit(SsaOp::Compare, get(PawnReg::Pri), get(PawnReg::Alt));
+  insn->cond = op;
+  set(PawnReg::Pri, insn);
+  return true;
+}
+
+bool
+SsaBuilder::visitEQ_C(PawnReg src, cell_t value)
+{
+  SsaInsn* insn = emit(SsaOp::Compare, get(src), constant(value));
+  insn->cond = CompareOp::Eq;
+  set(PawnReg::Pri, insn);
+  return true;
+}
+
+bool
+SsaBuilder::visitINC(PawnReg dest)
+{
+  set(dest, emit(SsaOp::Add, get(dest), constant(1)));
+  return true;
+}
+
+bool
+SsaBuilder::visitINC(cell_t address)
+{
+  SsaInsn* addr = constant(address);
+  SsaInsn* value = emit(SsaOp::Load, addr);
+  emit(SsaOp::Store, addr, emit(SsaOp::Add, value, constant(1)));
+  return true;
+}
+
+bool
+SsaBuilder::visitINC_S(cell_t offset)
+{
+  if (!checkSlot(offset))
+    return false;
+  writeSlot(offset, emit(SsaOp::Add, readSlot(offset), constant(1)));
+  return true;
+}
+
+bool
+SsaBuilder::visitINC_I()
+{
+  SsaInsn* addr = get(PawnReg::Pri);
+  SsaInsn* value = emit(SsaOp::Load, addr);
+  emit(SsaOp::Store, addr, emit(SsaOp::Add, value, constant(1)));
+  return true;
+}
+
+bool
+SsaBuilder::visitDEC(PawnReg dest)
+{
+  set(dest, emit(SsaOp::Sub, get(dest), constant(1)));
+  return true;
+}
+
+bool
+SsaBuilder::visitDEC(cell_t address)
+{
+  SsaInsn* addr = constant(address);
+  SsaInsn* value = emit(SsaOp::Load, addr);
+  emit(SsaOp::Store, addr, emit(SsaOp::Sub, value, constant(1)));
+  return true;
+}
+
+bool
+SsaBuilder::visitDEC_S(cell_t offset)
+{
+  if (!checkSlot(offset))
+    return false;
+  writeSlot(offset, emit(SsaOp::Sub, readSlot(offset), constant(1)));
+  return true;
+}
+
+bool
+SsaBuilder::visitDEC_I()
+{
+  SsaInsn* addr = get(PawnReg::Pri);
+  SsaInsn* value = emit(SsaOp::Load, addr);
+  emit(SsaOp::Store, addr, emit(SsaOp::Sub, value, constant(1)));
+  return true;
+}
+
+bool
+SsaBuilder::visitMOVS(uint32_t amount)
+{
+  SsaInsn* insn = emit(SsaOp::Movs, get(PawnReg::Pri), get(PawnReg::Alt));
+  insn->imm = amount;
+  return true;
+}
+
+bool
+SsaBuilder::visitFILL(uint32_t amount)
+{
+  SsaInsn* insn = emit(SsaOp::Fill, get(PawnReg::Alt), get(PawnReg::Pri));
+  insn->imm = amount;
+  return true;
+}
+
+bool
+SsaBuilder::visitBOUNDS(uint32_t limit)
+{
+  cell_t offset = cell_t((cip_ - code_) * sizeof(cell_t));
+  while (next_redundant_bounds_ < redundant_bounds_.length() &&
+         redundant_bounds_[next_redundant_bounds_] < offset)
+  {
+    next_redundant_bounds_++;
+  }
+  if (next_redundant_bounds_ < redundant_bounds_.length() &&
+      redundant_bounds_[next_redundant_bounds_] == offset)
+  {
+    return true;
+  }
+
+  SsaInsn* insn = emit(SsaOp::Bounds, get(PawnReg::Pri));
+  insn->imm = limit;
+  return true;
+}
+
+bool
+SsaBuilder::visitSYSREQ_C(uint32_t native_index)
+{
+  SsaInsn* nargs = readSlot(-depth_);
+  if (!nargs->isConstant() || nargs->imm < 0 || nargs->imm > depth_ / 4)
+    return fail();
+  materialize(-depth_, -depth_ + (nargs->imm + 1) * sizeof(cell_t));
+
+  SsaInsn* insn = emit(SsaOp::Native);
+  insn->imm = native_index;
+  insn->imm2 = -1;
+  forgetBelow(depth_);
+  set(PawnReg::Pri, insn);
+  return true;
+}
+
+bool
+SsaBuilder::visitSWAP(PawnReg dest)
+{
+  SsaInsn* top = readSlot(-depth_);
+  writeSlot(-depth_, get(dest));
+  set(dest, top);
+  return true;
+}
+
+bool
+SsaBuilder::visitSYSREQ_N(uint32_t native_index, uint32_t nparams)
+{
+  int32_t popped = nparams * sizeof(cell_t);
+  materialize(-depth_, -depth_ + popped);
+
+  SsaInsn* insn = emit(SsaOp::Native);
+  insn->imm = native_index;
+  insn->imm2 = nparams;
+  forgetBelow(depth_ - popped);
+  set(PawnReg::Pri, insn);
+  return true;
+}
+
+bool
+SsaBuilder::visitINTRINSIC_N(uint32_t native_index, uint32_t nparams,
+                             const sp_intrinsic_t* intrinsic)
+{
+  int32_t popped = nparams * sizeof(cell_t);
+  materialize(-depth_, -depth_ + popped);
+
+  SsaInsn* insn = emit(SsaOp::Intrinsic);
+  insn->imm = native_index;
+  insn->imm2 = nparams;
+  forgetBelow(depth_ - popped);
+  set(PawnReg::Pri, insn);
+  return true;
+}
+
+bool
+SsaBuilder::visitLOAD_BOTH(cell_t addressForPri, cell_t addressForAlt)
+{
+  visitLOAD(PawnReg::Pri, addressForPri);
+  visitLOAD(PawnReg::Alt, addressForAlt);
+  return true;
+}
+
+bool
+SsaBuilder::visitLOAD_S_BOTH(cell_t offsetForPri, cell_t offsetForAlt)
+{
+  return visitLOAD_S(PawnReg::Pri, offsetForPri) &&
+         visitLOAD_S(PawnReg::Alt, offsetForAlt);
+}
+
+bool
+SsaBuilder::visitCONST(cell_t address, cell_t value)
+{
+  emit(SsaOp::Store, constant(address), constant(value));
+  return true;
+}
+
+bool
+SsaBuilder::visitCONST_S(cell_t offset, cell_t value)
+{
+  if (!checkSlot(offset))
+    return false;
+  writeSlot(offset, constant(value));
+  return true;
+}
+
+bool
+SsaBuilder::visitTRACKER_PUSH_C(cell_t amount)
+{
+  SsaInsn* insn = emit(SsaOp::TrackerPush);
+  insn->imm = amount;
+  return true;
+}
+
+bool
+SsaBuilder::visitTRACKER_POP_SETHEAP()
+{
+  emit(SsaOp::TrackerPop);
+  return true;
+}
+
+bool
+SsaBuilder::visitGENARRAY(uint32_t dims, bool autozero)
+{
+  return fail();
+}
+
+bool
+SsaBuilder::visitSTRADJUST_PRI()
+{
+  SsaInsn* sum = emit(SsaOp::Add, get(PawnReg::Pri), constant(4));
+  set(PawnReg::Pri, emit(SsaOp::Sar, sum, constant(2)));
+  return true;
+}
+
+// The float opcodes replace a SYSREQ.N, so their arguments are on top of the
+// stack, and are popped.
+bool
+SsaBuilder::visitFABS()
+{
+  set(PawnReg::Pri, emit(SsaOp::And, readSlot(-depth_), constant(0x7fffffff)));
+  return true;
+}
+
+bool
+SsaBuilder::visitFLOAT()
+{
+  set(PawnReg::Pri, emit(SsaOp::IntToFloat, readSlot(-depth_)));
+  return true;
+}
+
+bool
+SsaBuilder::visitFLOATADD()
+{
+  set(PawnReg::Pri, emit(SsaOp::FloatAdd, readSlot(-depth_), readSlot(-depth_ + 4)));
+  return true;
+}
+
+bool
+SsaBuilder::visitFLOATSUB()
+{
+  set(PawnReg::Pri, emit(SsaOp::FloatSub, readSlot(-depth_), readSlot(-depth_ + 4)));
+  return true;
+}
+
+bool
+SsaBuilder::visitFLOATMUL()
+{
+  set(PawnReg::Pri, emit(SsaOp::FloatMul, readSlot(-depth_), readSlot(-depth_ + 4)));
+  return true;
+}
+
+bool
+SsaBuilder::visitFLOATDIV()
+{
+  set(PawnReg::Pri, emit(SsaOp::FloatDiv, readSlot(-depth_), readSlot(-depth_ + 4)));
+  return true;
+}
+
+bool
+SsaBuilder::visitRND_TO_NEAREST()
+{
+  SsaInsn* insn = emit(SsaOp::FloatToInt, readSlot(-depth_));
+  insn->imm = int32_t(FloatRounding::Nearest);
+  set(PawnReg::Pri, insn);
+  return true;
+}
+
+bool
+SsaBuilder::visitRND_TO_FLOOR()
+{
+  SsaInsn* insn = emit(SsaOp::FloatToInt, readSlot(-depth_));
+  insn->imm = int32_t(FloatRounding::Floor);
+  set(PawnReg::Pri, insn);
+  return true;
+}
+
+bool
+SsaBuilder::visitRND_TO_CEIL()
+{
+  SsaInsn* insn = emit(SsaOp::FloatToInt, readSlot(-depth_));
+  insn->imm = int32_t(FloatRounding::Ceil);
+  set(PawnReg::Pri, insn);
+  return true;
+}
+
+bool
+SsaBuilder::visitRND_TO_ZERO()
+{
+  SsaInsn* insn = emit(SsaOp::FloatToInt, readSlot(-depth_));
+  insn->imm = int32_t(FloatRounding::Zero);
+  set(PawnReg::Pri, insn);
+  return true;
+}
+
+bool
+SsaBuilder::visitFLOATCMP()
+{
+  set(PawnReg::Pri, emit(SsaOp::FloatCmp, readSlot(-depth_), readSlot(-depth_ + 4)));
+  return true;
+}
+
+bool
+SsaBuilder::visitFLOAT_CMP_OP(CompareOp op)
+{
+  SsaInsn* insn = emit(SsaOp::FloatCompare, readSlot(-depth_), readSlot(-depth_ + 4));
+  insn->cond = op;
+  set(PawnReg::Pri, insn);
+  return true;
+}
+
+bool
+SsaBuilder::visitFLOAT_NOT()
+{
+  set(PawnReg::Pri, emit(SsaOp::FloatNot, readSlot(-depth_)));
+  return true;
+}
+
+bool
+SsaBuilder::visitHALT(cell_t value)
+{
+  return fail();
+}
+
+bool
+SsaBuilder::visitSWITCH(cell_t defaultOffset, const CaseTableEntry* cases, size_t ncases)
+{
+  SsaBlock* block = cur_->block;
+  SsaInsn* insn = emit(SsaOp::Switch, get(PawnReg::Pri));
+  assert(block->succs[0] == blockAt(defaultOffset));
+
+  // As in the interpreter, the first case with a value wins.
+  for (size_t i = 0; i < ncases; i++) {
+    bool seen = false;
+    for (size_t j = 0; j < insn->cases.length(); j++) {
+      if (insn->cases[j] == cases[i].value) {
+        seen = true;
+        break;
+      }
+    }
+    if (seen)
+      continue;
+
+    SsaBlock* target = blockAt(cases[i].address);
+    for (size_t j = 0; j < block->succs.length(); j++) {
+      if (block->succs[j] == target) {
+        insn->cases.append(cases[i].value);
+        insn->case_targets.append(uint32_t(j));
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+} // namespace sp
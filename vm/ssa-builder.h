@@ -0,0 +1,250 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_ssa_builder_h_
+#define _include_sourcepawn_vm_ssa_builder_h_
+
+#include <sp_vm_types.h>
+#include <amtl/am-vector.h>
+#include "pcode-visitor.h"
+#include "ssa-graph.h"
+
+namespace sp {
+
+class PluginRuntime;
+
+// Translates a verified method into an SsaGraph, using the algorithm from
+// Braun et al., "Simple and Efficient Construction of Static Single
+// Assignment Form": each block remembers the last value written to each
+// variable, and reads that miss look through the predecessors, placing phis
+// where they meet.
+//
+// The variables are pri, alt, and each frame slot that is only reached
+// directly - that is, slots below the lowest local whose address is taken,
+// and likewise for arguments. Values pushed for calls and natives are stored
+// to memory right before the call, and every slot below the stack is
+// forgotten after it, since the callee may have used them.
+//
+// Methods the builder doesn't handle - ones that need a stack depth the
+// verifier couldn't find, create multi-dimensional arrays, or are too large -
+// make build() return false, and stay in the baseline tier.
+class SsaBuilder final : public PcodeVisitor
+{
+ public:
+  SsaBuilder(PluginRuntime* rt, uint32_t startOffset, uint32_t endOffset,
+             const ke::Vector<cell_t>& block_starts,
+             const ke::Vector<int32_t>& stack_depths,
+             const ke::Vector<cell_t>& redundant_bounds,
+             SsaGraph* graph);
+
+  bool build();
+
+ public:
+  bool visitLOAD(PawnReg dest, cell_t srcaddr) override;
+  bool visitLOAD_S(PawnReg dest, cell_t srcoffs) override;
+  bool visitLREF_S(PawnReg dest, cell_t srcoffs) override;
+  bool visitLOAD_I() override;
+  bool visitLODB_I(cell_t width) override;
+  bool visitCONST(PawnReg dest, cell_t imm) override;
+  bool visitADDR(PawnReg dest, cell_t offset) override;
+  bool visitSTOR(cell_t address, PawnReg src) override;
+  bool visitSTOR_S(cell_t offset, PawnReg src) override;
+  bool visitSREF_S(cell_t offset, PawnReg src) override;
+  bool visitSTOR_I() override;
+  bool visitSTRB_I(cell_t width) override;
+  bool visitLIDX() override;
+  bool visitIDXADDR() override;
+  bool visitMOVE(PawnReg reg) override;
+  bool visitXCHG() override;
+  bool visitPUSH(PawnReg src) override;
+  bool visitPUSH_C(const cell_t* vals, size_t nvals) override;
+  bool visitPUSH(const cell_t* addresses, size_t nvals) override;
+  bool visitPUSH_S(const cell_t* offsets, size_t nvals) override;
+  bool visitPOP(PawnReg dest) override;
+  bool visitSTACK(cell_t amount) override;
+  bool visitHEAP(cell_t amount) override;
+  bool visitRETN() override;
+  bool visitCALL(cell_t offset) override;
+  bool visitJUMP(cell_t offset) override;
+  bool visitJcmp(CompareOp op, cell_t offset) override;
+  bool visitSHL() override;
+  bool visitSHR() override;
+  bool visitSSHR() override;
+  bool visitSHL_C(PawnReg dest, cell_t amount) override;
+  bool visitSMUL() override;
+  bool visitSDIV(PawnReg dest) override;
+  bool visitADD() override;
+  bool visitSUB() override;
+  bool visitSUB_ALT() override;
+  bool visitAND() override;
+  bool visitOR() override;
+  bool visitXOR() override;
+  bool visitNOT() override;
+  bool visitNEG() override;
+  bool visitINVERT() override;
+  bool visitADD_C(cell_t value) override;
+  bool visitSMUL_C(cell_t value) override;
+  bool visitZERO(PawnReg dest) override;
+  bool visitZERO(cell_t address) override;
+  bool visitZERO_S(cell_t offset) override;
+  bool visitCompareOp(CompareOp op) override;
+  bool visitEQ_C(PawnReg src, cell_t value) override;
+  bool visitINC(PawnReg dest) override;
+  bool visitINC(cell_t address) override;
+  bool visitINC_S(cell_t offset) override;
+  bool visitINC_I() override;
+  bool visitDEC(PawnReg dest) override;
+  bool visitDEC(cell_t address) override;
+  bool visitDEC_S(cell_t offset) override;
+  bool visitDEC_I() override;
+  bool visitMOVS(uint32_t amount) override;
+  bool visitFILL(uint32_t amount) override;
+  bool visitBOUNDS(uint32_t limit) override;
+  bool visitSYSREQ_C(uint32_t native_index) override;
+  bool visitSWAP(PawnReg dest) override;
+  bool visitPUSH_ADR(const cell_t* offsets, size_t nvals) override;
+  bool visitSYSREQ_N(uint32_t native_index, uint32_t nparams) override;
+  bool visitINTRINSIC_N(uint32_t native_index, uint32_t nparams,
+                        const sp_intrinsic_t* intrinsic) override;
+  bool visitLOAD_BOTH(cell_t addressForPri, cell_t addressForAlt) override;
+  bool visitLOAD_S_BOTH(cell_t offsetForPri, cell_t offsetForAlt) override;
+  bool visitCONST(cell_t address, cell_t value) override;
+  bool visitCONST_S(cell_t offset, cell_t value) override;
+  bool visitTRACKER_PUSH_C(cell_t amount) override;
+  bool visitTRACKER_POP_SETHEAP() override;
+  bool visitGENARRAY(uint32_t dims, bool autozero) override;
+  bool visitSTRADJUST_PRI() override;
+  bool visitFABS() override;
+  bool visitFLOAT() override;
+  bool visitFLOATADD() override;
+  bool visitFLOATSUB() override;
+  bool visitFLOATMUL() override;
+  bool visitFLOATDIV() override;
+  bool visitRND_TO_NEAREST() override;
+  bool visitRND_TO_FLOOR() override;
+  bool visitRND_TO_CEIL() override;
+  bool visitRND_TO_ZERO() override;
+  bool visitFLOATCMP() override;
+  bool visitFLOAT_CMP_OP(CompareOp op) override;
+  bool visitFLOAT_NOT() override;
+  bool visitHALT(cell_t value) override;
+  bool visitSWITCH(cell_t defaultOffset, const CaseTableEntry* cases, size_t ncases) override;
+
+ private:
+  struct IncompletePhi {
+    uint32_t var;
+    SsaInsn* phi;
+  };
+
+  struct BlockState {
+    BlockState()
+     : block(nullptr),
+       start(0),
+       end(0),
+       filled_preds(0),
+       filled(false),
+       sealed(false)
+    {}
+
+    SsaBlock* block;
+    // The pcode the block covers, as offsets.
+    cell_t start;
+    cell_t end;
+    // The current value of each variable, or null.
+    ke::Vector<SsaInsn*> defs;
+    ke::Vector<IncompletePhi> incomplete;
+    size_t filled_preds;
+    bool filled;
+    bool sealed;
+  };
+
+  bool scan();
+  bool buildBlocks();
+  void successorsOf(const cell_t* cip, ke::Vector<cell_t>* targets);
+  SsaBlock* blockAt(cell_t offset);
+  bool fill(BlockState& state);
+  void seal(BlockState& state);
+  void finishBlock(BlockState& state);
+
+  // Variables.
+  static const uint32_t kPri = 0;
+  static const uint32_t kAlt = 1;
+  bool isPromoted(cell_t offset) const;
+  uint32_t slotVar(cell_t offset) const;
+  cell_t varOffset(uint32_t var) const;
+  void writeVar(uint32_t var, BlockState& state, SsaInsn* value);
+  SsaInsn* readVar(uint32_t var, BlockState& state);
+  SsaInsn* readVarRecursive(uint32_t var, BlockState& state);
+  SsaInsn* initialValue(uint32_t var);
+  void addPhiOperands(uint32_t var, SsaInsn* phi, BlockState& state);
+
+  SsaInsn* get(PawnReg reg);
+  void set(PawnReg reg, SsaInsn* value);
+  SsaInsn* readSlot(cell_t offset);
+  void writeSlot(cell_t offset, SsaInsn* value);
+  bool checkSlot(cell_t offset);
+
+  // Store the promoted slots in [lo, hi) so a callee can see them, and forget
+  // every slot below |depth_after| once it returns.
+  void materialize(cell_t lo, cell_t hi);
+  void forgetBelow(int32_t depth_after);
+
+  SsaInsn* emit(SsaOp op);
+  SsaInsn* emit(SsaOp op, SsaInsn* a);
+  SsaInsn* emit(SsaOp op, SsaInsn* a, SsaInsn* b);
+  SsaInsn* constant(cell_t value) {
+    return graph_->constant(value);
+  }
+
+  bool fail() {
+    failed_ = true;
+    return false;
+  }
+
+ private:
+  PluginRuntime* rt_;
+  const cell_t* code_;
+  const cell_t* method_;
+  const cell_t* end_;
+  uint32_t pcode_start_;
+  uint32_t pcode_end_;
+  const ke::Vector<cell_t>& block_starts_;
+  const ke::Vector<int32_t>& stack_depths_;
+  const ke::Vector<cell_t>& redundant_bounds_;
+  SsaGraph* graph_;
+  bool failed_;
+
+  // Block leaders, as sorted pcode offsets, and the state of each SsaBlock by
+  // id. The last entry of leaders_ is the end of the method.
+  ke::Vector<cell_t> leaders_;
+  ke::Vector<BlockState> states_;
+  SsaBlock* throw_block_;
+
+  // Frame slots: locals from -4 down, then arguments from 12 up.
+  uint32_t num_locals_;
+  uint32_t num_args_;
+  cell_t lowest_local_escape_;
+  cell_t lowest_arg_escape_;
+  bool writes_args_;
+  bool calls_natives_;
+  ke::Vector<SsaInsn*> params_;
+
+  // The instruction being translated.
+  BlockState* cur_;
+  const cell_t* cip_;
+  int32_t depth_;
+  size_t next_redundant_bounds_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_ssa_builder_h_
@@ -0,0 +1,477 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <assert.h>
+#include "ssa-graph.h"
+
+namespace sp {
+
+bool
+SsaInsn::hasResult() const
+{
+  switch (op) {
+  case SsaOp::Store:
+  case SsaOp::StoreChecked:
+  case SsaOp::StoreSlot:
+  case SsaOp::Movs:
+  case SsaOp::Fill:
+  case SsaOp::Bounds:
+  case SsaOp::StackCheck:
+  case SsaOp::TrackerPush:
+  case SsaOp::TrackerPop:
+    return false;
+  default:
+    return !isTerminator();
+  }
+}
+
+bool
+SsaInsn::isPure() const
+{
+  switch (op) {
+  case SsaOp::Constant:
+  case SsaOp::Add:
+  case SsaOp::Sub:
+  case SsaOp::Mul:
+  case SsaOp::And:
+  case SsaOp::Or:
+  case SsaOp::Xor:
+  case SsaOp::Shl:
+  case SsaOp::Shr:
+  case SsaOp::Sar:
+  case SsaOp::Neg:
+  case SsaOp::Invert:
+  case SsaOp::Not:
+  case SsaOp::Compare:
+  case SsaOp::IndexAddr:
+  case SsaOp::FrameAddr:
+  case SsaOp::FloatAdd:
+  case SsaOp::FloatSub:
+  case SsaOp::FloatMul:
+  case SsaOp::FloatDiv:
+  case SsaOp::IntToFloat:
+  case SsaOp::FloatToInt:
+  case SsaOp::FloatCmp:
+  case SsaOp::FloatCompare:
+  case SsaOp::FloatNot:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool
+SsaInsn::isRemovable() const
+{
+  if (isPure())
+    return true;
+  switch (op) {
+  case SsaOp::Undefined:
+  case SsaOp::Param:
+  case SsaOp::Phi:
+  case SsaOp::Mod:
+  case SsaOp::Load:
+  case SsaOp::LoadSlot:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool
+SsaInsn::writesMemory() const
+{
+  switch (op) {
+  case SsaOp::Store:
+  case SsaOp::StoreChecked:
+  case SsaOp::StoreSlot:
+  case SsaOp::Movs:
+  case SsaOp::Fill:
+  case SsaOp::Heap:
+  case SsaOp::TrackerPush:
+  case SsaOp::TrackerPop:
+  case SsaOp::Call:
+  case SsaOp::Native:
+  case SsaOp::Intrinsic:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool
+SsaInsn::clobbersRegisters() const
+{
+  switch (op) {
+  case SsaOp::TrackerPush:
+  case SsaOp::TrackerPop:
+  case SsaOp::Call:
+  case SsaOp::Native:
+  case SsaOp::Intrinsic:
+    return true;
+  default:
+    return false;
+  }
+}
+
+void
+SsaInsn::addOperand(SsaInsn* operand)
+{
+  operands.append(operand);
+  operand->uses.append(this);
+}
+
+static void
+RemoveUse(SsaInsn* value, SsaInsn* user)
+{
+  for (size_t i = 0; i < value->uses.length(); i++) {
+    if (value->uses[i] == user) {
+      value->uses.remove(i);
+      return;
+    }
+  }
+  assert(false);
+}
+
+void
+SsaInsn::setOperand(size_t index, SsaInsn* operand)
+{
+  if (operands[index] == operand)
+    return;
+  RemoveUse(operands[index], this);
+  operands[index] = operand;
+  operand->uses.append(this);
+}
+
+void
+SsaInsn::replaceAllUsesWith(SsaInsn* other)
+{
+  assert(other != this);
+  while (!uses.empty()) {
+    SsaInsn* user = uses.back();
+    for (size_t i = 0; i < user->operands.length(); i++) {
+      if (user->operands[i] == this)
+        user->setOperand(i, other);
+    }
+  }
+}
+
+void
+SsaInsn::dropOperands()
+{
+  for (size_t i = 0; i < operands.length(); i++) {
+    // An instruction can use the same value more than once.
+    bool seen = false;
+    for (size_t j = 0; j < i; j++) {
+      if (operands[j] == operands[i]) {
+        seen = true;
+        break;
+      }
+    }
+    if (seen)
+      continue;
+    SsaInsn* value = operands[i];
+    for (size_t j = value->uses.length(); j > 0; j--) {
+      if (value->uses[j - 1] == this)
+        value->uses.remove(j - 1);
+    }
+  }
+  operands.clear();
+}
+
+void
+SsaBlock::insertBeforeTerminator(SsaInsn* insn)
+{
+  assert(terminator() && terminator()->isTerminator());
+  insn->block = this;
+  insns.insert(insns.length() - 1, insn);
+}
+
+bool
+SsaBlock::dominates(const SsaBlock* other) const
+{
+  for (const SsaBlock* block = other; block; block = block->idom) {
+    if (block == this)
+      return true;
+    if (block->idom == block)
+      break;
+  }
+  return false;
+}
+
+SsaGraph::SsaGraph()
+ : undefined_(nullptr)
+{
+}
+
+SsaGraph::~SsaGraph()
+{
+  for (size_t i = 0; i < insns_.length(); i++)
+    delete insns_[i];
+  for (size_t i = 0; i < blocks_.length(); i++)
+    delete blocks_[i];
+}
+
+SsaBlock*
+SsaGraph::newBlock(cell_t pcode_offset)
+{
+  SsaBlock* block = new SsaBlock(uint32_t(blocks_.length()), pcode_offset);
+  blocks_.append(block);
+  return block;
+}
+
+SsaInsn*
+SsaGraph::newInsn(SsaOp op, SsaBlock* block, const cell_t* cip)
+{
+  SsaInsn* insn = new SsaInsn(op, block, cip);
+  insn->id = uint32_t(insns_.length());
+  insns_.append(insn);
+  return insn;
+}
+
+SsaInsn*
+SsaGraph::constant(cell_t value)
+{
+  for (size_t i = 0; i < constants_.length(); i++) {
+    if (constants_[i]->imm == value)
+      return constants_[i];
+  }
+  SsaInsn* insn = newInsn(SsaOp::Constant, entry(), nullptr);
+  insn->imm = value;
+  constants_.append(insn);
+  return insn;
+}
+
+SsaInsn*
+SsaGraph::undefined()
+{
+  if (!undefined_)
+    undefined_ = newInsn(SsaOp::Undefined, entry(), nullptr);
+  return undefined_;
+}
+
+void
+SsaGraph::addEdge(SsaBlock* from, SsaBlock* to)
+{
+  from->succs.append(to);
+  to->preds.append(from);
+}
+
+void
+SsaGraph::splitCriticalEdges()
+{
+  size_t nblocks = blocks_.length();
+  for (size_t i = 0; i < nblocks; i++) {
+    SsaBlock* block = blocks_[i];
+    if (block->succs.length() < 2)
+      continue;
+    for (size_t j = 0; j < block->succs.length(); j++) {
+      SsaBlock* succ = block->succs[j];
+      if (succ->preds.length() < 2)
+        continue;
+
+      SsaBlock* split = newBlock(succ->pcode_offset);
+      SsaInsn* jump = newInsn(SsaOp::Jump, split, block->terminator()->cip);
+      jump->depth = block->terminator()->depth;
+      split->insns.append(jump);
+
+      // Keep the successor's predecessor order, so its phis still line up.
+      block->succs[j] = split;
+      split->preds.append(block);
+      split->succs.append(succ);
+      for (size_t k = 0; k < succ->preds.length(); k++) {
+        if (succ->preds[k] == block) {
+          succ->preds[k] = split;
+          break;
+        }
+      }
+    }
+  }
+}
+
+void
+SsaGraph::computeOrder()
+{
+  // Iterative depth-first search, recording blocks as they are finished.
+  ke::Vector<SsaBlock*> postorder;
+  ke::Vector<uint8_t> visited;
+  visited.resize(blocks_.length());
+  for (size_t i = 0; i < visited.length(); i++)
+    visited[i] = 0;
+
+  struct Entry {
+    SsaBlock* block;
+    size_t next;
+  };
+  ke::Vector<Entry> stack;
+  stack.append(Entry{entry(), 0});
+  visited[entry()->id] = 1;
+  while (!stack.empty()) {
+    Entry& top = stack.back();
+    if (top.next < top.block->succs.length()) {
+      SsaBlock* succ = top.block->succs[top.next++];
+      if (!visited[succ->id]) {
+        visited[succ->id] = 1;
+        stack.append(Entry{succ, 0});
+      }
+      continue;
+    }
+    postorder.append(top.block);
+    stack.pop();
+  }
+
+  order_.clear();
+  for (size_t i = postorder.length(); i > 0; i--) {
+    SsaBlock* block = postorder[i - 1];
+    block->rpo = uint32_t(order_.length());
+    order_.append(block);
+  }
+}
+
+SsaBlock*
+SsaGraph::intersect(SsaBlock* a, SsaBlock* b)
+{
+  while (a != b) {
+    while (a->rpo > b->rpo)
+      a = a->idom;
+    while (b->rpo > a->rpo)
+      b = b->idom;
+  }
+  return a;
+}
+
+// Cooper, Harvey and Kennedy's "A Simple, Fast Dominance Algorithm".
+void
+SsaGraph::computeDominators()
+{
+  for (size_t i = 0; i < order_.length(); i++) {
+    order_[i]->idom = nullptr;
+    order_[i]->dominated.clear();
+  }
+  entry()->idom = entry();
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 1; i < order_.length(); i++) {
+      SsaBlock* block = order_[i];
+      SsaBlock* idom = nullptr;
+      for (size_t j = 0; j < block->preds.length(); j++) {
+        SsaBlock* pred = block->preds[j];
+        if (!pred->idom)
+          continue;
+        idom = idom ? intersect(pred, idom) : pred;
+      }
+      if (idom != block->idom) {
+        block->idom = idom;
+        changed = true;
+      }
+    }
+  }
+
+  for (size_t i = 1; i < order_.length(); i++)
+    order_[i]->idom->dominated.append(order_[i]);
+}
+
+void
+SsaGraph::computeLoops()
+{
+  loops_.clear();
+  for (size_t i = 0; i < order_.length(); i++) {
+    order_[i]->loop_header = nullptr;
+    order_[i]->loop_depth = 0;
+    order_[i]->is_loop_header = false;
+  }
+
+  for (size_t i = 0; i < order_.length(); i++) {
+    SsaBlock* header = order_[i];
+
+    SsaLoop loop;
+    loop.header = header;
+    loop.preheader = nullptr;
+    loop.size = 0;
+    loop.writes_memory = false;
+
+    // Walk back from each backedge until reaching the header.
+    ke::Vector<SsaBlock*> work;
+    for (size_t j = 0; j < header->preds.length(); j++) {
+      SsaBlock* pred = header->preds[j];
+      if (header->dominates(pred))
+        work.append(pred);
+    }
+    if (work.empty())
+      continue;
+
+    loop.body.resize(blocks_.length());
+    for (size_t j = 0; j < loop.body.length(); j++)
+      loop.body[j] = 0;
+    loop.body[header->id] = 1;
+    loop.size = 1;
+    while (!work.empty()) {
+      SsaBlock* block = work.back();
+      work.pop();
+      if (loop.body[block->id])
+        continue;
+      loop.body[block->id] = 1;
+      loop.size++;
+      for (size_t j = 0; j < block->preds.length(); j++)
+        work.append(block->preds[j]);
+    }
+
+    SsaBlock* outside = nullptr;
+    size_t noutside = 0;
+    for (size_t j = 0; j < header->preds.length(); j++) {
+      if (!loop.body[header->preds[j]->id]) {
+        outside = header->preds[j];
+        noutside++;
+      }
+    }
+    if (noutside == 1 && outside->succs.length() == 1)
+      loop.preheader = outside;
+
+    header->is_loop_header = true;
+    loops_.append(ke::Move(loop));
+  }
+
+  // Loops are found outermost first, since headers come in reverse postorder,
+  // so the last loop to contain a block is its innermost.
+  for (size_t i = 0; i < loops_.length(); i++) {
+    SsaLoop& loop = loops_[i];
+    for (size_t j = 0; j < order_.length(); j++) {
+      SsaBlock* block = order_[j];
+      if (!loop.body[block->id])
+        continue;
+      block->loop_depth++;
+      block->loop_header = loop.header;
+      for (size_t k = 0; k < block->insns.length(); k++) {
+        if (block->insns[k]->writesMemory())
+          loop.writes_memory = true;
+      }
+    }
+  }
+}
+
+void
+SsaGraph::remove(SsaInsn* insn)
+{
+  assert(insn->uses.empty());
+  ke::Vector<SsaInsn*>& list = (insn->op == SsaOp::Phi) ? insn->block->phis : insn->block->insns;
+  for (size_t i = 0; i < list.length(); i++) {
+    if (list[i] == insn) {
+      list.remove(i);
+      break;
+    }
+  }
+  insn->dropOperands();
+}
+
+} // namespace sp
@@ -0,0 +1,334 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_ssa_graph_h_
+#define _include_sourcepawn_vm_ssa_graph_h_
+
+#include <sp_vm_types.h>
+#include <amtl/am-vector.h>
+#include "pcode-visitor.h"
+
+namespace sp {
+
+// The IR of the optimizing tier. A method is a graph of basic blocks, each
+// holding a list of instructions in SSA form: every value is defined once,
+// and values that differ depending on how a block was reached are merged by
+// phis at its start. Only pri, alt, and frame slots whose address is never
+// taken become values; everything else stays in memory and is reached with
+// loads and stores.
+enum class SsaOp : uint8_t
+{
+  // Values. A constant's value, and a parameter's frame offset, are in imm.
+  // Undefined is the value of a frame slot that was never written; code that
+  // reads it can't be compiled.
+  Constant,
+  Undefined,
+  Param,
+  Phi,
+
+  // Integer arithmetic, on cells.
+  Add,
+  Sub,
+  Mul,
+  And,
+  Or,
+  Xor,
+  Shl,
+  Shr,
+  Sar,
+  Neg,
+  Invert,
+  Not,
+  Compare,            // cond
+  IndexAddr,          // operand0 + operand1 * 4
+  FrameAddr,          // frm + imm, as a dat-relative address
+
+  // Division checks its divisor, and is the quotient. Mod is the remainder,
+  // and is only created right after the Div that checked it.
+  Div,
+  Mod,
+
+  // Floats, as cells. FloatToInt rounds with the mode in imm.
+  FloatAdd,
+  FloatSub,
+  FloatMul,
+  FloatDiv,
+  IntToFloat,
+  FloatToInt,
+  FloatCmp,           // -1, 0 or 1, as the old FLOATCMP
+  FloatCompare,       // cond
+  FloatNot,
+
+  // Memory. Addresses are dat-relative cells; checked accesses test them
+  // like LOAD.I and STOR.I, and have a width in imm. Slot accesses are to
+  // frame slots that stay in memory, at offset imm.
+  Load,
+  LoadChecked,
+  LoadSlot,
+  Store,
+  StoreChecked,
+  StoreSlot,
+  Movs,               // operand0 to operand1, imm bytes
+  Fill,               // operand0 with operand1, imm bytes
+
+  // Checks and calls.
+  Bounds,             // operand0 against imm
+  StackCheck,
+  Heap,               // imm bytes; the old heap pointer
+  TrackerPush,        // imm bytes
+  TrackerPop,
+  Call,               // the method at imm
+  Native,             // native imm, with imm2 arguments, or -1 for SYSREQ.C
+  Intrinsic,          // native imm, with imm2 arguments, replaced by the host
+
+  // Block terminators.
+  Jump,
+  Branch,             // cond on operand0 and operand1
+  Switch,             // cases in the instruction; successor 0 is the default
+  Return,
+  Throw,              // error imm
+};
+
+// How FloatToInt rounds.
+enum class FloatRounding : int32_t
+{
+  Nearest,
+  Floor,
+  Ceil,
+  Zero
+};
+
+class SsaBlock;
+
+// Values without an allocation are rematerialized or have no uses.
+struct SsaAllocation
+{
+  enum Kind : uint8_t {
+    None,
+    Register,
+    Spill,
+  };
+  Kind kind;
+  int32_t index;
+
+  SsaAllocation()
+   : kind(None),
+     index(-1)
+  {}
+};
+
+class SsaInsn
+{
+ public:
+  SsaInsn(SsaOp op, SsaBlock* block, const cell_t* cip)
+   : op(op),
+     cond(CompareOp::Zero),
+     imm(0),
+     imm2(0),
+     depth(0),
+     block(block),
+     cip(cip),
+     id(0),
+     pos(0),
+     forward(nullptr)
+  {}
+
+  // Whether the instruction defines a value that other instructions can use.
+  bool hasResult() const;
+
+  // Whether an unused instance can be removed.
+  bool isRemovable() const;
+
+  // Whether the value only depends on the operands and immediates, so equal
+  // instructions can share a value, and it can be computed early.
+  bool isPure() const;
+
+  // Whether the instruction may write memory or call out.
+  bool writesMemory() const;
+
+  // Whether registers other than the callee-saved one are clobbered.
+  bool clobbersRegisters() const;
+
+  bool isTerminator() const {
+    return op >= SsaOp::Jump;
+  }
+  bool isConstant() const {
+    return op == SsaOp::Constant;
+  }
+
+  void addOperand(SsaInsn* operand);
+  void setOperand(size_t index, SsaInsn* operand);
+  SsaInsn* operand(size_t index) const {
+    return operands[index];
+  }
+  size_t numOperands() const {
+    return operands.length();
+  }
+
+  // Point every use of this value at |other| instead.
+  void replaceAllUsesWith(SsaInsn* other);
+
+  // Drop this instruction's uses of its operands.
+  void dropOperands();
+
+  SsaOp op;
+  CompareOp cond;
+  cell_t imm;
+  cell_t imm2;
+
+  // Bytes below frm before the instruction, for instructions that need the
+  // pcode stack pointer: calls, natives, and checks against it.
+  int32_t depth;
+
+  SsaBlock* block;
+
+  // The instruction it came from, for errors and the cip map.
+  const cell_t* cip;
+
+  uint32_t id;
+
+  // Position in the linear order used by register allocation.
+  uint32_t pos;
+
+  // A phi that turned out to be trivial points at its replacement.
+  SsaInsn* forward;
+
+  ke::Vector<SsaInsn*> operands;
+  ke::Vector<SsaInsn*> uses;
+
+  // Case values of a Switch, and the successor each goes to.
+  ke::Vector<cell_t> cases;
+  ke::Vector<uint32_t> case_targets;
+
+  SsaAllocation alloc;
+};
+
+class SsaBlock
+{
+ public:
+  SsaBlock(uint32_t id, cell_t pcode_offset)
+   : id(id),
+     pcode_offset(pcode_offset),
+     idom(nullptr),
+     rpo(0),
+     loop_header(nullptr),
+     loop_depth(0),
+     is_loop_header(false),
+     start_pos(0),
+     end_pos(0)
+  {}
+
+  SsaInsn* terminator() const {
+    return insns.empty() ? nullptr : insns.back();
+  }
+
+  // Insert |insn| before the terminator.
+  void insertBeforeTerminator(SsaInsn* insn);
+
+  bool dominates(const SsaBlock* other) const;
+
+  uint32_t id;
+  cell_t pcode_offset;
+
+  ke::Vector<SsaInsn*> phis;
+  ke::Vector<SsaInsn*> insns;
+
+  // Phi operands are in the same order as preds.
+  ke::Vector<SsaBlock*> preds;
+  ke::Vector<SsaBlock*> succs;
+
+  SsaBlock* idom;
+  ke::Vector<SsaBlock*> dominated;
+  uint32_t rpo;
+
+  // The innermost loop containing the block, by its header.
+  SsaBlock* loop_header;
+  uint32_t loop_depth;
+  bool is_loop_header;
+
+  uint32_t start_pos;
+  uint32_t end_pos;
+};
+
+// A natural loop, found from its backedges.
+struct SsaLoop
+{
+  SsaBlock* header;
+  // The block outside the loop that enters it, or null if there are several.
+  SsaBlock* preheader;
+  // Indexed by block id.
+  ke::Vector<uint8_t> body;
+  size_t size;
+  bool writes_memory;
+};
+
+class SsaGraph
+{
+ public:
+  SsaGraph();
+  ~SsaGraph();
+
+  SsaBlock* newBlock(cell_t pcode_offset);
+  SsaInsn* newInsn(SsaOp op, SsaBlock* block, const cell_t* cip);
+
+  // Constants live in the entry block, one per value, and are never emitted.
+  SsaInsn* constant(cell_t value);
+  SsaInsn* undefined();
+
+  SsaBlock* entry() const {
+    return blocks_[0];
+  }
+  const ke::Vector<SsaBlock*>& blocks() const {
+    return blocks_;
+  }
+  size_t numInsns() const {
+    return insns_.length();
+  }
+
+  void addEdge(SsaBlock* from, SsaBlock* to);
+
+  // Blocks in reverse postorder, once computeOrder() has run. Unreachable
+  // blocks are dropped.
+  const ke::Vector<SsaBlock*>& order() const {
+    return order_;
+  }
+
+  // Split every edge from a block with several successors to one with
+  // several predecessors, so phi moves have somewhere to go.
+  void splitCriticalEdges();
+
+  void computeOrder();
+  void computeDominators();
+  void computeLoops();
+
+  ke::Vector<SsaLoop>& loops() {
+    return loops_;
+  }
+
+  // Remove an instruction that has no uses left.
+  void remove(SsaInsn* insn);
+
+ private:
+  SsaBlock* intersect(SsaBlock* a, SsaBlock* b);
+
+ private:
+  ke::Vector<SsaBlock*> blocks_;
+  ke::Vector<SsaInsn*> insns_;
+  ke::Vector<SsaInsn*> constants_;
+  SsaInsn* undefined_;
+  ke::Vector<SsaBlock*> order_;
+  ke::Vector<SsaLoop> loops_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_ssa_graph_h_
@@ -0,0 +1,536 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <limits.h>
+#include <stdlib.h>
+#include "ssa-optimizer.h"
+
+namespace sp {
+
+using namespace ke;
+
+SsaOptimizer::SsaOptimizer(SsaGraph* graph)
+ : graph_(graph),
+   epoch_(0)
+{
+}
+
+bool
+SsaOptimizer::optimize()
+{
+  removeTrivialPhis();
+
+  graph_->splitCriticalEdges();
+  graph_->computeOrder();
+  graph_->computeDominators();
+
+  numberValues();
+  removeTrivialPhis();
+
+  graph_->computeLoops();
+  hoistLoopInvariants();
+
+  removeDeadCode();
+  return graph_->undefined()->uses.empty();
+}
+
+void
+SsaOptimizer::replace(SsaInsn* insn, SsaInsn* value)
+{
+  insn->replaceAllUsesWith(value);
+  graph_->remove(insn);
+}
+
+void
+SsaOptimizer::removeTrivialPhis()
+{
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    const Vector<SsaBlock*>& blocks = graph_->blocks();
+    for (size_t i = 0; i < blocks.length(); i++) {
+      SsaBlock* block = blocks[i];
+      for (size_t j = 0; j < block->phis.length();) {
+        SsaInsn* phi = block->phis[j];
+        SsaInsn* same = nullptr;
+        bool trivial = true;
+        for (size_t k = 0; k < phi->numOperands(); k++) {
+          SsaInsn* operand = phi->operand(k);
+          if (operand == phi || operand == same)
+            continue;
+          if (same) {
+            trivial = false;
+            break;
+          }
+          same = operand;
+        }
+        if (!trivial) {
+          j++;
+          continue;
+        }
+
+        // A phi that only merges itself is never reached from the entry.
+        if (!same)
+          same = graph_->undefined();
+        phi->replaceAllUsesWith(same);
+        graph_->remove(phi);
+        changed = true;
+      }
+    }
+  }
+}
+
+static bool
+EvalCompare(CompareOp cond, int32_t a, int32_t b)
+{
+  switch (cond) {
+  case CompareOp::Eq:
+    return a == b;
+  case CompareOp::Neq:
+    return a != b;
+  case CompareOp::Sless:
+    return a < b;
+  case CompareOp::Sleq:
+    return a <= b;
+  case CompareOp::Sgrtr:
+    return a > b;
+  case CompareOp::Sgeq:
+    return a >= b;
+  default:
+    assert(false);
+    return false;
+  }
+}
+
+static bool
+IsConstant(const SsaInsn* insn, cell_t value)
+{
+  return insn->isConstant() && insn->imm == value;
+}
+
+// Return the value |insn| is known to be, or null.
+SsaInsn*
+SsaOptimizer::fold(SsaInsn* insn)
+{
+  if (insn->numOperands() == 0 || insn->numOperands() > 2)
+    return nullptr;
+
+  SsaInsn* a = insn->operand(0);
+  SsaInsn* b = insn->numOperands() > 1 ? insn->operand(1) : nullptr;
+
+  if (a->isConstant() && (!b || b->isConstant())) {
+    uint32_t x = uint32_t(a->imm);
+    uint32_t y = b ? uint32_t(b->imm) : 0;
+    switch (insn->op) {
+    case SsaOp::Add:
+      return graph_->constant(cell_t(x + y));
+    case SsaOp::Sub:
+      return graph_->constant(cell_t(x - y));
+    case SsaOp::Mul:
+      return graph_->constant(cell_t(x * y));
+    case SsaOp::And:
+      return graph_->constant(cell_t(x & y));
+    case SsaOp::Or:
+      return graph_->constant(cell_t(x | y));
+    case SsaOp::Xor:
+      return graph_->constant(cell_t(x ^ y));
+    case SsaOp::Shl:
+      return graph_->constant(cell_t(x << (y & 31)));
+    case SsaOp::Shr:
+      return graph_->constant(cell_t(x >> (y & 31)));
+    case SsaOp::Sar:
+      return graph_->constant(cell_t(int32_t(x) >> (y & 31)));
+    case SsaOp::Neg:
+      return graph_->constant(cell_t(0 - x));
+    case SsaOp::Invert:
+      return graph_->constant(cell_t(~x));
+    case SsaOp::Not:
+      return graph_->constant(x == 0 ? 1 : 0);
+    case SsaOp::Compare:
+      return graph_->constant(EvalCompare(insn->cond, a->imm, b->imm) ? 1 : 0);
+    case SsaOp::IndexAddr:
+      return graph_->constant(cell_t(x + y * 4));
+    case SsaOp::Div:
+    case SsaOp::Mod:
+      // Leave the check to report the error.
+      if (y == 0 || (int32_t(x) == INT_MIN && int32_t(y) == -1))
+        return nullptr;
+      if (insn->op == SsaOp::Div)
+        return graph_->constant(int32_t(x) / int32_t(y));
+      return graph_->constant(int32_t(x) % int32_t(y));
+    default:
+      return nullptr;
+    }
+  }
+
+  switch (insn->op) {
+  case SsaOp::Add:
+  case SsaOp::Or:
+  case SsaOp::Xor:
+    if (IsConstant(b, 0))
+      return a;
+    if (IsConstant(a, 0))
+      return b;
+    if (insn->op == SsaOp::Or && a == b)
+      return a;
+    if (insn->op == SsaOp::Xor && a == b)
+      return graph_->constant(0);
+    break;
+  case SsaOp::Sub:
+    if (IsConstant(b, 0))
+      return a;
+    if (a == b)
+      return graph_->constant(0);
+    break;
+  case SsaOp::Shl:
+  case SsaOp::Shr:
+  case SsaOp::Sar:
+    if (b->isConstant() && (b->imm & 31) == 0)
+      return a;
+    break;
+  case SsaOp::Mul:
+    if (IsConstant(b, 1))
+      return a;
+    if (IsConstant(a, 1))
+      return b;
+    if (IsConstant(a, 0) || IsConstant(b, 0))
+      return graph_->constant(0);
+    break;
+  case SsaOp::And:
+    if (IsConstant(b, -1))
+      return a;
+    if (IsConstant(a, -1))
+      return b;
+    if (IsConstant(a, 0) || IsConstant(b, 0))
+      return graph_->constant(0);
+    if (a == b)
+      return a;
+    break;
+  case SsaOp::Compare:
+    if (a == b) {
+      switch (insn->cond) {
+      case CompareOp::Eq:
+      case CompareOp::Sleq:
+      case CompareOp::Sgeq:
+        return graph_->constant(1);
+      default:
+        return graph_->constant(0);
+      }
+    }
+    break;
+  default:
+    break;
+  }
+  return nullptr;
+}
+
+bool
+SsaOptimizer::isRedundantBoundsCheck(SsaInsn* insn)
+{
+  uint32_t limit = uint32_t(insn->imm);
+  SsaInsn* index = insn->operand(0);
+
+  if (index->isConstant())
+    return uint32_t(index->imm) <= limit;
+
+  // x & mask is at most mask, and x >>> n at most UINT_MAX >> n.
+  if (index->op == SsaOp::And) {
+    for (size_t i = 0; i < 2; i++) {
+      SsaInsn* mask = index->operand(i);
+      if (mask->isConstant() && uint32_t(mask->imm) <= limit)
+        return true;
+    }
+  }
+  if (index->op == SsaOp::Shr && index->operand(1)->isConstant()) {
+    uint32_t shift = uint32_t(index->operand(1)->imm) & 31;
+    if ((UINT_MAX >> shift) <= limit)
+      return true;
+  }
+
+  for (size_t i = 0; i < bounds_checks_.length(); i++) {
+    SsaInsn* other = bounds_checks_[i];
+    if (other->operand(0) == index && uint32_t(other->imm) <= limit &&
+        other->block->dominates(insn->block))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool
+SsaOptimizer::canNumber(const SsaInsn* insn) const
+{
+  if (insn->isPure())
+    return true;
+  switch (insn->op) {
+  case SsaOp::Div:
+  case SsaOp::Mod:
+  case SsaOp::Load:
+  case SsaOp::LoadChecked:
+  case SsaOp::LoadSlot:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool
+IsCommutative(SsaOp op)
+{
+  switch (op) {
+  case SsaOp::Add:
+  case SsaOp::Mul:
+  case SsaOp::And:
+  case SsaOp::Or:
+  case SsaOp::Xor:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool
+IsLoad(SsaOp op)
+{
+  return op == SsaOp::Load || op == SsaOp::LoadChecked || op == SsaOp::LoadSlot;
+}
+
+uint32_t
+SsaOptimizer::hash(const SsaInsn* insn) const
+{
+  uint32_t h = uint32_t(insn->op) * 31 + uint32_t(insn->cond);
+  h = h * 31 + uint32_t(insn->imm);
+  h = h * 31 + uint32_t(insn->imm2);
+  if (IsCommutative(insn->op)) {
+    // Order doesn't matter, so combine the operands symmetrically.
+    h = h * 31 + (insn->operand(0)->id ^ insn->operand(1)->id) +
+        (insn->operand(0)->id + insn->operand(1)->id) * 17;
+  } else {
+    for (size_t i = 0; i < insn->numOperands(); i++)
+      h = h * 31 + insn->operand(i)->id;
+  }
+  return h * 2654435761u;
+}
+
+bool
+SsaOptimizer::congruent(const SsaInsn* a, const SsaInsn* b) const
+{
+  if (a->op != b->op || a->cond != b->cond || a->imm != b->imm || a->imm2 != b->imm2)
+    return false;
+  if (a->numOperands() != b->numOperands())
+    return false;
+
+  bool same = true;
+  for (size_t i = 0; i < a->numOperands(); i++) {
+    if (a->operand(i) != b->operand(i)) {
+      same = false;
+      break;
+    }
+  }
+  if (!same) {
+    if (!IsCommutative(a->op) ||
+        a->operand(0) != b->operand(1) || a->operand(1) != b->operand(0))
+    {
+      return false;
+    }
+  }
+
+  if (IsLoad(a->op)) {
+    if (a->block != b->block)
+      return false;
+    if (a->id >= epochs_.length() || b->id >= epochs_.length())
+      return false;
+    return epochs_[a->id] == epochs_[b->id];
+  }
+  return true;
+}
+
+SsaInsn*
+SsaOptimizer::lookupOrInsert(SsaInsn* insn)
+{
+  size_t mask = table_.length() - 1;
+  for (size_t i = hash(insn) & mask;; i = (i + 1) & mask) {
+    SsaInsn* entry = table_[i];
+    if (!entry) {
+      table_[i] = insn;
+      return nullptr;
+    }
+    if (congruent(entry, insn) && entry->block->dominates(insn->block))
+      return entry;
+  }
+}
+
+void
+SsaOptimizer::numberValues()
+{
+  size_t capacity = 16;
+  while (capacity < graph_->numInsns() * 2)
+    capacity *= 2;
+  table_.resize(capacity);
+  for (size_t i = 0; i < table_.length(); i++)
+    table_[i] = nullptr;
+
+  epochs_.resize(graph_->numInsns());
+  for (size_t i = 0; i < epochs_.length(); i++)
+    epochs_[i] = 0;
+
+  // Dominators come first in reverse postorder, so every value a lookup can
+  // find has been numbered.
+  const Vector<SsaBlock*>& order = graph_->order();
+  for (size_t i = 0; i < order.length(); i++) {
+    SsaBlock* block = order[i];
+    epoch_++;
+
+    for (size_t j = 0; j < block->insns.length();) {
+      SsaInsn* insn = block->insns[j];
+      if (insn->id < epochs_.length())
+        epochs_[insn->id] = epoch_;
+
+      if (SsaInsn* value = fold(insn)) {
+        replace(insn, value);
+        continue;
+      }
+
+      if (insn->op == SsaOp::Bounds) {
+        if (isRedundantBoundsCheck(insn)) {
+          graph_->remove(insn);
+          continue;
+        }
+        bounds_checks_.append(insn);
+      } else if (canNumber(insn)) {
+        if (SsaInsn* value = lookupOrInsert(insn)) {
+          replace(insn, value);
+          continue;
+        }
+      }
+
+      if (insn->writesMemory())
+        epoch_++;
+      j++;
+    }
+  }
+}
+
+void
+SsaOptimizer::hoistLoopInvariants()
+{
+  Vector<SsaLoop>& loops = graph_->loops();
+
+  // Innermost loops first, so invariants can keep moving outward.
+  Vector<SsaLoop*> sorted;
+  for (size_t i = 0; i < loops.length(); i++)
+    sorted.append(&loops[i]);
+  qsort(sorted.buffer(), sorted.length(), sizeof(SsaLoop*),
+        [](const void* a, const void* b) -> int {
+    size_t left = (*reinterpret_cast<SsaLoop* const*>(a))->size;
+    size_t right = (*reinterpret_cast<SsaLoop* const*>(b))->size;
+    if (left < right)
+      return -1;
+    return left > right ? 1 : 0;
+  });
+
+  const Vector<SsaBlock*>& order = graph_->order();
+  for (size_t i = 0; i < sorted.length(); i++) {
+    SsaLoop* loop = sorted[i];
+    SsaBlock* preheader = loop->preheader;
+    if (!preheader)
+      continue;
+
+    for (size_t j = 0; j < order.length(); j++) {
+      SsaBlock* block = order[j];
+      if (!loop->body[block->id])
+        continue;
+
+      for (size_t k = 0; k < block->insns.length();) {
+        SsaInsn* insn = block->insns[k];
+
+        bool hoistable = insn->isPure();
+        if (!loop->writes_memory) {
+          if (insn->op == SsaOp::LoadSlot)
+            hoistable = true;
+          else if (insn->op == SsaOp::Load && insn->operand(0)->isConstant())
+            hoistable = true;
+        }
+        for (size_t n = 0; hoistable && n < insn->numOperands(); n++) {
+          if (loop->body[insn->operand(n)->block->id])
+            hoistable = false;
+        }
+        if (!hoistable) {
+          k++;
+          continue;
+        }
+
+        block->insns.remove(k);
+        preheader->insertBeforeTerminator(insn);
+      }
+    }
+  }
+}
+
+void
+SsaOptimizer::removeDeadCode()
+{
+  Vector<uint8_t> live;
+  live.resize(graph_->numInsns());
+  for (size_t i = 0; i < live.length(); i++)
+    live[i] = 0;
+
+  Vector<SsaInsn*> work;
+  const Vector<SsaBlock*>& order = graph_->order();
+  for (size_t i = 0; i < order.length(); i++) {
+    SsaBlock* block = order[i];
+    for (size_t j = 0; j < block->insns.length(); j++) {
+      SsaInsn* insn = block->insns[j];
+      if (!insn->isRemovable()) {
+        live[insn->id] = 1;
+        work.append(insn);
+      }
+    }
+  }
+  while (!work.empty()) {
+    SsaInsn* insn = work.popCopy();
+    for (size_t i = 0; i < insn->numOperands(); i++) {
+      SsaInsn* operand = insn->operand(i);
+      if (!live[operand->id]) {
+        live[operand->id] = 1;
+        work.append(operand);
+      }
+    }
+  }
+
+  // Dead instructions may use each other, so drop every dead use first.
+  for (size_t i = 0; i < order.length(); i++) {
+    SsaBlock* block = order[i];
+    for (size_t j = 0; j < block->phis.length(); j++) {
+      if (!live[block->phis[j]->id])
+        block->phis[j]->dropOperands();
+    }
+    for (size_t j = 0; j < block->insns.length(); j++) {
+      if (!live[block->insns[j]->id])
+        block->insns[j]->dropOperands();
+    }
+  }
+  for (size_t i = 0; i < order.length(); i++) {
+    SsaBlock* block = order[i];
+    for (size_t j = block->phis.length(); j > 0; j--) {
+      if (!live[block->phis[j - 1]->id])
+        block->phis.remove(j - 1);
+    }
+    for (size_t j = block->insns.length(); j > 0; j--) {
+      if (!live[block->insns[j - 1]->id])
+        block->insns.remove(j - 1);
+    }
+  }
+}
+
+} // namespace sp
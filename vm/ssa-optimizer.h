@@ -0,0 +1,76 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_ssa_optimizer_h_
+#define _include_sourcepawn_vm_ssa_optimizer_h_
+
+#include <amtl/am-vector.h>
+#include "ssa-graph.h"
+
+namespace sp {
+
+// Optimizes an SsaGraph fresh from the builder. The passes are:
+//  - trivial phi removal: phis whose inputs are all one value, or the phi
+//    itself, become that value;
+//  - global value numbering: an instruction equal to one that dominates it
+//    reuses its value, and instructions on constants are folded. Loads are
+//    only reused within a block, with no write in between;
+//  - bounds check elimination: a BOUNDS on a constant, on a value masked
+//    below the limit, or on a value already checked against a smaller limit
+//    is removed;
+//  - loop-invariant code motion: pure instructions whose inputs come from
+//    outside a loop move to its preheader, as do loads from globals and
+//    frame slots when nothing in the loop writes memory;
+//  - dead code elimination.
+//
+// Critical edges are split first, and the block order, dominators, and
+// loops are left up to date for register allocation.
+class SsaOptimizer final
+{
+ public:
+  explicit SsaOptimizer(SsaGraph* graph);
+
+  // Returns false if the method can't be compiled, because it reads a frame
+  // slot that was never written.
+  bool optimize();
+
+ private:
+  void removeTrivialPhis();
+  void numberValues();
+  SsaInsn* fold(SsaInsn* insn);
+  bool isRedundantBoundsCheck(SsaInsn* insn);
+  bool canNumber(const SsaInsn* insn) const;
+  bool congruent(const SsaInsn* a, const SsaInsn* b) const;
+  uint32_t hash(const SsaInsn* insn) const;
+  SsaInsn* lookupOrInsert(SsaInsn* insn);
+  void hoistLoopInvariants();
+  void removeDeadCode();
+  void replace(SsaInsn* insn, SsaInsn* value);
+
+ private:
+  SsaGraph* graph_;
+
+  // Open-addressed table of numbered instructions. Entries stay until the
+  // pass ends; a match must also dominate the instruction being looked up.
+  ke::Vector<SsaInsn*> table_;
+
+  // The memory epoch each load was numbered in, by id. It changes at each
+  // block and after each write.
+  ke::Vector<uint32_t> epochs_;
+  uint32_t epoch_;
+
+  ke::Vector<SsaInsn*> bounds_checks_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_ssa_optimizer_h_
@@ -15,6 +15,7 @@
 #include "plugin-context.h"
 #include "stack-frames.h"
 #include "compiled-function.h"
+#include "interp-code.h"
 #include "method-info.h"
 #if defined(KE_ARCH_X86)
 # include "x86/frames-x86.h"
@@ -43,11 +44,11 @@ InvokeFrame::~InvokeFrame()
 }
 
 InterpInvokeFrame::InterpInvokeFrame(PluginContext* cx,
-                                     MethodInfo* method,
-                                     const cell_t* const& cip)
- : InvokeFrame(cx, method->pcode_offset()),
-   method_(method),
-   cip_(cip),
+                                     const ke::Vector<InterpFrame>& frames,
+                                     const InterpInsn* const& ip)
+ : InvokeFrame(cx, frames[0].method->pcode_offset()),
+   frames_(frames),
+   ip_(ip),
    native_index_(-1)
 {
 }
@@ -83,7 +84,8 @@ JitInvokeFrame::~JitInvokeFrame()
 }
 
 InterpFrameIterator::InterpFrameIterator(InterpInvokeFrame* ivk)
- : ivk_(ivk)
+ : ivk_(ivk),
+   index_(ivk->frames_.length() - 1)
 {
   if (ivk_->native_index_ != -1)
     current_ = FrameType::Native;
@@ -94,14 +96,17 @@ InterpFrameIterator::InterpFrameIterator(InterpInvokeFrame* ivk)
 bool
 InterpFrameIterator::done() const
 {
-  return current_ == FrameType::Scripted;
+  return current_ == FrameType::Scripted && index_ == 0;
 }
 
 void
 InterpFrameIterator::next()
 {
   assert(!done());
-  current_ = FrameType::Scripted;
+  if (current_ == FrameType::Native)
+    current_ = FrameType::Scripted;
+  else
+    index_--;
 }
 
 FrameType
@@ -114,19 +119,19 @@ cell_t
 InterpFrameIterator::function_cip() const
 {
   assert(current_ == FrameType::Scripted);
-  return ivk_->method_->pcode_offset();
+  return ivk_->frames_[index_].method->pcode_offset();
 }
 
 cell_t
 InterpFrameIterator::cip() const
 {
   assert(current_ == FrameType::Scripted);
-  auto& code = ivk_->cx()->runtime()->code();
-
-  const uint8_t* ptr = reinterpret_cast<const uint8_t*>(ivk_->cip_);
-  assert(ptr >= code.bytes && ptr < code.bytes + code.length);
 
-  return ptr - code.bytes;
+  const InterpFrame& frame = ivk_->frames_[index_];
+  const InterpInsn* ip = (index_ == ivk_->frames_.length() - 1)
+                         ? ivk_->ip_
+                         : frame.ip;
+  return frame.method->interp_code()->cipOf(ip);
 }
 
 uint32_t
@@ -152,6 +157,7 @@ JitFrameIterator::JitFrameIterator(PluginRuntime* rt, intptr_t* exit_fp)
 
   pc_ = nullptr;
   cip_ = kInvalidCip;
+  inlined_function_cip_ = kInvalidCip;
 }
 
 bool
@@ -165,9 +171,39 @@ JitFrameIterator::next()
 {
   assert(!done());
 
+  // Move from an inlined method to the method it was inlined into, which
+  // has the same native frame.
+  if (inlined_function_cip_ != kInvalidCip) {
+    inlined_function_cip_ = kInvalidCip;
+    return;
+  }
+
   pc_ = cur_frame_->return_address;
   cip_ = kInvalidCip;
   cur_frame_ = FrameLayout::FromFp(cur_frame_->prev_fp);
+  findInlinedFrame();
+}
+
+void
+JitFrameIterator::findInlinedFrame()
+{
+  if (cur_frame_->frame_type != JitFrameType::Scripted)
+    return;
+
+  RefPtr<MethodInfo> method = rt_->GetMethod(cur_frame_->function_id);
+  CompiledFunction* fn = method ? method->jitContaining(pc_) : nullptr;
+  if (!fn)
+    return;
+
+  ucell_t call_cip = fn->FindInlinedCallByPc(pc_);
+  if (call_cip == kInvalidCip)
+    return;
+
+  // The CALL's operand is the inlined method; the verifier checked it. The
+  // CALL is also where the outer method is.
+  const cell_t* call = reinterpret_cast<const cell_t*>(rt_->code().bytes + call_cip);
+  inlined_function_cip_ = call[1];
+  cip_ = call_cip;
 }
 
 FrameType
@@ -189,20 +225,26 @@ cell_t
 JitFrameIterator::function_cip() const
 {
   assert(cur_frame_->frame_type == JitFrameType::Scripted);
+  if (inlined_function_cip_ != kInvalidCip)
+    return inlined_function_cip_;
   return cur_frame_->function_id;
 }
 
 cell_t
 JitFrameIterator::cip() const
 {
-  RefPtr<MethodInfo> method = rt_->GetMethod(function_cip());
+  RefPtr<MethodInfo> method = rt_->GetMethod(cur_frame_->function_id);
   if (!method)
     return 0;
 
-  CompiledFunction *fn = method->jit();
+  CompiledFunction *fn = method->jitContaining(pc_);
   if (!fn)
     return 0;
 
+  // The cip map has the inlined method's cips.
+  if (inlined_function_cip_ != kInvalidCip)
+    return fn->FindCipByPc(pc_);
+
   if (cip_ == kInvalidCip) {
     if (pc_)
       cip_ = fn->FindCipByPc(pc_);
@@ -237,6 +279,13 @@ FrameIterator::nextInvokeFrame()
     return;
   }
   if (InterpInvokeFrame* ivk = ivk_->AsInterpInvokeFrame()) {
+    if (!ivk->hasFrames()) {
+      // Nothing to show; the JIT frame above already covers this method.
+      ivk_ = ivk_->prev();
+      if (ivk_)
+        nextInvokeFrame();
+      return;
+    }
     frame_cursor_ = new InterpFrameIterator(ivk);
     return;
   }
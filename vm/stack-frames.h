@@ -20,6 +20,7 @@
 #include <amtl/am-platform.h>
 #include <amtl/am-refcounting.h>
 #include <amtl/am-enum.h>
+#include <amtl/am-vector.h>
 #if defined(KE_ARCH_X86)
 # include "x86/frames-x86.h"
 #elif defined(KE_ARCH_X64)
@@ -34,6 +35,7 @@ class PluginContext;
 class PluginRuntime;
 class MethodInfo;
 struct FrameLayout;
+struct InterpInsn;
 
 enum class FrameType
 {
@@ -112,27 +114,53 @@ class InvokeFrame
   ucell_t entry_cip_;
 };
 
-// Created by the interpreter. These are 1:1 with interpreter frames, for now.
+// A scripted frame on the interpreter's own call stack. |ip| is the CALL
+// instruction the frame is suspended at; it is not used for the innermost
+// frame, whose position lives in the dispatch loop.
+struct InterpFrame
+{
+  InterpFrame()
+   : method(nullptr),
+     ip(nullptr)
+  {}
+  explicit InterpFrame(MethodInfo* method)
+   : method(method),
+     ip(nullptr)
+  {}
+
+  MethodInfo* method;
+  const InterpInsn* ip;
+};
+
+// Created by the interpreter. One of these covers every scripted frame
+// pushed by a single entry into the interpreter, since calls between
+// scripted functions do not leave the dispatch loop.
 class InterpInvokeFrame final : public InvokeFrame
 {
   friend class InterpFrameIterator;
 
  public:
   InterpInvokeFrame(PluginContext* cx,
-                    MethodInfo* method,
-                    const cell_t* const& cip);
+                    const ke::Vector<InterpFrame>& frames,
+                    const InterpInsn* const& ip);
   ~InterpInvokeFrame();
 
   void enterNativeCall(uint32_t native_index);
   void leaveNativeCall();
 
+  // This is false once the interpreter has handed its last frame to the JIT
+  // through on-stack replacement.
+  bool hasFrames() const {
+    return !frames_.empty();
+  }
+
   InterpInvokeFrame* AsInterpInvokeFrame() override {
     return this;
   }
 
  private:
-  ke::RefPtr<MethodInfo> method_;
-  const cell_t* const& cip_;
+  const ke::Vector<InterpFrame>& frames_;
+  const InterpInsn* const& ip_;
   int native_index_;
 };
 
@@ -186,6 +214,7 @@ class InterpFrameIterator final : public InlineFrameIterator
  private:
   InterpInvokeFrame* ivk_;
   FrameType current_;
+  size_t index_;
 };
 
 class JitFrameIterator final : public InlineFrameIterator
@@ -205,11 +234,18 @@ class JitFrameIterator final : public InlineFrameIterator
     return cur_frame_;
   }
 
+ private:
+  void findInlinedFrame();
+
  private:
   PluginRuntime* rt_;
   FrameLayout* cur_frame_;
   mutable ucell_t cip_;
   void* pc_;
+
+  // If the current frame's pc is in code inlined from another method, that
+  // method is shown first, as a frame of its own. Otherwise, kInvalidCip.
+  ucell_t inlined_function_cip_;
 };
 
 class FrameIterator : public SourcePawn::IFrameIterator
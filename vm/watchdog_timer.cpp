@@ -25,8 +25,7 @@ WatchdogTimer::WatchdogTimer(Environment *env)
    terminate_(false),
    mainthread_(ke::GetCurrentThreadId()),
    last_frame_id_(0),
-   second_timeout_(false),
-   timedout_(false)
+   second_timeout_(false)
 {
 }
 
@@ -108,23 +107,10 @@ WatchdogTimer::Run()
       continue;
     }
 
-    {
-      // Prevent the JIT from linking or destroying runtimes and functions.
-      ke::AutoLock lock(env_->lock());
-
-      // Set the timeout notification bit. If this is detected before any patched
-      // JIT backedges are reached, the main thread will attempt to acquire the
-      // monitor lock, and block until we call Wait().
-      timedout_ = true;
-    
-      // Patch all jumps. This can race with the main thread's execution since
-      // all code writes are 32-bit integer instruction operands, which are
-      // guaranteed to be atomic on x86.
-      env_->PatchAllJumpsForTimeout();
-    }
-
-    // The JIT will be free to compile new functions while we wait, but it will
-    // see the timeout bit set above and immediately bail out.
+    // The main thread handles the interrupt at its next safepoint. If that
+    // happens before we call Wait(), it blocks on the monitor lock until we
+    // do.
+    env_->RequestInterrupt(Environment::kTimeoutInterrupt);
     cv_.Wait();
 
     second_timeout_ = false;
@@ -139,29 +125,10 @@ WatchdogTimer::Run()
   }
 }
 
-bool
+void
 WatchdogTimer::NotifyTimeoutReceived()
 {
-  // We are guaranteed that the watchdog thread is waiting for our
-  // notification, and is therefore blocked. We take the JIT lock
-  // anyway for sanity.
-  {
-    ke::AutoLock lock(env_->lock());
-    env_->UnpatchAllJumpsFromTimeout();
-  }
-
-  timedout_ = false;
-
   // Wake up the watchdog thread, it's okay to keep processing now.
   ke::AutoLock lock(&cv_);
   cv_.Notify();
-  return false;
-}
-
-bool
-WatchdogTimer::HandleInterrupt()
-{
-  if (timedout_)
-    return NotifyTimeoutReceived();
-  return true;
 }
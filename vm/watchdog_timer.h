@@ -36,9 +36,8 @@ class WatchdogTimer
   bool Initialize(size_t timeout_ms);
   void Shutdown();
 
-  // Called from main thread.
-  bool NotifyTimeoutReceived();
-  bool HandleInterrupt();
+  // Called from main thread, when it handles the timeout interrupt.
+  void NotifyTimeoutReceived();
 
  private:
   // Watchdog thread.
@@ -57,9 +56,6 @@ class WatchdogTimer
   // Accessed only on the watchdog thread.
   uintptr_t last_frame_id_;
   bool second_timeout_;
-
-  // Accessed only on the main thread.
-  bool timedout_;
 };
 
 } // namespace sp
@@ -16,19 +16,33 @@
 namespace sp {
 
 void
-Assembler::emitToExecutableMemory(void *code)
+Assembler::emitToExecutableMemory(void *code, void *cold_code)
 {
   assert(!outOfMemory());
+  assert(cold_code || !coldLength());
 
   uint8_t *base = reinterpret_cast<uint8_t *>(code);
-  memcpy(base, buffer(), length());
+  uint8_t *cold = reinterpret_cast<uint8_t *>(cold_code);
+  copyToExecutableMemory(base, cold);
+
+  // Displacements were computed as if the cold code directly followed the
+  // hot code.
+  for (size_t i = 0; i < split_refs_.length(); i++) {
+    uint32_t offset = split_refs_[i];
+    int32_t delta = *reinterpret_cast<int32_t *>(buffer() + offset - 4);
+    uint8_t *site = linkedAddress(base, cold, offset);
+    ptrdiff_t disp = linkedAddress(base, cold, offset + delta) - site;
+    assert(disp >= INT_MIN && disp <= INT_MAX);
+    *reinterpret_cast<int32_t *>(site - 4) = static_cast<int32_t>(disp);
+  }
 
   for (size_t i = 0; i < absolute_code_refs_.length(); i++) {
-    size_t offset = absolute_code_refs_[i];
-    size_t target = *reinterpret_cast<uint64_t*>(base + offset - 8);
+    uint32_t offset = absolute_code_refs_[i];
+    uint64_t target = *reinterpret_cast<uint64_t*>(buffer() + offset - 8);
     assert(target <= length());
 
-    *reinterpret_cast<void**>(base + offset - 8) = base + target;
+    *reinterpret_cast<void**>(linkedAddress(base, cold, offset) - 8) =
+      linkedAddress(base, cold, uint32_t(target));
   }
 }
 
@@ -331,7 +331,35 @@ struct Operand
 class Assembler : public AssemblerBase
 {
  public:
-  void emitToExecutableMemory(void *code);
+  Assembler()
+   : relocatable_(false)
+  {}
+
+  // |cold_code| receives the cold code, if there is any.
+  void emitToExecutableMemory(void *code, void *cold_code = nullptr);
+
+  // In relocatable code, addresses always use the full 64-bit encoding, and
+  // the end of each one is recorded, so they can be rewritten if the code is
+  // loaded into another process. Addresses of the code itself are recorded
+  // separately.
+  void setRelocatable() {
+    relocatable_ = true;
+  }
+  bool relocatable() const {
+    return relocatable_;
+  }
+  const ke::Vector<uint32_t>& absoluteRefs() const {
+    return absolute_refs_;
+  }
+  const ke::Vector<uint32_t>& absoluteCodeRefs() const {
+    return absolute_code_refs_;
+  }
+
+  // Ends of rel32 displacements between the hot and cold code, which have to
+  // be adjusted once both parts are placed.
+  const ke::Vector<uint32_t>& splitRefs() const {
+    return split_refs_;
+  }
 
   void bind(Label *target) {
     if (outOfMemory()) {
@@ -355,6 +383,7 @@ class Assembler : public AssemblerBase
       int32_t *p = reinterpret_cast<int32_t *>(buffer() + offset - 4);
       status = *p;
       *p = static_cast<int32_t>(delta);
+      noteSplitRef(offset, pc());
     }
     target->bind(pc());
   }
@@ -445,7 +474,8 @@ class Assembler : public AssemblerBase
       movl(dest, int32_t(value));
     } else if (value >= INT_MIN && value <= INT_MAX) {
       // Perform a sign-extended move.
-      emit1_64(0xc7, 1, dest);
+      emit1_64(0xc7, 0, dest);
+      writeInt32(int32_t(value));
     } else {
       // Do a full 64-bit move.
       emit1_64_rex(0xb8 + dest.low_bits(), dest);
@@ -474,7 +504,14 @@ class Assembler : public AssemblerBase
     writeInt32(value);
   }
   void movq(Register dest, const AddressValue& address) {
-    movq(dest, address.value());
+    if (!relocatable_) {
+      movq(dest, address.value());
+      return;
+    }
+    emit1_64_rex(0xb8 + dest.low_bits(), dest);
+    writeInt64(address.value());
+    if (!absolute_refs_.append(pc()))
+      outOfMemory_ = true;
   }
   void movl(Register dest, const Operand& src) {
     emit1(0x8b, dest, src);
@@ -533,7 +570,6 @@ class Assembler : public AssemblerBase
   void cmpq(const T& left, Register right) {
     emit1_64(0x39, right, left);
   }
-  template <typename T>
   void cmpq(Register left, const Operand& right) {
     emit1_64(0x3b, left, right);
   }
@@ -541,7 +577,6 @@ class Assembler : public AssemblerBase
   void cmpl(const T& left, Register right) {
     emit1(0x39, right, left);
   }
-  template <typename T>
   void cmpl(Register left, const Operand& right) {
     emit1(0x3b, left, right);
   }
@@ -555,9 +590,246 @@ class Assembler : public AssemblerBase
     emit1_64(0x31, right, left);
   }
 
+  // 32-bit operations. Writing to a 32-bit register zeroes its upper half,
+  // which keeps cells usable as indexes into the plugin's memory.
+  void leal(Register dest, const Operand& src) {
+    emit1(0x8d, dest, src);
+  }
+  void movsxd(Register dest, const Operand& src) {
+    emit1_64(0x63, dest, src);
+  }
+  void movw(const Operand& dest, Register src) {
+    ensureSpace();
+    *pos_++ = 0x66;
+    maybe_emit_rex(src, dest);
+    emit1_tail(0x89, src, dest);
+  }
+  void movb(const Operand& dest, Register src) {
+    ensureSpace();
+    // Without a REX prefix, codes 4-7 would select ah, ch, dh and bh.
+    uint8_t bits = static_cast<uint8_t>((src.rex_bit() << 2) | dest.rex_bits());
+    if (bits || src.code >= 4)
+      *pos_++ = 0x40 | bits;
+    emit1_tail(0x88, src, dest);
+  }
+  void xchgl(Register dest, Register src) {
+    emit1(0x87, dest, src);
+  }
+
+  template <typename T>
+  void addl(const T& dest, Register src) {
+    emit1(0x01, src, dest);
+  }
+  void addl(Register dest, const Operand& src) {
+    emit1(0x03, dest, src);
+  }
+  template <typename T>
+  void subl(const T& dest, Register src) {
+    emit1(0x29, src, dest);
+  }
+  void subl(Register dest, const Operand& src) {
+    emit1(0x2b, dest, src);
+  }
+  template <typename T>
+  void subl(const T& rm, int32_t imm) {
+    alu_imm_32(5, imm, rm);
+  }
+  template <typename T>
+  void andl(const T& dest, Register src) {
+    emit1(0x21, src, dest);
+  }
+  void andl(Register dest, const Operand& src) {
+    emit1(0x23, dest, src);
+  }
+  template <typename T>
+  void andl(const T& rm, int32_t imm) {
+    alu_imm_32(4, imm, rm);
+  }
+  template <typename T>
+  void orl(const T& dest, Register src) {
+    emit1(0x09, src, dest);
+  }
+  void orl(Register dest, const Operand& src) {
+    emit1(0x0b, dest, src);
+  }
+  template <typename T>
+  void orl(const T& rm, int32_t imm) {
+    alu_imm_32(1, imm, rm);
+  }
+  template <typename T>
+  void xorl(const T& dest, Register src) {
+    emit1(0x31, src, dest);
+  }
+  void xorl(Register dest, const Operand& src) {
+    emit1(0x33, dest, src);
+  }
+  template <typename T>
+  void xorl(const T& rm, int32_t imm) {
+    alu_imm_32(6, imm, rm);
+  }
+
+  void imull(Register dest, Register src) {
+    ensureSpace();
+    maybe_emit_rex(dest, src);
+    *pos_++ = 0x0f;
+    emit1_tail(0xaf, dest, src);
+  }
+  void imull(Register dest, const Operand& src) {
+    ensureSpace();
+    maybe_emit_rex(dest, src);
+    *pos_++ = 0x0f;
+    emit1_tail(0xaf, dest, src);
+  }
+  void imull(Register dest, Register src, int32_t imm) {
+    if (imm >= SCHAR_MIN && imm <= SCHAR_MAX) {
+      emit1(0x6b, dest, src);
+      *pos_++ = uint8_t(imm & 0xff);
+    } else {
+      emit1(0x69, dest, src);
+      writeInt32(imm);
+    }
+  }
+  void negl(Register srcdest) {
+    emit1(0xf7, 3, srcdest);
+  }
+  void notl(Register srcdest) {
+    emit1(0xf7, 2, srcdest);
+  }
+  void idivl(Register divisor) {
+    emit1(0xf7, 7, divisor);
+  }
+
+  void shll_cl(Register dest) {
+    emit1(0xd3, 4, dest);
+  }
+  void shrl_cl(Register dest) {
+    emit1(0xd3, 5, dest);
+  }
+  void sarl_cl(Register dest) {
+    emit1(0xd3, 7, dest);
+  }
+  void shll(Register dest, uint8_t imm) {
+    shift_imm(4, imm, dest);
+  }
+  void shrl(Register dest, uint8_t imm) {
+    shift_imm(5, imm, dest);
+  }
+  void sarl(Register dest, uint8_t imm) {
+    shift_imm(7, imm, dest);
+  }
+
+  void set(ConditionCode cc, Register dest) {
+    ensureSpace();
+    if (dest.code >= 4)
+      *pos_++ = 0x40 | dest.rex_bit();
+    *pos_++ = 0x0f;
+    emit1_tail(0x90 + uint8_t(cc), 0, dest);
+  }
+
+  void cld() {
+    emit1(0xfc);
+  }
+  void rep_movsb() {
+    emit2(0xf3, 0xa4);
+  }
+  void rep_movsd() {
+    emit2(0xf3, 0xa5);
+  }
+  void rep_stosd() {
+    emit2(0xf3, 0xab);
+  }
+
+  // Jumps that always use a 32-bit displacement, so they can be patched.
+  void jmp32(Label *dest) {
+    emit1(0xe9);
+    emitJumpTarget(dest);
+  }
+  void j32(ConditionCode cc, Label *dest) {
+    emit2(0x0f, 0x80 + uint8_t(cc));
+    emitJumpTarget(dest);
+  }
+
+  // Emit the offset of |dest| from the end of this 32-bit value, as an entry
+  // of a jump table.
+  void emit_relative_address(Label *dest) {
+    ensureSpace();
+    emitJumpTarget(dest);
+  }
+
+  // SSE and SSE2 are part of the x86-64 baseline, so these need no feature
+  // detection.
+  void movss(FloatRegister dest, const Operand& src) {
+    emit_sse(0xf3, 0x10, ToRegister(dest), src);
+  }
+  void addss(FloatRegister dest, const Operand& src) {
+    emit_sse(0xf3, 0x58, ToRegister(dest), src);
+  }
+  void addss(FloatRegister dest, FloatRegister src) {
+    emit_sse(0xf3, 0x58, ToRegister(dest), ToRegister(src));
+  }
+  void subss(FloatRegister dest, const Operand& src) {
+    emit_sse(0xf3, 0x5c, ToRegister(dest), src);
+  }
+  void subss(FloatRegister dest, FloatRegister src) {
+    emit_sse(0xf3, 0x5c, ToRegister(dest), ToRegister(src));
+  }
+  void mulss(FloatRegister dest, const Operand& src) {
+    emit_sse(0xf3, 0x59, ToRegister(dest), src);
+  }
+  void mulss(FloatRegister dest, FloatRegister src) {
+    emit_sse(0xf3, 0x59, ToRegister(dest), ToRegister(src));
+  }
+  void divss(FloatRegister dest, const Operand& src) {
+    emit_sse(0xf3, 0x5e, ToRegister(dest), src);
+  }
+  void divss(FloatRegister dest, FloatRegister src) {
+    emit_sse(0xf3, 0x5e, ToRegister(dest), ToRegister(src));
+  }
+  void cvtsi2ss(FloatRegister dest, const Operand& src) {
+    emit_sse(0xf3, 0x2a, ToRegister(dest), src);
+  }
+  void cvtsi2ss(FloatRegister dest, Register src) {
+    emit_sse(0xf3, 0x2a, ToRegister(dest), src);
+  }
+  void cvtss2si(Register dest, const Operand& src) {
+    emit_sse(0xf3, 0x2d, dest, src);
+  }
+  void cvtss2si(Register dest, FloatRegister src) {
+    emit_sse(0xf3, 0x2d, dest, ToRegister(src));
+  }
+  void cvttss2si(Register dest, const Operand& src) {
+    emit_sse(0xf3, 0x2c, dest, src);
+  }
+  void cvttss2si(Register dest, FloatRegister src) {
+    emit_sse(0xf3, 0x2c, dest, ToRegister(src));
+  }
+  void xorps(FloatRegister dest, FloatRegister src) {
+    emit_sse(0, 0x57, ToRegister(dest), ToRegister(src));
+  }
+  // Compares |right| to |left|, so "above" means right > left.
+  void ucomiss(const Operand& left, FloatRegister right) {
+    emit_sse(0, 0x2e, ToRegister(right), left);
+  }
+  void ucomiss(FloatRegister left, FloatRegister right) {
+    emit_sse(0, 0x2e, ToRegister(right), ToRegister(left));
+  }
+  void movd(Register dest, FloatRegister src) {
+    emit_sse(0x66, 0x7e, ToRegister(src), dest);
+  }
+  void movd(FloatRegister dest, Register src) {
+    emit_sse(0x66, 0x6e, ToRegister(dest), src);
+  }
+  void stmxcsr(const Operand& dest) {
+    emit_sse(0, 0xae, 3, dest);
+  }
+  void ldmxcsr(const Operand& src) {
+    emit_sse(0, 0xae, 2, src);
+  }
+
  protected:
   // If address does not fit in a 32-bit value, src must be rax.
   void movq(const AddressOperand& address, Register src) {
+    assert(!relocatable_);
     if (src == rax) {
       emit1_64(0xa3);
       writeInt64(address.asIntPtr());
@@ -566,6 +838,7 @@ class Assembler : public AssemblerBase
     }
   }
   void movq(Register dest, const AddressOperand& src) {
+    assert(!relocatable_);
     if (dest == rax) {
       emit1_64(0xa1);
       writeInt64(src.asIntPtr());
@@ -576,7 +849,7 @@ class Assembler : public AssemblerBase
 
  private:
   bool canEmitSmallJump(Label *dest, int8_t *deltap) {
-    if (!dest->bound())
+    if (!dest->bound() || isCold(dest->offset()) != isCold(pc()))
       return false;
 
     // All small jumps are assumed to be 2 bytes.
@@ -591,17 +864,22 @@ class Assembler : public AssemblerBase
       ptrdiff_t delta = ptrdiff_t(dest->offset()) - (position() + 4);
       assert(delta >= INT_MIN && delta <= INT_MAX);
       writeInt32(static_cast<int32_t>(delta));
+      noteSplitRef(pc(), dest->offset());
     } else {
       writeUint32(dest->addPending(position() + 4));
     }
   }
+  void noteSplitRef(uint32_t end, uint32_t target) {
+    if (isCold(end) != isCold(target) && !split_refs_.append(end))
+      outOfMemory_ = true;
+  }
 
   void alu_imm_64(uint8_t r, int32_t imm, Register rm) {
     if (imm >= SCHAR_MIN && imm <= SCHAR_MAX) {
       emit1_64(0x83, r, rm);
       *pos_++ = uint8_t(imm & 0xff);
     } else if (rm == rax) {
-      emit1(0x05 | (r << 3));
+      emit1_64(0x05 | (r << 3));
       writeInt32(imm);
     } else {
       emit1_64(0x81, r, rm);
@@ -638,6 +916,39 @@ class Assembler : public AssemblerBase
       writeInt32(imm);
     }
   }
+  void shift_imm(uint8_t r, uint8_t imm, Register rm) {
+    if (imm == 1) {
+      emit1(0xd1, r, rm);
+    } else {
+      emit1(0xc1, r, rm);
+      *pos_++ = imm;
+    }
+  }
+
+  // SSE instructions put their mandatory prefix before the REX prefix, and
+  // use a two-byte opcode.
+  template <typename RMType>
+  void emit_sse(uint8_t prefix, uint8_t opcode, Register opreg, const RMType& rm) {
+    ensureSpace();
+    if (prefix)
+      *pos_++ = prefix;
+    maybe_emit_rex(opreg, rm);
+    *pos_++ = 0x0f;
+    emit1_tail(opcode, opreg, rm);
+  }
+  template <typename RMType>
+  void emit_sse(uint8_t prefix, uint8_t opcode, uint8_t opreg, const RMType& rm) {
+    ensureSpace();
+    if (prefix)
+      *pos_++ = prefix;
+    maybe_emit_rex(rm);
+    *pos_++ = 0x0f;
+    emit1_tail(opcode, opreg, rm);
+  }
+  static Register ToRegister(FloatRegister reg) {
+    Register r = { reg.code };
+    return r;
+  }
 
   // Instructions can fall into one or more of the following categories, and
   // we slice up helpers to cover them all:
@@ -770,7 +1081,10 @@ class Assembler : public AssemblerBase
   }
 
  private:
+  bool relocatable_;
+  ke::Vector<uint32_t> absolute_refs_;
   ke::Vector<uint32_t> absolute_code_refs_;
+  ke::Vector<uint32_t> split_refs_;
 };
 
 } // namespace sp
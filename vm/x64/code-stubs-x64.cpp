@@ -33,28 +33,32 @@ CodeStubs::CompileInvokeStub()
   MacroAssembler masm;
   __ enterFrame(JitFrameType::Entry, 0);
 
+  // rsi and rdi are only callee-saved on Windows, but optimized code keeps
+  // values in them, so they're saved everywhere.
   __ push(rbx);
+  __ push(rsi);
+  __ push(rdi);
   __ push(r12);
   __ push(r13);
   __ push(r14);
   __ push(r15);
 
-  // We push 5 values, plus 2 for the frame size.
-  static const intptr_t kFpOffsetToPreAlignedSp = -(5 + kExtraWordsInSpFrame) * 8;
+  // We push 7 values, plus 2 for the frame size.
+  static const intptr_t kFpOffsetToPreAlignedSp = -(7 + kExtraWordsInSpFrame) * 8;
 
   // arg0 = cx
   // arg1 = code
   // arg2 = rval
   
   // Save the context and rval pointers.
-  const Register context = saved1;
+  const Register context = ctx;
   const Register rvalptr = saved0;
   __ movq(context, ArgReg0);
   __ movq(rvalptr, ArgReg2);
   
   // Set up runtime registers.
   __ movq(dat, Operand(context, static_cast<int32_t>(PluginContext::offsetOfMemory())));
-  __ movq(stk, Operand(context, static_cast<int32_t>(PluginContext::offsetOfSp())));
+  __ movl(stk, Operand(context, static_cast<int32_t>(PluginContext::offsetOfSp())));
   __ addq(stk, dat);
 
   // Align the stack.
@@ -64,14 +68,14 @@ CodeStubs::CompileInvokeStub()
   __ call(ArgReg1);
 
   // Store the rval.
-  __ movq(Operand(rvalptr, 0), pri);
+  __ movl(Operand(rvalptr, 0), pri);
 
   // Store latest stk. If we have an error code, we'll jump directly to here,
   // so rax will already be set.
   Label ret;
   __ bind(&ret);
   __ subq(stk, dat);
-  __ movq(Operand(context, static_cast<int32_t>(PluginContext::offsetOfSp())), stk);
+  __ movl(Operand(context, static_cast<int32_t>(PluginContext::offsetOfSp())), stk);
 
   // Restore registers and leave.
   __ leaq(rsp, Operand(rbp, kFpOffsetToPreAlignedSp));
@@ -79,6 +83,8 @@ CodeStubs::CompileInvokeStub()
   __ pop(r14);
   __ pop(r13);
   __ pop(r12);
+  __ pop(rdi);
+  __ pop(rsi);
   __ pop(rbx);
   __ leaveFrame();
   __ ret();
@@ -88,7 +94,7 @@ CodeStubs::CompileInvokeStub()
   __ bind(&error);
   __ jmp(&ret);
 
-  invoke_stub_ = LinkCode(env_, masm);
+  invoke_stub_ = LinkCode(env_, masm, "sp::InvokeStub");
   if (!invoke_stub_.address())
     return false;
 
@@ -113,7 +119,7 @@ CodeStubs::CreateFakeNativeStub(SPVM_FAKENATIVE_FUNC callback, void *pData)
   __ leave();
   __ ret();
 
-  return (SPVM_NATIVE_FUNC)LinkCodeToLegacyPtr(env_, masm);
+  return (SPVM_NATIVE_FUNC)LinkCodeToLegacyPtr(env_, masm, "sp::FakeNativeStub");
 }
 
 } // namespace sp
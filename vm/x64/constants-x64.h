@@ -33,6 +33,10 @@ static const Register frm = rbx;
 static const Register saved0 = r12;
 static const Register saved1 = r13;
 
+// The invoke stub keeps the PluginContext here for as long as compiled code
+// runs, so its registers (sp, hp, frm) are at fixed offsets from it.
+static const Register ctx = saved1;
+
 static const Register scratch0 = rcx;
 static const Register scratch1 = r11;
 static const Register scratch2 = r10;
@@ -0,0 +1,1180 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <assert.h>
+#include "jit_opt_x64.h"
+#include "frames-x64.h"
+#include "linear-scan.h"
+#include "outofline-asm.h"
+#include "plugin-context.h"
+#include "plugin-runtime.h"
+#include "ssa-builder.h"
+#include "ssa-optimizer.h"
+
+#define __ masm.
+
+namespace sp {
+
+using namespace ke;
+
+// Registers handed out by the allocator, in order of preference. The last is
+// callee-saved, so it is the only one that survives calls.
+static const Register kAllocatable[] = { rsi, rdi, r9, r10, r11, r12 };
+static const uint32_t kNumAllocatable = sizeof(kAllocatable) / sizeof(kAllocatable[0]);
+static const uint32_t kPreserved = kNumAllocatable - 1;
+
+// Below the frame type and function id: the caller's r12, then spill slots.
+static const int32_t kSavedRegOffset = -3 * int32_t(sizeof(intptr_t));
+static const int32_t kFirstSpillOffset = -4 * int32_t(sizeof(intptr_t));
+
+// MXCSR rounding control.
+static const int32_t kMxcsrRoundingMask = 0x6000;
+static const int32_t kMxcsrRoundDown = 0x2000;
+static const int32_t kMxcsrRoundUp = 0x4000;
+
+static inline ConditionCode
+OpToCondition(CompareOp op)
+{
+  switch (op) {
+  case CompareOp::Eq:
+    return equal;
+  case CompareOp::Neq:
+    return not_equal;
+  case CompareOp::Sless:
+    return less;
+  case CompareOp::Sleq:
+    return less_equal;
+  case CompareOp::Sgrtr:
+    return greater;
+  case CompareOp::Sgeq:
+    return greater_equal;
+  default:
+    assert(false);
+    return negative;
+  }
+}
+
+// The comparison with its operands swapped.
+static inline CompareOp
+SwapOperands(CompareOp op)
+{
+  switch (op) {
+  case CompareOp::Sless:
+    return CompareOp::Sgrtr;
+  case CompareOp::Sleq:
+    return CompareOp::Sgeq;
+  case CompareOp::Sgrtr:
+    return CompareOp::Sless;
+  case CompareOp::Sgeq:
+    return CompareOp::Sleq;
+  default:
+    return op;
+  }
+}
+
+// Condition codes come in pairs that differ in the low bit.
+static inline ConditionCode
+Invert(ConditionCode cc)
+{
+  return ConditionCode(int(cc) ^ 1);
+}
+
+OptimizingCompiler::OptimizingCompiler(PluginRuntime* rt, cell_t pcode_offs)
+ : Compiler(rt, pcode_offs),
+   graph_(nullptr),
+   block_labels_(nullptr),
+   next_(nullptr),
+   stk_depth_(-1)
+{
+}
+
+OptimizingCompiler::~OptimizingCompiler()
+{
+  delete [] block_labels_;
+}
+
+CompiledFunction*
+OptimizingCompiler::compile()
+{
+  if (!findBlocks())
+    return nullptr;
+
+  SsaGraph graph;
+  SsaBuilder builder(rt_, pcode_start_, pcode_end_, block_starts_, stack_depths_,
+                     redundant_bounds_, &graph);
+  if (!builder.build())
+    return nullptr;
+
+  SsaOptimizer optimizer(&graph);
+  if (!optimizer.optimize())
+    return nullptr;
+
+  LinearScan allocator(&graph, kNumAllocatable, kPreserved);
+  allocator.allocate();
+
+  graph_ = &graph;
+  block_labels_ = new Label[graph.blocks().length()];
+
+  emitEntry(allocator.numSpillSlots());
+
+  const Vector<SsaBlock*>& order = graph.order();
+  for (size_t i = 0; i < order.length(); i++) {
+    next_ = (i + 1 < order.length()) ? order[i + 1] : nullptr;
+    if (!emitBlock(order[i]))
+      return nullptr;
+  }
+
+  CompiledFunction* fun = finish();
+  graph_ = nullptr;
+  return fun;
+}
+
+// Optimized code is only entered at the start, so loops have no entry points.
+bool
+OptimizingCompiler::emitOsrEntries()
+{
+  return true;
+}
+
+void
+OptimizingCompiler::emitEntry(uint32_t nspills)
+{
+  __ enterFrame(JitFrameType::Scripted, pcode_start_);
+  emitPushFrame();
+
+  // Keep the stack aligned for calls.
+  int32_t size = int32_t((1 + nspills) * sizeof(intptr_t));
+  size = (size + 15) & ~15;
+  __ subq(rsp, size);
+  __ movq(Operand(rbp, kSavedRegOffset), r12);
+
+  stk_depth_ = 0;
+}
+
+bool
+OptimizingCompiler::emitBlock(SsaBlock* block)
+{
+  __ bind(&block_labels_[block->id]);
+
+  // Blocks can be reached from anywhere.
+  if (block != graph_->entry())
+    stk_depth_ = -1;
+
+  for (size_t i = 0; i < block->insns.length(); i++) {
+    SsaInsn* insn = block->insns[i];
+    op_cip_ = insn->cip;
+    if (!emitInsn(insn) || error_)
+      return false;
+  }
+  return true;
+}
+
+Register
+OptimizingCompiler::registerOf(const SsaInsn* value) const
+{
+  assert(inRegister(value));
+  return kAllocatable[value->alloc.index];
+}
+
+Operand
+OptimizingCompiler::slotOf(const SsaInsn* value) const
+{
+  assert(value->alloc.kind == SsaAllocation::Spill);
+
+  // A spilled parameter stays in its argument slot.
+  if (value->alloc.index < 0)
+    return Operand(frm, value->imm);
+  return Operand(rbp, kFirstSpillOffset - value->alloc.index * int32_t(sizeof(intptr_t)));
+}
+
+Register
+OptimizingCompiler::resultRegister(const SsaInsn* insn) const
+{
+  if (inRegister(insn))
+    return registerOf(insn);
+  return rax;
+}
+
+void
+OptimizingCompiler::load(Register dest, SsaInsn* value)
+{
+  if (value->isConstant()) {
+    __ movl(dest, value->imm);
+  } else if (inRegister(value)) {
+    Register src = registerOf(value);
+    if (src != dest)
+      __ movl(dest, src);
+  } else {
+    __ movl(dest, slotOf(value));
+  }
+}
+
+void
+OptimizingCompiler::loadFloat(FloatRegister dest, SsaInsn* value)
+{
+  if (value->isConstant()) {
+    __ movl(rax, value->imm);
+    __ movd(dest, rax);
+  } else if (inRegister(value)) {
+    __ movd(dest, registerOf(value));
+  } else {
+    __ movss(dest, slotOf(value));
+  }
+}
+
+void
+OptimizingCompiler::storeResult(SsaInsn* insn, Register src)
+{
+  switch (insn->alloc.kind) {
+  case SsaAllocation::Register:
+    if (registerOf(insn) != src)
+      __ movl(registerOf(insn), src);
+    break;
+  case SsaAllocation::Spill:
+    __ movl(slotOf(insn), src);
+    break;
+  default:
+    // Unused.
+    break;
+  }
+}
+
+void
+OptimizingCompiler::syncStack(int32_t depth)
+{
+  if (stk_depth_ == depth)
+    return;
+  if (depth == 0)
+    __ movq(stk, frm);
+  else
+    __ leaq(stk, Operand(frm, -depth));
+  stk_depth_ = depth;
+}
+
+bool
+OptimizingCompiler::emitInsn(SsaInsn* insn)
+{
+  switch (insn->op) {
+  case SsaOp::Constant:
+  case SsaOp::Undefined:
+  case SsaOp::Phi:
+    return true;
+
+  case SsaOp::Param:
+    if (inRegister(insn))
+      __ movl(registerOf(insn), Operand(frm, insn->imm));
+    return true;
+
+  case SsaOp::Add:
+  case SsaOp::Sub:
+  case SsaOp::Mul:
+  case SsaOp::And:
+  case SsaOp::Or:
+  case SsaOp::Xor:
+    emitBinary(insn);
+    return true;
+
+  case SsaOp::Shl:
+  case SsaOp::Shr:
+  case SsaOp::Sar:
+    emitShift(insn);
+    return true;
+
+  case SsaOp::Neg:
+  case SsaOp::Invert:
+  {
+    Register dest = resultRegister(insn);
+    load(dest, insn->operand(0));
+    if (insn->op == SsaOp::Neg)
+      __ negl(dest);
+    else
+      __ notl(dest);
+    storeResult(insn, dest);
+    return true;
+  }
+
+  case SsaOp::Not:
+  {
+    Register dest = resultRegister(insn);
+    ConditionCode cc = emitCompare(insn->operand(0), graph_->constant(0), CompareOp::Eq);
+    __ movl(dest, 0);
+    __ set(cc, dest);
+    storeResult(insn, dest);
+    return true;
+  }
+
+  case SsaOp::Compare:
+  {
+    Register dest = resultRegister(insn);
+    ConditionCode cc = emitCompare(insn->operand(0), insn->operand(1), insn->cond);
+    __ movl(dest, 0);
+    __ set(cc, dest);
+    storeResult(insn, dest);
+    return true;
+  }
+
+  case SsaOp::IndexAddr:
+  {
+    Register dest = resultRegister(insn);
+    SsaInsn* base = insn->operand(0);
+    SsaInsn* index = insn->operand(1);
+    if (index->isConstant()) {
+      load(dest, base);
+      __ addl(dest, index->imm * int32_t(sizeof(cell_t)));
+    } else {
+      Register base_reg = rax;
+      if (inRegister(base))
+        base_reg = registerOf(base);
+      else
+        load(rax, base);
+      Register index_reg = rcx;
+      if (inRegister(index))
+        index_reg = registerOf(index);
+      else
+        load(rcx, index);
+
+      // Addresses wrap at 32 bits.
+      __ leaq(dest, Operand(base_reg, index_reg, ScaleFour));
+      __ movl(dest, dest);
+    }
+    storeResult(insn, dest);
+    return true;
+  }
+
+  case SsaOp::FrameAddr:
+  {
+    Register dest = resultRegister(insn);
+    __ leaq(dest, Operand(frm, insn->imm));
+    __ subq(dest, dat);
+    storeResult(insn, dest);
+    return true;
+  }
+
+  case SsaOp::Div:
+  case SsaOp::Mod:
+    emitDivide(insn);
+    return true;
+
+  case SsaOp::FloatAdd:
+  case SsaOp::FloatSub:
+  case SsaOp::FloatMul:
+  case SsaOp::FloatDiv:
+    emitFloatBinary(insn);
+    return true;
+
+  case SsaOp::IntToFloat:
+  {
+    SsaInsn* value = insn->operand(0);
+    if (inRegister(value)) {
+      __ cvtsi2ss(xmm0, registerOf(value));
+    } else if (value->isConstant()) {
+      __ movl(rax, value->imm);
+      __ cvtsi2ss(xmm0, rax);
+    } else {
+      __ cvtsi2ss(xmm0, slotOf(value));
+    }
+    __ movd(resultRegister(insn), xmm0);
+    storeResult(insn, resultRegister(insn));
+    return true;
+  }
+
+  case SsaOp::FloatToInt:
+    emitFloatToInt(insn);
+    return true;
+
+  case SsaOp::FloatCmp:
+    emitFloatCmp(insn);
+    return true;
+
+  case SsaOp::FloatCompare:
+    emitFloatCompare(insn);
+    return true;
+
+  case SsaOp::FloatNot:
+  {
+    // See Compiler::visitFLOAT_NOT().
+    Register dest = resultRegister(insn);
+    loadFloat(xmm1, insn->operand(0));
+    __ xorps(xmm0, xmm0);
+    __ ucomiss(xmm1, xmm0);
+
+    Label done;
+    __ movl(dest, 1);
+    __ j(parity, &done);
+    __ set(zero, dest);
+    __ bind(&done);
+    storeResult(insn, dest);
+    return true;
+  }
+
+  case SsaOp::Load:
+  {
+    Register dest = resultRegister(insn);
+    SsaInsn* addr = insn->operand(0);
+    if (addr->isConstant()) {
+      __ movl(dest, Operand(dat, addr->imm));
+    } else {
+      Register addr_reg = rax;
+      if (inRegister(addr))
+        addr_reg = registerOf(addr);
+      else
+        load(rax, addr);
+      __ movl(dest, Operand(dat, addr_reg, NoScale));
+    }
+    storeResult(insn, dest);
+    return true;
+  }
+
+  case SsaOp::LoadChecked:
+  {
+    Register dest = resultRegister(insn);
+    load(rax, insn->operand(0));
+    syncStack(insn->depth);
+    emitCheckAddress(rax);
+    __ movl(dest, Operand(dat, rax, NoScale));
+    if (insn->imm == 1)
+      __ andl(dest, 0xff);
+    else if (insn->imm == 2)
+      __ andl(dest, 0xffff);
+    storeResult(insn, dest);
+    return true;
+  }
+
+  case SsaOp::LoadSlot:
+  {
+    Register dest = resultRegister(insn);
+    __ movl(dest, Operand(frm, insn->imm));
+    storeResult(insn, dest);
+    return true;
+  }
+
+  case SsaOp::Store:
+  case SsaOp::StoreSlot:
+  {
+    Operand dest = Operand(frm, 0);
+    SsaInsn* value;
+    if (insn->op == SsaOp::StoreSlot) {
+      dest = Operand(frm, insn->imm);
+      value = insn->operand(0);
+    } else {
+      SsaInsn* addr = insn->operand(0);
+      value = insn->operand(1);
+      if (addr->isConstant()) {
+        dest = Operand(dat, addr->imm);
+      } else if (inRegister(addr)) {
+        dest = Operand(dat, registerOf(addr), NoScale);
+      } else {
+        load(rdx, addr);
+        dest = Operand(dat, rdx, NoScale);
+      }
+    }
+
+    if (value->isConstant()) {
+      __ movl(dest, value->imm);
+    } else if (inRegister(value)) {
+      __ movl(dest, registerOf(value));
+    } else {
+      load(rax, value);
+      __ movl(dest, rax);
+    }
+    return true;
+  }
+
+  case SsaOp::StoreChecked:
+  {
+    load(rdx, insn->operand(0));
+    load(rax, insn->operand(1));
+    syncStack(insn->depth);
+    emitCheckAddress(rdx);
+    if (insn->imm == 1)
+      __ movb(Operand(dat, rdx, NoScale), rax);
+    else if (insn->imm == 2)
+      __ movw(Operand(dat, rdx, NoScale), rax);
+    else if (insn->imm == 4)
+      __ movl(Operand(dat, rdx, NoScale), rax);
+    return true;
+  }
+
+  case SsaOp::Movs:
+  {
+    // rsi and rdi hold values, so they are saved, after the addresses are
+    // out of them.
+    uint32_t dwords = uint32_t(insn->imm) / 4;
+    uint32_t bytes = uint32_t(insn->imm) % 4;
+    load(rax, insn->operand(0));
+    load(rdx, insn->operand(1));
+    __ push(rsi);
+    __ push(rdi);
+    __ leaq(rdi, Operand(dat, rdx, NoScale));
+    __ leaq(rsi, Operand(dat, rax, NoScale));
+    __ cld();
+    if (dwords) {
+      __ movl(rcx, dwords);
+      __ rep_movsd();
+    }
+    if (bytes) {
+      __ movl(rcx, bytes);
+      __ rep_movsb();
+    }
+    __ pop(rdi);
+    __ pop(rsi);
+    return true;
+  }
+
+  case SsaOp::Fill:
+  {
+    load(rdx, insn->operand(0));
+    load(rax, insn->operand(1));
+    __ push(rdi);
+    __ leaq(rdi, Operand(dat, rdx, NoScale));
+    __ movl(rcx, uint32_t(insn->imm) / 4);
+    __ cld();
+    __ rep_stosd();
+    __ pop(rdi);
+    return true;
+  }
+
+  case SsaOp::Bounds:
+  {
+    OutOfBoundsErrorPath* bounds = new OutOfBoundsErrorPath(op_cip_, nullptr, insn->imm);
+    if (!ool_paths_.append(bounds)) {
+      reportError(SP_ERROR_OUT_OF_MEMORY);
+      return false;
+    }
+
+    // The error path takes the index in pri.
+    load(pri, insn->operand(0));
+    __ cmpl(pri, insn->imm);
+    __ j(above, bounds->label());
+    return true;
+  }
+
+  case SsaOp::StackCheck:
+    // See Compiler::visitSTACK(). The depth is the new one.
+    syncStack(insn->depth);
+    __ movl(tmp, hpAddr());
+    __ leaq(tmp, Operand(dat, tmp, NoScale, STACK_MARGIN));
+    __ cmpq(stk, tmp);
+    jumpOnError(below, SP_ERROR_STACKLOW);
+    return true;
+
+  case SsaOp::Heap:
+    syncStack(insn->depth);
+    visitHEAP(insn->imm);
+    storeResult(insn, alt);
+    return true;
+
+  case SsaOp::TrackerPush:
+    visitTRACKER_PUSH_C(insn->imm);
+    return true;
+
+  case SsaOp::TrackerPop:
+    visitTRACKER_POP_SETHEAP();
+    return true;
+
+  case SsaOp::Call:
+    syncStack(insn->depth);
+    emitInterruptCheck();
+    emitCallTo(insn->imm);
+    stk_depth_ = -1;
+    storeResult(insn, pri);
+    return true;
+
+  case SsaOp::Native:
+  case SsaOp::Intrinsic:
+  {
+    syncStack(insn->depth);
+    const sp_intrinsic_t* intrinsic = nullptr;
+    if (insn->op == SsaOp::Intrinsic)
+      intrinsic = rt_->GetIntrinsic(insn->imm);
+    if (intrinsic)
+      visitINTRINSIC_N(insn->imm, insn->imm2, intrinsic);
+    else if (insn->imm2 < 0)
+      visitSYSREQ_C(insn->imm);
+    else
+      visitSYSREQ_N(insn->imm, insn->imm2);
+    stk_depth_ = -1;
+    storeResult(insn, pri);
+    return true;
+  }
+
+  case SsaOp::Jump:
+    emitLoopEdgeCheck(insn);
+    emitPhiMoves(insn->block, insn->block->succs[0]);
+    jumpTo(insn->block->succs[0]);
+    return true;
+
+  case SsaOp::Branch:
+    emitLoopEdgeCheck(insn);
+    emitBranch(insn);
+    return true;
+
+  case SsaOp::Switch:
+    emitLoopEdgeCheck(insn);
+    emitSwitch(insn);
+    return true;
+
+  case SsaOp::Return:
+    emitReturn(insn);
+    return true;
+
+  case SsaOp::Throw:
+    return emitThrow(insn->imm);
+
+  default:
+    assert(false);
+    reportError(SP_ERROR_INVALID_INSTRUCTION);
+    return false;
+  }
+}
+
+void
+OptimizingCompiler::emitBinary(SsaInsn* insn)
+{
+  SsaInsn* left = insn->operand(0);
+  SsaInsn* right = insn->operand(1);
+  Register dest = resultRegister(insn);
+
+  // Loading the left operand must not clobber the right one.
+  if (left != right && inRegister(right) && registerOf(right) == dest) {
+    if (insn->op == SsaOp::Sub) {
+      dest = rax;
+    } else {
+      SsaInsn* temp = left;
+      left = right;
+      right = temp;
+    }
+  }
+  load(dest, left);
+
+  if (right->isConstant()) {
+    cell_t imm = right->imm;
+    switch (insn->op) {
+    case SsaOp::Add:
+      __ addl(dest, imm);
+      break;
+    case SsaOp::Sub:
+      __ subl(dest, imm);
+      break;
+    case SsaOp::Mul:
+      __ imull(dest, dest, imm);
+      break;
+    case SsaOp::And:
+      __ andl(dest, imm);
+      break;
+    case SsaOp::Or:
+      __ orl(dest, imm);
+      break;
+    case SsaOp::Xor:
+      __ xorl(dest, imm);
+      break;
+    default:
+      assert(false);
+    }
+  } else if (inRegister(right)) {
+    Register src = registerOf(right);
+    switch (insn->op) {
+    case SsaOp::Add:
+      __ addl(dest, src);
+      break;
+    case SsaOp::Sub:
+      __ subl(dest, src);
+      break;
+    case SsaOp::Mul:
+      __ imull(dest, src);
+      break;
+    case SsaOp::And:
+      __ andl(dest, src);
+      break;
+    case SsaOp::Or:
+      __ orl(dest, src);
+      break;
+    case SsaOp::Xor:
+      __ xorl(dest, src);
+      break;
+    default:
+      assert(false);
+    }
+  } else {
+    Operand src = slotOf(right);
+    switch (insn->op) {
+    case SsaOp::Add:
+      __ addl(dest, src);
+      break;
+    case SsaOp::Sub:
+      __ subl(dest, src);
+      break;
+    case SsaOp::Mul:
+      __ imull(dest, src);
+      break;
+    case SsaOp::And:
+      __ andl(dest, src);
+      break;
+    case SsaOp::Or:
+      __ orl(dest, src);
+      break;
+    case SsaOp::Xor:
+      __ xorl(dest, src);
+      break;
+    default:
+      assert(false);
+    }
+  }
+  storeResult(insn, dest);
+}
+
+void
+OptimizingCompiler::emitShift(SsaInsn* insn)
+{
+  Register dest = resultRegister(insn);
+  SsaInsn* amount = insn->operand(1);
+  if (amount->isConstant()) {
+    // The CPU masks the count the same way.
+    uint8_t bits = uint8_t(amount->imm & 31);
+    load(dest, insn->operand(0));
+    if (insn->op == SsaOp::Shl)
+      __ shll(dest, bits);
+    else if (insn->op == SsaOp::Shr)
+      __ shrl(dest, bits);
+    else
+      __ sarl(dest, bits);
+  } else {
+    // The count has to be in cl, which is never allocated.
+    load(rcx, amount);
+    load(dest, insn->operand(0));
+    if (insn->op == SsaOp::Shl)
+      __ shll_cl(dest);
+    else if (insn->op == SsaOp::Shr)
+      __ shrl_cl(dest);
+    else
+      __ sarl_cl(dest);
+  }
+  storeResult(insn, dest);
+}
+
+void
+OptimizingCompiler::emitDivide(SsaInsn* insn)
+{
+  SsaInsn* divisor = insn->operand(1);
+  load(rcx, divisor);
+  load(rax, insn->operand(0));
+
+  // See Compiler::visitSDIV(). A Mod always follows the Div that checked
+  // its operands.
+  if (insn->op == SsaOp::Div) {
+    if (!divisor->isConstant() || divisor->imm == 0) {
+      __ testl(rcx, rcx);
+      jumpOnError(zero, SP_ERROR_DIVIDE_BY_ZERO);
+    }
+    if (!divisor->isConstant() || divisor->imm == -1) {
+      Label ok;
+      __ cmpl(rcx, -1);
+      __ j(not_equal, &ok);
+      __ cmpl(rax, 0x80000000);
+      jumpOnError(equal, SP_ERROR_INTEGER_OVERFLOW);
+      __ bind(&ok);
+    }
+  }
+
+  __ movl(rdx, rax);
+  __ sarl(rdx, 31);
+  __ idivl(rcx);
+  storeResult(insn, insn->op == SsaOp::Div ? rax : rdx);
+}
+
+void
+OptimizingCompiler::emitFloatBinary(SsaInsn* insn)
+{
+  loadFloat(xmm0, insn->operand(0));
+  loadFloat(xmm1, insn->operand(1));
+  switch (insn->op) {
+  case SsaOp::FloatAdd:
+    __ addss(xmm0, xmm1);
+    break;
+  case SsaOp::FloatSub:
+    __ subss(xmm0, xmm1);
+    break;
+  case SsaOp::FloatMul:
+    __ mulss(xmm0, xmm1);
+    break;
+  case SsaOp::FloatDiv:
+    __ divss(xmm0, xmm1);
+    break;
+  default:
+    assert(false);
+  }
+  Register dest = resultRegister(insn);
+  __ movd(dest, xmm0);
+  storeResult(insn, dest);
+}
+
+void
+OptimizingCompiler::emitFloatToInt(SsaInsn* insn)
+{
+  Register dest = resultRegister(insn);
+  loadFloat(xmm0, insn->operand(0));
+
+  switch (FloatRounding(insn->imm)) {
+  case FloatRounding::Nearest:
+    // MXCSR is preserved across calls, so it rounds to nearest.
+    __ cvtss2si(dest, xmm0);
+    break;
+  case FloatRounding::Zero:
+    __ cvttss2si(dest, xmm0);
+    break;
+  case FloatRounding::Floor:
+  case FloatRounding::Ceil:
+  {
+    // See Compiler::emitRoundWithMode().
+    int32_t mode = (FloatRounding(insn->imm) == FloatRounding::Floor)
+                   ? kMxcsrRoundDown
+                   : kMxcsrRoundUp;
+    __ subq(rsp, 16);
+    __ stmxcsr(Operand(rsp, 0));
+    __ movl(tmp, Operand(rsp, 0));
+    __ andl(tmp, ~kMxcsrRoundingMask);
+    __ orl(tmp, mode);
+    __ movl(Operand(rsp, 4), tmp);
+    __ ldmxcsr(Operand(rsp, 4));
+    __ cvtss2si(dest, xmm0);
+    __ ldmxcsr(Operand(rsp, 0));
+    __ addq(rsp, 16);
+    break;
+  }
+  }
+  storeResult(insn, dest);
+}
+
+void
+OptimizingCompiler::emitFloatCmp(SsaInsn* insn)
+{
+  // See Compiler::visitFLOATCMP(): the test is |right OP left|.
+  Register dest = resultRegister(insn);
+  loadFloat(xmm0, insn->operand(1));
+  loadFloat(xmm1, insn->operand(0));
+  __ ucomiss(xmm1, xmm0);
+
+  Label bl, ab, done;
+  __ j(above, &ab);
+  __ j(below, &bl);
+  __ xorl(dest, dest);
+  __ jmp(&done);
+  __ bind(&ab);
+  __ movl(dest, -1);
+  __ jmp(&done);
+  __ bind(&bl);
+  __ movl(dest, 1);
+  __ bind(&done);
+  storeResult(insn, dest);
+}
+
+void
+OptimizingCompiler::emitFloatCompare(SsaInsn* insn)
+{
+  ConditionCode cc;
+  switch (insn->cond) {
+  case CompareOp::Sgrtr:
+    cc = above;
+    break;
+  case CompareOp::Sgeq:
+    cc = above_equal;
+    break;
+  case CompareOp::Sleq:
+    cc = below_equal;
+    break;
+  case CompareOp::Sless:
+    cc = below;
+    break;
+  case CompareOp::Eq:
+    cc = equal;
+    break;
+  default:
+    assert(insn->cond == CompareOp::Neq);
+    cc = not_equal;
+    break;
+  }
+
+  // See Compiler::emitFloatCmp(): every relational compare is made to look
+  // like ja/jae, so comparisons with NaN fail.
+  SsaInsn* left = insn->operand(0);
+  SsaInsn* right = insn->operand(1);
+  if (cc == below || cc == below_equal) {
+    cc = (cc == below) ? above : above_equal;
+    SsaInsn* temp = left;
+    left = right;
+    right = temp;
+  }
+
+  Register dest = resultRegister(insn);
+  loadFloat(xmm0, left);
+  loadFloat(xmm1, right);
+  __ ucomiss(xmm1, xmm0);
+
+  if (cc == equal || cc == not_equal) {
+    Label done;
+    __ movl(dest, (cc == equal) ? 0 : 1);
+    __ j(parity, &done);
+    __ set(cc, dest);
+    __ bind(&done);
+  } else {
+    __ movl(dest, 0);
+    __ set(cc, dest);
+  }
+  storeResult(insn, dest);
+}
+
+ConditionCode
+OptimizingCompiler::emitCompare(SsaInsn* left, SsaInsn* right, CompareOp op)
+{
+  if (left->isConstant() && !right->isConstant()) {
+    SsaInsn* temp = left;
+    left = right;
+    right = temp;
+    op = SwapOperands(op);
+  }
+
+  if (left->isConstant()) {
+    load(rax, left);
+    __ cmpl(rax, right->imm);
+  } else if (inRegister(left)) {
+    Register reg = registerOf(left);
+    if (right->isConstant()) {
+      if (right->imm == 0 && (op == CompareOp::Eq || op == CompareOp::Neq))
+        __ testl(reg, reg);
+      else
+        __ cmpl(reg, right->imm);
+    } else if (inRegister(right)) {
+      __ cmpl(reg, registerOf(right));
+    } else {
+      __ cmpl(reg, slotOf(right));
+    }
+  } else {
+    Operand mem = slotOf(left);
+    if (right->isConstant()) {
+      __ cmpl(mem, right->imm);
+    } else if (inRegister(right)) {
+      __ cmpl(mem, registerOf(right));
+    } else {
+      load(rax, left);
+      __ cmpl(rax, slotOf(right));
+    }
+  }
+  return OpToCondition(op);
+}
+
+void
+OptimizingCompiler::emitBranch(SsaInsn* insn)
+{
+  SsaBlock* taken = insn->block->succs[0];
+  SsaBlock* fallthrough = insn->block->succs[1];
+  ConditionCode cc = emitCompare(insn->operand(0), insn->operand(1), insn->cond);
+  if (taken == next_) {
+    jumpTo(Invert(cc), fallthrough);
+    return;
+  }
+  jumpTo(cc, taken);
+  jumpTo(fallthrough);
+}
+
+void
+OptimizingCompiler::emitSwitch(SsaInsn* insn)
+{
+  SsaBlock* block = insn->block;
+  if (block->succs.length() == 1) {
+    emitPhiMoves(block, block->succs[0]);
+    jumpTo(block->succs[0]);
+    return;
+  }
+
+  SsaInsn* value = insn->operand(0);
+  Register reg = rax;
+  if (inRegister(value))
+    reg = registerOf(value);
+  else
+    load(rax, value);
+
+  for (size_t i = 0; i < insn->cases.length(); i++) {
+    __ cmpl(reg, insn->cases[i]);
+    jumpTo(equal, block->succs[insn->case_targets[i]]);
+  }
+  jumpTo(block->succs[0]);
+}
+
+void
+OptimizingCompiler::emitReturn(SsaInsn* insn)
+{
+  // The value could be in an argument slot, which is about to go away.
+  load(pri, insn->operand(0));
+  syncStack(insn->depth);
+
+  // See Compiler::visitRETN().
+  __ movl(frm, Operand(stk, 4));
+  __ addq(stk, 8);
+  __ movl(frmAddr(), frm);
+  __ addq(frm, dat);
+  __ movl(tmp, Operand(stk, 0));
+  __ leaq(stk, Operand(stk, tmp, ScaleFour, 4));
+
+  __ movq(r12, Operand(rbp, kSavedRegOffset));
+  __ leaveFrame();
+  __ ret();
+}
+
+bool
+OptimizingCompiler::emitThrow(int err)
+{
+  ErrorPath* path = new ErrorPath(op_cip_, nullptr, err);
+  if (!ool_paths_.append(path)) {
+    reportError(SP_ERROR_OUT_OF_MEMORY);
+    return false;
+  }
+  __ jmp(path->label());
+  return true;
+}
+
+// Phi moves happen all at once: each reads its source before any writes its
+// destination. Sources and destinations are numbered below; constants and
+// argument slots are never written, so they need no number.
+static const int32_t kNoLocation = -1;
+static const int32_t kTempLocation = kNumAllocatable;
+static const int32_t kFirstSlotLocation = kNumAllocatable + 1;
+
+struct PhiMove
+{
+  SsaInsn* value;
+  int32_t src;
+  int32_t dest;
+  SsaInsn* phi;
+};
+
+static int32_t
+LocationOf(const SsaInsn* value)
+{
+  if (value->alloc.kind == SsaAllocation::Register)
+    return value->alloc.index;
+  if (value->alloc.kind == SsaAllocation::Spill && value->alloc.index >= 0)
+    return kFirstSlotLocation + value->alloc.index;
+  return kNoLocation;
+}
+
+void
+OptimizingCompiler::emitPhiMoves(SsaBlock* block, SsaBlock* succ)
+{
+  if (succ->phis.empty())
+    return;
+
+  size_t index = 0;
+  while (succ->preds[index] != block)
+    index++;
+
+  Vector<PhiMove> moves;
+  for (size_t i = 0; i < succ->phis.length(); i++) {
+    SsaInsn* phi = succ->phis[i];
+    if (phi->alloc.kind == SsaAllocation::None)
+      continue;
+    SsaInsn* value = phi->operand(index);
+    PhiMove move = { value, LocationOf(value), LocationOf(phi), phi };
+    if (move.src != kNoLocation && move.src == move.dest)
+      continue;
+    moves.append(move);
+  }
+
+  auto emitMove = [this](const PhiMove& move) -> void {
+    if (move.src == kNoLocation) {
+      if (inRegister(move.phi)) {
+        load(registerOf(move.phi), move.value);
+      } else if (move.value->isConstant()) {
+        __ movl(slotOf(move.phi), move.value->imm);
+      } else {
+        load(rax, move.value);
+        __ movl(slotOf(move.phi), rax);
+      }
+      return;
+    }
+
+    Register src = rax;
+    if (move.src == kTempLocation)
+      src = tmp;
+    else if (move.src < kTempLocation)
+      src = kAllocatable[move.src];
+    else
+      __ movl(rax, Operand(rbp, kFirstSpillOffset -
+                                (move.src - kFirstSlotLocation) * int32_t(sizeof(intptr_t))));
+    storeResult(move.phi, src);
+  };
+
+  while (!moves.empty()) {
+    bool progress = false;
+    for (size_t i = 0; i < moves.length();) {
+      bool blocked = false;
+      for (size_t j = 0; j < moves.length(); j++) {
+        if (j != i && moves[j].src == moves[i].dest) {
+          blocked = true;
+          break;
+        }
+      }
+      if (blocked) {
+        i++;
+        continue;
+      }
+      emitMove(moves[i]);
+      moves.remove(i);
+      progress = true;
+    }
+    if (progress)
+      continue;
+
+    // Everything left is on a cycle. Save one destination in the temp, and
+    // read it from there instead; the rest of the cycle then resolves
+    // before the temp is needed again.
+    int32_t saved = moves[0].dest;
+    if (saved < kTempLocation)
+      __ movl(tmp, kAllocatable[saved]);
+    else
+      __ movl(tmp, slotOf(moves[0].phi));
+    for (size_t i = 0; i < moves.length(); i++) {
+      if (moves[i].src == saved)
+        moves[i].src = kTempLocation;
+    }
+  }
+}
+
+// Jumps back to an emitted block can be loops, so they have to check for
+// interrupts. The handler sees the pcode stack, so it has to be in sync.
+void
+OptimizingCompiler::emitLoopEdgeCheck(SsaInsn* insn)
+{
+  const Vector<SsaBlock*>& succs = insn->block->succs;
+  for (size_t i = 0; i < succs.length(); i++) {
+    if (block_labels_[succs[i]->id].bound()) {
+      syncStack(insn->depth);
+      emitInterruptCheck();
+      return;
+    }
+  }
+}
+
+void
+OptimizingCompiler::jumpTo(SsaBlock* target)
+{
+  if (target == next_)
+    return;
+  __ jmp(&block_labels_[target->id]);
+}
+
+void
+OptimizingCompiler::jumpTo(ConditionCode cc, SsaBlock* target)
+{
+  __ j(cc, &block_labels_[target->id]);
+}
+
+} // namespace sp
@@ -0,0 +1,97 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_jit_opt_x64_h_
+#define _include_sourcepawn_vm_jit_opt_x64_h_
+
+#include <am-vector.h>
+#include "jit_x64.h"
+#include "ssa-graph.h"
+
+namespace sp {
+
+// The optimizing tier. A method is built into an SsaGraph, optimized, and
+// register allocated, and its blocks are emitted in reverse postorder. The
+// frame layout, cip map, interrupt checks, and error paths are the same as
+// the baseline compiler's, so stack walks, error reports, and the watchdog
+// timer work unchanged, and instructions that call out, such as natives and
+// heap checks, reuse the baseline emitters.
+//
+// Values live in rsi, rdi, r9, r10, r11, and r12, or in spill slots below
+// the frame. Only r12 survives calls, so optimized code saves it, and the
+// invoke stub saves rsi and rdi. rax, rcx, rdx, xmm0, and xmm1 are scratch.
+// The pcode stack pointer is only kept up to date for instructions that use
+// it.
+class OptimizingCompiler final : public Compiler
+{
+ public:
+  OptimizingCompiler(PluginRuntime* rt, cell_t pcode_offs);
+  ~OptimizingCompiler();
+
+  // Returns null if the method can't be optimized. error() is only set if
+  // the method has an error.
+  CompiledFunction* compile();
+
+ private:
+  bool emitOsrEntries() override;
+
+  void emitEntry(uint32_t nspills);
+  bool emitBlock(SsaBlock* block);
+  bool emitInsn(SsaInsn* insn);
+  void emitBinary(SsaInsn* insn);
+  void emitShift(SsaInsn* insn);
+  void emitDivide(SsaInsn* insn);
+  void emitFloatBinary(SsaInsn* insn);
+  void emitFloatToInt(SsaInsn* insn);
+  void emitFloatCmp(SsaInsn* insn);
+  void emitFloatCompare(SsaInsn* insn);
+  ConditionCode emitCompare(SsaInsn* left, SsaInsn* right, CompareOp op);
+  void emitBranch(SsaInsn* insn);
+  void emitSwitch(SsaInsn* insn);
+  void emitReturn(SsaInsn* insn);
+  bool emitThrow(int err);
+  void emitPhiMoves(SsaBlock* block, SsaBlock* succ);
+  void emitLoopEdgeCheck(SsaInsn* insn);
+  void jumpTo(SsaBlock* target);
+  void jumpTo(ConditionCode cc, SsaBlock* target);
+
+  // Point stk at |depth| bytes below frm.
+  void syncStack(int32_t depth);
+
+  // Where values are.
+  bool inRegister(const SsaInsn* value) const {
+    return value->alloc.kind == SsaAllocation::Register;
+  }
+  Register registerOf(const SsaInsn* value) const;
+  Operand slotOf(const SsaInsn* value) const;
+
+  // The register to compute |insn|'s result in: its own, or rax.
+  Register resultRegister(const SsaInsn* insn) const;
+
+  void load(Register dest, SsaInsn* value);
+  void loadFloat(FloatRegister dest, SsaInsn* value);
+  void storeResult(SsaInsn* insn, Register src);
+
+ private:
+  SsaGraph* graph_;
+  Label* block_labels_;
+
+  // The block emitted after the current one, which can be fallen into.
+  SsaBlock* next_;
+
+  // The depth stk is at, or -1 if it isn't known.
+  int32_t stk_depth_;
+};
+
+} // namespace sp
+
+#endif // _include_sourcepawn_vm_jit_opt_x64_h_
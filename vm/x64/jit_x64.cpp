@@ -0,0 +1,2123 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "jit_x64.h"
+#include "plugin-runtime.h"
+#include "plugin-context.h"
+#include "watchdog_timer.h"
+#include "environment.h"
+#include "code-stubs.h"
+#include "linking.h"
+#include "frames-x64.h"
+#include "outofline-asm.h"
+#include "method-info.h"
+#include "runtime-helpers.h"
+#include "opcode-profiler.h"
+
+#define __ masm.
+
+namespace sp {
+
+// MXCSR rounding control.
+static const int32_t kMxcsrRoundingMask = 0x6000;
+static const int32_t kMxcsrRoundDown = 0x2000;
+static const int32_t kMxcsrRoundUp = 0x4000;
+
+static inline ConditionCode
+OpToCondition(CompareOp op)
+{
+  switch (op) {
+  case CompareOp::Eq:
+    return equal;
+  case CompareOp::Neq:
+    return not_equal;
+  case CompareOp::Sless:
+    return less;
+  case CompareOp::Sleq:
+    return less_equal;
+  case CompareOp::Sgrtr:
+    return greater;
+  case CompareOp::Sgeq:
+    return greater_equal;
+  default:
+    assert(false);
+    return negative;
+  }
+}
+
+Compiler::Compiler(PluginRuntime *rt, cell_t pcode_offs)
+ : CompilerBase(rt, pcode_offs),
+   cache_clock_(0)
+{
+  cached_slots_[0].reg = scratch1;
+  cached_slots_[1].reg = scratch2;
+  cached_slots_[2].reg = scratch3;
+}
+
+Compiler::~Compiler()
+{
+}
+
+// No exit frame - error code is returned directly.
+static int
+InvokePushTracker(PluginContext *cx, uint32_t amount)
+{
+  return cx->pushTracker(amount);
+}
+
+// No exit frame - error code is returned directly.
+static int
+InvokePopTrackerAndSetHeap(PluginContext *cx)
+{
+  return cx->popTrackerAndSetHeap();
+}
+
+// No exit frame - error code is returned directly.
+static int
+InvokeGenerateFullArray(PluginContext *cx, uint32_t argc, cell_t *argv, int autozero)
+{
+  return cx->generateFullArray(argc, argv, autozero);
+}
+
+bool
+Compiler::visitMOVE(PawnReg reg)
+{
+  if (reg == PawnReg::Pri)
+    __ movl(pri, alt);
+  else
+    __ movl(alt, pri);
+  return true;
+}
+
+bool
+Compiler::visitXCHG()
+{
+  __ xchgl(pri, alt);
+  return true;
+}
+
+bool
+Compiler::visitZERO(cell_t offset)
+{
+  __ movl(Operand(dat, offset), 0);
+  return true;
+}
+
+bool
+Compiler::visitZERO_S(cell_t offset)
+{
+  CachedSlot* slot = findCachedSlot(offset);
+  if (!slot && isCacheableSlot(offset))
+    slot = cacheSlot(offset, false);
+  if (slot) {
+    __ xorl(slot->reg, slot->reg);
+    slot->dirty = true;
+    return true;
+  }
+  __ movl(Operand(frm, offset), 0);
+  return true;
+}
+
+bool
+Compiler::visitPUSH(PawnReg src)
+{
+  Register reg = (src == PawnReg::Pri) ? pri : alt;
+  __ movl(Operand(stk, -4), reg);
+  __ subq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitPUSH_C(const cell_t* vals, size_t nvals)
+{
+  for (size_t i = 1; i <= nvals; i++)
+    __ movl(Operand(stk, -(4 * int(i))), vals[i - 1]);
+  __ subq(stk, 4 * nvals);
+  return true;
+}
+
+bool
+Compiler::visitPUSH_ADR(const cell_t* offsets, size_t nvals)
+{
+  // Addresses are pushed relative to dat, not as absolute addresses.
+  for (size_t i = 1; i <= nvals; i++) {
+    __ leaq(tmp, Operand(frm, offsets[i - 1]));
+    __ subq(tmp, dat);
+    __ movl(Operand(stk, -(4 * int(i))), tmp);
+  }
+  __ subq(stk, 4 * nvals);
+  return true;
+}
+
+bool
+Compiler::visitPUSH_S(const cell_t* offsets, size_t nvals)
+{
+  for (size_t i = 1; i <= nvals; i++) {
+    if (CachedSlot* slot = findCachedSlot(offsets[i - 1])) {
+      __ movl(Operand(stk, -(4 * int(i))), slot->reg);
+      continue;
+    }
+    __ movl(tmp, Operand(frm, offsets[i - 1]));
+    __ movl(Operand(stk, -(4 * int(i))), tmp);
+  }
+  __ subq(stk, 4 * nvals);
+  return true;
+}
+
+bool
+Compiler::visitPUSH(const cell_t* offsets, size_t nvals)
+{
+  for (size_t i = 1; i <= nvals; i++) {
+    __ movl(tmp, Operand(dat, offsets[i - 1]));
+    __ movl(Operand(stk, -(4 * int(i))), tmp);
+  }
+  __ subq(stk, 4 * nvals);
+  return true;
+}
+
+bool
+Compiler::visitZERO(PawnReg dest)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ xorl(reg, reg);
+  return true;
+}
+
+bool
+Compiler::visitADD()
+{
+  __ addl(pri, alt);
+  return true;
+}
+
+bool
+Compiler::visitSUB()
+{
+  __ subl(pri, alt);
+  return true;
+}
+
+bool
+Compiler::visitSUB_ALT()
+{
+  __ movl(tmp, alt);
+  __ subl(tmp, pri);
+  __ movl(pri, tmp);
+  return true;
+}
+
+// Taken from the prologue once the tier-up counter runs out, before the
+// frame is entered, so the optimized code can be jumped to as if it had been
+// called. Rejoins if there is no optimized code.
+class TierUpPath : public OutOfLinePath
+{
+ public:
+  bool emit(Compiler* cc) override {
+    cc->emitTierUpPath(this);
+    return true;
+  }
+
+  Label* rejoin() {
+    return &rejoin_;
+  }
+
+ private:
+  Label rejoin_;
+};
+
+void
+Compiler::emitPrologue()
+{
+  if (tiersUp()) {
+    TierUpPath* path = new TierUpPath();
+    if (!ool_paths_.append(path)) {
+      reportError(SP_ERROR_OUT_OF_MEMORY);
+      return;
+    }
+    emitTierUpCount(MethodInfo::kTierUpCallCost);
+    __ j(less_equal, path->label());
+    __ bind(path->rejoin());
+  }
+
+  __ enterFrame(JitFrameType::Scripted, pcode_start_);
+  emitPushFrame();
+}
+
+bool
+Compiler::tiersUp() const
+{
+  return method_ && !for_cache_ && !opcode_counts_ && env_->IsOptimizingJitEnabled();
+}
+
+void
+Compiler::emitTierUpCount(int32_t cost)
+{
+  __ movq(tmp, AddressValue(method_->addressOfTierUpCounter()));
+  __ subl(Operand(tmp, 0), cost);
+}
+
+void
+Compiler::emitTierUpPath(TierUpPath* path)
+{
+  // Once the method is optimized, calls that still arrive here go straight
+  // to the optimized code. Resetting the counter keeps it from wrapping.
+  Label compile;
+  __ movq(tmp, AddressValue(method_->addressOfOptimizedEntry()));
+  __ movq(tmp, Operand(tmp, 0));
+  __ testq(tmp, tmp);
+  __ j(zero, &compile);
+  __ movq(scratch1, AddressValue(method_->addressOfTierUpCounter()));
+  __ movl(Operand(scratch1, 0), 0);
+  __ jmp(tmp);
+
+  __ bind(&compile);
+  __ enterExitFrame(ExitFrameType::Helper, 0);
+  __ movq(ArgReg1, AddressValue(method_));
+  __ movq(ArgReg0, AddressValue(context_));
+  __ callWithABI(AddressValue((void *)TierUpFromBaseline));
+  __ leaveExitFrame();
+
+  __ testq(rax, rax);
+  __ j(zero, path->rejoin());
+  __ jmp(rax);
+}
+
+void
+Compiler::emitPushFrame()
+{
+  // Push the old frame onto the stack.
+  __ movl(tmp, frmAddr());
+  __ movl(Operand(stk, -4), tmp);
+  __ subq(stk, 8);    // extra unused slot for non-existant CIP
+
+  // Get and store the new frame.
+  __ movq(tmp, stk);
+  __ movq(frm, stk);
+  __ subq(tmp, dat);
+  __ movl(frmAddr(), tmp);
+}
+
+void
+Compiler::emitOsrEntry(Label* target)
+{
+  __ enterFrame(JitFrameType::Scripted, pcode_start_);
+
+  // The interpreter left pri and alt on top of the stack.
+  __ movl(pri, Operand(stk, 0));
+  __ movl(alt, Operand(stk, 4));
+  __ addq(stk, 8);
+
+  // The frame itself is already set up; just load it.
+  __ movl(frm, frmAddr());
+  __ addq(frm, dat);
+
+  __ jmp(target);
+}
+
+// This is OpcodeProfiler::record, without triples.
+void
+Compiler::emitOpcodeCount(OPCODE op)
+{
+  OpcodeProfiler* profiler = env_->opcode_profiler();
+
+  __ movq(scratch1, AddressValue(&opcode_counts_->ops[op]));
+  __ addq(Operand(scratch1, 0), 1);
+
+  // Shift the history, and count the pair it ends.
+  __ movq(scratch1, AddressValue(profiler->history()));
+  __ movl(tmp, Operand(scratch1, offsetof(OpcodeProfiler::History, prev)));
+  __ movl(Operand(scratch1, offsetof(OpcodeProfiler::History, prev2)), tmp);
+  __ movl(Operand(scratch1, offsetof(OpcodeProfiler::History, prev)), op);
+  __ imull(tmp, tmp, OPCODES_TOTAL * sizeof(uint64_t));
+  __ movq(scratch1, AddressValue(&profiler->pairs()[op]));
+  __ addq(Operand(scratch1, tmp, NoScale), 1);
+}
+
+// How an instruction interacts with frame slots held in registers.
+enum class SlotCacheUse
+{
+  // Doesn't touch the frame, or only through the cache.
+  None,
+  // Reads memory that could be in the frame, such as popping the stack, or
+  // leaves the block.
+  WriteBack,
+  // Anything else: it could write to the frame, or call out and clobber the
+  // registers.
+  Barrier
+};
+
+static SlotCacheUse
+ClassifySlotCacheUse(OPCODE op)
+{
+  switch (op) {
+  case OP_NOP:
+  case OP_BREAK:
+  case OP_LOAD_PRI:
+  case OP_LOAD_ALT:
+  case OP_LOAD_BOTH:
+  case OP_LOAD_S_PRI:
+  case OP_LOAD_S_ALT:
+  case OP_LOAD_S_BOTH:
+  case OP_CONST_PRI:
+  case OP_CONST_ALT:
+  case OP_CONST:
+  case OP_CONST_S:
+  case OP_ADDR_PRI:
+  case OP_ADDR_ALT:
+  case OP_STOR_PRI:
+  case OP_STOR_ALT:
+  case OP_STOR_S_PRI:
+  case OP_STOR_S_ALT:
+  case OP_IDXADDR:
+  case OP_MOVE_PRI:
+  case OP_MOVE_ALT:
+  case OP_XCHG:
+  case OP_PUSH_PRI:
+  case OP_PUSH_ALT:
+  case OP_PUSH_C:
+  case OP_PUSH2_C:
+  case OP_PUSH3_C:
+  case OP_PUSH4_C:
+  case OP_PUSH5_C:
+  case OP_PUSH:
+  case OP_PUSH2:
+  case OP_PUSH3:
+  case OP_PUSH4:
+  case OP_PUSH5:
+  case OP_PUSH_S:
+  case OP_PUSH2_S:
+  case OP_PUSH3_S:
+  case OP_PUSH4_S:
+  case OP_PUSH5_S:
+  case OP_PUSH_ADR:
+  case OP_PUSH2_ADR:
+  case OP_PUSH3_ADR:
+  case OP_PUSH4_ADR:
+  case OP_PUSH5_ADR:
+  case OP_SHL:
+  case OP_SHR:
+  case OP_SSHR:
+  case OP_SHL_C_PRI:
+  case OP_SHL_C_ALT:
+  case OP_SMUL:
+  case OP_SDIV:
+  case OP_SDIV_ALT:
+  case OP_ADD:
+  case OP_SUB:
+  case OP_SUB_ALT:
+  case OP_AND:
+  case OP_OR:
+  case OP_XOR:
+  case OP_NOT:
+  case OP_NEG:
+  case OP_INVERT:
+  case OP_ADD_C:
+  case OP_SMUL_C:
+  case OP_ZERO_PRI:
+  case OP_ZERO_ALT:
+  case OP_ZERO:
+  case OP_ZERO_S:
+  case OP_EQ:
+  case OP_NEQ:
+  case OP_SLESS:
+  case OP_SLEQ:
+  case OP_SGRTR:
+  case OP_SGEQ:
+  case OP_EQ_C_PRI:
+  case OP_EQ_C_ALT:
+  case OP_INC_PRI:
+  case OP_INC_ALT:
+  case OP_INC:
+  case OP_INC_S:
+  case OP_DEC_PRI:
+  case OP_DEC_ALT:
+  case OP_DEC:
+  case OP_DEC_S:
+  case OP_BOUNDS:
+  case OP_STRADJUST_PRI:
+  case OP_HEAP:
+    return SlotCacheUse::None;
+
+  case OP_LREF_S_PRI:
+  case OP_LREF_S_ALT:
+  case OP_LOAD_I:
+  case OP_LODB_I:
+  case OP_LIDX:
+  case OP_JZER:
+  case OP_JNZ:
+  case OP_JEQ:
+  case OP_JNEQ:
+  case OP_JSLESS:
+  case OP_JSLEQ:
+  case OP_JSGRTR:
+  case OP_JSGEQ:
+  case OP_POP_PRI:
+  case OP_POP_ALT:
+  case OP_STACK:
+  case OP_FABS:
+  case OP_FLOAT:
+  case OP_FLOATADD:
+  case OP_FLOATSUB:
+  case OP_FLOATMUL:
+  case OP_FLOATDIV:
+  case OP_RND_TO_NEAREST:
+  case OP_RND_TO_FLOOR:
+  case OP_RND_TO_CEIL:
+  case OP_RND_TO_ZERO:
+  case OP_FLOATCMP:
+  case OP_FLOAT_GT:
+  case OP_FLOAT_GE:
+  case OP_FLOAT_LT:
+  case OP_FLOAT_LE:
+  case OP_FLOAT_NE:
+  case OP_FLOAT_EQ:
+  case OP_FLOAT_NOT:
+    return SlotCacheUse::WriteBack;
+
+  default:
+    return SlotCacheUse::Barrier;
+  }
+}
+
+// Within a block, frame slots can live in the scratch registers, which
+// instructions that aren't barriers leave alone. Only arguments, and locals
+// the verifier knows are above the stack pointer, are cached, so pushes can't
+// overwrite them; locals are dropped once they're popped. Dirty slots are
+// written back before leaving the block or reading memory that could be in
+// the frame, and every slot is dropped at barriers and block starts, where
+// control can arrive from elsewhere.
+void
+Compiler::emitBeforeInstruction(OPCODE op, bool block_start)
+{
+  if (block_start) {
+    forgetSlots();
+    return;
+  }
+
+  // Drop locals that the last instruction popped off the stack, since a push
+  // could reuse them.
+  int32_t depth = stackDepth();
+  for (size_t i = 0; i < kNumCachedSlots; i++) {
+    CachedSlot& slot = cached_slots_[i];
+    if (slot.valid && slot.offset < 0 && (depth < 0 || -slot.offset > depth)) {
+      if (slot.dirty)
+        __ movl(Operand(frm, slot.offset), slot.reg);
+      slot.valid = false;
+    }
+  }
+
+  switch (ClassifySlotCacheUse(op)) {
+  case SlotCacheUse::None:
+    break;
+  case SlotCacheUse::WriteBack:
+    writeBackSlots();
+    break;
+  case SlotCacheUse::Barrier:
+    forgetSlots();
+    break;
+  }
+}
+
+bool
+Compiler::isCacheableSlot(cell_t offset)
+{
+  // Profiling calls out between instructions.
+  if (opcode_counts_)
+    return false;
+  if (!ke::IsAligned(offset, sizeof(cell_t)))
+    return false;
+
+  // Arguments are never on this frame's part of the stack. Locals must be
+  // above the stack pointer.
+  if (offset >= cell_t(3 * sizeof(cell_t)))
+    return true;
+  int32_t depth = stackDepth();
+  return offset < 0 && depth >= 0 && -offset <= depth;
+}
+
+CachedSlot*
+Compiler::findCachedSlot(cell_t offset)
+{
+  for (size_t i = 0; i < kNumCachedSlots; i++) {
+    CachedSlot& slot = cached_slots_[i];
+    if (slot.valid && slot.offset == offset) {
+      slot.last_use = ++cache_clock_;
+      return &slot;
+    }
+  }
+  return nullptr;
+}
+
+CachedSlot*
+Compiler::cacheSlot(cell_t offset, bool load)
+{
+  // Take a free register, or evict the least recently used slot.
+  CachedSlot* slot = &cached_slots_[0];
+  for (size_t i = 0; i < kNumCachedSlots && slot->valid; i++) {
+    CachedSlot& other = cached_slots_[i];
+    if (!other.valid || other.last_use < slot->last_use)
+      slot = &other;
+  }
+  if (slot->valid && slot->dirty)
+    __ movl(Operand(frm, slot->offset), slot->reg);
+
+  slot->offset = offset;
+  slot->valid = true;
+  slot->dirty = false;
+  slot->last_use = ++cache_clock_;
+  if (load)
+    __ movl(slot->reg, Operand(frm, offset));
+  return slot;
+}
+
+void
+Compiler::writeBackSlots()
+{
+  for (size_t i = 0; i < kNumCachedSlots; i++) {
+    CachedSlot& slot = cached_slots_[i];
+    if (slot.valid && slot.dirty) {
+      __ movl(Operand(frm, slot.offset), slot.reg);
+      slot.dirty = false;
+    }
+  }
+}
+
+void
+Compiler::forgetSlots()
+{
+  writeBackSlots();
+  for (size_t i = 0; i < kNumCachedSlots; i++)
+    cached_slots_[i].valid = false;
+}
+
+bool
+Compiler::visitSHL()
+{
+  __ movl(rcx, alt);
+  __ shll_cl(pri);
+  return true;
+}
+
+bool
+Compiler::visitSHR()
+{
+  __ movl(rcx, alt);
+  __ shrl_cl(pri);
+  return true;
+}
+
+bool
+Compiler::visitSSHR()
+{
+  __ movl(rcx, alt);
+  __ sarl_cl(pri);
+  return true;
+}
+
+bool
+Compiler::visitSHL_C(PawnReg dest, cell_t amount)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ shll(reg, amount);
+  return true;
+}
+
+bool
+Compiler::visitSMUL()
+{
+  __ imull(pri, alt);
+  return true;
+}
+
+bool
+Compiler::visitNOT()
+{
+  __ testl(pri, pri);
+  __ movl(pri, 0);
+  __ set(zero, pri);
+  return true;
+}
+
+bool
+Compiler::visitNEG()
+{
+  __ negl(pri);
+  return true;
+}
+
+bool
+Compiler::visitXOR()
+{
+  __ xorl(pri, alt);
+  return true;
+}
+
+bool
+Compiler::visitOR()
+{
+  __ orl(pri, alt);
+  return true;
+}
+
+bool
+Compiler::visitAND()
+{
+  __ andl(pri, alt);
+  return true;
+}
+
+bool
+Compiler::visitINVERT()
+{
+  __ notl(pri);
+  return true;
+}
+
+bool
+Compiler::visitADD_C(cell_t value)
+{
+  __ addl(pri, value);
+  return true;
+}
+
+bool
+Compiler::visitSMUL_C(cell_t value)
+{
+  __ imull(pri, pri, value);
+  return true;
+}
+
+bool
+Compiler::visitCompareOp(CompareOp op)
+{
+  ConditionCode cc = OpToCondition(op);
+  __ cmpl(pri, alt);
+  __ movl(pri, 0);
+  __ set(cc, pri);
+  return true;
+}
+
+bool
+Compiler::visitEQ_C(PawnReg src, cell_t value)
+{
+  Register reg = (src == PawnReg::Pri) ? pri : alt;
+  __ cmpl(reg, value);
+  __ movl(pri, 0);
+  __ set(equal, pri);
+  return true;
+}
+
+bool
+Compiler::visitINC(PawnReg dest)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ addl(reg, 1);
+  return true;
+}
+
+bool
+Compiler::visitINC(cell_t offset)
+{
+  __ addl(Operand(dat, offset), 1);
+  return true;
+}
+
+bool
+Compiler::visitINC_S(cell_t offset)
+{
+  CachedSlot* slot = findCachedSlot(offset);
+  if (!slot && isCacheableSlot(offset))
+    slot = cacheSlot(offset, true);
+  if (slot) {
+    __ addl(slot->reg, 1);
+    slot->dirty = true;
+    return true;
+  }
+  __ addl(Operand(frm, offset), 1);
+  return true;
+}
+
+bool
+Compiler::visitINC_I()
+{
+  __ addl(Operand(dat, pri, NoScale), 1);
+  return true;
+}
+
+bool
+Compiler::visitDEC(PawnReg dest)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ subl(reg, 1);
+  return true;
+}
+
+bool
+Compiler::visitDEC(cell_t offset)
+{
+  __ subl(Operand(dat, offset), 1);
+  return true;
+}
+
+bool
+Compiler::visitDEC_S(cell_t offset)
+{
+  CachedSlot* slot = findCachedSlot(offset);
+  if (!slot && isCacheableSlot(offset))
+    slot = cacheSlot(offset, true);
+  if (slot) {
+    __ subl(slot->reg, 1);
+    slot->dirty = true;
+    return true;
+  }
+  __ subl(Operand(frm, offset), 1);
+  return true;
+}
+
+bool
+Compiler::visitDEC_I()
+{
+  __ subl(Operand(dat, pri, NoScale), 1);
+  return true;
+}
+
+bool
+Compiler::visitLOAD(PawnReg dest, cell_t srcaddr)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ movl(reg, Operand(dat, srcaddr));
+  return true;
+}
+
+bool
+Compiler::visitLOAD_BOTH(cell_t offsetForPri, cell_t offsetForAlt)
+{
+  visitLOAD(PawnReg::Pri, offsetForPri);
+  visitLOAD(PawnReg::Alt, offsetForAlt);
+  return true;
+}
+
+bool
+Compiler::visitLOAD_S(PawnReg dest, cell_t srcoffs)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  CachedSlot* slot = findCachedSlot(srcoffs);
+  if (!slot && isCacheableSlot(srcoffs))
+    slot = cacheSlot(srcoffs, true);
+  if (slot)
+    __ movl(reg, slot->reg);
+  else
+    __ movl(reg, Operand(frm, srcoffs));
+  return true;
+}
+
+bool
+Compiler::visitLOAD_S_BOTH(cell_t offsetForPri, cell_t offsetForAlt)
+{
+  visitLOAD_S(PawnReg::Pri, offsetForPri);
+  visitLOAD_S(PawnReg::Alt, offsetForAlt);
+  return true;
+}
+
+bool
+Compiler::visitLREF_S(PawnReg dest, cell_t srcoffs)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  if (CachedSlot* slot = findCachedSlot(srcoffs))
+    __ movl(reg, slot->reg);
+  else
+    __ movl(reg, Operand(frm, srcoffs));
+  __ movl(reg, Operand(dat, reg, NoScale));
+  return true;
+}
+
+bool
+Compiler::visitCONST(PawnReg dest, cell_t val)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ movl(reg, val);
+  return true;
+}
+
+bool
+Compiler::visitADDR(PawnReg dest, cell_t offset)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ movl(reg, frmAddr());
+  __ addl(reg, offset);
+  return true;
+}
+
+bool
+Compiler::visitSTOR(cell_t offset, PawnReg src)
+{
+  Register reg = (src == PawnReg::Pri) ? pri : alt;
+  __ movl(Operand(dat, offset), reg);
+  return true;
+}
+
+bool
+Compiler::visitSTOR_S(cell_t offset, PawnReg src)
+{
+  Register reg = (src == PawnReg::Pri) ? pri : alt;
+  CachedSlot* slot = findCachedSlot(offset);
+  if (!slot && isCacheableSlot(offset))
+    slot = cacheSlot(offset, false);
+  if (slot) {
+    __ movl(slot->reg, reg);
+    slot->dirty = true;
+    return true;
+  }
+  __ movl(Operand(frm, offset), reg);
+  return true;
+}
+
+bool
+Compiler::visitIDXADDR()
+{
+  __ leal(pri, Operand(alt, pri, ScaleFour));
+  return true;
+}
+
+bool
+Compiler::visitSREF_S(cell_t offset, PawnReg src)
+{
+  Register reg = (src == PawnReg::Pri) ? pri : alt;
+  __ movl(tmp, Operand(frm, offset));
+  __ movl(Operand(dat, tmp, NoScale), reg);
+  return true;
+}
+
+bool
+Compiler::visitPOP(PawnReg dest)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ movl(reg, Operand(stk, 0));
+  __ addq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitSWAP(PawnReg dest)
+{
+  Register reg = (dest == PawnReg::Pri) ? pri : alt;
+  __ movl(tmp, Operand(stk, 0));
+  __ movl(Operand(stk, 0), reg);
+  __ movl(reg, tmp);
+  return true;
+}
+
+bool
+Compiler::visitLIDX()
+{
+  __ leal(pri, Operand(alt, pri, ScaleFour));
+  __ movl(pri, Operand(dat, pri, NoScale));
+  return true;
+}
+
+bool
+Compiler::visitCONST(cell_t offset, cell_t value)
+{
+  __ movl(Operand(dat, offset), value);
+  return true;
+}
+
+bool
+Compiler::visitCONST_S(cell_t offset, cell_t value)
+{
+  CachedSlot* slot = findCachedSlot(offset);
+  if (!slot && isCacheableSlot(offset))
+    slot = cacheSlot(offset, false);
+  if (slot) {
+    __ movl(slot->reg, value);
+    slot->dirty = true;
+    return true;
+  }
+  __ movl(Operand(frm, offset), value);
+  return true;
+}
+
+bool
+Compiler::visitLOAD_I()
+{
+  emitCheckAddress(pri);
+  __ movl(pri, Operand(dat, pri, NoScale));
+  return true;
+}
+
+bool
+Compiler::visitSTOR_I()
+{
+  emitCheckAddress(alt);
+  __ movl(Operand(dat, alt, NoScale), pri);
+  return true;
+}
+
+bool
+Compiler::visitSDIV(PawnReg dest)
+{
+  Register dividend = (dest == PawnReg::Pri) ? pri : alt;
+  Register divisor = (dest == PawnReg::Pri) ? alt : pri;
+
+  // Guard against divide-by-zero.
+  __ testl(divisor, divisor);
+  jumpOnError(zero, SP_ERROR_DIVIDE_BY_ZERO);
+
+  // A more subtle case; -INT_MIN / -1 yields an overflow exception.
+  Label ok;
+  __ cmpl(divisor, -1);
+  __ j(not_equal, &ok);
+  __ cmpl(dividend, 0x80000000);
+  jumpOnError(equal, SP_ERROR_INTEGER_OVERFLOW);
+  __ bind(&ok);
+
+  // Now we can actually perform the divide.
+  __ movl(tmp, divisor);
+  if (dest == PawnReg::Pri)
+    __ movl(rdx, dividend);
+  else
+    __ movl(rax, dividend);
+  __ sarl(rdx, 31);
+  __ idivl(tmp);
+  return true;
+}
+
+bool
+Compiler::visitLODB_I(cell_t width)
+{
+  emitCheckAddress(pri);
+  __ movl(pri, Operand(dat, pri, NoScale));
+  if (width == 1)
+    __ andl(pri, 0xff);
+  else if (width == 2)
+    __ andl(pri, 0xffff);
+  return true;
+}
+
+bool
+Compiler::visitSTRB_I(cell_t width)
+{
+  emitCheckAddress(alt);
+  if (width == 1)
+    __ movb(Operand(dat, alt, NoScale), pri);
+  else if (width == 2)
+    __ movw(Operand(dat, alt, NoScale), pri);
+  else if (width == 4)
+    __ movl(Operand(dat, alt, NoScale), pri);
+  return true;
+}
+
+bool
+Compiler::visitRETN()
+{
+  // Restore the old frame pointer.
+  __ movl(frm, Operand(stk, 4));              // get the old frm
+  __ addq(stk, 8);                            // pop stack
+  __ movl(frmAddr(), frm);                    // store back old frm
+  __ addq(frm, dat);                          // relocate
+
+  // Remove parameters.
+  __ movl(tmp, Operand(stk, 0));
+  __ leaq(stk, Operand(stk, tmp, ScaleFour, 4));
+
+  if (inlining()) {
+    emitInlineReturn();
+    return true;
+  }
+
+  __ leaveFrame();
+  __ ret();
+  return true;
+}
+
+bool
+Compiler::visitMOVS(uint32_t amount)
+{
+  unsigned dwords = amount / 4;
+  unsigned bytes = amount % 4;
+
+  // rsi and rdi are non-volatile on Windows, so save them.
+  __ cld();
+  __ push(rsi);
+  __ push(rdi);
+  __ leaq(rdi, Operand(dat, alt, NoScale));
+  __ leaq(rsi, Operand(dat, pri, NoScale));
+  if (dwords) {
+    __ movl(rcx, dwords);
+    __ rep_movsd();
+  }
+  if (bytes) {
+    __ movl(rcx, bytes);
+    __ rep_movsb();
+  }
+  __ pop(rdi);
+  __ pop(rsi);
+  return true;
+}
+
+bool
+Compiler::visitFILL(uint32_t amount)
+{
+  // eax/pri is used implicitly.
+  unsigned dwords = amount / 4;
+  __ push(rdi);
+  __ leaq(rdi, Operand(dat, alt, NoScale));
+  __ movl(rcx, dwords);
+  __ cld();
+  __ rep_stosd();
+  __ pop(rdi);
+  return true;
+}
+
+bool
+Compiler::visitSTRADJUST_PRI()
+{
+  __ addl(pri, 4);
+  __ sarl(pri, 2);
+  return true;
+}
+
+bool
+Compiler::visitFABS()
+{
+  __ movl(pri, Operand(stk, 0));
+  __ andl(pri, 0x7fffffff);
+  __ addq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitFLOAT()
+{
+  __ cvtsi2ss(xmm0, Operand(stk, 0));
+  __ movd(pri, xmm0);
+  __ addq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitFLOATADD()
+{
+  __ movss(xmm0, Operand(stk, 0));
+  __ addss(xmm0, Operand(stk, 4));
+  __ movd(pri, xmm0);
+  __ addq(stk, 8);
+  return true;
+}
+
+bool
+Compiler::visitFLOATSUB()
+{
+  __ movss(xmm0, Operand(stk, 0));
+  __ subss(xmm0, Operand(stk, 4));
+  __ movd(pri, xmm0);
+  __ addq(stk, 8);
+  return true;
+}
+
+bool
+Compiler::visitFLOATMUL()
+{
+  __ movss(xmm0, Operand(stk, 0));
+  __ mulss(xmm0, Operand(stk, 4));
+  __ movd(pri, xmm0);
+  __ addq(stk, 8);
+  return true;
+}
+
+bool
+Compiler::visitFLOATDIV()
+{
+  __ movss(xmm0, Operand(stk, 0));
+  __ divss(xmm0, Operand(stk, 4));
+  __ movd(pri, xmm0);
+  __ addq(stk, 8);
+  return true;
+}
+
+bool
+Compiler::visitRND_TO_NEAREST()
+{
+  // Docs say that MXCSR must be preserved across function calls, so we
+  // assume that we'll always get the default round-to-nearest.
+  __ cvtss2si(pri, Operand(stk, 0));
+  __ addq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitRND_TO_CEIL()
+{
+  emitRoundWithMode(kMxcsrRoundUp);
+  return true;
+}
+
+bool
+Compiler::visitRND_TO_ZERO()
+{
+  __ cvttss2si(pri, Operand(stk, 0));
+  __ addq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitRND_TO_FLOOR()
+{
+  emitRoundWithMode(kMxcsrRoundDown);
+  return true;
+}
+
+// Convert the float on top of the stack with MXCSR temporarily set to a
+// different rounding mode. As with the x87 version, values that are out of
+// range become 0x80000000.
+void
+Compiler::emitRoundWithMode(int32_t mode)
+{
+  __ subq(rsp, 16);
+  __ stmxcsr(Operand(rsp, 0));
+  __ movl(tmp, Operand(rsp, 0));
+  __ andl(tmp, ~kMxcsrRoundingMask);
+  __ orl(tmp, mode);
+  __ movl(Operand(rsp, 4), tmp);
+  __ ldmxcsr(Operand(rsp, 4));
+  __ cvtss2si(pri, Operand(stk, 0));
+  __ ldmxcsr(Operand(rsp, 0));
+  __ addq(rsp, 16);
+  __ addq(stk, 4);
+}
+
+bool
+Compiler::visitFLOATCMP()
+{
+  // This is the old float cmp, which returns ordered results. In newly
+  // compiled code it should not be used or generated.
+  //
+  // Note that the checks here are inverted: the test is |rhs OP lhs|.
+  Label bl, ab, done;
+  __ movss(xmm0, Operand(stk, 4));
+  __ ucomiss(Operand(stk, 0), xmm0);
+  __ j(above, &ab);
+  __ j(below, &bl);
+  __ xorl(pri, pri);
+  __ jmp(&done);
+  __ bind(&ab);
+  __ movl(pri, -1);
+  __ jmp(&done);
+  __ bind(&bl);
+  __ movl(pri, 1);
+  __ bind(&done);
+  __ addq(stk, 8);
+  return true;
+}
+
+bool
+Compiler::visitFLOAT_CMP_OP(CompareOp op)
+{
+  ConditionCode code;
+  switch (op) {
+  case CompareOp::Sgrtr:
+    code = above;
+    break;
+  case CompareOp::Sgeq:
+    code = above_equal;
+    break;
+  case CompareOp::Sleq:
+    code = below_equal;
+    break;
+  case CompareOp::Sless:
+    code = below;
+    break;
+  case CompareOp::Eq:
+    code = equal;
+    break;
+  case CompareOp::Neq:
+    code = not_equal;
+    break;
+  default:
+    assert(false);
+    reportError(SP_ERROR_INVALID_INSTRUCTION);
+    return false;
+  }
+  emitFloatCmp(code);
+  return true;
+}
+
+bool
+Compiler::visitFLOAT_NOT()
+{
+  __ xorps(xmm0, xmm0);
+  __ ucomiss(Operand(stk, 0), xmm0);
+
+  // See emitFloatCmp() - this is a shorter version.
+  Label done;
+  __ movl(pri, 1);
+  __ j(parity, &done);
+  __ set(zero, pri);
+  __ bind(&done);
+
+  __ addq(stk, 4);
+  return true;
+}
+
+bool
+Compiler::visitSTACK(cell_t amount)
+{
+  __ addq(stk, amount);
+
+  if (amount > 0) {
+    // Check if the stack went beyond the stack top - usually a compiler error.
+    __ movq(tmp, AddressValue(context_->memory() + context_->HeapSize()));
+    __ cmpq(stk, tmp);
+    jumpOnError(not_below, SP_ERROR_STACKMIN);
+  } else {
+    // Check if the stack is going to collide with the heap.
+    __ movl(tmp, hpAddr());
+    __ leaq(tmp, Operand(dat, tmp, NoScale, STACK_MARGIN));
+    __ cmpq(stk, tmp);
+    jumpOnError(below, SP_ERROR_STACKLOW);
+  }
+  return true;
+}
+
+bool
+Compiler::visitHEAP(cell_t amount)
+{
+  __ movl(alt, hpAddr());
+  __ addl(hpAddr(), amount);
+
+  if (amount < 0) {
+    __ cmpl(hpAddr(), context_->DataSize());
+    jumpOnError(below, SP_ERROR_HEAPMIN);
+  } else {
+    __ movl(tmp, hpAddr());
+    __ leaq(tmp, Operand(dat, tmp, NoScale, STACK_MARGIN));
+    __ cmpq(tmp, stk);
+    jumpOnError(above, SP_ERROR_HEAPLOW);
+  }
+  return true;
+}
+
+bool
+Compiler::visitJUMP(cell_t offset)
+{
+  Label *target = labelAt(offset);
+  if (target->bound()) {
+    if (tiersUp())
+      emitTierUpCount(1);
+    emitLoopEdge(offset);
+  }
+  __ jmp(target);
+  return true;
+}
+
+bool
+Compiler::visitJcmp(CompareOp op, cell_t offset)
+{
+  Label *target = labelAt(offset);
+  if (target->bound()) {
+    if (tiersUp())
+      emitTierUpCount(1);
+    emitLoopEdge(offset);
+  }
+
+  switch (op) {
+  case CompareOp::Zero:
+  case CompareOp::NotZero:
+  {
+    ConditionCode cc = (op == CompareOp::Zero) ? zero : not_zero;
+    __ testl(pri, pri);
+    __ j(cc, target);
+    break;
+  }
+
+  case CompareOp::Eq:
+  case CompareOp::Neq:
+  case CompareOp::Sless:
+  case CompareOp::Sleq:
+  case CompareOp::Sgrtr:
+  case CompareOp::Sgeq:
+  {
+    ConditionCode cc = OpToCondition(op);
+    __ cmpl(pri, alt);
+    __ j(cc, target);
+    break;
+  }
+  default:
+    assert(false);
+    break;
+  }
+  return true;
+}
+
+bool
+Compiler::visitTRACKER_PUSH_C(cell_t amount)
+{
+  __ push(pri);
+  __ push(alt);
+
+  __ movl(ArgReg1, amount);
+  __ movq(ArgReg0, AddressValue(rt_->GetBaseContext()));
+  __ callWithABI(AddressValue((void *)InvokePushTracker));
+  __ testl(rax, rax);
+  jumpOnError(not_zero);
+
+  __ pop(alt);
+  __ pop(pri);
+  return true;
+}
+
+bool
+Compiler::visitTRACKER_POP_SETHEAP()
+{
+  // Save registers.
+  __ push(pri);
+  __ push(alt);
+
+  // Get the context pointer and call the sanity checker.
+  __ movq(ArgReg0, AddressValue(rt_->GetBaseContext()));
+  __ callWithABI(AddressValue((void *)InvokePopTrackerAndSetHeap));
+  __ testl(rax, rax);
+  jumpOnError(not_zero);
+
+  __ pop(alt);
+  __ pop(pri);
+  return true;
+}
+
+bool
+Compiler::visitHALT(cell_t value)
+{
+  // We don't support this. It's included in the bytestream by default, but it
+  // must be unreachable.
+  reportError(SP_ERROR_INVALID_INSTRUCTION);
+  return false;
+}
+
+bool
+Compiler::visitBOUNDS(uint32_t limit)
+{
+  if (boundsCheckIsRedundant())
+    return true;
+
+  OutOfBoundsErrorPath* bounds = new OutOfBoundsErrorPath(op_cip_, inlinedAt(), limit);
+  if (!ool_paths_.append(bounds)) {
+    reportError(SP_ERROR_OUT_OF_MEMORY);
+    return false;
+  }
+
+  __ cmpl(pri, limit);
+  __ j(above, bounds->label());
+  return true;
+}
+
+void
+Compiler::emitCheckAddress(Register reg)
+{
+  // Check if we're in memory bounds.
+  __ cmpl(reg, context_->HeapSize());
+  jumpOnError(not_below, SP_ERROR_MEMACCESS);
+
+  // Check if we're in the invalid region between hp and sp.
+  Label done;
+  __ cmpl(reg, hpAddr());
+  __ j(below, &done);
+  __ leaq(tmp, Operand(dat, reg, NoScale));
+  __ cmpq(tmp, stk);
+  jumpOnError(below, SP_ERROR_MEMACCESS);
+  __ bind(&done);
+}
+
+// Taken when the heap tracker is full, so the push has to call out and grow
+// it. Rejoins with the size of the array, in bytes, in tmp.
+class GrowTrackerPath : public OutOfLinePath
+{
+ public:
+  explicit GrowTrackerPath(ErrorPath* error)
+   : error(error)
+  {
+  }
+
+  bool emit(Compiler* cc) override {
+    cc->emitGrowTrackerPath(this);
+    return true;
+  }
+
+  Label* rejoin() {
+    return &rejoin_;
+  }
+
+  ErrorPath* error;
+
+ private:
+  Label rejoin_;
+};
+
+bool
+Compiler::visitGENARRAY(uint32_t dims, bool autozero)
+{
+  if (dims == 1)
+  {
+    // flat array; we can generate this without indirection tables, or any
+    // calls unless the tracker is full.
+    // Note that we can overwrite ALT because technically STACK should be destroying ALT
+    ErrorPath* error = new ErrorPath(op_cip_, inlinedAt(), 0);
+    GrowTrackerPath* grow = new GrowTrackerPath(error);
+    if (!ool_paths_.append(error) || !ool_paths_.append(grow)) {
+      reportError(SP_ERROR_OUT_OF_MEMORY);
+      return false;
+    }
+
+    // The size must be positive, and its size in bytes must fit in a cell.
+    __ movl(tmp, Operand(stk, 0));
+    __ leal(alt, Operand(tmp, -1));
+    __ cmpl(alt, 0x3ffffffe);
+    jumpOnError(above, SP_ERROR_ARRAY_TOO_BIG);
+
+    // hp + bytes is computed in 64 bits, so it can't wrap past the stack.
+    __ shll(tmp, 2);
+    __ movl(alt, hpAddr());
+    __ movl(Operand(stk, 0), alt);    // store base of the array into the stack.
+    __ addq(alt, tmp);
+    __ movl(hpAddr(), alt);
+    __ addq(alt, dat);
+    __ cmpq(alt, stk);
+    jumpOnError(not_below, SP_ERROR_HEAPLOW);
+
+    // Push the size onto the tracker.
+    __ movq(alt, trackerCurAddr());
+    __ cmpq(alt, trackerLimitAddr());
+    __ j(not_below, grow->label());
+    __ movl(Operand(alt, 0), tmp);
+    __ addq(alt, sizeof(ucell_t));
+    __ movq(trackerCurAddr(), alt);
+    __ bind(grow->rejoin());
+
+    if (autozero) {
+      // rep stos needs rax and rdi, which are pri and an argument register.
+      __ shrl(tmp, 2);
+      __ movl(alt, pri);
+      __ movq(scratch1, rdi);
+      __ xorl(rax, rax);
+      __ movl(rdi, Operand(stk, 0));
+      __ addq(rdi, dat);
+      __ cld();
+      __ rep_stosd();
+      __ movq(rdi, scratch1);
+      __ movl(pri, alt);
+    }
+  } else {
+    __ push(pri);
+    __ subq(rsp, 8);
+
+    // int GenerateArray(cx, vars[], uint32_t, cell_t *, int, unsigned *);
+    __ movl(ArgReg3, autozero ? 1 : 0);
+    __ movq(ArgReg2, stk);
+    __ movl(ArgReg1, dims);
+    __ movq(ArgReg0, AddressValue(context_));
+    __ callWithABI(AddressValue((void *)InvokeGenerateFullArray));
+    __ addq(rsp, 8);
+
+    // restore pri to tmp
+    __ pop(tmp);
+
+    __ testl(rax, rax);
+    jumpOnError(not_zero);
+
+    // Move tmp back to pri, remove pushed args.
+    __ movl(pri, tmp);
+    __ addq(stk, (dims - 1) * 4);
+  }
+  return true;
+}
+
+class CallThunk : public OutOfLinePath
+{
+ public:
+  CallThunk(cell_t pcode_offset)
+   : pcode_offset(pcode_offset)
+  {
+  }
+
+  bool emit(Compiler* cc) override {
+    cc->emitCallThunk(this);
+    return true;
+  }
+
+  // Compiled code can be further than 2GB away, so call sites go through an
+  // absolute address, which is what gets patched.
+  CodeLabel* address() {
+    return &address_;
+  }
+
+  cell_t pcode_offset;
+
+ private:
+  CodeLabel address_;
+};
+
+bool
+Compiler::visitCALL(cell_t offset)
+{
+  // Inlined calls are safepoints too, as in the interpreter.
+  emitInterruptCheck();
+  if (emitInlineCall(offset))
+    return !error_;
+
+  emitCallTo(offset);
+  return !error_;
+}
+
+void
+Compiler::emitCallTo(cell_t offset)
+{
+  RefPtr<MethodInfo> method = linksDirectly() ? rt_->GetMethod(offset) : nullptr;
+  CompiledFunction* fun = method ? method->bestJit() : nullptr;
+  if (!fun) {
+    // Need to emit a delayed thunk.
+    CallThunk* thunk = new CallThunk(offset);
+    __ movq(scratch1, thunk->address());
+    __ call(scratch1);
+    emitCallSite(offset);
+    if (!ool_paths_.append(thunk)) {
+      reportError(SP_ERROR_OUT_OF_MEMORY);
+      return;
+    }
+  } else {
+    // Function is already emitted, we can do a direct call.
+    __ call(AddressValue(fun->GetEntryAddress()));
+  }
+
+  // Map the return address to the cip that started this call.
+  emitCipMapping(op_cip_);
+}
+
+void
+Compiler::emitGrowTrackerPath(GrowTrackerPath* path)
+{
+  // Save pri and the byte count across the call.
+  __ push(pri);
+  __ push(tmp);
+  __ movl(ArgReg1, tmp);
+  __ movq(ArgReg0, AddressValue(rt_->GetBaseContext()));
+  __ callWithABI(AddressValue((void *)InvokePushTracker));
+  __ pop(tmp);
+  __ pop(alt);
+  __ testl(rax, rax);
+  __ j(not_zero, path->error->label());
+  __ movl(pri, alt);
+  __ jmp(path->rejoin());
+}
+
+void
+Compiler::emitCallThunk(CallThunk* thunk)
+{
+  __ bind(thunk->address());
+
+  // Enter the exit frame. This aligns the stack.
+  __ enterExitFrame(ExitFrameType::Helper, 0);
+
+  // Reserve a slot for the address CompileFromThunk returns. The return
+  // address is the call that we need to patch.
+  __ subq(rsp, 16);
+  __ movq(ArgReg3, Operand(rbp, 8));
+  __ movq(ArgReg2, rsp);
+  __ movl(ArgReg1, thunk->pcode_offset);
+  __ movq(ArgReg0, AddressValue(context_));
+  __ callWithABI(AddressValue((void *)CompileFromThunk));
+  __ movq(scratch1, Operand(rsp, 0));
+  __ leaveExitFrame();
+
+  __ testl(rax, rax);
+  jumpOnError(not_zero);
+
+  // If we got an address back, the callee is compiled.
+  Label interpret;
+  __ testq(scratch1, scratch1);
+  __ j(zero, &interpret);
+  __ jmp(scratch1);
+
+  // Otherwise, the callee is still cold and must run in the interpreter. The
+  // return address is on top of the stack again, so build a new exit frame.
+  __ bind(&interpret);
+  __ enterExitFrame(ExitFrameType::Helper, 0);
+
+  // Update the context's view of the stack, so the interpreter can find the
+  // arguments.
+  __ movq(tmp, stk);
+  __ subq(tmp, dat);
+  __ movl(spAddr(), tmp);
+
+  // Three arguments, plus a slot for the return value.
+  __ subq(rsp, 16);
+  __ movq(ArgReg2, rsp);
+  __ movl(ArgReg1, thunk->pcode_offset);
+  __ movq(ArgReg0, AddressValue(context_));
+  __ callWithABI(AddressValue((void *)InterpretFromThunk));
+  __ movl(pri, Operand(rsp, 0));
+
+  // The interpreter popped the arguments, so reload stk.
+  __ movl(stk, spAddr());
+  __ addq(stk, dat);
+  __ leaveExitFrame();
+
+  // Check for errors. As with natives, the error has already been reported.
+  __ cmpl(AddressOperand(Environment::get()->addressOfExceptionCode()), 0);
+  __ j(not_zero, &return_reported_error_);
+  __ ret();
+}
+
+bool
+Compiler::visitSYSREQ_N(uint32_t native_index, uint32_t nparams)
+{
+  NativeEntry* native = rt_->NativeAt(native_index);
+  if (fastNativeFor(native, nparams)) {
+    emitFastNativeCall(native_index, native, nparams);
+    return true;
+  }
+
+  // Store the number of parameters on the stack.
+  __ movl(Operand(stk, -4), nparams);
+  __ subq(stk, 4);
+  emitLegacyNativeCall(native_index, native);
+  __ addq(stk, (nparams + 1) * sizeof(cell_t));
+  return true;
+}
+
+// Call a native's fast function, with its arguments in registers and no
+// exit frame. If it asks for the fallback, call the native normally.
+void
+Compiler::emitFastNativeCall(uint32_t native_index, NativeEntry* native, uint32_t nparams)
+{
+  const sp_fastnativeinfo_t* info = native->fast;
+
+  // Save ALT, and make room for the fallback flag. Two words keep the stack
+  // aligned.
+  __ push(alt);
+  __ push(alt);
+  __ movl(Operand(rsp, 0), 0);
+  __ movq(ArgReg0, rsp);
+
+  // Win64 assigns argument registers by position; SysV numbers integer and
+  // float registers separately.
+  static const Register kIntArgs[] = { ArgReg1, ArgReg2, ArgReg3 };
+#if defined(KE_WINDOWS)
+  static const FloatRegister kFloatArgs[] = { xmm1, xmm2, xmm3 };
+#else
+  static const FloatRegister kFloatArgs[] = { xmm0, xmm1, xmm2 };
+#endif
+  uint32_t int_args = 0, float_args = 0;
+  for (uint32_t i = 0; i < nparams; i++) {
+    Operand arg(stk, i * sizeof(cell_t));
+    if (info->param_kinds[i] == SP_FASTARG_FLOAT)
+      __ movss(kFloatArgs[float_args++], arg);
+    else
+      __ movl(kIntArgs[int_args++], arg);
+#if defined(KE_WINDOWS)
+    int_args = float_args = i + 1;
+#endif
+  }
+
+  __ callWithABI(AddressValue(info->fast));
+  if (info->return_kind == SP_FASTARG_FLOAT)
+    __ movd(pri, xmm0);
+  else
+    __ movl(pri, pri);
+
+  // Pop the flag, then ALT. Neither changes the flags.
+  Label done;
+  __ cmpl(Operand(rsp, 0), 0);
+  __ pop(alt);
+  __ pop(alt);
+  __ j(zero, &done);
+
+  __ movl(Operand(stk, -4), nparams);
+  __ subq(stk, 4);
+  emitLegacyNativeCall(native_index, native);
+  __ addq(stk, sizeof(cell_t));
+  __ bind(&done);
+  __ addq(stk, nparams * sizeof(cell_t));
+}
+
+bool
+Compiler::visitINTRINSIC_N(uint32_t native_index, uint32_t nparams,
+                           const sp_intrinsic_t* intrinsic)
+{
+  uses_intrinsics_ = true;
+
+  // Emitters take their arguments in PRI and ALT, and may clobber ALT.
+  if (intrinsic->emitter && nparams == intrinsic->nparams) {
+    __ push(alt);
+    if (nparams >= 1)
+      __ movl(pri, Operand(stk, 0));
+    if (nparams >= 2)
+      __ movl(alt, Operand(stk, 4));
+    bool emitted = intrinsic->emitter(masm);
+    __ pop(alt);
+    if (emitted) {
+      __ addq(stk, nparams * sizeof(cell_t));
+      return true;
+    }
+  }
+
+  // Otherwise, call the fallback with a native-style parameter array. It
+  // can't fail or call back into the VM, so no exit frame is needed.
+  __ movl(Operand(stk, -4), nparams);
+  __ subq(stk, 4);
+
+  // Save ALT. Two words keep the stack aligned.
+  __ push(alt);
+  __ push(alt);
+  __ movq(ArgReg0, stk);
+  __ callWithABI(AddressValue((void *)intrinsic->fallback));
+  __ movl(pri, pri);
+  __ pop(alt);
+  __ pop(alt);
+
+  __ addq(stk, (nparams + 1) * sizeof(cell_t));
+  return true;
+}
+
+bool
+Compiler::visitSYSREQ_C(uint32_t native_index)
+{
+  emitLegacyNativeCall(native_index, rt_->NativeAt(native_index));
+  return true;
+}
+
+void
+Compiler::emitLegacyNativeCall(uint32_t native_index, NativeEntry* native)
+{
+  CodeLabel return_address;
+  __ enterInlineExitFrame(ExitFrameType::Native, native_index, &return_address);
+
+  // Save ALT and the old heap pointer. Two words keep the stack aligned.
+  __ push(alt);
+  __ movl(tmp, hpAddr());
+  __ push(tmp);
+
+  // Check whether the native is bound.
+  bool immutable = linksDirectly() &&
+                   native->status == SP_NATIVE_BOUND &&
+                   !(native->flags & (SP_NTVFLAG_EPHEMERAL|SP_NTVFLAG_OPTIONAL));
+  if (!immutable) {
+    __ movq(scratch1, AddressOperand(&native->legacy_fn));
+    __ testq(scratch1, scratch1);
+    jumpOnError(zero, SP_ERROR_INVALID_NATIVE);
+  }
+
+  // The last parameter for the C++ function is our absolute stk.
+  __ movq(ArgReg1, stk);
+
+  // Relocate our absolute stk to be dat-relative, and update the context's
+  // view.
+  __ subq(stk, dat);
+  __ movl(spAddr(), stk);
+
+  // The first parameter is the context.
+  __ movq(ArgReg0, AddressValue(rt_->GetBaseContext()));
+
+  // Invoke the native.
+  if (immutable)
+    __ callWithABI(AddressValue((void *)native->legacy_fn));
+  else
+    __ callWithABI(scratch1);
+  __ bind(&return_address);
+  // Map the return address to the cip that initiated this call.
+  emitCipMapping(op_cip_);
+
+  // Natives return a cell, so the upper half of rax is undefined.
+  __ movl(pri, pri);
+
+  // Restore the heap pointer and ALT.
+  __ pop(tmp);
+  __ movl(hpAddr(), tmp);
+  __ pop(alt);
+
+  // Restore SP.
+  __ addq(stk, dat);
+
+  __ leaveInlineExitFrame();
+
+  // Check for errors. Note we jump directly to the return stub since the
+  // error has already been reported.
+  __ cmpl(AddressOperand(Environment::get()->addressOfExceptionCode()), 0);
+  __ j(not_zero, &return_reported_error_);
+}
+
+bool
+Compiler::visitSWITCH(cell_t defaultOffset,
+                      const CaseTableEntry* cases,
+                      size_t ncases)
+{
+  Label *defaultCase = labelAt(defaultOffset);
+
+  // Degenerate - 0 cases.
+  if (!ncases) {
+    __ jmp(defaultCase);
+    return true;
+  }
+
+  ke::Vector<CaseTableEntry> sorted;
+  ke::Vector<SwitchCluster> clusters;
+  PlanSwitch(cases, ncases, &sorted, &clusters);
+
+  emitSwitchTree(sorted, clusters, 0, clusters.length(), defaultCase);
+  return true;
+}
+
+// Binary search over the clusters, by their lowest value, down to one.
+void
+Compiler::emitSwitchTree(const ke::Vector<CaseTableEntry>& cases,
+                         const ke::Vector<SwitchCluster>& clusters,
+                         size_t first, size_t last,
+                         Label* defaultCase)
+{
+  if (last - first == 1) {
+    emitSwitchCluster(cases, clusters[first], defaultCase);
+    return;
+  }
+
+  size_t mid = first + (last - first) / 2;
+
+  Label lower;
+  __ cmpl(pri, clusters[mid].low);
+  __ j(less, &lower);
+  emitSwitchTree(cases, clusters, mid, last, defaultCase);
+  __ bind(&lower);
+  emitSwitchTree(cases, clusters, first, mid, defaultCase);
+}
+
+void
+Compiler::emitSwitchCluster(const ke::Vector<CaseTableEntry>& cases,
+                            const SwitchCluster& cluster,
+                            Label* defaultCase)
+{
+  if (!cluster.jump_table) {
+    for (size_t i = cluster.first; i < cluster.first + cluster.ncases; i++) {
+      __ cmpl(pri, cases[i].value);
+      __ j(equal, labelAt(cases[i].address));
+    }
+    __ jmp(defaultCase);
+    return;
+  }
+
+  // Rebase to zero, so one unsigned compare checks both bounds.
+  if (cluster.low != 0)
+    __ leal(tmp, Operand(pri, int32_t(0 - uint32_t(cluster.low))));
+  else
+    __ movl(tmp, pri);
+  __ cmpl(tmp, cluster.high - cluster.low);
+  __ j(above, defaultCase);
+
+  // Each entry is the offset of its target from the end of the entry. Gaps
+  // go to the default case.
+  CodeLabel table;
+  __ movq(scratch1, &table);
+  __ movsxd(scratch2, Operand(scratch1, tmp, ScaleFour));
+  __ leaq(scratch1, Operand(scratch1, tmp, ScaleFour, 4));
+  __ addq(scratch1, scratch2);
+  __ jmp(scratch1);
+
+  __ bind(&table);
+  size_t next = cluster.first;
+  for (int64_t value = cluster.low; value <= cluster.high; value++) {
+    if (cases[next].value == value) {
+      __ emit_relative_address(labelAt(cases[next].address));
+      next++;
+    } else {
+      __ emit_relative_address(defaultCase);
+    }
+  }
+}
+
+void
+Compiler::emitFloatCmp(ConditionCode cc)
+{
+  unsigned lhs = 4;
+  unsigned rhs = 0;
+  if (cc == below || cc == below_equal) {
+    // NaN results in ZF=1 PF=1 CF=1
+    //
+    // ja/jae check for ZF,CF=0 and CF=0. If we make all relational compares
+    // look like ja/jae, we'll guarantee all NaN comparisons will fail (which
+    // would not be true for jb/jbe, unless we checked with jp).
+    if (cc == below)
+      cc = above;
+    else
+      cc = above_equal;
+    rhs = 4;
+    lhs = 0;
+  }
+
+  __ movss(xmm0, Operand(stk, rhs));
+  __ ucomiss(Operand(stk, lhs), xmm0);
+
+  // An equal or not-equal needs special handling for the parity bit.
+  if (cc == equal || cc == not_equal) {
+    // If NaN, PF=1, ZF=1, and E/Z tests ZF=1.
+    //
+    // If NaN, PF=1, ZF=1 and NE/NZ tests Z=0. But, we want any != with NaNs
+    // to return true, including NaN != NaN.
+    //
+    // To make checks simpler, we set |eax| to the expected value of a NaN
+    // beforehand. This also clears the top bits of |eax| for setcc.
+    Label done;
+    __ movl(pri, (cc == equal) ? 0 : 1);
+    __ j(parity, &done);
+    __ set(cc, pri);
+    __ bind(&done);
+  } else {
+    __ movl(pri, 0);
+    __ set(cc, pri);
+  }
+  __ addq(stk, 8);
+}
+
+void
+Compiler::jumpOnError(ConditionCode cc, int err)
+{
+  // Note: we accept 0 for err. In this case we expect the error to be in eax.
+  ErrorPath* path = new ErrorPath(op_cip_, inlinedAt(), err);
+  if (!ool_paths_.append(path))
+    reportError(SP_ERROR_OUT_OF_MEMORY);
+
+  __ j(cc, path->label());
+}
+
+void
+Compiler::emitOutOfBoundsErrorPath(OutOfBoundsErrorPath* path)
+{
+  CodeLabel return_address;
+  __ alignStack();
+  __ enterInlineExitFrame(ExitFrameType::Helper, 0, &return_address);
+  __ movl(ArgReg1, path->bounds);
+  __ movl(ArgReg0, pri);
+  __ callWithABI(AddressValue((void *)ReportOutOfBoundsError));
+  __ bind(&return_address);
+  emitCipMapping(path->cip, path->inlined_at);
+  __ leaveInlineExitFrame();
+  __ jmp(&return_reported_error_);
+}
+
+void
+Compiler::emitInterruptCheck()
+{
+  InterruptPath* path = new InterruptPath(op_cip_, inlinedAt());
+  if (!ool_paths_.append(path)) {
+    reportError(SP_ERROR_OUT_OF_MEMORY);
+    return;
+  }
+
+  __ cmpl(AddressOperand(env_->addressOfInterrupts()), 0);
+  __ j(not_equal, path->label());
+  __ bind(path->rejoin());
+}
+
+// Values may be live in any register here, including the ones optimized code
+// allocates, so everything the call can clobber is saved. There are eight,
+// which keeps the stack aligned.
+static const Register kInterruptSavedRegs[] = { rax, rdx, rsi, rdi, r8, r9, r10, r11 };
+static const size_t kNumInterruptSavedRegs =
+  sizeof(kInterruptSavedRegs) / sizeof(kInterruptSavedRegs[0]);
+
+void
+Compiler::emitInterruptPath(InterruptPath* path)
+{
+  for (size_t i = 0; i < kNumInterruptSavedRegs; i++)
+    __ push(kInterruptSavedRegs[i]);
+
+  // The handler may call back into the plugin, so update the context's view
+  // of the stack first.
+  __ movq(r8, stk);
+  __ subq(r8, dat);
+  __ movl(spAddr(), r8);
+
+  CodeLabel return_address;
+  __ enterInlineExitFrame(ExitFrameType::Helper, 0, &return_address);
+  __ movq(ArgReg0, AddressValue(context_));
+  __ callWithABI(AddressValue((void *)InvokeHandleInterrupts));
+  __ bind(&return_address);
+  emitCipMapping(path->cip, path->inlined_at);
+  __ leaveInlineExitFrame();
+  __ movl(tmp, rax);
+
+  for (size_t i = kNumInterruptSavedRegs; i > 0; i--)
+    __ pop(kInterruptSavedRegs[i - 1]);
+
+  __ testl(tmp, tmp);
+  __ j(not_zero, &return_reported_error_);
+  __ jmp(path->rejoin());
+}
+
+void
+Compiler::emitErrorHandlers()
+{
+  Label return_to_invoke;
+
+  if (report_error_.used()) {
+    __ bind(&report_error_);
+
+    // Create the exit frame. We always get here through a call from the opcode
+    // (and always via an out-of-line thunk).
+    __ enterExitFrame(ExitFrameType::Helper, 0);
+
+    __ movl(ArgReg0, rax);
+    __ callWithABI(AddressValue((void *)InvokeReportError));
+    __ leaveExitFrame();
+    __ jmp(&return_to_invoke);
+  }
+
+  // We get here if we know an exception is already pending.
+  if (return_reported_error_.used()) {
+    __ bind(&return_reported_error_);
+    __ call(&return_to_invoke);
+  }
+
+  if (return_to_invoke.used()) {
+    __ bind(&return_to_invoke);
+
+    // We get here either through an explicit call, or a call that terminated
+    // in a tail-jmp here. The stack may not be aligned, but it is about to be
+    // discarded anyway.
+    __ enterExitFrame(ExitFrameType::Helper, 0);
+    __ alignStack();
+
+    // We cannot jump to the return stub just yet. We could be multiple frames
+    // deep, and our |rbp| does not match the initial frame. Find and restore
+    // it now.
+    __ callWithABI(AddressValue((void *)find_entry_fp));
+    __ leaveExitFrame();
+
+    __ movq(rbp, rax);
+    __ jmp(AddressValue(env_->stubs()->ReturnStub()));
+  }
+}
+
+void
+Compiler::emitThrowPath(int err)
+{
+  __ movl(rax, err);
+  __ jmp(&report_error_);
+}
+
+void
+CompilerBase::PatchCallThunk(uint8_t* pc, void* target)
+{
+  // The call site is "movq scratch1, imm64; call scratch1", and the call is
+  // three bytes long.
+  *reinterpret_cast<void**>(pc - 3 - sizeof(void*)) = target;
+}
+
+} // namespace sp
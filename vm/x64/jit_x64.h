@@ -0,0 +1,234 @@
+// vim: set sts=2 ts=8 sw=2 tw=99 et:
+//
+// Copyright (C) 2006-2015 AlliedModders LLC
+//
+// This file is part of SourcePawn. SourcePawn is free software: you can
+// redistribute it and/or modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+//
+// You should have received a copy of the GNU General Public License along with
+// SourcePawn. If not, see http://www.gnu.org/licenses/.
+//
+#ifndef _include_sourcepawn_vm_jit_x64_h_
+#define _include_sourcepawn_vm_jit_x64_h_
+
+#include <sp_vm_types.h>
+#include <sp_vm_api.h>
+#include <am-vector.h>
+#include "jit.h"
+#include "plugin-runtime.h"
+#include "plugin-context.h"
+#include "compiled-function.h"
+#include "opcodes.h"
+#include "macro-assembler.h"
+#include "constants-x64.h"
+
+using namespace SourcePawn;
+
+namespace sp {
+class LegacyImage;
+class Environment;
+class CompiledFunction;
+class CallThunk;
+class GrowTrackerPath;
+class TierUpPath;
+
+// A frame slot whose value is held in a register. See Compiler::emitBeforeInstruction().
+struct CachedSlot
+{
+  CachedSlot()
+   : offset(0),
+     valid(false),
+     dirty(false),
+     last_use(0)
+  {}
+
+  Register reg;
+  cell_t offset;
+  bool valid;
+  // Set if the register is newer than the frame.
+  bool dirty;
+  uint32_t last_use;
+};
+
+// Cells are 32 bits wide, so pri and alt only ever hold zero-extended 32-bit
+// values, and can be used directly as indexes off |dat|. |stk| and |frm|
+// hold absolute addresses.
+class Compiler : public CompilerBase
+{
+  friend class CallThunk;
+  friend class GrowTrackerPath;
+  friend class TierUpPath;
+  friend class OutOfBoundsErrorPath;
+  friend class InterruptPath;
+
+ public:
+  Compiler(PluginRuntime *rt, cell_t pcode_offs);
+  ~Compiler();
+
+  bool visitLOAD(PawnReg dest, cell_t srcaddr) override;
+  bool visitLOAD_S(PawnReg dest, cell_t srcoffs) override;
+  bool visitLREF_S(PawnReg dest, cell_t srcoffs) override;
+  bool visitLOAD_I() override;
+  bool visitLODB_I(cell_t width) override;
+  bool visitCONST(PawnReg dest, cell_t imm) override;
+  bool visitADDR(PawnReg dest, cell_t offset) override;
+  bool visitSTOR(cell_t offset, PawnReg src) override;
+  bool visitSTOR_S(cell_t offset, PawnReg src) override;
+  bool visitSREF_S(cell_t offset, PawnReg src) override;
+  bool visitSTOR_I() override;
+  bool visitSTRB_I(cell_t width) override;
+  bool visitLIDX() override;
+  bool visitIDXADDR() override;
+  bool visitMOVE(PawnReg reg) override;
+  bool visitXCHG() override;
+  bool visitPUSH(PawnReg src) override;
+  bool visitPUSH_C(const cell_t* val, size_t nvals) override;
+  bool visitPUSH(const cell_t* offsets, size_t nvals) override;
+  bool visitPUSH_S(const cell_t* offsets, size_t nvals) override;
+  bool visitPOP(PawnReg dest) override;
+  bool visitSTACK(cell_t amount) override;
+  bool visitHEAP(cell_t amount) override;
+  bool visitRETN() override;
+  bool visitCALL(cell_t offset) override;
+  bool visitJUMP(cell_t offset) override;
+  bool visitJcmp(CompareOp op, cell_t offset) override;
+  bool visitSHL() override;
+  bool visitSHR() override;
+  bool visitSSHR() override;
+  bool visitSHL_C(PawnReg dest, cell_t amount) override;
+  bool visitSMUL() override;
+  bool visitSDIV(PawnReg dest) override;
+  bool visitADD() override;
+  bool visitSUB() override;
+  bool visitSUB_ALT() override;
+  bool visitAND() override;
+  bool visitOR() override;
+  bool visitXOR() override;
+  bool visitNOT() override;
+  bool visitNEG() override;
+  bool visitINVERT() override;
+  bool visitADD_C(cell_t value) override;
+  bool visitSMUL_C(cell_t value) override;
+  bool visitZERO(PawnReg dest) override;
+  bool visitZERO(cell_t offset) override;
+  bool visitZERO_S(cell_t offset) override;
+  bool visitCompareOp(CompareOp op) override;
+  bool visitEQ_C(PawnReg src, cell_t value) override;
+  bool visitINC(PawnReg dest) override;
+  bool visitINC(cell_t offset) override;
+  bool visitINC_S(cell_t offset) override;
+  bool visitINC_I() override;
+  bool visitDEC(PawnReg dest) override;
+  bool visitDEC(cell_t offset) override;
+  bool visitDEC_S(cell_t offset) override;
+  bool visitDEC_I() override;
+  bool visitMOVS(uint32_t amount) override;
+  bool visitFILL(uint32_t amount) override;
+  bool visitBOUNDS(uint32_t limit) override;
+  bool visitSYSREQ_C(uint32_t native_index) override;
+  bool visitSWAP(PawnReg dest) override;
+  bool visitPUSH_ADR(const cell_t* offsets, size_t nvals) override;
+  bool visitSYSREQ_N(uint32_t native_index, uint32_t nparams) override;
+  bool visitINTRINSIC_N(uint32_t native_index, uint32_t nparams,
+                        const sp_intrinsic_t* intrinsic) override;
+  bool visitLOAD_BOTH(cell_t offsetForPri, cell_t offsetForAlt) override;
+  bool visitLOAD_S_BOTH(cell_t offsetForPri, cell_t offsetForAlt) override;
+  bool visitCONST(cell_t offset, cell_t value) override;
+  bool visitCONST_S(cell_t offset, cell_t value) override;
+  bool visitTRACKER_PUSH_C(cell_t amount) override;
+  bool visitTRACKER_POP_SETHEAP() override;
+  bool visitGENARRAY(uint32_t dims, bool autozero) override;
+  bool visitSTRADJUST_PRI() override;
+  bool visitFABS() override;
+  bool visitFLOAT() override;
+  bool visitFLOATADD() override;
+  bool visitFLOATSUB() override;
+  bool visitFLOATMUL() override;
+  bool visitFLOATDIV() override;
+  bool visitRND_TO_NEAREST() override;
+  bool visitRND_TO_FLOOR() override;
+  bool visitRND_TO_CEIL() override;
+  bool visitRND_TO_ZERO() override;
+  bool visitFLOATCMP() override;
+  bool visitFLOAT_CMP_OP(CompareOp op) override;
+  bool visitFLOAT_NOT() override;
+  bool visitHALT(cell_t value) override;
+  bool visitSWITCH(
+    cell_t defaultOffset,
+    const CaseTableEntry* cases,
+    size_t ncases) override;
+
+ protected:
+  void emitPrologue() override;
+  void emitPushFrame() override;
+  void emitThrowPath(int err) override;
+  void emitErrorHandlers() override;
+  void emitOutOfBoundsErrorPath(OutOfBoundsErrorPath* path) override;
+  void emitInterruptCheck() override;
+  void emitInterruptPath(InterruptPath* path) override;
+  void emitOsrEntry(Label* target) override;
+  void emitOpcodeCount(OPCODE op) override;
+  void emitBeforeInstruction(OPCODE op, bool block_start) override;
+
+  void emitLegacyNativeCall(uint32_t native_index, NativeEntry* native);
+  void emitFastNativeCall(uint32_t native_index, NativeEntry* native, uint32_t nparams);
+  void emitCheckAddress(Register reg);
+  void emitFloatCmp(ConditionCode cc);
+  void emitRoundWithMode(int32_t mode);
+  void emitCallThunk(CallThunk* thunk);
+  void emitGrowTrackerPath(GrowTrackerPath* path);
+  void emitTierUpPath(TierUpPath* path);
+  void emitTierUpCount(int32_t cost);
+
+  // Call the method at |offset|, through a thunk if it isn't compiled yet or
+  // can't be linked directly.
+  void emitCallTo(cell_t offset);
+
+  // Whether baseline code counts calls and backedges toward optimizing the
+  // method. Cached code can't refer to the method, and profiled code has to
+  // keep counting opcodes.
+  bool tiersUp() const;
+  void jumpOnError(ConditionCode cc, int err = 0);
+  void emitSwitchTree(const ke::Vector<CaseTableEntry>& cases,
+                      const ke::Vector<SwitchCluster>& clusters,
+                      size_t first, size_t last,
+                      Label* defaultCase);
+  void emitSwitchCluster(const ke::Vector<CaseTableEntry>& cases,
+                         const SwitchCluster& cluster,
+                         Label* defaultCase);
+
+  bool isCacheableSlot(cell_t offset);
+  CachedSlot* findCachedSlot(cell_t offset);
+  CachedSlot* cacheSlot(cell_t offset, bool load);
+  void writeBackSlots();
+  void forgetSlots();
+
+  Operand hpAddr() {
+    return Operand(ctx, int32_t(PluginContext::offsetOfHp()));
+  }
+  Operand frmAddr() {
+    return Operand(ctx, int32_t(PluginContext::offsetOfFrm()));
+  }
+  Operand spAddr() {
+    return Operand(ctx, int32_t(PluginContext::offsetOfSp()));
+  }
+  Operand trackerCurAddr() {
+    return Operand(ctx, int32_t(PluginContext::offsetOfTrackerCur()));
+  }
+  Operand trackerLimitAddr() {
+    return Operand(ctx, int32_t(PluginContext::offsetOfTrackerLimit()));
+  }
+
+ private:
+  static const size_t kNumCachedSlots = 3;
+  CachedSlot cached_slots_[kNumCachedSlots];
+  uint32_t cache_clock_;
+};
+
+const Register tmp = scratch0;
+
+}
+
+#endif // _include_sourcepawn_vm_jit_x64_h_
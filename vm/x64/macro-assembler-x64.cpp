@@ -46,6 +46,14 @@ MacroAssembler::enterInlineExitFrame(ExitFrameType type, uintptr_t payload, Code
   enterExitFrame(type, payload);
 }
 
+void
+MacroAssembler::leaveInlineExitFrame()
+{
+  // Note: no ret, the frame is inline. We pop the return address instead.
+  leaveExitFrame();
+  addq(rsp, 8);
+}
+
 void
 MacroAssembler::enterExitFrame(ExitFrameType type, uintptr_t payload)
 {
@@ -80,7 +88,7 @@ MacroAssembler::assertStackAligned()
 void
 MacroAssembler::movq(const AddressOperand& dest, Register src)
 {
-  if (dest.has32BitEncoding() || src == rax) {
+  if (!relocatable() && (dest.has32BitEncoding() || src == rax)) {
     Assembler::movq(dest, src);
   } else {
     ReserveScratch scratch(this);
@@ -92,7 +100,7 @@ MacroAssembler::movq(const AddressOperand& dest, Register src)
 void
 MacroAssembler::movq(Register dest, const AddressOperand& src)
 {
-  if (src.has32BitEncoding() || dest == rax) {
+  if (!relocatable() && (src.has32BitEncoding() || dest == rax)) {
     Assembler::movq(dest, src);
   } else {
     ReserveScratch scratch(this);
@@ -104,7 +112,7 @@ MacroAssembler::movq(Register dest, const AddressOperand& src)
 void
 MacroAssembler::movl(const AddressOperand& dest, Register src)
 {
-  if (dest.has32BitEncoding()) {
+  if (!relocatable() && dest.has32BitEncoding()) {
     Assembler::movl(Operand(dest.asValue()), src);
   } else {
     ReserveScratch scratch(this);
@@ -116,7 +124,7 @@ MacroAssembler::movl(const AddressOperand& dest, Register src)
 void
 MacroAssembler::movl(Register dest, const AddressOperand& src)
 {
-  if (src.has32BitEncoding()) {
+  if (!relocatable() && src.has32BitEncoding()) {
     Assembler::movl(dest, Operand(src.asValue()));
   } else {
     ReserveScratch scratch(this);
@@ -128,12 +136,12 @@ MacroAssembler::movl(Register dest, const AddressOperand& src)
 void
 MacroAssembler::cmpl(const AddressOperand& dest, int32_t imm)
 {
-  if (dest.has32BitEncoding()) {
+  if (!relocatable() && dest.has32BitEncoding()) {
     cmpl(Operand(dest.asValue()), imm);
   } else {
     ReserveScratch scratch(this);
     movq(scratch.reg(), dest.asValue());
-    cmpl(Operand(scratch.reg(), 0), 0);
+    cmpl(Operand(scratch.reg(), 0), imm);
   }
 }
 
@@ -769,6 +769,7 @@ class Assembler : public AssemblerBase
       int32_t *p = reinterpret_cast<int32_t *>(buffer() + offset - 4);
       status = *p;
       *p = delta;
+      noteSplitRef(offset, pc());
     }
     target->bind(pc());
   }
@@ -900,24 +901,40 @@ class Assembler : public AssemblerBase
     *reinterpret_cast<int32_t *>(ip - 4) = delta;
   }
 
-  void emitToExecutableMemory(void *code) {
+  // |cold_code| receives the cold code, if there is any.
+  void emitToExecutableMemory(void *code, void *cold_code = nullptr) {
     assert(!outOfMemory());
+    assert(cold_code || !coldLength());
 
-    // Relocate anything we emitted as rel32 with an external pointer.
     uint8_t *base = reinterpret_cast<uint8_t *>(code);
-    memcpy(base, buffer(), length());
+    uint8_t *cold = reinterpret_cast<uint8_t *>(cold_code);
+    copyToExecutableMemory(base, cold);
+
+    // Relocate anything we emitted as rel32 with an external pointer.
     for (size_t i = 0; i < external_refs_.length(); i++) {
-      size_t offset = external_refs_[i];
-      PatchRel32Absolute(base + offset, *reinterpret_cast<void **>(base + offset - 4));
+      uint32_t offset = external_refs_[i];
+      PatchRel32Absolute(linkedAddress(base, cold, offset),
+                         *reinterpret_cast<void **>(buffer() + offset - 4));
+    }
+
+    // Displacements between the hot and cold code were computed as if the
+    // cold code directly followed the hot code.
+    for (size_t i = 0; i < split_refs_.length(); i++) {
+      uint32_t offset = split_refs_[i];
+      int32_t delta = *reinterpret_cast<int32_t *>(buffer() + offset - 4);
+      uint8_t *site = linkedAddress(base, cold, offset);
+      PatchRel32Absolute(site, linkedAddress(base, cold, offset + delta));
     }
 
     // Relocate everything we emitted as an abs32 with an internal offset. Note
     // that in the code stream, we use relative offsets so we can use both Label
-    // and CodeLabel.
+    // and CodeLabel. Labels used this way may also have been recorded above,
+    // so these are patched last.
     for (size_t i = 0; i < local_refs_.length(); i++) {
-      size_t offset = local_refs_[i];
-      int32_t delta = *reinterpret_cast<int32_t *>(base + offset - 4);
-      *reinterpret_cast<void **>(base + offset - 4) = base + offset + delta;
+      uint32_t offset = local_refs_[i];
+      int32_t delta = *reinterpret_cast<int32_t *>(buffer() + offset - 4);
+      *reinterpret_cast<void **>(linkedAddress(base, cold, offset) - 4) =
+        linkedAddress(base, cold, offset + delta);
     }
   }
 
@@ -987,7 +1004,7 @@ class Assembler : public AssemblerBase
 
  private:
   bool canEmitSmallJump(Label *dest, int8_t *deltap) {
-    if (!dest->bound())
+    if (!dest->bound() || isCold(dest->offset()) != isCold(pc()))
       return false;
 
     // All small jumps are assumed to be 2 bytes.
@@ -1002,10 +1019,15 @@ class Assembler : public AssemblerBase
       ptrdiff_t delta = ptrdiff_t(dest->offset()) - (position() + 4);
       assert(delta >= INT_MIN && delta <= INT_MAX);
       writeInt32(delta);
+      noteSplitRef(pc(), dest->offset());
     } else {
       writeUint32(dest->addPending(position() + 4));
     }
   }
+  void noteSplitRef(uint32_t end, uint32_t target) {
+    if (isCold(end) != isCold(target) && !split_refs_.append(end))
+      outOfMemory_ = true;
+  }
 
   void emit(uint8_t reg, const Operand &operand) {
     *pos_++ = operand.getByte(0) | (reg << 3);
@@ -1101,6 +1123,7 @@ class Assembler : public AssemblerBase
  private:
   ke::Vector<uint32_t> external_refs_;
   ke::Vector<uint32_t> local_refs_;
+  ke::Vector<uint32_t> split_refs_;
 };
 
 #endif // _include_sourcepawn_assembler_x86_h__
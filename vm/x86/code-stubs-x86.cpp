@@ -26,7 +26,7 @@ CodeStubs::InitializeFeatureDetection()
 {
   MacroAssembler masm;
   MacroAssembler::GenerateFeatureDetection(masm);
-  CodeChunk code = LinkCode(env_, masm);
+  CodeChunk code = LinkCode(env_, masm, nullptr);
   if (!code.address())
     return false;
   MacroAssembler::RunFeatureDetection(code.address());
@@ -97,7 +97,7 @@ CodeStubs::CompileInvokeStub()
   __ bind(&error);
   __ jmp(&ret);
 
-  invoke_stub_ = LinkCode(env_, masm);
+  invoke_stub_ = LinkCode(env_, masm, "sp::InvokeStub");
   if (!invoke_stub_.address())
     return false;
 
@@ -129,5 +129,5 @@ CodeStubs::CreateFakeNativeStub(SPVM_FAKENATIVE_FUNC callback, void *pData)
   __ pop(ebx);
   __ ret();
 
-  return (SPVM_NATIVE_FUNC)LinkCodeToLegacyPtr(env_, masm);
+  return (SPVM_NATIVE_FUNC)LinkCodeToLegacyPtr(env_, masm, "sp::FakeNativeStub");
 }
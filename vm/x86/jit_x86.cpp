@@ -43,6 +43,7 @@
 #include "outofline-asm.h"
 #include "method-info.h"
 #include "runtime-helpers.h"
+#include "opcode-profiler.h"
 
 #define __ masm.
 
@@ -221,7 +222,12 @@ void
 Compiler::emitPrologue()
 {
   __ enterFrame(JitFrameType::Scripted, pcode_start_);
+  emitPushFrame();
+}
 
+void
+Compiler::emitPushFrame()
+{
   // Push the old frame onto the stack.
   __ movl(tmp, Operand(frmAddr()));
   __ movl(Operand(stk, -4), tmp);
@@ -234,6 +240,45 @@ Compiler::emitPrologue()
   __ movl(Operand(frmAddr()), tmp);
 }
 
+void
+Compiler::emitOsrEntry(Label* target)
+{
+  __ enterFrame(JitFrameType::Scripted, pcode_start_);
+
+  // The interpreter left pri and alt on top of the stack.
+  __ movl(pri, Operand(stk, 0));
+  __ movl(alt, Operand(stk, 4));
+  __ addl(stk, 8);
+
+  // The frame itself is already set up; just load it.
+  __ movl(frm, Operand(frmAddr()));
+  __ addl(frm, dat);
+
+  __ jmp(target);
+}
+
+// This is OpcodeProfiler::record, without triples. Counts are 64-bit, so
+// each is incremented with a carry into its high half.
+void
+Compiler::emitOpcodeCount(OPCODE op)
+{
+  OpcodeProfiler* profiler = Environment::get()->opcode_profiler();
+
+  uint64_t* count = &opcode_counts_->ops[op];
+  __ addl(Operand(ExternalAddress(count)), 1);
+  __ adcl(Operand(ExternalAddress(reinterpret_cast<uint32_t*>(count) + 1)), 0);
+
+  // Shift the history, and count the pair it ends.
+  OpcodeProfiler::History* history = profiler->history();
+  __ movl(tmp, Operand(ExternalAddress(&history->prev)));
+  __ movl(Operand(ExternalAddress(&history->prev2)), tmp);
+  __ movl(Operand(ExternalAddress(&history->prev)), op);
+  __ imull(tmp, tmp, OPCODES_TOTAL * sizeof(uint64_t));
+  intptr_t pair = reinterpret_cast<intptr_t>(&profiler->pairs()[op]);
+  __ addl(Operand(tmp, int32_t(pair)), 1);
+  __ adcl(Operand(tmp, int32_t(pair + 4)), 0);
+}
+
 bool
 Compiler::visitSHL()
 {
@@ -623,6 +668,11 @@ Compiler::visitRETN()
   __ movl(tmp, Operand(stk, 0));
   __ lea(stk, Operand(stk, tmp, ScaleFour, 4));
 
+  if (inlining()) {
+    emitInlineReturn();
+    return true;
+  }
+
   __ leaveFrame();
   __ ret();
   return true;
@@ -986,12 +1036,9 @@ bool
 Compiler::visitJUMP(cell_t offset)
 {
   Label *target = labelAt(offset);
-  if (target->bound()) {
-    __ jmp32(target);
-    backward_jumps_.append(BackwardJump(masm.pc(), op_cip_));
-  } else {
-    __ jmp(target);
-  }
+  if (target->bound())
+    emitLoopEdge(offset);
+  __ jmp(target);
   return true;
 }
 
@@ -999,6 +1046,8 @@ bool
 Compiler::visitJcmp(CompareOp op, cell_t offset)
 {
   Label *target = labelAt(offset);
+  if (target->bound())
+    emitLoopEdge(offset);
 
   switch (op) {
   case CompareOp::Zero:
@@ -1006,12 +1055,7 @@ Compiler::visitJcmp(CompareOp op, cell_t offset)
   {
     ConditionCode cc = (op == CompareOp::Zero) ? zero : not_zero;
     __ testl(pri, pri);
-    if (target->bound()) {
-      __ j32(cc, target);
-      backward_jumps_.append(BackwardJump(masm.pc(), op_cip_));
-    } else {
-      __ j(cc, target);
-    }
+    __ j(cc, target);
     break;
   }
 
@@ -1024,12 +1068,7 @@ Compiler::visitJcmp(CompareOp op, cell_t offset)
   {
     ConditionCode cc = OpToCondition(op);
     __ cmpl(pri, alt);
-    if (target->bound()) {
-      __ j32(cc, target);
-      backward_jumps_.append(BackwardJump(masm.pc(), op_cip_));
-    } else {
-      __ j(cc, target);
-    }
+    __ j(cc, target);
     break;
   }
   default:
@@ -1091,7 +1130,10 @@ Compiler::visitHALT(cell_t value)
 bool
 Compiler::visitBOUNDS(uint32_t limit)
 {
-  OutOfBoundsErrorPath* bounds = new OutOfBoundsErrorPath(op_cip_, limit);
+  if (boundsCheckIsRedundant())
+    return true;
+
+  OutOfBoundsErrorPath* bounds = new OutOfBoundsErrorPath(op_cip_, inlinedAt(), limit);
   if (!ool_paths_.append(bounds)) {
     reportError(SP_ERROR_OUT_OF_MEMORY);
     return false;
@@ -1119,35 +1161,75 @@ Compiler::emitCheckAddress(Register reg)
   __ bind(&done);
 }
 
+// Taken when the heap tracker is full, so the push has to call out and grow
+// it. Rejoins with the size of the array, in bytes, in tmp.
+class GrowTrackerPath : public OutOfLinePath
+{
+ public:
+  explicit GrowTrackerPath(ErrorPath* error)
+   : error(error)
+  {
+  }
+
+  bool emit(Compiler* cc) override {
+    cc->emitGrowTrackerPath(this);
+    return true;
+  }
+
+  Label* rejoin() {
+    return &rejoin_;
+  }
+
+  ErrorPath* error;
+
+ private:
+  Label rejoin_;
+};
+
 bool
 Compiler::visitGENARRAY(uint32_t dims, bool autozero)
 {
   if (dims == 1)
   {
-    // flat array; we can generate this without indirection tables.
+    // flat array; we can generate this without indirection tables, or any
+    // calls unless the tracker is full.
     // Note that we can overwrite ALT because technically STACK should be destroying ALT
-    __ movl(alt, Operand(hpAddr()));
+    ErrorPath* error = new ErrorPath(op_cip_, inlinedAt(), 0);
+    GrowTrackerPath* grow = new GrowTrackerPath(error);
+    if (!ool_paths_.append(error) || !ool_paths_.append(grow)) {
+      reportError(SP_ERROR_OUT_OF_MEMORY);
+      return false;
+    }
+
+    // The size must be positive, and its size in bytes must fit in a cell.
     __ movl(tmp, Operand(stk, 0));
+    __ lea(alt, Operand(tmp, -1));
+    __ cmpl(alt, 0x3ffffffe);
+    jumpOnError(above, SP_ERROR_ARRAY_TOO_BIG);
+
+    __ shll(tmp, 2);
+    __ movl(alt, Operand(hpAddr()));
     __ movl(Operand(stk, 0), alt);    // store base of the array into the stack.
-    __ lea(alt, Operand(alt, tmp, ScaleFour));
+    // "below" is a carry out of each add.
+    __ addl(alt, tmp);
+    jumpOnError(below, SP_ERROR_ARRAY_TOO_BIG);
     __ movl(Operand(hpAddr()), alt);
     __ addl(alt, dat);
+    jumpOnError(below, SP_ERROR_HEAPLOW);
     __ cmpl(alt, stk);
     jumpOnError(not_below, SP_ERROR_HEAPLOW);
 
-    __ shll(tmp, 2);
-    __ subl(esp, 8);
-    __ push(tmp);
-    __ push(intptr_t(rt_->GetBaseContext()));
-    __ callWithABI(ExternalAddress((void *)InvokePushTracker));
-    __ movl(tmp, Operand(esp, 4));
-    __ addl(esp, 16);
-    __ shrl(tmp, 2);
-    __ testl(eax, eax);
-    jumpOnError(not_zero);
+    // Push the size onto the tracker.
+    __ movl(alt, Operand(trackerCurAddr()));
+    __ cmpl(alt, Operand(trackerLimitAddr()));
+    __ j(not_below, grow->label());
+    __ movl(Operand(alt, 0), tmp);
+    __ addl(alt, sizeof(ucell_t));
+    __ movl(Operand(trackerCurAddr()), alt);
+    __ bind(grow->rejoin());
 
     if (autozero) {
-      // Note - tmp is ecx and still intact.
+      __ shrl(tmp, 2);
       __ push(eax);
       __ push(edi);
       __ xorl(eax, eax);
@@ -1202,11 +1284,17 @@ class CallThunk : public OutOfLinePath
 bool
 Compiler::visitCALL(cell_t offset)
 {
-  RefPtr<MethodInfo> method = rt_->GetMethod(offset);
+  // Inlined calls are safepoints too, as in the interpreter.
+  emitInterruptCheck();
+  if (emitInlineCall(offset))
+    return !error_;
+
+  RefPtr<MethodInfo> method = linksDirectly() ? rt_->GetMethod(offset) : nullptr;
   if (!method || !method->jit()) {
     // Need to emit a delayed thunk.
     CallThunk* thunk = new CallThunk(offset);
     __ callWithABI(thunk->label());
+    emitCallSite(offset);
     if (!ool_paths_.append(thunk)) {
       reportError(SP_ERROR_OUT_OF_MEMORY);
       return false;
@@ -1221,6 +1309,24 @@ Compiler::visitCALL(cell_t offset)
   return true;
 }
 
+void
+Compiler::emitGrowTrackerPath(GrowTrackerPath* path)
+{
+  // Save pri and the byte count across the call.
+  __ subl(esp, 4);
+  __ push(pri);
+  __ push(tmp);
+  __ push(intptr_t(rt_->GetBaseContext()));
+  __ callWithABI(ExternalAddress((void *)InvokePushTracker));
+  __ movl(tmp, Operand(esp, 4));
+  __ movl(alt, Operand(esp, 8));
+  __ addl(esp, 16);
+  __ testl(eax, eax);
+  __ j(not_zero, path->error->label());
+  __ movl(pri, alt);
+  __ jmp(path->rejoin());
+}
+
 void
 Compiler::emitCallThunk(CallThunk* thunk)
 {
@@ -1252,13 +1358,52 @@ Compiler::emitCallThunk(CallThunk* thunk)
   __ testl(eax, eax);
   jumpOnError(not_zero);
 
+  // If we got an address back, the callee is compiled.
+  Label interpret;
+  __ testl(edx, edx);
+  __ j(zero, &interpret);
   __ jmp(edx);
+
+  // Otherwise, the callee is still cold and must run in the interpreter. The
+  // return address is on top of the stack again, so build a new exit frame.
+  __ bind(&interpret);
+  __ enterExitFrame(ExitFrameType::Helper, 0);
+
+  // Update the context's view of the stack, so the interpreter can find the
+  // arguments.
+  __ movl(tmp, stk);
+  __ subl(tmp, dat);
+  __ movl(Operand(spAddr()), tmp);
+
+  // Three arguments, plus a word for the return value.
+  __ subl(esp, 4 * sizeof(void *));
+  __ lea(edx, Operand(esp, 3 * sizeof(void *)));
+  __ movl(Operand(esp, 2 * sizeof(void *)), edx);
+  __ movl(Operand(esp, 1 * sizeof(void *)), intptr_t(thunk->pcode_offset));
+  __ movl(Operand(esp, 0 * sizeof(void *)), intptr_t(context_));
+  __ callWithABI(ExternalAddress((void *)InterpretFromThunk));
+  __ movl(pri, Operand(esp, 3 * sizeof(void *)));
+
+  // The interpreter popped the arguments, so reload stk.
+  __ movl(stk, Operand(spAddr()));
+  __ addl(stk, dat);
+  __ leaveExitFrame();
+
+  // Check for errors. As with natives, the error has already been reported.
+  ExternalAddress exn_code(Environment::get()->addressOfExceptionCode());
+  __ cmpl(Operand(exn_code), 0);
+  __ j(not_zero, &return_reported_error_);
+  __ ret();
 }
 
 bool
 Compiler::visitSYSREQ_N(uint32_t native_index, uint32_t nparams)
 {
   NativeEntry* native = rt_->NativeAt(native_index);
+  if (fastNativeFor(native, nparams)) {
+    emitFastNativeCall(native_index, native, nparams);
+    return true;
+  }
 
   // Store the number of parameters on the stack.
   __ movl(Operand(stk, -4), nparams);
@@ -1268,6 +1413,89 @@ Compiler::visitSYSREQ_N(uint32_t native_index, uint32_t nparams)
   return true;
 }
 
+// Call a native's fast function, with its arguments copied to the native
+// stack and no exit frame. If it asks for the fallback, call the native
+// normally.
+void
+Compiler::emitFastNativeCall(uint32_t native_index, NativeEntry* native, uint32_t nparams)
+{
+  const sp_fastnativeinfo_t* info = native->fast;
+
+  // ALT, the fallback flag, the arguments, and the flag's address.
+  uint32_t stack_use = (nparams + 3) * sizeof(intptr_t);
+  uint32_t padding = Align(stack_use, 16) - stack_use;
+
+  __ push(alt);
+  __ push(int32_t(0));
+  if (padding)
+    __ subl(esp, padding);
+
+  // Floats are passed with the same bits as cells.
+  for (uint32_t i = nparams; i > 0; i--)
+    __ push(Operand(stk, (i - 1) * sizeof(cell_t)));
+  __ lea(tmp, Operand(esp, nparams * sizeof(cell_t) + padding));
+  __ push(tmp);
+
+  __ callWithABI(ExternalAddress(info->fast));
+  if (info->return_kind == SP_FASTARG_FLOAT) {
+    __ fstp32(Operand(esp, 0));
+    __ movl(pri, Operand(esp, 0));
+  }
+  __ addl(esp, (nparams + 1) * sizeof(intptr_t) + padding);
+
+  // Pop the flag, then ALT. Neither changes the flags.
+  Label done;
+  __ cmpl(Operand(esp, 0), 0);
+  __ pop(alt);
+  __ pop(alt);
+  __ j(zero, &done);
+
+  __ movl(Operand(stk, -4), nparams);
+  __ subl(stk, 4);
+  emitLegacyNativeCall(native_index, native);
+  __ addl(stk, sizeof(cell_t));
+  __ bind(&done);
+  __ addl(stk, nparams * sizeof(cell_t));
+}
+
+bool
+Compiler::visitINTRINSIC_N(uint32_t native_index, uint32_t nparams,
+                           const sp_intrinsic_t* intrinsic)
+{
+  uses_intrinsics_ = true;
+
+  // Emitters take their arguments in PRI and ALT, and may clobber ALT.
+  if (intrinsic->emitter && nparams == intrinsic->nparams) {
+    __ push(alt);
+    if (nparams >= 1)
+      __ movl(pri, Operand(stk, 0));
+    if (nparams >= 2)
+      __ movl(alt, Operand(stk, 4));
+    bool emitted = intrinsic->emitter(masm);
+    __ pop(alt);
+    if (emitted) {
+      __ addl(stk, nparams * sizeof(cell_t));
+      return true;
+    }
+  }
+
+  // Otherwise, call the fallback with a native-style parameter array. It
+  // can't fail or call back into the VM, so no exit frame is needed.
+  __ movl(Operand(stk, -4), nparams);
+  __ subl(stk, 4);
+
+  // Save ALT, and keep the stack aligned.
+  __ push(alt);
+  __ subl(esp, 2 * sizeof(intptr_t));
+  __ push(stk);
+  __ callWithABI(ExternalAddress((void *)intrinsic->fallback));
+  __ addl(esp, 3 * sizeof(intptr_t));
+  __ pop(alt);
+
+  __ addl(stk, (nparams + 1) * sizeof(cell_t));
+  return true;
+}
+
 bool
 Compiler::visitSYSREQ_C(uint32_t native_index)
 {
@@ -1291,7 +1519,8 @@ Compiler::emitLegacyNativeCall(uint32_t native_index, NativeEntry* native)
   __ push(edx);
 
   // Check whether the native is bound.
-  bool immutable = native->status == SP_NATIVE_BOUND &&
+  bool immutable = linksDirectly() &&
+                   native->status == SP_NATIVE_BOUND &&
                    !(native->flags & (SP_NTVFLAG_EPHEMERAL|SP_NTVFLAG_OPTIONAL));
   if (!immutable) {
     __ movl(edx, Operand(ExternalAddress(&native->legacy_fn)));
@@ -1355,71 +1584,79 @@ Compiler::visitSWITCH(cell_t defaultOffset,
     return true;
   }
 
-  // Degenerate - 1 case.
-  if (ncases == 1) {
-    Label *maybe = labelAt(cases[0].address);
-    __ cmpl(pri, cases[0].value);
-    __ j(equal, maybe);
-    __ jmp(defaultCase);
-    return true;
+  ke::Vector<CaseTableEntry> sorted;
+  ke::Vector<SwitchCluster> clusters;
+  PlanSwitch(cases, ncases, &sorted, &clusters);
+
+  emitSwitchTree(sorted, clusters, 0, clusters.length(), defaultCase);
+  return true;
+}
+
+// Binary search over the clusters, by their lowest value, down to one.
+void
+Compiler::emitSwitchTree(const ke::Vector<CaseTableEntry>& cases,
+                         const ke::Vector<SwitchCluster>& clusters,
+                         size_t first, size_t last,
+                         Label* defaultCase)
+{
+  if (last - first == 1) {
+    emitSwitchCluster(cases, clusters[first], defaultCase);
+    return;
   }
 
-  // We have two or more cases, so let's generate a full switch. Decide
-  // whether we'll make an if chain, or a jump table, based on whether
-  // the numbers are strictly sequential.
-  bool sequential = true;
-  {
-    cell_t first = cases[0].value;
-    cell_t last = first;
-    for (size_t i = 1; i < ncases; i++) {
-      if (cases[i].value != ++last) {
-        sequential = false;
-        break;
-      }
+  size_t mid = first + (last - first) / 2;
+
+  Label lower;
+  __ cmpl(pri, clusters[mid].low);
+  __ j(less, &lower);
+  emitSwitchTree(cases, clusters, mid, last, defaultCase);
+  __ bind(&lower);
+  emitSwitchTree(cases, clusters, first, mid, defaultCase);
+}
+
+void
+Compiler::emitSwitchCluster(const ke::Vector<CaseTableEntry>& cases,
+                            const SwitchCluster& cluster,
+                            Label* defaultCase)
+{
+  if (!cluster.jump_table) {
+    for (size_t i = cluster.first; i < cluster.first + cluster.ncases; i++) {
+      __ cmpl(pri, cases[i].value);
+      __ j(equal, labelAt(cases[i].address));
     }
+    __ jmp(defaultCase);
+    return;
   }
 
-  // First check whether the bounds are correct: if (a < LOW || a > HIGH);
-  // this check is valid whether or not we emit a sequential-optimized switch.
-  cell_t low = cases[0].value;
-  if (low != 0) {
-    // negate it so we'll get a lower bound of 0.
-    low = -low;
-    __ lea(tmp, Operand(pri, low));
-  } else {
+  // Rebase to zero, so one unsigned compare checks both bounds.
+  if (cluster.low != 0)
+    __ lea(tmp, Operand(pri, int32_t(0 - uint32_t(cluster.low))));
+  else
     __ movl(tmp, pri);
-  }
-
-  cell_t high = abs(cases[0].value - cases[ncases - 1].value);
-  __ cmpl(tmp, high);
+  __ cmpl(tmp, cluster.high - cluster.low);
   __ j(above, defaultCase);
 
-  if (sequential) {
-    // Optimized table version. The tomfoolery below is because we only have
-    // one free register... it seems unlikely pri or alt will be used given
-    // that we're at the end of a control-flow point, but we'll play it safe.
-    CodeLabel table;
-    __ push(eax);
-    __ movl(eax, &table);
-    __ movl(ecx, Operand(eax, ecx, ScaleFour));
-    __ pop(eax);
-    __ jmp(ecx);
-
-    __ bind(&table);
-    for (size_t i = 0; i < ncases; i++) {
-      Label *label = labelAt(cases[i].address);
-      __ emit_absolute_address(label);
-    }
-  } else {
-    // Slower version. Go through each case and generate a check.
-    for (size_t i = 0; i < ncases; i++) {
-      Label *label = labelAt(cases[i].address);
-      __ cmpl(pri, cases[i].value);
-      __ j(equal, label);
+  // The tomfoolery below is because we only have one free register... it
+  // seems unlikely pri or alt will be used given that we're at the end of a
+  // control-flow point, but we'll play it safe.
+  CodeLabel table;
+  __ push(eax);
+  __ movl(eax, &table);
+  __ movl(ecx, Operand(eax, ecx, ScaleFour));
+  __ pop(eax);
+  __ jmp(ecx);
+
+  // Gaps go to the default case.
+  __ bind(&table);
+  size_t next = cluster.first;
+  for (int64_t value = cluster.low; value <= cluster.high; value++) {
+    if (cases[next].value == value) {
+      __ emit_absolute_address(labelAt(cases[next].address));
+      next++;
+    } else {
+      __ emit_absolute_address(defaultCase);
     }
-    __ jmp(defaultCase);
   }
-  return true;
 }
 
 void
@@ -1476,7 +1713,7 @@ void
 Compiler::jumpOnError(ConditionCode cc, int err)
 {
   // Note: we accept 0 for err. In this case we expect the error to be in eax.
-  ErrorPath* path = new ErrorPath(op_cip_, err);
+  ErrorPath* path = new ErrorPath(op_cip_, inlinedAt(), err);
   if (!ool_paths_.append(path))
     reportError(SP_ERROR_OUT_OF_MEMORY);
 
@@ -1494,11 +1731,58 @@ Compiler::emitOutOfBoundsErrorPath(OutOfBoundsErrorPath* path)
   __ push(eax);
   __ callWithABI(ExternalAddress((void *)ReportOutOfBoundsError));
   __ bind(&return_address);
-  emitCipMapping(path->cip);
+  emitCipMapping(path->cip, path->inlined_at);
   __ leaveInlineExitFrame();
   __ jmp(&return_reported_error_);
 }
 
+void
+Compiler::emitInterruptCheck()
+{
+  InterruptPath* path = new InterruptPath(op_cip_, inlinedAt());
+  if (!ool_paths_.append(path)) {
+    reportError(SP_ERROR_OUT_OF_MEMORY);
+    return;
+  }
+
+  __ cmpl(Operand(ExternalAddress(Environment::get()->addressOfInterrupts())), 0);
+  __ j(not_equal, path->label());
+  __ bind(path->rejoin());
+}
+
+void
+Compiler::emitInterruptPath(InterruptPath* path)
+{
+  // PRI and ALT can be live here; the other registers are callee-saved, or
+  // scratch.
+  __ push(pri);
+  __ push(alt);
+
+  // The handler may call back into the plugin, so update the context's view
+  // of the stack first.
+  __ movl(tmp, stk);
+  __ subl(tmp, dat);
+  __ movl(Operand(spAddr()), tmp);
+
+  CodeLabel return_address;
+  __ enterInlineExitFrame(ExitFrameType::Helper, 0, &return_address);
+  __ alignStack();
+  __ subl(esp, 12);
+  __ push(intptr_t(context_));
+  __ callWithABI(ExternalAddress((void *)InvokeHandleInterrupts));
+  __ bind(&return_address);
+  emitCipMapping(path->cip, path->inlined_at);
+  __ leaveInlineExitFrame();
+  __ movl(tmp, eax);
+
+  __ pop(alt);
+  __ pop(pri);
+
+  __ testl(tmp, tmp);
+  __ j(not_zero, &return_reported_error_);
+  __ jmp(path->rejoin());
+}
+
 void
 Compiler::emitErrorHandlers()
 {
@@ -1519,20 +1803,6 @@ Compiler::emitErrorHandlers()
     __ jmp(&return_to_invoke);
   }
 
-  // The timeout uses a special stub.
-  if (throw_timeout_.used()) {
-    __ bind(&throw_timeout_);
-
-    // Create the exit frame.
-    __ enterExitFrame(ExitFrameType::Helper, 0);
-
-    // Since the return stub wipes out the stack, we don't need to addl after
-    // the call.
-    __ callWithABI(ExternalAddress((void *)InvokeReportTimeout));
-    __ leaveExitFrame();
-    __ jmp(&return_reported_error_);
-  }
-
   // We get here if we know an exception is already pending.
   if (return_reported_error_.used()) {
     __ bind(&return_reported_error_);
@@ -34,11 +34,14 @@ class LegacyImage;
 class Environment;
 class CompiledFunction;
 class CallThunk;
+class GrowTrackerPath;
 
 class Compiler : public CompilerBase
 {
   friend class CallThunk;
+  friend class GrowTrackerPath;
   friend class OutOfBoundsErrorPath;
+  friend class InterruptPath;
 
  public:
   Compiler(PluginRuntime *rt, cell_t pcode_offs);
@@ -108,6 +111,8 @@ class Compiler : public CompilerBase
   bool visitSWAP(PawnReg dest) override;
   bool visitPUSH_ADR(const cell_t* offsets, size_t nvals) override;
   bool visitSYSREQ_N(uint32_t native_index, uint32_t nparams) override;
+  bool visitINTRINSIC_N(uint32_t native_index, uint32_t nparams,
+                        const sp_intrinsic_t* intrinsic) override;
   bool visitLOAD_BOTH(cell_t offsetForPri, cell_t offsetForAlt) override;
   bool visitLOAD_S_BOTH(cell_t offsetForPri, cell_t offsetForAlt) override;
   bool visitCONST(cell_t offset, cell_t value) override;
@@ -140,16 +145,30 @@ class Compiler : public CompilerBase
 
  private:
   void emitPrologue() override;
+  void emitPushFrame() override;
   void emitThrowPath(int err) override;
   void emitErrorHandlers() override;
   void emitOutOfBoundsErrorPath(OutOfBoundsErrorPath* path) override;
+  void emitInterruptCheck() override;
+  void emitInterruptPath(InterruptPath* path) override;
+  void emitOsrEntry(Label* target) override;
+  void emitOpcodeCount(OPCODE op) override;
 
   void emitLegacyNativeCall(uint32_t native_index, NativeEntry* native);
+  void emitFastNativeCall(uint32_t native_index, NativeEntry* native, uint32_t nparams);
   void emitGenArray(bool autozero);
   void emitCheckAddress(Register reg);
   void emitFloatCmp(ConditionCode cc);
   void emitCallThunk(CallThunk* thunk);
+  void emitGrowTrackerPath(GrowTrackerPath* path);
   void jumpOnError(ConditionCode cc, int err = 0);
+  void emitSwitchTree(const ke::Vector<CaseTableEntry>& cases,
+                      const ke::Vector<SwitchCluster>& clusters,
+                      size_t first, size_t last,
+                      Label* defaultCase);
+  void emitSwitchCluster(const ke::Vector<CaseTableEntry>& cases,
+                         const SwitchCluster& cluster,
+                         Label* defaultCase);
 
   ExternalAddress hpAddr() {
     return ExternalAddress(context_->addressOfHp());
@@ -160,12 +179,11 @@ class Compiler : public CompilerBase
   ExternalAddress spAddr() {
     return ExternalAddress(context_->addressOfSp());
   }
-
-  Label *labelAt(size_t offset) {
-    assert(ke::IsAligned(offset, sizeof(cell_t)));
-    assert(offset >= pcode_start_);
-    assert(offset < rt_->code().length); 
-    return &jump_map_[offset / sizeof(cell_t)];
+  ExternalAddress trackerCurAddr() {
+    return ExternalAddress(context_->addressOfTrackerCur());
+  }
+  ExternalAddress trackerLimitAddr() {
+    return ExternalAddress(context_->addressOfTrackerLimit());
   }
 };
 